@@ -33,6 +33,9 @@
 
 #include <sys/stat.h>
 #include <dirent.h>
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
 
 #include <libgen.h> /* use basename, dirname */
 #include "asterisk/paths.h"	/* use ast_config_AST_DATA_DIR */
@@ -44,6 +47,8 @@
 #include "asterisk/say.h"
 #include "asterisk/conversions.h"
 #include "asterisk/musiconhold.h"
+#include "asterisk/alertpipe.h"
+#include "asterisk/poll-compat.h"
 
 /*** DOCUMENTATION
 	<application name="Audichron" language="en_US">
@@ -262,6 +267,496 @@ static int get_audio_length(struct ast_channel *chan, const char *filename, stru
 	return length;
 }
 
+/*! \brief A playable file in a prompt directory */
+struct prompt_file {
+	int length;		/* Length in ms, -1 if not computed yet */
+	char name[0];	/* Filename, with extension */
+};
+
+/*! \brief Cached listing of a prompt directory */
+struct prompt_dir {
+	struct prompt_file **files;	/* Sorted by name */
+	int num;
+	int wd;						/* inotify watch descriptor, -1 if not watched */
+	time_t mtime;				/* Directory modification time, for directories that aren't watched */
+	unsigned int stale:1;		/* Directory has changed since it was last scanned */
+	char **aliases;				/* Other spellings of path that callers have used */
+	int numaliases;
+	AST_LIST_ENTRY(prompt_dir) entry;
+	char path[0];				/* Canonical path */
+};
+
+/* Prompt directories are per-call arguments, so each one is added to the catalog the first time it's used.
+ * After that, finding prompts and their lengths doesn't touch the filesystem, until the directory changes. */
+static AST_LIST_HEAD_STATIC(prompt_dirs, prompt_dir);
+
+#ifdef HAVE_INOTIFY
+static int inotify_fd = -1;
+static int catalog_alert_pipe[2] = { -1, -1 };
+static pthread_t catalog_thread = AST_PTHREADT_NULL;
+#endif
+
+static int prompt_file_cmp(const void *a, const void *b)
+{
+	const struct prompt_file *pf_a = *(const struct prompt_file **) a;
+	const struct prompt_file *pf_b = *(const struct prompt_file **) b;
+	return strcmp(pf_a->name, pf_b->name);
+}
+
+static int prompt_file_name_cmp(const void *key, const void *b)
+{
+	const struct prompt_file *pf = *(const struct prompt_file **) b;
+	return strcmp(key, pf->name);
+}
+
+static int prompt_file_playable(struct prompt_file *pf)
+{
+	const char *ext = strrchr(pf->name, '.'); /* Files without an extension aren't cataloged */
+	return ast_get_format_for_file_ext(ext + 1) ? 1 : 0;
+}
+
+static void prompt_files_free(struct prompt_file **files, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		ast_free(files[i]);
+	}
+	ast_free(files);
+}
+
+static void prompt_dir_free(struct prompt_dir *pd)
+{
+	int i;
+
+#ifdef HAVE_INOTIFY
+	if (pd->wd >= 0) {
+		inotify_rm_watch(inotify_fd, pd->wd);
+	}
+#endif
+	prompt_files_free(pd->files, pd->num);
+	for (i = 0; i < pd->numaliases; i++) {
+		ast_free(pd->aliases[i]);
+	}
+	ast_free(pd->aliases);
+	ast_free(pd);
+}
+
+/*! \brief Remember another spelling of a directory's path, so it can be found without resolving it again */
+static void prompt_dir_alias_add(struct prompt_dir *pd, const char *path)
+{
+	char **aliases = ast_realloc(pd->aliases, (pd->numaliases + 1) * sizeof(*aliases));
+
+	if (!aliases) {
+		return; /* Not fatal, it'll just be resolved again next time */
+	}
+	pd->aliases = aliases;
+	if ((aliases[pd->numaliases] = ast_strdup(path))) {
+		pd->numaliases++;
+	}
+}
+
+/*! \brief Read a directory's regular files, sorted by name */
+static int prompt_dir_scan(const char *path, struct prompt_file ***files_ptr, int *num_ptr, time_t *mtime)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	struct prompt_file **files = NULL;
+	int num = 0, alloc = 0;
+
+	dir = opendir(path);
+	if (!dir) {
+		ast_debug(1, "Failed to open directory '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (!fstat(dirfd(dir), &st)) {
+		*mtime = st.st_mtime;
+	}
+
+	while ((entry = readdir(dir))) {
+		struct prompt_file *pf;
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") || !strrchr(entry->d_name, '.')) {
+			continue;
+		}
+		if (entry->d_type != DT_REG) {
+			if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
+				continue;
+			} else if (fstatat(dirfd(dir), entry->d_name, &st, 0) || !S_ISREG(st.st_mode)) {
+				continue;
+			}
+		}
+		if (num == alloc) {
+			struct prompt_file **newfiles = ast_realloc(files, (alloc ? alloc * 2 : 32) * sizeof(*files));
+			if (!newfiles) {
+				break;
+			}
+			files = newfiles;
+			alloc = alloc ? alloc * 2 : 32;
+		}
+		pf = ast_malloc(sizeof(*pf) + strlen(entry->d_name) + 1);
+		if (!pf) {
+			break;
+		}
+		pf->length = -1;
+		strcpy(pf->name, entry->d_name); /* Safe */
+		files[num++] = pf;
+	}
+	closedir(dir);
+
+	if (num) {
+		qsort(files, num, sizeof(*files), prompt_file_cmp);
+	}
+	*files_ptr = files;
+	*num_ptr = num;
+	return 0;
+}
+
+/*! \note Must be called with prompt_dirs locked */
+static struct prompt_file *catalog_file(struct prompt_dir *pd, const char *name)
+{
+	struct prompt_file **pfp;
+
+	if (!pd->num) {
+		return NULL;
+	}
+	pfp = bsearch(name, pd->files, pd->num, sizeof(*pd->files), prompt_file_name_cmp);
+	return pfp ? *pfp : NULL;
+}
+
+/*!
+ * \brief Rescan a cataloged directory, keeping the lengths of files that haven't changed
+ * \note Must be called with prompt_dirs locked
+ */
+static int catalog_refresh(struct prompt_dir *pd)
+{
+	struct prompt_file **files;
+	int i, num;
+
+	if (prompt_dir_scan(pd->path, &files, &num, &pd->mtime)) {
+		return -1;
+	}
+	for (i = 0; i < num; i++) {
+		struct prompt_file *old = catalog_file(pd, files[i]->name);
+		if (old) {
+			files[i]->length = old->length;
+		}
+	}
+	prompt_files_free(pd->files, pd->num);
+	pd->files = files;
+	pd->num = num;
+	pd->stale = 0;
+	ast_debug(3, "Refreshed prompt catalog for %s (%d file%s)\n", pd->path, num, ESS(num));
+	return 0;
+}
+
+/*!
+ * \brief Find a directory in the catalog by any spelling of its path that's been used
+ * \note Must be called with prompt_dirs locked
+ */
+static struct prompt_dir *catalog_find(const char *path)
+{
+	struct prompt_dir *pd;
+	int i;
+
+	AST_LIST_TRAVERSE(&prompt_dirs, pd, entry) {
+		if (!strcmp(pd->path, path)) {
+			return pd;
+		}
+		for (i = 0; i < pd->numaliases; i++) {
+			if (!strcmp(pd->aliases[i], path)) {
+				return pd;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*!
+ * \brief Get a directory's catalog, adding it if this is the first time it's used
+ * \note Must be called with prompt_dirs locked
+ */
+static struct prompt_dir *catalog_dir(const char *path)
+{
+	struct prompt_dir *pd;
+	const char *alias = NULL;
+	char canonical[PATH_MAX];
+
+	pd = catalog_find(path);
+	if (!pd && realpath(path, canonical) && strcmp(canonical, path)) {
+		/* Different spellings of the same directory must share an entry, since inotify
+		 * returns the same watch descriptor for all of them. This is only resolved
+		 * the first time a spelling is used, after which it's found as an alias. */
+		alias = path;
+		path = canonical;
+		pd = catalog_find(path);
+		if (pd) {
+			prompt_dir_alias_add(pd, alias);
+		}
+	}
+	if (pd) {
+		struct stat st;
+		/* Watched directories are kept up to date by the monitor thread.
+		 * Otherwise, the directory's mtime will tell us if files were added or removed. */
+		if (pd->wd < 0 && (stat(pd->path, &st) || st.st_mtime != pd->mtime)) {
+			pd->stale = 1;
+		}
+		if (pd->stale && catalog_refresh(pd)) {
+			AST_LIST_REMOVE(&prompt_dirs, pd, entry);
+			prompt_dir_free(pd);
+			return NULL;
+		}
+		return pd;
+	}
+
+	pd = ast_calloc(1, sizeof(*pd) + strlen(path) + 1);
+	if (!pd) {
+		return NULL;
+	}
+	strcpy(pd->path, path); /* Safe */
+	pd->wd = -1;
+	if (prompt_dir_scan(path, &pd->files, &pd->num, &pd->mtime)) {
+		ast_free(pd);
+		return NULL;
+	}
+#ifdef HAVE_INOTIFY
+	if (inotify_fd >= 0) {
+		pd->wd = inotify_add_watch(inotify_fd, path, IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+		if (pd->wd < 0) {
+			ast_log(LOG_WARNING, "Failed to watch directory '%s': %s\n", path, strerror(errno));
+		}
+	}
+#endif
+	if (alias) {
+		prompt_dir_alias_add(pd, alias);
+	}
+	AST_LIST_INSERT_HEAD(&prompt_dirs, pd, entry);
+	ast_debug(3, "Added %s to prompt catalog (%d file%s)\n", path, pd->num, ESS(pd->num));
+	return pd;
+}
+
+/*! \brief ast_file_read_dir equivalent, using the catalog */
+static int catalog_read_dir(const char *path, int (*callback)(const char *dir_name, const char *filename, void *obj), void *obj)
+{
+	struct prompt_dir *pd;
+	int i, res = 0;
+
+	AST_LIST_LOCK(&prompt_dirs);
+	pd = catalog_dir(path);
+	if (!pd) {
+		res = -1;
+	} else {
+		for (i = 0; i < pd->num; i++) {
+			if (callback(path, pd->files[i]->name, obj)) {
+				break;
+			}
+		}
+	}
+	AST_LIST_UNLOCK(&prompt_dirs);
+	return res;
+}
+
+/*!
+ * \brief Find a file in the catalog
+ * \param filename Full path, without extension
+ * \param ext Extension
+ * \note Must be called with prompt_dirs locked
+ */
+static struct prompt_file *catalog_lookup(const char *filename, const char *ext)
+{
+	struct prompt_dir *pd;
+	char dir[PATH_MAX];
+	char name[PATH_MAX];
+	const char *base = strrchr(filename, '/');
+
+	if (!base || base == filename) {
+		return NULL;
+	}
+	ast_copy_string(dir, filename, MIN(sizeof(dir), (size_t) (base - filename + 1)));
+	snprintf(name, sizeof(name), "%s.%s", base + 1, ext);
+	pd = catalog_dir(dir);
+	return pd ? catalog_file(pd, name) : NULL;
+}
+
+static int prompt_exists(const char *filename, const char *ext)
+{
+	int exists;
+
+	if (!strchr(filename, '/')) {
+		/* Relative to the current directory, not worth cataloging */
+		char testname[PATH_MAX];
+		struct stat st;
+		snprintf(testname, sizeof(testname), "%s.%s", filename, ext);
+		return stat(testname, &st) ? 0 : 1;
+	}
+
+	AST_LIST_LOCK(&prompt_dirs);
+	exists = catalog_lookup(filename, ext) ? 1 : 0;
+	AST_LIST_UNLOCK(&prompt_dirs);
+	return exists;
+}
+
+/*! \brief get_audio_length, but only opening the file the first time its length is needed */
+static int prompt_length(struct ast_channel *chan, const char *filename, const char *ext, struct ast_format *fmt)
+{
+	struct prompt_file *pf;
+	int length = -1;
+
+	AST_LIST_LOCK(&prompt_dirs);
+	pf = catalog_lookup(filename, ext);
+	if (pf) {
+		length = pf->length;
+	}
+	AST_LIST_UNLOCK(&prompt_dirs);
+
+	if (length >= 0) {
+		return length;
+	}
+
+	/* Don't hold the lock while opening the file */
+	length = get_audio_length(chan, filename, fmt);
+	if (length >= 0) {
+		AST_LIST_LOCK(&prompt_dirs);
+		pf = catalog_lookup(filename, ext); /* Directory could have been refreshed in the meantime */
+		if (pf) {
+			pf->length = length;
+		}
+		AST_LIST_UNLOCK(&prompt_dirs);
+	}
+	return length;
+}
+
+#ifdef HAVE_INOTIFY
+static void *catalog_monitor(void *unused)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfds[2];
+
+	pfds[0].fd = inotify_fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = catalog_alert_pipe[0];
+	pfds[1].events = POLLIN;
+
+	for (;;) {
+		struct prompt_dir *pd;
+		const struct inotify_event *event;
+		ssize_t res;
+		char *ptr;
+
+		if (ast_poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ast_log(LOG_ERROR, "poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (pfds[1].revents) {
+			break; /* Unloading */
+		}
+		res = read(inotify_fd, buf, sizeof(buf));
+		if (res <= 0) {
+			if (res < 0 && (errno == EINTR || errno == EAGAIN)) {
+				continue;
+			}
+			ast_log(LOG_ERROR, "read failed: %s\n", strerror(errno));
+			break;
+		}
+
+		AST_LIST_LOCK(&prompt_dirs);
+		for (ptr = buf; ptr < buf + res; ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *) ptr;
+			AST_LIST_TRAVERSE(&prompt_dirs, pd, entry) {
+				if (pd->wd == event->wd) {
+					break;
+				}
+			}
+			if (!pd) {
+				continue;
+			}
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				/* Directory is gone, it'll get added back if it's used again */
+				ast_debug(3, "Removing %s from prompt catalog\n", pd->path);
+				AST_LIST_REMOVE(&prompt_dirs, pd, entry);
+				if (event->mask & IN_IGNORED) {
+					pd->wd = -1; /* Watch already removed */
+				}
+				prompt_dir_free(pd);
+				continue;
+			}
+			if (event->len && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) {
+				/* File was replaced or rewritten, so its length needs to be recomputed */
+				struct prompt_file *pf = catalog_file(pd, event->name);
+				if (pf) {
+					pf->length = -1;
+				}
+			}
+			pd->stale = 1;
+		}
+		/* Rescan now, rather than making the next caller do it */
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&prompt_dirs, pd, entry) {
+			if (pd->stale && catalog_refresh(pd)) {
+				AST_LIST_REMOVE_CURRENT(entry);
+				prompt_dir_free(pd);
+			}
+		}
+		AST_LIST_TRAVERSE_SAFE_END;
+		AST_LIST_UNLOCK(&prompt_dirs);
+	}
+
+	return NULL;
+}
+#endif
+
+static void catalog_init(void)
+{
+#ifdef HAVE_INOTIFY
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		ast_log(LOG_WARNING, "inotify_init failed, prompt directories will be checked for changes on each use: %s\n", strerror(errno));
+		return;
+	}
+	if (ast_alertpipe_init(catalog_alert_pipe)) {
+		ast_log(LOG_WARNING, "Failed to create alert pipe, prompt directories will be checked for changes on each use\n");
+		close(inotify_fd);
+		inotify_fd = -1;
+		return;
+	}
+	if (ast_pthread_create_background(&catalog_thread, NULL, catalog_monitor, NULL)) {
+		ast_log(LOG_WARNING, "Failed to start monitor thread, prompt directories will be checked for changes on each use\n");
+		ast_alertpipe_close(catalog_alert_pipe);
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+#endif
+}
+
+static void catalog_cleanup(void)
+{
+	struct prompt_dir *pd;
+
+#ifdef HAVE_INOTIFY
+	if (catalog_thread != AST_PTHREADT_NULL) {
+		ast_alertpipe_write(catalog_alert_pipe);
+		pthread_join(catalog_thread, NULL);
+		catalog_thread = AST_PTHREADT_NULL;
+		ast_alertpipe_close(catalog_alert_pipe);
+	}
+#endif
+
+	AST_LIST_LOCK(&prompt_dirs);
+	while ((pd = AST_LIST_REMOVE_HEAD(&prompt_dirs, entry))) {
+		prompt_dir_free(pd);
+	}
+	AST_LIST_UNLOCK(&prompt_dirs);
+
+#ifdef HAVE_INOTIFY
+	if (inotify_fd >= 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+#endif
+}
+
 static int find_prompt(struct ast_channel *chan, struct audichron *restrict a, const char *promptdir, int *restrict pretime, char *restrict buf, size_t len,
 	const char *prefix, const char *opt_prefix, const char *default_prompt, int exact)
 {
@@ -304,7 +799,7 @@ static int find_prompt(struct ast_channel *chan, struct audichron *restrict a, c
 			snprintf(parentdir, sizeof(parentdir), "%s/sounds/%s%s%s", ast_config_AST_DATA_DIR, ast_channel_language(chan), *parent != '\0' ? "/" : "", parent);
 		}
 		ast_debug(3, "basename = %s, dirname = %s\n", base, parentdir);
-		res = ast_file_read_dir(parentdir, handle_find_prompt, &search);
+		res = catalog_read_dir(parentdir, handle_find_prompt, &search);
 		if (res < 0) {
 			ast_log(LOG_ERROR, "Failed to scan directory '%s'\n", parentdir);
 			return -1;
@@ -324,7 +819,7 @@ static int find_prompt(struct ast_channel *chan, struct audichron *restrict a, c
 			.result = "",
 			.exact = exact,
 		};
-		int res = ast_file_read_dir(promptdir, handle_find_prompt, &search);
+		int res = catalog_read_dir(promptdir, handle_find_prompt, &search);
 		if (res < 0) {
 			ast_log(LOG_ERROR, "Failed to scan directory '%s'\n", promptdir);
 			return -1;
@@ -332,7 +827,7 @@ static int find_prompt(struct ast_channel *chan, struct audichron *restrict a, c
 		/* If it's a number, try without zero prefix */
 		if (!search.result[0] && prefix[0] == '0') {
 			search.prefix = prefix + 1;
-			res = ast_file_read_dir(promptdir, handle_find_prompt, &search);
+			res = catalog_read_dir(promptdir, handle_find_prompt, &search);
 			if (res < 0) {
 				return -1;
 			}
@@ -342,14 +837,14 @@ static int find_prompt(struct ast_channel *chan, struct audichron *restrict a, c
 			char fullprefix[PATH_MAX];
 			snprintf(fullprefix, sizeof(fullprefix), "%s%s", opt_prefix, prefix);
 			search.prefix = fullprefix;
-			res = ast_file_read_dir(promptdir, handle_find_prompt, &search);
+			res = catalog_read_dir(promptdir, handle_find_prompt, &search);
 			if (res < 0) {
 				return -1;
 			}
 			if (!search.result[0] && prefix[0] == '0') {
 				snprintf(fullprefix, sizeof(fullprefix), "%s%s", opt_prefix, prefix + 1);
 				search.prefix = fullprefix;
-				res = ast_file_read_dir(promptdir, handle_find_prompt, &search);
+				res = catalog_read_dir(promptdir, handle_find_prompt, &search);
 				if (res < 0) {
 					return -1;
 				}
@@ -377,7 +872,7 @@ static int find_prompt(struct ast_channel *chan, struct audichron *restrict a, c
 	}
 #endif
 
-	length = get_audio_length(chan, buf, fmt);
+	length = prompt_length(chan, buf, ext, fmt);
 
 	*pretime += length;
 	return 0;
@@ -429,30 +924,31 @@ static int play_temperature(struct ast_channel *chan, struct audichron *a, int n
 
 static int get_rand_file(struct audichron *a, char *buf, size_t len, const char *directory)
 {
-	struct dirent *entry, **entries;
-	int files, fno;
-	unsigned int c = 0;
-	char *ext;
+	struct prompt_dir *pd;
+	int i;
+	int c = 0;
 	int found_file = 0;
 
-	/* use scandir instead of opendir/readdir, so the listing is ordered */
-	files = scandir(directory, &entries, NULL, alphasort);
-	if (files < 0) {
-		ast_log(LOG_ERROR, "scandir(%s) failed: %s\n", directory, strerror(errno));
+	/* The catalog is sorted, so the listing is ordered */
+	AST_LIST_LOCK(&prompt_dirs);
+	pd = catalog_dir(directory);
+	if (!pd) {
+		AST_LIST_UNLOCK(&prompt_dirs);
+		ast_log(LOG_ERROR, "Failed to scan directory '%s'\n", directory);
 		return -1;
 	}
 	if (!a->num_files) {
 		/* 1-indexed, so not initialized yet */
-		fno = 0;
-		while (fno < files && (entry = entries[fno++])) {
-			if (entry->d_type != DT_REG || !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
-				continue;
-			}
-			ext = strrchr(entry->d_name, '.');
-			if (ext++ && ast_get_format_for_file_ext(ext)) {
+		for (i = 0; i < pd->num; i++) {
+			if (prompt_file_playable(pd->files[i])) {
 				c++;
 			}
 		}
+		if (!c) {
+			AST_LIST_UNLOCK(&prompt_dirs);
+			ast_log(LOG_WARNING, "Directory %s is empty or does not contain any playable files\n", directory);
+			return -1;
+		}
 		a->num_files = c;
 		a->rand_index = rand() % a->num_files;
 	} else {
@@ -460,29 +956,18 @@ static int get_rand_file(struct audichron *a, char *buf, size_t len, const char
 			a->rand_index = 0;
 		}
 	}
-	fno = 0;
 	c = 0;
-	while (fno < files && (entry = entries[fno++])) {
-		if (entry->d_type != DT_REG || !strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
-			ast_std_free(entry);
-			continue;
-		}
-		ext = strrchr(entry->d_name, '.');
-		if (!ext++ || !ast_get_format_for_file_ext(ext)) {
-			ast_std_free(entry);
+	for (i = 0; i < pd->num; i++) {
+		if (!prompt_file_playable(pd->files[i])) {
 			continue;
 		}
 		if (c++ == a->rand_index) {
-			snprintf(buf, len, "%s/%s", directory, entry->d_name);
+			snprintf(buf, len, "%s/%s", directory, pd->files[i]->name);
 			found_file = 1;
+			break;
 		}
-		ast_std_free(entry);
-	}
-	ast_std_free(entries);
-	if (!a->num_files) {
-		ast_log(LOG_WARNING, "Directory %s is empty or does not contain any playable files\n", directory);
-		return -1;
 	}
+	AST_LIST_UNLOCK(&prompt_dirs);
 	ast_assert_return(found_file, -1);
 	return 0;
 }
@@ -556,21 +1041,14 @@ static int audichron_loop(struct ast_channel *chan, struct audichron *a)
 				return -1;
 			}
 			*ext++ = '\0'; /* Remove extension */
-			length = get_audio_length(chan, adfile, ast_get_format_for_file_ext(ext));
+			length = prompt_length(chan, adfile, ext, ast_get_format_for_file_ext(ext));
 			pretime += length;
 		} else {
-			char testname[PATH_MAX];
+			const char *ext;
 #ifdef NO_WAY_TO_DETERMINE_EXTENSION_FROM_FILESTREAM
-			struct stat st;
-			struct ast_format *fmt;
-			snprintf(testname, sizeof(testname), "%s.ulaw", a->advertisement);
-			if (!stat(testname, &st)) {
-				fmt = ast_get_format_for_file_ext("ulaw");
-			} else {
-				fmt = ast_get_format_for_file_ext("wav");
-			}
+			ext = prompt_exists(a->advertisement, "ulaw") ? "ulaw" : "wav";
 #endif
-			length = get_audio_length(chan, a->advertisement, fmt);
+			length = prompt_length(chan, a->advertisement, ext, ast_get_format_for_file_ext(ext));
 			pretime += length;
 		}
 	}
@@ -868,11 +1346,14 @@ static int audichron_exec(struct ast_channel *chan, const char *data)
 
 static int unload_module(void)
 {
-	return ast_unregister_application(app);
+	int res = ast_unregister_application(app);
+	catalog_cleanup();
+	return res;
 }
 
 static int load_module(void)
 {
+	catalog_init();
 	return ast_register_application_xml(app, audichron_exec);
 }
 
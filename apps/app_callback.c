@@ -40,6 +40,9 @@
 #include "asterisk/format_cache.h"
 #include "asterisk/cli.h"
 #include "asterisk/causes.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/stasis.h"
+#include "asterisk/devicestate.h"
 
 /*** DOCUMENTATION
 	<application name="RequestCallback" language="en_US">
@@ -83,6 +86,9 @@
 				<para>Polling interval of device state. An override will apply to both local and remote intervals.
 				To specify both local and remote interval, delimit using a pipe.</para>
 				<para>Default is 5 seconds for local destinations and 30 seconds for remote destinations.</para>
+				<para>Local destinations are also checked as soon as the device state of the destination
+				(or the caller, with the <literal>l</literal> option) changes, so the local interval
+				is only a fallback.</para>
 				<para>WARNING: A low interval for remote polling could significantly increase network traffic.</para>
 			</parameter>
 			<parameter name="tagname">
@@ -177,39 +183,92 @@
 static char *app = "RequestCallback";
 static char *app2 = "CancelCallback";
 
+/*! \brief Number of seconds covered by the timer wheel. Deadlines further out wrap around. */
+#define WHEEL_SLOTS 64
+
+/*! \brief Number of threads that query remote device state */
+#define REMOTE_POLLERS 2
+
 struct callback_monitor_item {
-	ast_mutex_t lock;
-	pthread_t thread;
 	char number[AST_MAX_EXTENSION];
 	char caller[AST_MAX_EXTENSION];
+	char endpoints[256];	/* Devices of the watched number's hint, if local */
+	char callerhint[256];	/* Devices of the caller's hint, if require_local_idle */
 	int watch_start;
-	int remaining;
-	int timeout_ms;
+	time_t expires;
+	time_t next_poll;
+	int slot;				/* Timer wheel slot, -1 if not in the wheel */
 	int ringtime;
 	int poll_local;
 	int poll_remote;
+	int querytimeout;
+	int queued;				/* In the remote poll queue, protected by poll_lock */
 	char *localstate;
 	char *remotedialcontext;
 	char *callbackcaller;
 	char *callbackwatched;
 	char *tagname;
 	unsigned int require_local_idle:1;
+	unsigned int remote:1;
+	unsigned int check:1;	/* In the check list, for a device state change */
 	unsigned int cancel:1;
 	AST_RWLIST_ENTRY(callback_monitor_item) entry;		/*!< Next record */
+	AST_LIST_ENTRY(callback_monitor_item) slot_entry;	/*!< Next in timer wheel slot */
+	AST_LIST_ENTRY(callback_monitor_item) check_entry;	/*!< Next to check */
+	AST_LIST_ENTRY(callback_monitor_item) poll_entry;	/*!< Next to poll remotely */
 };
 
+/*!
+ * All callbacks. The list lock also protects the timer wheel, the check list,
+ * and the scheduling fields of callbacks.
+ */
 static AST_RWLIST_HEAD_STATIC(callbacks, callback_monitor_item);
 
+/*! \brief Timer wheel of callbacks, by the second of their next deadline (poll or expiration) */
+static AST_LIST_HEAD_NOLOCK(, callback_monitor_item) wheel[WHEEL_SLOTS];
+static time_t wheel_time;	/* Last second processed */
+
+/*! \brief Callbacks to check now, because the device state of their endpoints changed */
+static AST_LIST_HEAD_NOLOCK(, callback_monitor_item) checks;
+
+/*! \brief Remote device state queries, protected by poll_lock */
+static AST_LIST_HEAD_NOLOCK(, callback_monitor_item) pollq;
+
+static ast_mutex_t sched_lock;
+static ast_cond_t sched_cond;
+static int sched_wakeup = 0;
+
+static ast_mutex_t poll_lock;
+static ast_cond_t poll_cond;
+
+static int unloading = 0;
+static pthread_t sched_thread = AST_PTHREADT_NULL;
+static pthread_t poll_threads[REMOTE_POLLERS];
+static struct stasis_subscription *devstate_sub;
+
+#define free_if_exists(ptr) if (ptr) ast_free(ptr);
+
+static void callback_destructor(void *obj)
+{
+	struct callback_monitor_item *cb = obj;
+
+	/* Don't free anything that's NULL. */
+	free_if_exists(cb->localstate);
+	free_if_exists(cb->remotedialcontext);
+	free_if_exists(cb->callbackcaller);
+	free_if_exists(cb->callbackwatched);
+	free_if_exists(cb->tagname);
+}
+
 /*! \brief Allocate and initialize callback */
 static struct callback_monitor_item *alloc_callback(const char *caller, const char *number)
 {
 	struct callback_monitor_item *cb;
 
-	if (!(cb = ast_calloc(1, sizeof(*cb)))) {
+	if (!(cb = ao2_alloc_options(sizeof(*cb), callback_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
 		return NULL;
 	}
 
-	ast_mutex_init(&cb->lock);
 	if (!ast_strlen_zero(caller)) {
 		ast_copy_string(cb->caller, caller, sizeof(cb->caller));
 	} else {
@@ -222,23 +281,11 @@ static struct callback_monitor_item *alloc_callback(const char *caller, const ch
 	}
 
 	cb->watch_start = (int) time(NULL);
+	cb->slot = -1;
 
 	return cb;
 }
 
-#define free_if_exists(ptr) if (ptr) ast_free(ptr);
-
-static void callback_free(struct callback_monitor_item *cb)
-{
-	/* Don't free anything that's NULL. */
-	free_if_exists(cb->localstate);
-	free_if_exists(cb->remotedialcontext);
-	free_if_exists(cb->callbackcaller);
-	free_if_exists(cb->callbackwatched);
-	free_if_exists(cb->tagname);
-	ast_free(cb);
-}
-
 static int local_endpoint_busy(const char *endpoints, const char *number)
 {
 	int res = -1;
@@ -329,131 +376,305 @@ static int remote_endpoint_busy(const char *number, const char *remotedialcontex
 	return res;
 }
 
-static void *callback_monitor(void *data)
+
+#define SET_STATUS "CALLBACK_REQUEST_STATUS"
+#define CANCEL_STATUS "CALLBACK_CANCEL_STATUS"
+
+/*! \brief Wake up the scheduler, to process device state changes or a new deadline */
+static void sched_wake(void)
 {
-	char endpoints[256];
-	char callerhint[256];
-	int remote, poll_ms = 0;
-	struct callback_monitor_item *cb2 = NULL, *cb = data;
-	struct timeval start, pollstart;
-	int timeout;
+	ast_mutex_lock(&sched_lock);
+	sched_wakeup = 1;
+	ast_cond_signal(&sched_cond);
+	ast_mutex_unlock(&sched_lock);
+}
 
-	if (!cb) {
-		ast_log(LOG_WARNING, "Missing data\n");
-		return NULL;
+/*! \note callbacks must be locked */
+static void wheel_remove(struct callback_monitor_item *cb)
+{
+	if (cb->slot >= 0) {
+		AST_LIST_REMOVE(&wheel[cb->slot], cb, slot_entry);
+		cb->slot = -1;
 	}
+}
 
-	/* Determine if the endpoint is local or not. */
-	remote = ast_get_hint(endpoints, sizeof(endpoints), NULL, 0, NULL, cb->localstate, cb->number) ? 0 : 1; /* chan is NULL, there isn't one, and we don't need it. */
-	poll_ms = remote ? cb->poll_remote : cb->poll_local;
+/*!
+ * \brief Schedule a callback's next poll (or its expiration, if sooner)
+ * \note callbacks must be locked
+ */
+static void wheel_schedule(struct callback_monitor_item *cb, time_t now)
+{
+	time_t deadline;
 
-	start = ast_tvnow();
-	pollstart = ast_tvnow();
+	wheel_remove(cb);
+	cb->next_poll = now + (cb->remote ? cb->poll_remote : cb->poll_local);
+	deadline = MIN(cb->next_poll, cb->expires);
+	if (deadline <= wheel_time) {
+		deadline = wheel_time + 1; /* That slot was already processed */
+	}
+	cb->slot = deadline % WHEEL_SLOTS;
+	AST_LIST_INSERT_TAIL(&wheel[cb->slot], cb, slot_entry);
+}
 
-	if (cb->require_local_idle) {
-		callerhint[0] = '\0';
-		if (!ast_get_hint(callerhint, sizeof(callerhint), NULL, 0, NULL, cb->localstate, cb->caller)) {
-			ast_log(LOG_WARNING, "Couldn't find hint for %s\n", cb->caller);
-		}
+/*! \brief Queue a remote device state query for a callback */
+static void poll_remote(struct callback_monitor_item *cb)
+{
+	ast_mutex_lock(&poll_lock);
+	if (!cb->queued) {
+		ao2_ref(cb, +1); /* Released by the poller */
+		cb->queued = 1;
+		AST_LIST_INSERT_TAIL(&pollq, cb, poll_entry);
+		ast_cond_signal(&poll_cond);
 	}
+	ast_mutex_unlock(&poll_lock);
+}
 
-	ast_verb(3, "Callback activated for %s by %s for %d minutes\n", cb->number, cb->caller, cb->timeout_ms / 60000);
+/*!
+ * \brief Remove a callback from the timer wheel, check list, and poll queue
+ * \note callbacks must be write locked. The callback must already have been removed from the list.
+ */
+static void callback_unschedule(struct callback_monitor_item *cb)
+{
+	wheel_remove(cb);
+	if (cb->check) {
+		AST_LIST_REMOVE(&checks, cb, check_entry);
+		cb->check = 0;
+	}
+	ast_mutex_lock(&poll_lock);
+	if (cb->queued) {
+		AST_LIST_REMOVE(&pollq, cb, poll_entry);
+		cb->queued = 0;
+		ao2_ref(cb, -1);
+	}
+	ast_mutex_unlock(&poll_lock);
+	cb->cancel = 1; /* If a remote query is in progress, the poller will discard the result */
+}
 
-	timeout = 4;
-	if (poll_ms <= timeout * 1000) {
-		timeout = 2;
-		if (poll_ms <= timeout * 1000) {
-			ast_log(LOG_WARNING, "Poll timeout %d is too short.\n", poll_ms);
-		}
+/*! \retval 1 if the caller is able to receive the callback */
+static int caller_ready(struct callback_monitor_item *cb)
+{
+	if (cb->require_local_idle && local_endpoint_busy(cb->callerhint, cb->caller)) {
+		ast_debug(1, "%s is now free, but caller (%s) is not, delaying callback...\n", cb->number, cb->caller);
+		return 0;
 	}
+	return 1;
+}
 
-	while ((cb->remaining = ast_remaining_ms(start, cb->timeout_ms)) > 0) {
-		usleep(250000); /* sleep for 250ms */
-		if (cb->cancel) { /* Thread was cancelled. */
-			ast_debug(1, "Callback %s/%s is ending early\n", cb->caller, cb->number);
-			break;
-		}
-		if (ast_remaining_ms(pollstart, poll_ms) <= 0) {
-			ast_debug(2, "Polling availability of %s...\n", cb->number);
-			if ((!remote && !local_endpoint_busy(endpoints, cb->number)) || (remote && !remote_endpoint_busy(cb->number, cb->remotedialcontext, cb->caller, timeout))) {
-				if (cb->require_local_idle && local_endpoint_busy(callerhint, cb->caller)) {
-					ast_debug(1, "%s is now free, but caller (%s) is not, delaying callback...\n", cb->number, cb->caller);
-				} else {
-					char dialbuf[256];
-					struct ast_format_cap *cap;
-					int outgoing_status = 0;
-					ast_verb(3, "Destination %s is now idle! Queuing callback for %s\n", cb->number, cb->caller);
-					/* Async originate call to caller. If/when answered, ring watched number. */
-					/* Caller ID is that of the watched number. Anything else just doesn't make sense. */
-					/* As for Caller ID Name, dunno, but try to be informative with "CALLBACK", so user knows. */
-					cap = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT);
-					if (!cap) {
-						ast_log(LOG_WARNING, "Failed to allocate capabilities\n");
-						break;
-					}
-					ast_format_cap_append(cap, ast_format_slin, 0);
-					snprintf(dialbuf, sizeof(dialbuf), "%s@%s", cb->caller, cb->callbackcaller);
-					ast_pbx_outgoing_exten("Local", cap, dialbuf, cb->ringtime * 1000,
-						cb->callbackwatched, cb->number, 1,
-						&outgoing_status, AST_OUTGOING_NO_WAIT, cb->number, "CALLBACK", NULL, NULL, NULL, 0, NULL);
-					ao2_cleanup(cap);
-					break; /* Our work here is done. */
-				}
-			}
-			pollstart = ast_tvnow();
-		}
+/*! \brief Originate a callback, now that the destination is idle */
+static void callback_activate(struct callback_monitor_item *cb)
+{
+	char dialbuf[256];
+	struct ast_format_cap *cap;
+	int outgoing_status = 0;
+
+	ast_verb(3, "Destination %s is now idle! Queuing callback for %s\n", cb->number, cb->caller);
+	/* Async originate call to caller. If/when answered, ring watched number. */
+	/* Caller ID is that of the watched number. Anything else just doesn't make sense. */
+	/* As for Caller ID Name, dunno, but try to be informative with "CALLBACK", so user knows. */
+	cap = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT);
+	if (!cap) {
+		ast_log(LOG_WARNING, "Failed to allocate capabilities\n");
+		return;
 	}
+	ast_format_cap_append(cap, ast_format_slin, 0);
+	snprintf(dialbuf, sizeof(dialbuf), "%s@%s", cb->caller, cb->callbackcaller);
+	ast_pbx_outgoing_exten("Local", cap, dialbuf, cb->ringtime * 1000,
+		cb->callbackwatched, cb->number, 1,
+		&outgoing_status, AST_OUTGOING_NO_WAIT, cb->number, "CALLBACK", NULL, NULL, NULL, 0, NULL);
+	ao2_cleanup(cap);
+}
+
+AST_LIST_HEAD_NOLOCK(callback_list, callback_monitor_item);
 
-	if (cb->remaining <= 0) {
-		/* Somebody's a chatty Kathy... */
-		ast_log(LOG_NOTICE, "Callback request from %s to %s expired without completion\n", cb->caller, cb->number);
+/*!
+ * \brief Check if a local callback can be completed, and if so, move it to a list to activate
+ * \note callbacks must be write locked
+ */
+static void check_local(struct callback_monitor_item *cb, struct callback_list *activate, time_t now)
+{
+	if (!local_endpoint_busy(cb->endpoints, cb->number) && caller_ready(cb)) {
+		AST_RWLIST_REMOVE(&callbacks, cb, entry);
+		callback_unschedule(cb);
+		AST_LIST_INSERT_TAIL(activate, cb, slot_entry); /* No longer in the wheel, so the entry is free */
+	} else {
+		wheel_schedule(cb, now);
 	}
+}
 
-	ast_debug(1, "Callback monitor from %s to %s is terminating\n", cb->caller, cb->number);
+/*!
+ * \brief Single thread that runs all callbacks
+ * \details Local callbacks are checked as soon as the device state of their hint changes.
+ * Each callback is also in a timer wheel slot for the second of its next deadline:
+ * its next poll (remote callbacks, or as a fallback for local ones) or expiration.
+ */
+static void *callback_scheduler(void *unused)
+{
+	for (;;) {
+		struct callback_list activate = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+		struct callback_monitor_item *cb;
+		struct timespec ts = { 0, };
+		time_t now, t;
+		int i, idle;
 
-	if (!cb->cancel) { /* If we were cancelled, the list is already locked by someone traversing it, and locking would lead to deadlock since they're waiting for us to die. */
 		AST_RWLIST_WRLOCK(&callbacks);
-		/* Look for an existing one */
-		AST_RWLIST_TRAVERSE_SAFE_BEGIN(&callbacks, cb2, entry) {
-			if (cb == cb2) { /* Remove this callback from the list, if we find it. */
-				AST_RWLIST_REMOVE_CURRENT(entry);
+		now = time(NULL);
+
+		/* Device state changes */
+		while ((cb = AST_LIST_REMOVE_HEAD(&checks, check_entry))) {
+			cb->check = 0;
+			ast_debug(2, "Device state changed, checking availability of %s...\n", cb->number);
+			check_local(cb, &activate, now);
+		}
+
+		/* Turn the wheel up to the current second. If we're more than a revolution behind, every slot is processed once. */
+		for (t = MAX(wheel_time + 1, now - WHEEL_SLOTS + 1); t <= now; t++) {
+			AST_LIST_TRAVERSE_SAFE_BEGIN(&wheel[t % WHEEL_SLOTS], cb, slot_entry) {
+				if (MIN(cb->next_poll, cb->expires) > now) {
+					continue; /* Due in a later revolution */
+				}
+				AST_LIST_REMOVE_CURRENT(slot_entry);
+				cb->slot = -1;
+				if (cb->expires <= now) {
+					/* Somebody's a chatty Kathy... */
+					ast_log(LOG_NOTICE, "Callback request from %s to %s expired without completion\n", cb->caller, cb->number);
+					AST_RWLIST_REMOVE(&callbacks, cb, entry);
+					callback_unschedule(cb);
+					ao2_ref(cb, -1);
+				} else if (cb->remote) {
+					poll_remote(cb); /* The poller reschedules it once the query finishes */
+				} else {
+					ast_debug(2, "Polling availability of %s...\n", cb->number);
+					check_local(cb, &activate, now); /* In case a device state change was missed */
+				}
+			}
+			AST_LIST_TRAVERSE_SAFE_END;
+		}
+		wheel_time = now;
+
+		/* Sleep until the next second with anything in its slot (or a device state change) */
+		for (i = 1; i < WHEEL_SLOTS; i++) {
+			if (!AST_LIST_EMPTY(&wheel[(now + i) % WHEEL_SLOTS])) {
 				break;
 			}
 		}
-		AST_RWLIST_TRAVERSE_SAFE_END;
+		ts.tv_sec = now + i;
+		idle = AST_RWLIST_EMPTY(&callbacks);
 		AST_RWLIST_UNLOCK(&callbacks);
-	}
 
-	if (cb2) {
-		ast_debug(3, "Removed entry from list ourselves.\n");
+		while ((cb = AST_LIST_REMOVE_HEAD(&activate, slot_entry))) {
+			callback_activate(cb);
+			ao2_ref(cb, -1);
+		}
+
+		ast_mutex_lock(&sched_lock);
+		if (!sched_wakeup && !unloading) {
+			if (idle) {
+				ast_cond_wait(&sched_cond, &sched_lock); /* No callbacks, nothing to do until one is requested */
+			} else {
+				ast_cond_timedwait(&sched_cond, &sched_lock, &ts);
+			}
+		}
+		sched_wakeup = 0;
+		if (unloading) {
+			ast_mutex_unlock(&sched_lock);
+			break;
+		}
+		ast_mutex_unlock(&sched_lock);
 	}
+	return NULL;
+}
+
+/*! \brief Thread that queries remote device state, which can take several seconds per query */
+static void *remote_poller(void *unused)
+{
+	for (;;) {
+		struct callback_monitor_item *cb;
+		int ready, cancelled;
+
+		ast_mutex_lock(&poll_lock);
+		while (!unloading && !(cb = AST_LIST_REMOVE_HEAD(&pollq, poll_entry))) {
+			ast_cond_wait(&poll_cond, &poll_lock);
+		}
+		if (unloading) {
+			ast_mutex_unlock(&poll_lock);
+			break;
+		}
+		cb->queued = 0;
+		ast_mutex_unlock(&poll_lock);
 
-	ast_assert(cb->cancel || cb2 != NULL); /* We better have found the entry we were using in the list, if we really exited of our own volition. */
+		ast_debug(2, "Polling availability of %s...\n", cb->number);
+		ready = !remote_endpoint_busy(cb->number, cb->remotedialcontext, cb->caller, cb->querytimeout);
+
+		AST_RWLIST_WRLOCK(&callbacks);
+		cancelled = cb->cancel;
+		if (cancelled) {
+			ready = 0; /* Cancelled while we were querying */
+		} else if (ready && caller_ready(cb)) {
+			AST_RWLIST_REMOVE(&callbacks, cb, entry);
+			ao2_ref(cb, -1); /* We still have the queue's reference */
+		} else {
+			ready = 0;
+			wheel_schedule(cb, time(NULL));
+		}
+		AST_RWLIST_UNLOCK(&callbacks);
 
-	callback_free(cb);
+		if (ready) {
+			callback_activate(cb);
+		} else if (!cancelled) {
+			sched_wake(); /* Deadline may be sooner than the scheduler expects */
+		}
+		ao2_ref(cb, -1);
+	}
 	return NULL;
 }
 
-#define SET_STATUS "CALLBACK_REQUEST_STATUS"
-#define CANCEL_STATUS "CALLBACK_CANCEL_STATUS"
+/*! \retval 1 if device is one of the &-separated devices */
+static int device_in_list(const char *device, const char *devices)
+{
+	size_t len = strlen(device);
+
+	while (!ast_strlen_zero(devices)) {
+		const char *end = strchr(devices, '&');
+		size_t devlen = end ? (size_t) (end - devices) : strlen(devices);
+		if (devlen == len && !strncasecmp(devices, device, len)) {
+			return 1;
+		}
+		devices = end ? end + 1 : NULL;
+	}
+	return 0;
+}
 
-static void cancel_thread(struct callback_monitor_item *cb, int join)
+static void devstate_cb(void *data, struct stasis_subscription *sub, struct stasis_message *msg)
 {
-	pthread_t thread = cb->thread;
+	struct ast_device_state_message *dev_state;
+	struct callback_monitor_item *cb;
+	int found = 0;
+
+	if (stasis_message_type(msg) != ast_device_state_message_type()) {
+		return;
+	}
 
-	ast_debug(3, "Instructing callback thread %lu to exit\n", (long) thread);
+	dev_state = stasis_message_data(msg);
+	if (dev_state->eid) {
+		return; /* Only interested in the aggregate state */
+	}
+
+	AST_RWLIST_WRLOCK(&callbacks);
+	AST_RWLIST_TRAVERSE(&callbacks, cb, entry) {
+		if (cb->remote || cb->check) {
+			continue;
+		}
+		if (device_in_list(dev_state->device, cb->endpoints) || (cb->require_local_idle && device_in_list(dev_state->device, cb->callerhint))) {
+			cb->check = 1;
+			AST_LIST_INSERT_TAIL(&checks, cb, check_entry);
+			found = 1;
+		}
+	}
+	AST_RWLIST_UNLOCK(&callbacks);
 
-	ast_mutex_lock(&cb->lock);
-	cb->cancel = 1;
-	/* Let thread exit of its own volition */
-	/* i.e. no: pthread_cancel(thread); */
-	/* i.e. no: pthread_kill(thread, SIGURG); */
-	ast_mutex_unlock(&cb->lock);
-	if (join) {
-		/*! \todo join can cause a segfault on module unload/refresh, but why??? */
-		pthread_join(thread, NULL); /* Thread will now free cb and clean up. */
+	if (found) {
+		sched_wake();
 	}
-	ast_debug(3, "Thread %ld has exited\n", (long) thread);
 }
 
 static int cancel_exec(struct ast_channel *chan, const char *data)
@@ -484,8 +705,9 @@ static int cancel_exec(struct ast_channel *chan, const char *data)
 			if ((ast_strlen_zero(cb->tagname) && ast_strlen_zero(tagname)) || (!ast_strlen_zero(cb->tagname) && !ast_strlen_zero(tagname) && !strcmp(cb->tagname, tagname))) {
 				success = 1;
 				ast_verb(3, "Cancelling callback from %s to %s\n", cb->caller, cb->number);
-				AST_RWLIST_REMOVE_CURRENT (entry);
-				cancel_thread(cb, 1);
+				AST_RWLIST_REMOVE_CURRENT(entry);
+				callback_unschedule(cb);
+				ao2_ref(cb, -1);
 			}
 		}
 	}
@@ -497,12 +719,40 @@ static int cancel_exec(struct ast_channel *chan, const char *data)
 	return 0;
 }
 
+/*!
+ * \brief Check if a new callback would conflict with an existing one
+ * \note callbacks must be locked
+ * \retval 1 if it would, and the status has been set
+ */
+static int callback_exists(struct ast_channel *chan, const char *caller, const char *number, int single, int *already_had)
+{
+	struct callback_monitor_item *cb;
+
+	/* Look for an existing one */
+	AST_RWLIST_TRAVERSE(&callbacks, cb, entry) {
+		ast_debug(3, "Comparing %s with %s\n", cb->caller, caller);
+		if ((ast_strlen_zero(cb->caller) && ast_strlen_zero(caller)) || !strcmp(cb->caller, caller)) {
+			(*already_had)++;
+			if (!strcmp(cb->number, number)) {
+				ast_verb(3, "Callback from %s to %s already pending\n", caller, number);
+				pbx_builtin_setvar_helper(chan, SET_STATUS, "DUPLICATE");
+				return 1;
+			} else if (single) {
+				ast_verb(3, "%s already has a callback pending (to %s)\n", caller, cb->number);
+				pbx_builtin_setvar_helper(chan, SET_STATUS, "ALREADY");
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
 static int callback_exec(struct ast_channel *chan, const char *data)
 {
-	char endpoints[256];
+	char tmpbuf[1]; /* Result not needed */
 	char *caller;
 	int ringtime = 30, timeout_ms = 1800000, poll_local = 0, poll_remote = 0, single = 0, require_local_idle = 0;
-	int remote, already_had = 0;
+	int res, already_had = 0;
 	char *appdata;
 	struct callback_monitor_item *cb;
 	AST_DECLARE_APP_ARGS(args,
@@ -571,70 +821,80 @@ static int callback_exec(struct ast_channel *chan, const char *data)
 
 	caller = !ast_strlen_zero(args.caller) ? args.caller : S_OR(ast_channel_caller(chan)->id.number.str, "");
 
-	AST_RWLIST_WRLOCK(&callbacks);
-	/* Look for an existing one */
-	AST_RWLIST_TRAVERSE(&callbacks, cb, entry) {
-		ast_debug(3, "Comparing %s with %s\n", cb->caller, caller);
-		if ((ast_strlen_zero(cb->caller) && ast_strlen_zero(caller)) || !strcmp(cb->caller, caller)) {
-			already_had++;
-			if (!strcmp(cb->number, args.number)) {
-				ast_verb(3, "Callback from %s to %s already pending\n", caller, args.number);
-				pbx_builtin_setvar_helper(chan, SET_STATUS, "DUPLICATE");
-				break;
-			} else if (single) {
-				ast_verb(3, "%s already has a callback pending (to %s)\n", caller, cb->number);
-				pbx_builtin_setvar_helper(chan, SET_STATUS, "ALREADY");
-				break;
-			}
-		}
+	AST_RWLIST_RDLOCK(&callbacks);
+	res = callback_exists(chan, caller, args.number, single, &already_had);
+	AST_RWLIST_UNLOCK(&callbacks);
+	if (res) {
+		return 0;
 	}
 
-	if (!cb) { /* We're good to request a callback */
-		cb = alloc_callback(caller, args.number);
-		if (cb) {
-			char tmpbuf[1]; /* Result not needed */
-			cb->thread = AST_PTHREADT_NULL;
-			cb->timeout_ms = timeout_ms;
-			cb->ringtime = ringtime;
-			cb->poll_local = poll_local ? poll_local * 1000 : 5000;
-			cb->poll_remote = poll_remote ? poll_remote * 1000 : 30000;
-			cb->require_local_idle = require_local_idle;
-			cb->localstate = args.localdevicestate ? ast_strdup(args.localdevicestate) : NULL;
-			cb->remotedialcontext = args.remotedialcontext ? ast_strdup(args.remotedialcontext) : NULL;
-			cb->callbackcaller = args.callbackcaller ? ast_strdup(args.callbackcaller) : NULL;
-			cb->callbackwatched = args.callbackwatched ? ast_strdup(args.callbackwatched) : NULL;
-			cb->tagname = args.tagname ? ast_strdup(args.tagname) : NULL;
-
-			remote = ast_get_hint(endpoints, sizeof(endpoints), NULL, 0, NULL, cb->localstate, cb->number) ? 0 : 1;
-			/* Check if it's available now. */
-			if (!remote && !local_endpoint_busy(endpoints, cb->number)) {
-				ast_verb(3, "Destination %s is currently idle.\n", cb->number);
-				pbx_builtin_setvar_helper(chan, SET_STATUS, "IDLE");
-				/* The call can just complete directly now, no callback is necessary. */
-				callback_free(cb);
-			} else if (ast_get_extension_data(tmpbuf, sizeof(tmpbuf), chan, cb->remotedialcontext, cb->number, 1)) {
-				ast_verb(3, "Can't determine status of destination %s.\n", cb->number);
-				pbx_builtin_setvar_helper(chan, SET_STATUS, "UNSUPPORTED");
-				/* Not a local endpoint, and no route to the remote status. */
-				callback_free(cb);
-			} else if (remote && !remote_endpoint_busy(cb->number, cb->remotedialcontext, cb->caller, 4)) {
-				ast_verb(3, "Destination %s is currently idle.\n", cb->number);
-				pbx_builtin_setvar_helper(chan, SET_STATUS, "IDLE");
-				/* The call can just complete directly now, no callback is necessary. */
-				callback_free(cb);
-			} else if (ast_pthread_create_background(&cb->thread, NULL, callback_monitor, (void *) cb)) {
-				ast_log(LOG_ERROR, "Unable to monitor for callback completion\n");
-				callback_free(cb);
-				pbx_builtin_setvar_helper(chan, SET_STATUS, "FAILURE");
-			} else {
-				AST_RWLIST_INSERT_TAIL(&callbacks, cb, entry);
-				pbx_builtin_setvar_helper(chan, SET_STATUS, already_had ? "ANOTHER" : "QUEUED");
-			}
+	cb = alloc_callback(caller, args.number);
+	if (!cb) {
+		pbx_builtin_setvar_helper(chan, SET_STATUS, "FAILURE");
+		return 0;
+	}
+
+	cb->ringtime = ringtime;
+	cb->poll_local = poll_local ? poll_local : 5;
+	cb->poll_remote = poll_remote ? poll_remote : 30;
+	cb->require_local_idle = require_local_idle;
+	cb->localstate = args.localdevicestate ? ast_strdup(args.localdevicestate) : NULL;
+	cb->remotedialcontext = args.remotedialcontext ? ast_strdup(args.remotedialcontext) : NULL;
+	cb->callbackcaller = args.callbackcaller ? ast_strdup(args.callbackcaller) : NULL;
+	cb->callbackwatched = args.callbackwatched ? ast_strdup(args.callbackwatched) : NULL;
+	cb->tagname = args.tagname ? ast_strdup(args.tagname) : NULL;
+
+	/* Determine if the endpoint is local or not. */
+	cb->remote = ast_get_hint(cb->endpoints, sizeof(cb->endpoints), NULL, 0, NULL, cb->localstate, cb->number) ? 0 : 1;
+	if (cb->require_local_idle && !ast_get_hint(cb->callerhint, sizeof(cb->callerhint), NULL, 0, NULL, cb->localstate, cb->caller)) {
+		ast_log(LOG_WARNING, "Couldn't find hint for %s\n", cb->caller);
+	}
+
+	cb->querytimeout = 4;
+	if (cb->poll_remote <= cb->querytimeout) {
+		cb->querytimeout = 2;
+		if (cb->remote && cb->poll_remote <= cb->querytimeout) {
+			ast_log(LOG_WARNING, "Poll timeout %d is too short.\n", cb->poll_remote * 1000);
 		}
 	}
 
+	/* Check if it's available now. This is done without the list locked, since querying remote device state can take a while. */
+	if (!cb->remote && !local_endpoint_busy(cb->endpoints, cb->number)) {
+		ast_verb(3, "Destination %s is currently idle.\n", cb->number);
+		pbx_builtin_setvar_helper(chan, SET_STATUS, "IDLE");
+		/* The call can just complete directly now, no callback is necessary. */
+		ao2_ref(cb, -1);
+		return 0;
+	} else if (ast_get_extension_data(tmpbuf, sizeof(tmpbuf), chan, cb->remotedialcontext, cb->number, 1)) {
+		ast_verb(3, "Can't determine status of destination %s.\n", cb->number);
+		pbx_builtin_setvar_helper(chan, SET_STATUS, "UNSUPPORTED");
+		/* Not a local endpoint, and no route to the remote status. */
+		ao2_ref(cb, -1);
+		return 0;
+	} else if (cb->remote && !remote_endpoint_busy(cb->number, cb->remotedialcontext, cb->caller, 4)) {
+		ast_verb(3, "Destination %s is currently idle.\n", cb->number);
+		pbx_builtin_setvar_helper(chan, SET_STATUS, "IDLE");
+		/* The call can just complete directly now, no callback is necessary. */
+		ao2_ref(cb, -1);
+		return 0;
+	}
+
+	AST_RWLIST_WRLOCK(&callbacks);
+	/* Check again, in case an identical request came in while we weren't looking */
+	already_had = 0;
+	if (callback_exists(chan, caller, args.number, single, &already_had)) {
+		AST_RWLIST_UNLOCK(&callbacks);
+		ao2_ref(cb, -1);
+		return 0;
+	}
+	cb->expires = time(NULL) + (timeout_ms + 999) / 1000;
+	AST_RWLIST_INSERT_TAIL(&callbacks, cb, entry); /* The list owns our reference */
+	wheel_schedule(cb, time(NULL));
 	AST_RWLIST_UNLOCK(&callbacks);
 
+	ast_verb(3, "Callback activated for %s by %s for %d minutes\n", cb->number, cb->caller, timeout_ms / 60000);
+	sched_wake();
+	pbx_builtin_setvar_helper(chan, SET_STATUS, already_had ? "ANOTHER" : "QUEUED");
 	return 0;
 }
 
@@ -658,7 +918,7 @@ static char *handle_show_callbacks(struct ast_cli_entry *e, int cmd, struct ast_
 	AST_RWLIST_RDLOCK(&callbacks);
 	AST_RWLIST_TRAVERSE(&callbacks, cb, entry) {
 		int elapsed = (int) time(NULL) - cb->watch_start;
-		int remaining = cb->remaining / 1000;
+		int remaining = (int) (cb->expires - time(NULL));
 		ast_cli(a->fd, "%4d | %15s | %15s | %11d:%02d | %11d:%02d\n", ++i, cb->caller, cb->number, elapsed / 60, elapsed % 60, remaining / 60, remaining % 60);
 	}
 	AST_RWLIST_UNLOCK(&callbacks);
@@ -693,7 +953,8 @@ static char *handle_cancel(struct ast_cli_entry *e, int cmd, struct ast_cli_args
 		if (all || !strcmp(cb->caller, a->argv[2])) {
 			ast_cli(a->fd, "Cancelling callback from %s to %s\n", cb->caller, cb->number);
 			AST_RWLIST_REMOVE_CURRENT(entry);
-			cancel_thread(cb, 1);
+			callback_unschedule(cb);
+			ao2_ref(cb, -1);
 		}
 	}
 	AST_RWLIST_TRAVERSE_SAFE_END;
@@ -707,6 +968,30 @@ static struct ast_cli_entry callback_cli[] = {
 	AST_CLI_DEFINE(handle_cancel, "Cancel some or all active callbacks"),
 };
 
+static void stop_threads(void)
+{
+	int i;
+
+	ast_mutex_lock(&sched_lock);
+	ast_mutex_lock(&poll_lock);
+	unloading = 1;
+	ast_cond_signal(&sched_cond);
+	ast_cond_broadcast(&poll_cond);
+	ast_mutex_unlock(&poll_lock);
+	ast_mutex_unlock(&sched_lock);
+
+	if (sched_thread != AST_PTHREADT_NULL) {
+		pthread_join(sched_thread, NULL);
+		sched_thread = AST_PTHREADT_NULL;
+	}
+	for (i = 0; i < REMOTE_POLLERS; i++) {
+		if (poll_threads[i] != AST_PTHREADT_NULL) {
+			pthread_join(poll_threads[i], NULL); /* Waits for any query in progress */
+			poll_threads[i] = AST_PTHREADT_NULL;
+		}
+	}
+}
+
 static int unload_module(void)
 {
 	int res;
@@ -716,18 +1001,61 @@ static int unload_module(void)
 	res |= ast_unregister_application(app2);
 	ast_cli_unregister_multiple(callback_cli, ARRAY_LEN(callback_cli));
 
+	devstate_sub = stasis_unsubscribe_and_join(devstate_sub);
+	stop_threads();
+
 	AST_RWLIST_WRLOCK(&callbacks);
 	while ((cb = AST_RWLIST_REMOVE_HEAD(&callbacks, entry))) {
-		cancel_thread(cb, 0); /* Thread will free cb itself. */
+		callback_unschedule(cb);
+		ao2_ref(cb, -1);
 	}
 	AST_RWLIST_UNLOCK(&callbacks);
 
+	ast_mutex_destroy(&sched_lock);
+	ast_cond_destroy(&sched_cond);
+	ast_mutex_destroy(&poll_lock);
+	ast_cond_destroy(&poll_cond);
+
 	return res;
 }
 
 static int load_module(void)
 {
-	int res;
+	int i, res;
+
+	ast_mutex_init(&sched_lock);
+	ast_cond_init(&sched_cond, NULL);
+	ast_mutex_init(&poll_lock);
+	ast_cond_init(&poll_cond, NULL);
+	unloading = 0;
+	wheel_time = time(NULL);
+
+	for (i = 0; i < REMOTE_POLLERS; i++) {
+		poll_threads[i] = AST_PTHREADT_NULL;
+	}
+	if (ast_pthread_create(&sched_thread, NULL, callback_scheduler, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start callback scheduler\n");
+		sched_thread = AST_PTHREADT_NULL;
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	for (i = 0; i < REMOTE_POLLERS; i++) {
+		if (ast_pthread_create(&poll_threads[i], NULL, remote_poller, NULL)) {
+			ast_log(LOG_ERROR, "Unable to start remote poller\n");
+			poll_threads[i] = AST_PTHREADT_NULL;
+			unload_module();
+			return AST_MODULE_LOAD_DECLINE;
+		}
+	}
+
+	/* Local callbacks are checked as soon as the state of a device they're watching changes */
+	devstate_sub = stasis_subscribe(ast_device_state_topic_all(), devstate_cb, NULL);
+	if (!devstate_sub) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	stasis_subscription_accept_message_type(devstate_sub, ast_device_state_message_type());
+	stasis_subscription_set_filter(devstate_sub, STASIS_SUBSCRIPTION_FILTER_SELECTIVE);
 
 	ast_cli_register_multiple(callback_cli, ARRAY_LEN(callback_cli));
 
@@ -40,6 +40,9 @@
 #include "asterisk.h"
 
 #include "asterisk/lock.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/dlinkedlists.h"
+#include "asterisk/heap.h"
 #include "asterisk/file.h"
 #include "asterisk/channel.h"
 #include "asterisk/pbx.h"
@@ -528,8 +531,8 @@ static void reset_cdr_var_names(void)
 	CHRARRAY_ZERO(cdrvar_digits);
 }
 
+/*! \note Routes are updated in place on reload, so fields must only be accessed with the route locked */
 struct route {
-	ast_mutex_t lock;
 	char name[AST_MAX_CONTEXT];			/*!< Name */
 	char facility[AST_MAX_CONTEXT];		/*!< Facility Name */
 	enum facility_type factype;			/*!< Facility Type */
@@ -542,11 +545,22 @@ struct route {
 	unsigned int mer:1;					/*!< More Expensive Route? */
 	unsigned int busyiscongestion:1;	/*!< Whether facility should be considered "in use" if disposition is BUSY */
 	char time[PATH_MAX];				/*!< Simple time restrictions */
-	AST_LIST_ENTRY(route) entry;		/*!< Next route record */
+	struct ast_timing timing;			/*!< Time restrictions, compiled */
+	unsigned int has_timing:1;			/*!< Whether timing is valid */
 };
 
+/*! \brief Routes eligible for a call, in order, resolved ahead of time */
+struct route_plan {
+	const char *str;					/*!< Original pipe-separated list of routes */
+	int num;							/*!< Number of routes (including empty ones) */
+	struct route_plan_entry {
+		const char *name;				/*!< Route name (may be empty) */
+		struct route *route;			/*!< Route, NULL if it doesn't exist */
+	} routes[0];
+};
+
+/*! \note CCSAs are updated in place on reload, so fields must only be accessed with the CCSA locked */
 struct ccsa {
-	ast_mutex_t lock;
 	char name[AST_MAX_CONTEXT];			/*!< Name */
 	char routes[PATH_MAX];				/*!< List of routes */
 	unsigned int auth_code_len;			/*!< Auth code length */
@@ -562,15 +576,20 @@ struct ccsa {
 	/* CBQ Timers */
 	unsigned int queue_promo_timer;
 	unsigned int route_advance_timer;
-	/* CDR variables */
-	AST_LIST_ENTRY(ccsa) entry;			/*!< Next CCSA record */
+	struct route_plan *plan;			/*!< Compiled routes */
 };
 
+#define MAX_QUEUE_PRIORITY 3
+
+struct facility_queue;
+struct route_calls;
+
 struct ccsa_call {
 	char *channel;
 	char *ccsa;
 	char *route;
 	char *nextroute;
+	char *nextfacility;
 	char *facility;
 	char *caller;
 	char *called;
@@ -581,21 +600,62 @@ struct ccsa_call {
 	unsigned int cbq:1;		/* 1 if this is a CBQ call */
 	unsigned int aborted:1;	/* 1 if CBQ call aborted */
 	unsigned int preempted:1; /* If call was preempted */
-	pthread_t cbqthread;
-	int queue_alert_pipe[2];
+	unsigned int ready:1;	/* CBQ call's turn, waiting for the CBQ engine to call back */
+	unsigned int timed:1;	/* CBQ call is in the timer heap */
+	int queue_alert_pipe[2];	/* Off-Hook Queue calls only */
 	unsigned int effective_frl;
 	unsigned int queue_promo_timer;
 	unsigned int route_advance_timer;
+	struct timeval next_promo;		/* Next Queue Promotion, if any */
+	struct timeval next_advance;	/* Route Advance, if pending */
+	struct timeval next_timer;		/* Earliest of the above */
+	ssize_t __heap_index;
 	char *callback_caller_context;
 	char *callback_dest_context;
+	struct facility_queue *fq;	/* Facility the call is active or queued on, NULL if not (yet or anymore) */
+	struct route_calls *rc;		/* Calls on the call's route */
 	/* Not used internally, but stored for statistics */
 	int start;
-	AST_LIST_ENTRY(ccsa_call) entry;
+	AST_DLLIST_ENTRY(ccsa_call) entry;		/*!< All calls */
+	AST_DLLIST_ENTRY(ccsa_call) fentry;		/*!< Facility's active calls or queue */
+	AST_LIST_ENTRY(ccsa_call) rentry;		/*!< CBQ calls ready for callback */
 };
 
-static AST_RWLIST_HEAD_STATIC(routes, route); /* Routes are not inherently tied to a single CCSA (nor a single facility), but often will be */
-static AST_RWLIST_HEAD_STATIC(ccsas, ccsa);
-static AST_RWLIST_HEAD_STATIC(calls, ccsa_call);
+/*! \brief Active and queued calls on a facility */
+struct facility_queue {
+	int active;		/* Active calls */
+	int queued;		/* Queued calls */
+	AST_DLLIST_HEAD_NOLOCK(, ccsa_call) activecalls;
+	AST_DLLIST_HEAD_NOLOCK(, ccsa_call) queues[MAX_QUEUE_PRIORITY + 1];	/* Queued calls, by queue priority */
+	char name[0];
+};
+
+/*! \brief Calls on a route */
+struct route_calls {
+	int calls;		/* Active and queued calls */
+	int pri3;		/* Queued calls with priority 3 */
+	char name[0];
+};
+
+#define PROFILE_BUCKETS 37
+#define CALL_INDEX_BUCKETS 37
+
+static struct ao2_container *route_profiles; /* Routes are not inherently tied to a single CCSA (nor a single facility), but often will be */
+static struct ao2_container *ccsa_profiles;
+static AST_RWDLLIST_HEAD_STATIC(calls, ccsa_call);
+
+/* These are all protected by the calls lock */
+static struct ao2_container *facility_queues;							/* Only facilities that currently have calls, by name */
+static struct ao2_container *route_calls_index;							/* Only routes that currently have calls, by name */
+static struct ast_heap *cbq_timers;									/* CBQ calls, by next timer expiration */
+static AST_LIST_HEAD_NOLOCK_STATIC(cbq_ready, ccsa_call);				/* CBQ calls whose turn it is */
+
+/* CBQ engine */
+static ast_mutex_t engine_lock;
+static ast_cond_t engine_cond;
+static int engine_wakeup = 0;
+static int engine_unloading = 0;
+static pthread_t engine_thread = AST_PTHREADT_NULL;
 
 static enum facility_type facility_from_str(const char *str)
 {
@@ -624,124 +684,455 @@ static const char *facility_type_str(enum facility_type factype)
 	return "Unknown";
 }
 
+static void route_destructor(void *obj)
+{
+	struct route *f = obj;
+
+	if (f->devstate) {
+		ast_free(f->devstate);
+	}
+	if (f->has_timing) {
+		ast_destroy_timing(&f->timing);
+	}
+}
+
 static struct route *alloc_route(const char *name)
 {
 	struct route *f;
 
-	if (!(f = ast_calloc(1, sizeof(*f)))) {
+	if (!(f = ao2_alloc(sizeof(*f), route_destructor))) {
 		return NULL;
 	}
 
-	ast_mutex_init(&f->lock);
 	ast_copy_string(f->name, name, sizeof(f->name));
 	ast_copy_string(f->facility, name, sizeof(f->facility));
 
 	return f;
 }
 
+static void ccsa_destructor(void *obj)
+{
+	struct ccsa *c = obj;
+
+	ao2_cleanup(c->plan);
+}
+
 static struct ccsa *alloc_ccsa(const char *name)
 {
 	struct ccsa *c;
 
-	if (!(c = ast_calloc(1, sizeof(*c)))) {
+	if (!(c = ao2_alloc(sizeof(*c), ccsa_destructor))) {
 		return NULL;
 	}
 
-	ast_mutex_init(&c->lock);
 	ast_copy_string(c->name, name, sizeof(c->name));
 
 	return c;
 }
 
-static struct route *find_route(const char *name, int lock)
+/* Names are case-insensitive */
+static int route_hash_fn(const void *obj, const int flags)
 {
-	struct route *f = NULL;
-	if (lock) {
-		AST_RWLIST_RDLOCK(&routes);
+	const struct route *r;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		r = obj;
+		key = r->name;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
 	}
-	AST_LIST_TRAVERSE(&routes, f, entry) {
-		if (!strcasecmp(f->name, name)) {
-			break;
-		}
+	return ast_str_case_hash(key);
+}
+
+static int route_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct route *r = obj, *right = arg;
+	const char *key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = right->name;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcasecmp(r->name, key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
 	}
-	if (lock) {
-		AST_RWLIST_UNLOCK(&routes);
+}
+
+static int ccsa_hash_fn(const void *obj, const int flags)
+{
+	const struct ccsa *c;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		c = obj;
+		key = c->name;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
 	}
-	return f;
+	return ast_str_case_hash(key);
 }
 
-/*! \brief Retrieve the facility used by a route */
-static int get_route_facility(const char *routename, char *buf, size_t len)
+static int ccsa_cmp_fn(void *obj, void *arg, int flags)
 {
-	int res = -1;
-	struct route *f = NULL;
-	AST_RWLIST_RDLOCK(&routes);
-	AST_LIST_TRAVERSE(&routes, f, entry) {
-		if (!strcasecmp(f->name, routename)) {
-			res = 0;
-			ast_copy_string(buf, f->facility, len);
-			break;
-		}
+	const struct ccsa *c = obj, *right = arg;
+	const char *key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = right->name;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcasecmp(c->name, key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
 	}
-	AST_RWLIST_UNLOCK(&routes);
-	return res;
 }
 
-static struct ccsa *find_ccsa(const char *name, int lock)
+/*! \note Returns a reference */
+static struct route *find_route(const char *name)
+{
+	return ao2_find(route_profiles, name, OBJ_SEARCH_KEY);
+}
+
+/*! \note Returns a reference */
+static struct ccsa *find_ccsa(const char *name)
 {
-	struct ccsa *c = NULL;
-	if (lock) {
-		AST_RWLIST_RDLOCK(&ccsas);
+	return ao2_find(ccsa_profiles, name, OBJ_SEARCH_KEY);
+}
+
+static void route_plan_destructor(void *obj)
+{
+	struct route_plan *plan = obj;
+	int i;
+
+	for (i = 0; i < plan->num; i++) {
+		ao2_cleanup(plan->routes[i].route);
 	}
-	AST_LIST_TRAVERSE(&ccsas, c, entry) {
-		if (!strcasecmp(c->name, name)) {
-			break;
+}
+
+/*!
+ * \brief Resolve a pipe-separated list of routes
+ * \note Routes that don't exist (yet) are kept, so that attempting them fails the same way at runtime
+ * \return Plan (a reference), or NULL on failure
+ */
+static struct route_plan *route_plan_build(const char *routes)
+{
+	struct route_plan *plan;
+	char *buf, *names, *route;
+	size_t len = strlen(routes) + 1;
+	int num = 1;
+	const char *tmp;
+
+	for (tmp = routes; *tmp; tmp++) {
+		if (*tmp == '|') {
+			num++;
 		}
 	}
-	if (lock) {
-		AST_RWLIST_UNLOCK(&ccsas);
+
+	plan = ao2_alloc_options(sizeof(*plan) + num * sizeof(plan->routes[0]) + 2 * len, route_plan_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!plan) {
+		return NULL;
 	}
-	return c;
+
+	buf = (char *) &plan->routes[num];
+	strcpy(buf, routes); /* Safe */
+	plan->str = buf;
+	names = buf + len;
+	strcpy(names, routes); /* Safe */
+
+	while ((route = strsep(&names, "|"))) {
+		struct route_plan_entry *rpe = &plan->routes[plan->num++];
+		rpe->name = route;
+		if (!ast_strlen_zero(route)) {
+			rpe->route = find_route(route);
+		}
+	}
+
+	return plan;
 }
 
-/*! \note Must be called with list write locked */
-static int call_queue_remove(struct ccsa_call *call)
+static int facility_queue_hash_fn(const void *obj, const int flags)
 {
-	struct ccsa_call *call2;
+	const struct facility_queue *fq;
+	const char *key;
 
-	AST_LIST_TRAVERSE_SAFE_BEGIN(&calls, call2, entry) {
-		if (call2 == call) {
-			AST_LIST_REMOVE_CURRENT(entry);
-			break;
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		fq = obj;
+		key = fq->name;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int facility_queue_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct facility_queue *fq = obj, *right = arg;
+	const char *key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = right->name;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(fq->name, key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+static int route_calls_hash_fn(const void *obj, const int flags)
+{
+	const struct route_calls *rc;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		rc = obj;
+		key = rc->name;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int route_calls_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct route_calls *rc = obj, *right = arg;
+	const char *key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = right->name;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(rc->name, key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+/*!
+ * \note Must be called with calls locked
+ * \note Does not return a reference. The index's reference keeps it around until it's unlinked.
+ */
+static struct facility_queue *find_facility_queue(const char *facility, int create)
+{
+	struct facility_queue *fq;
+
+	fq = ao2_find(facility_queues, facility, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+	if (fq) {
+		ao2_ref(fq, -1);
+		return fq;
+	}
+	if (create && (fq = ao2_alloc_options(sizeof(*fq) + strlen(facility) + 1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+		strcpy(fq->name, facility); /* Safe */
+		if (!ao2_link_flags(facility_queues, fq, OBJ_NOLOCK)) {
+			ao2_ref(fq, -1);
+			return NULL;
 		}
+		ao2_ref(fq, -1);
 	}
-	AST_LIST_TRAVERSE_SAFE_END;
+	return fq;
+}
 
-	return call2 ? 0 : -1;
+/*!
+ * \note Must be called with calls locked
+ * \note Does not return a reference. The index's reference keeps it around until it's unlinked.
+ */
+static struct route_calls *find_route_calls(const char *route, int create)
+{
+	struct route_calls *rc;
+
+	rc = ao2_find(route_calls_index, route, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+	if (rc) {
+		ao2_ref(rc, -1);
+		return rc;
+	}
+	if (create && (rc = ao2_alloc_options(sizeof(*rc) + strlen(route) + 1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+		strcpy(rc->name, route); /* Safe */
+		if (!ao2_link_flags(route_calls_index, rc, OBJ_NOLOCK)) {
+			ao2_ref(rc, -1);
+			return NULL;
+		}
+		ao2_ref(rc, -1);
+	}
+	return rc;
 }
 
+/*! \brief Add a call to its facility's active calls or queue, and its route's counts */
 /*! \note Must be called with list write locked */
-static int call_queue_insert(struct ccsa_call *call, const char *route)
+static int call_attach(struct ccsa_call *call)
 {
+	call->fq = find_facility_queue(call->facility, 1);
+	if (!call->fq) {
+		return -1;
+	}
+	call->rc = find_route_calls(call->route, 1);
+	if (!call->rc) {
+		if (!call->fq->active && !call->fq->queued) {
+			ao2_unlink_flags(facility_queues, call->fq, OBJ_NOLOCK);
+		}
+		call->fq = NULL;
+		return -1;
+	}
+
+	call->rc->calls++;
 	if (call->active) { /* Don't really care about actual queue position */
-		AST_RWLIST_INSERT_TAIL(&calls, call, entry);
+		call->fq->active++;
+		AST_DLLIST_INSERT_TAIL(&call->fq->activecalls, call, fentry);
 	} else {
-		int inserted = 0;
-		/* Maintain ordering for any queued calls. We insert at the end, but of each priority, so higher priorities are always before lower ones.
-		 * Newer entries should be at the beginning of the list naturally, since we tail insert, so no need to compare timestamps, really. */
-		struct ccsa_call *ecall;
-		AST_RWLIST_TRAVERSE_SAFE_BEGIN(&calls, ecall, entry) {
-			if (!strcmp(route, ecall->route) && !ecall->active && call->queue_priority > ecall->queue_priority) { /* Same route, and lower priority? */
-				AST_RWLIST_INSERT_BEFORE_CURRENT(call, entry);
-				inserted = 1;
-				break;
-			}
+		/* Calls are served in order of priority, and in order of arrival within each priority. */
+		call->fq->queued++;
+		AST_DLLIST_INSERT_TAIL(&call->fq->queues[call->queue_priority], call, fentry);
+		if (call->queue_priority == 3) {
+			call->rc->pri3++;
+		}
+		ast_debug(2, "Joined queue for %s at priority %d (%d call%s queued)\n", call->facility, call->queue_priority, call->fq->queued, ESS(call->fq->queued));
+	}
+	return 0;
+}
+
+/*! \brief Remove a call from its facility and route, if it's still attached to them */
+/*! \note Must be called with list write locked */
+static void call_detach(struct ccsa_call *call)
+{
+	if (!call->fq) {
+		return;
+	}
+
+	call->rc->calls--;
+	if (call->active) {
+		call->fq->active--;
+		AST_DLLIST_REMOVE(&call->fq->activecalls, call, fentry);
+	} else {
+		call->fq->queued--;
+		AST_DLLIST_REMOVE(&call->fq->queues[call->queue_priority], call, fentry);
+		if (call->queue_priority == 3) {
+			call->rc->pri3--;
 		}
-		AST_RWLIST_TRAVERSE_SAFE_END;
-		if (!inserted) {
-			AST_RWLIST_INSERT_TAIL(&calls, call, entry);
+	}
+
+	/* Only keep track of facilities and routes that have calls */
+	if (!call->fq->active && !call->fq->queued) {
+		ao2_unlink_flags(facility_queues, call->fq, OBJ_NOLOCK);
+	}
+	if (!call->rc->calls) {
+		ao2_unlink_flags(route_calls_index, call->rc, OBJ_NOLOCK);
+	}
+	call->fq = NULL;
+	call->rc = NULL;
+}
+
+/*! \brief Next call in line on a facility */
+/*! \note Must be called with list locked */
+static struct ccsa_call *facility_queue_head(struct facility_queue *fq)
+{
+	int i;
+
+	for (i = MAX_QUEUE_PRIORITY; i >= 0; i--) {
+		if (!AST_DLLIST_EMPTY(&fq->queues[i])) {
+			return AST_DLLIST_FIRST(&fq->queues[i]);
 		}
-		ast_debug(2, "Joined queue %s\n", inserted ? "ahead of another call" : "at the very end");
+	}
+	return NULL;
+}
+
+/*! \brief Order CBQ calls so that the one with the earliest timer is at the top of the heap */
+static int cbq_timer_cmp(void *a, void *b)
+{
+	struct ccsa_call *call_a = a, *call_b = b;
+	return ast_tvcmp(call_b->next_timer, call_a->next_timer);
+}
+
+/*! \brief Wake up the CBQ engine, to process calls whose turn it is or a new timer */
+static void engine_wake(void)
+{
+	ast_mutex_lock(&engine_lock);
+	engine_wakeup = 1;
+	ast_cond_signal(&engine_cond);
+	ast_mutex_unlock(&engine_lock);
+}
+
+/*! \brief Add or re-add a CBQ call to the timer heap, if it has any timers pending */
+/*! \note Must be called with list write locked */
+static void cbq_schedule(struct ccsa_call *call)
+{
+	if (call->timed) {
+		ast_heap_remove(cbq_timers, call);
+		call->timed = 0;
+	}
+	if (ast_tvzero(call->next_promo)) {
+		call->next_timer = call->next_advance;
+	} else if (ast_tvzero(call->next_advance)) {
+		call->next_timer = call->next_promo;
+	} else {
+		call->next_timer = ast_tvcmp(call->next_promo, call->next_advance) < 0 ? call->next_promo : call->next_advance;
+	}
+	if (!ast_tvzero(call->next_timer)) {
+		ast_heap_push(cbq_timers, call);
+		call->timed = 1;
+	}
+}
+
+/*! \brief Remove a call from its facility and route, and from the CBQ engine */
+/*! \note Must be called with list write locked */
+static void call_unschedule(struct ccsa_call *call)
+{
+	call_detach(call);
+	if (call->timed) {
+		ast_heap_remove(cbq_timers, call);
+		call->timed = 0;
+	}
+	if (call->ready) {
+		AST_LIST_REMOVE(&cbq_ready, call, rentry);
+		call->ready = 0;
+	}
+}
+
+/*! \note Must be called with list write locked */
+static int call_queue_remove(struct ccsa_call *call)
+{
+	AST_DLLIST_REMOVE(&calls, call, entry);
+	call_unschedule(call);
+	return 0;
+}
+
+/*! \note Must be called with list write locked */
+static int call_queue_insert(struct ccsa_call *call)
+{
+	if (call_attach(call)) {
+		return -1;
+	}
+	AST_DLLIST_INSERT_TAIL(&calls, call, entry);
+	if (call->cbq) {
+		cbq_schedule(call);
 	}
 	return 0;
 }
@@ -751,11 +1142,11 @@ static int call_queue_insert(struct ccsa_call *call, const char *route)
 static void __call_free(struct ccsa_call *call, int remove, const char *function, int lineno)
 {
 	if (remove) {
-		AST_RWLIST_WRLOCK(&calls);
+		AST_RWDLLIST_WRLOCK(&calls);
 		if (call_queue_remove(call)) {
 			ast_log(LOG_WARNING, "%s:%d: Unable to find call %p in call list\n", function, lineno, call);
 		}
-		AST_RWLIST_UNLOCK(&calls);
+		AST_RWDLLIST_UNLOCK(&calls);
 	}
 	ast_alertpipe_close(call->queue_alert_pipe);
 	ast_free(call->channel);
@@ -769,6 +1160,9 @@ static void __call_free(struct ccsa_call *call, int remove, const char *function
 	if (call->nextroute) {
 		ast_free(call->nextroute);
 	}
+	if (call->nextfacility) {
+		ast_free(call->nextfacility);
+	}
 	if (call->callback_caller_context) {
 		ast_free(call->callback_caller_context);
 	}
@@ -781,7 +1175,8 @@ static void __call_free(struct ccsa_call *call, int remove, const char *function
 	ast_free(call);
 }
 
-static struct ccsa_call *call_add(const char *channel, const char *facility, const char *route, const char *caller, const char *called, int active, int call_priority, int queue_priority)
+/*! \brief Allocate a call, without adding it to the call list */
+static struct ccsa_call *call_alloc(const char *channel, const char *facility, const char *route, const char *caller, const char *called, int active, int cbq, int call_priority, int queue_priority)
 {
 	struct ccsa_call *call;
 	char *chandup, *facdup, *routedup, *callerdup, *calleddup;
@@ -791,7 +1186,7 @@ static struct ccsa_call *call_add(const char *channel, const char *facility, con
 	if (!chandup) {
 		return NULL;
 	}
-	facdup = ast_strdup(route);
+	facdup = ast_strdup(facility);
 	if (!facdup) {
 		ast_free(chandup);
 		return NULL;
@@ -834,19 +1229,45 @@ static struct ccsa_call *call_add(const char *channel, const char *facility, con
 	call->called = calleddup;
 	call->call_priority = call_priority; /* Needed for both actual and queued calls */
 	call->active = active;
+	call->cbq = cbq;
 	call->start = (int) time(NULL);
 
 	if (!active) {
-		call->queue_priority = queue_priority;
+		call->queue_priority = MAX(0, MIN(queue_priority, MAX_QUEUE_PRIORITY));
 	}
 
 	call->queue_alert_pipe[0] = call->queue_alert_pipe[1] = -1;
-	ast_alertpipe_init(call->queue_alert_pipe);
+	if (!active && !cbq) {
+		/* Off-Hook Queue calls wait on the channel and this pipe at the same time. CBQ calls are handled by the CBQ engine. */
+		ast_alertpipe_init(call->queue_alert_pipe);
+	}
+
+	return call;
+}
+
+/*! \brief Add an allocated call to the call list */
+static int call_link(struct ccsa_call *call)
+{
+	int res;
 
-	AST_RWLIST_WRLOCK(&calls);
-	call_queue_insert(call, call->route);
-	AST_RWLIST_UNLOCK(&calls);
+	AST_RWDLLIST_WRLOCK(&calls);
+	res = call_queue_insert(call);
+	AST_RWDLLIST_UNLOCK(&calls);
 
+	if (!res && call->cbq) {
+		engine_wake(); /* Its timers may be due before anything else's */
+	}
+	return res;
+}
+
+static struct ccsa_call *call_add(const char *channel, const char *facility, const char *route, const char *caller, const char *called, int active, int call_priority, int queue_priority)
+{
+	struct ccsa_call *call = call_alloc(channel, facility, route, caller, called, active, 0, call_priority, queue_priority);
+
+	if (call && call_link(call)) {
+		call_free(call, 0);
+		return NULL;
+	}
 	return call;
 }
 
@@ -855,12 +1276,14 @@ static int try_facility_preempt(const char *facility, char preempt_priority)
 {
 	/* Look for an active call on same facility (even if a different route) with lower priority than us. */
 	int preempted = -1;
+	struct facility_queue *fq;
 	struct ccsa_call *call;
 	char *target = NULL;
 
-	AST_RWLIST_WRLOCK(&calls);
-	AST_LIST_TRAVERSE(&calls, call, entry) {
-		if (call->active && !strcmp(facility, call->facility)) {
+	AST_RWDLLIST_WRLOCK(&calls);
+	fq = find_facility_queue(facility, 0);
+	if (fq) {
+		AST_DLLIST_TRAVERSE(&fq->activecalls, call, fentry) {
 			preempted = 0;
 			if (call->call_priority > preempt_priority) {
 				/* If they have a strictly higher priority than us, it must be an actual priority, so no need to isprint guard their priority. */
@@ -874,9 +1297,9 @@ static int try_facility_preempt(const char *facility, char preempt_priority)
 			break;
 		}
 	}
-	AST_RWLIST_UNLOCK(&calls);
+	AST_RWDLLIST_UNLOCK(&calls);
 
-	if (preempted) { /* Actually do the preempt */
+	if (preempted > 0) { /* Actually do the preempt */
 		struct ast_channel *ochan = ast_channel_get_by_name(target);
 		if (!ochan) {
 			ast_log(LOG_WARNING, "Channel to prempt (%s) doesn't exist?\n", target);
@@ -923,39 +1346,30 @@ static int queue_cancel_cbq(int fd, const char *caller)
 {
 	struct ccsa_call *call;
 	int total = 0;
-	pthread_t cbq_thread;
 
-	AST_RWLIST_WRLOCK(&calls); /* call_queue_remove does modify the list itself. */
-	AST_LIST_TRAVERSE(&calls, call, entry) {
+	AST_RWDLLIST_WRLOCK(&calls);
+	AST_DLLIST_TRAVERSE_SAFE_BEGIN(&calls, call, entry) {
 		if (!call->active && call->cbq && !call->aborted) {
 			if (!ast_strlen_zero(caller) && strcmp(call->caller, caller)) {
 				continue; /* Doesn't match filter */
 			}
-			cbq_thread = call->cbqthread;
 			call->aborted = 1;
-			if (ast_alertpipe_write(call->queue_alert_pipe)) {
-				ast_log(LOG_WARNING, "%s: write() failed: %s\n", __FUNCTION__, strerror(errno));
+			total++;
+			if (fd >= 0) {
+				ast_cli(fd, "Cancelled CBQ for %s\n", call->caller);
 			} else {
-				total++;
-				if (fd >= 0) {
-					ast_cli(fd, "Requested cancellation of CBQ for %s\n", call->caller);
-				} else {
-					ast_debug(2, "Requested cancellation of CBQ for %s\n", call->caller);
-				}
-				/* Wait for the CBQ to cancel and kill itself. */
-				if (pthread_join(cbq_thread, NULL)) {
-					ast_log(LOG_WARNING, "Failed to wait for CBQ to terminate: %s\n", strerror(errno));
-				}
-				/* Since we already have a list lock, aborted calls cannot free themselves / remove themselves from the list. */
-				call_queue_remove(call);
-				call_free(call, 0); /* Already been removed from the list, don't try to remove it again (that would try to grab another WRLOCK too) */
+				ast_debug(2, "Cancelled CBQ for %s\n", call->caller);
 			}
-			break;
+			/* CBQ calls don't have a thread of their own, and the engine only uses calls that are still in the list, so we can free it now. */
+			AST_DLLIST_REMOVE_CURRENT(entry);
+			call_unschedule(call);
+			call_free(call, 0); /* Already been removed from the list, don't try to remove it again (that would try to grab another WRLOCK too) */
 		}
 	}
-	AST_RWLIST_UNLOCK(&calls);
+	AST_DLLIST_TRAVERSE_SAFE_END;
+	AST_RWDLLIST_UNLOCK(&calls);
 
-	ast_debug(2, "Notified %d CBQ call%s in queue about shutdown\n", total, ESS(total));
+	ast_debug(2, "Cancelled %d CBQ call%s in queue\n", total, ESS(total));
 
 	return total;
 }
@@ -963,21 +1377,35 @@ static int queue_cancel_cbq(int fd, const char *caller)
 /*! \brief Notify the call at the head of the line for this facility that it's its turn */
 static int queue_notify_facility_head(const char *facility)
 {
-	struct ccsa_call *call;
-	int total = 0;
-
-	AST_RWLIST_RDLOCK(&calls);
-	AST_LIST_TRAVERSE(&calls, call, entry) {
-		if (!call->active && !strcmp(facility, call->facility)) {
-			if (ast_alertpipe_write(call->queue_alert_pipe)) {
-				ast_log(LOG_WARNING, "%s: write() failed: %s\n", __FUNCTION__, strerror(errno));
-			} else {
-				total++;
-			}
-			break;
+	struct facility_queue *fq;
+	struct ccsa_call *call = NULL;
+	int total = 0, cbq = 0;
+
+	AST_RWDLLIST_WRLOCK(&calls);
+	fq = find_facility_queue(facility, 0);
+	if (fq) {
+		call = facility_queue_head(fq);
+	}
+	if (call) {
+		/* Take it out of the queue now, so the next notification goes to the next call in line. */
+		call_detach(call);
+		if (call->cbq) {
+			/* The CBQ engine will call back the caller. */
+			call->ready = 1;
+			AST_LIST_INSERT_TAIL(&cbq_ready, call, rentry);
+			cbq = 1;
+			total++;
+		} else if (ast_alertpipe_write(call->queue_alert_pipe)) {
+			ast_log(LOG_WARNING, "%s: write() failed: %s\n", __FUNCTION__, strerror(errno));
+		} else {
+			total++;
 		}
 	}
-	AST_RWLIST_UNLOCK(&calls);
+	AST_RWDLLIST_UNLOCK(&calls);
+
+	if (cbq) {
+		engine_wake();
+	}
 
 	ast_debug(2, "Notified %d call%s in queue about availability of facility %s\n", total, ESS(total), facility);
 
@@ -986,18 +1414,15 @@ static int queue_notify_facility_head(const char *facility)
 
 static int facility_num_calls(const char *facility)
 {
-	struct ccsa_call *call;
+	struct facility_queue *fq;
 	int total = 0;
 
-	AST_RWLIST_RDLOCK(&calls);
-	AST_LIST_TRAVERSE(&calls, call, entry) {
-		if (!strcmp(facility, call->facility)) {
-			if (call->active) {
-				total++;
-			}
-		}
+	AST_RWDLLIST_RDLOCK(&calls);
+	fq = find_facility_queue(facility, 0);
+	if (fq) {
+		total = fq->active;
 	}
-	AST_RWLIST_UNLOCK(&calls);
+	AST_RWDLLIST_UNLOCK(&calls);
 
 	ast_debug(2, "Facility %s currently has %d active calls\n", facility, total);
 
@@ -1006,18 +1431,15 @@ static int facility_num_calls(const char *facility)
 
 static int route_num_priority3_calls(const char *route)
 {
-	struct ccsa_call *call;
+	struct route_calls *rc;
 	int pri3calls = 0;
 
-	AST_RWLIST_RDLOCK(&calls);
-	AST_LIST_TRAVERSE(&calls, call, entry) {
-		if (!strcmp(route, call->route)) {
-			if (call->queue_priority == 3) {
-				pri3calls++;
-			}
-		}
+	AST_RWDLLIST_RDLOCK(&calls);
+	rc = find_route_calls(route, 0);
+	if (rc) {
+		pri3calls = rc->pri3;
 	}
-	AST_RWLIST_UNLOCK(&calls);
+	AST_RWDLLIST_UNLOCK(&calls);
 
 	ast_debug(2, "Route %s currently has %d priority 3 calls\n", route, pri3calls);
 
@@ -1026,18 +1448,13 @@ static int route_num_priority3_calls(const char *route)
 
 static int route_has_any_calls(const char *route)
 {
-	struct ccsa_call *call;
+	int res;
 
-	AST_RWLIST_RDLOCK(&calls);
-	AST_LIST_TRAVERSE(&calls, call, entry) {
-		if (!strcmp(route, call->route)) {
-			AST_RWLIST_UNLOCK(&calls);
-			return 1;
-		}
-	}
-	AST_RWLIST_UNLOCK(&calls);
+	AST_RWDLLIST_RDLOCK(&calls);
+	res = find_route_calls(route, 0) ? 1 : 0;
+	AST_RWDLLIST_UNLOCK(&calls);
 
-	return 0;
+	return res;
 }
 
 static int cbq_calls_pending(const char *caller)
@@ -1045,35 +1462,30 @@ static int cbq_calls_pending(const char *caller)
 	struct ccsa_call *call;
 	int already = 0;
 
-	AST_RWLIST_RDLOCK(&calls);
-	AST_LIST_TRAVERSE(&calls, call, entry) {
+	AST_RWDLLIST_RDLOCK(&calls);
+	AST_DLLIST_TRAVERSE(&calls, call, entry) {
 		if (!call->active && !strcmp(call->caller, caller)) { /* Check ALL routes */
 			already++;
 		}
 	}
-	AST_RWLIST_UNLOCK(&calls);
+	AST_RWDLLIST_UNLOCK(&calls);
 
 	ast_debug(2, "Currently %d calls queued for %s\n", already, caller);
 
 	return already;
 }
 
-/*! \brief 0 if time matches condition, -1 if failure, -1 if doesn't match */
-static int time_matches(const char *expr)
+/*! \brief 0 if route's time condition is satisfied (or it has none), 1 if not (or the condition is invalid) */
+/*! \note Must be called with route locked */
+static int route_time_restricted(struct route *f)
 {
-	struct ast_timing timing;
-	int res;
-
-	if (!ast_build_timing(&timing, expr)) {
-		ast_log(LOG_WARNING, "Invalid Time Spec: %s\n", expr);
-		res = -1;
-	} else {
-		res = ast_check_timing(&timing) ? 0 : 1;
+	if (ast_strlen_zero(f->time)) {
+		return 0;
 	}
-
-	ast_destroy_timing(&timing);
-
-	return res;
+	if (!f->has_timing) {
+		return 1; /* Invalid Time Spec, already warned about on load */
+	}
+	return ast_check_timing(&f->timing) ? 0 : 1;
 }
 
 static int cdr_write(struct ast_channel *chan, const char *name, const char *val)
@@ -1196,7 +1608,7 @@ static int route_permits_ohq_locked(struct route *f, time_t elapsed, int is_simu
 		return 0;
 	}
 
-	if (!ast_strlen_zero(f->time) && time_matches(f->time)) {
+	if (route_time_restricted(f)) {
 		ast_debug(6, "Facility %s skipped due to time restrictions\n", f->name);
 		return 0; /* Route time restrictions not satisfied, so OHQ not permitted either */
 	}
@@ -1268,31 +1680,25 @@ static int route_permits_ohq_locked(struct route *f, time_t elapsed, int is_simu
 	return 1;
 }
 
-static int route_permits_ohq(const char *route, time_t elapsed, int is_simulation)
+static int route_permits_ohq(struct route *f, time_t elapsed, int is_simulation)
 {
-	struct route *f;
 	int can_queue;
 
-	AST_RWLIST_RDLOCK(&routes);
-	f = find_route(route, 0);
 	if (!f) {
 		/* Would've already thrown a warning about this route not existing if it didn't, so don't do it again. */
-		can_queue = 0;
-	} else {
-		can_queue = route_permits_ohq_locked(f, elapsed, is_simulation);
+		return 0;
 	}
-	AST_RWLIST_UNLOCK(&routes);
+
+	ao2_lock(f);
+	can_queue = route_permits_ohq_locked(f, elapsed, is_simulation);
+	ao2_unlock(f);
 
 	return can_queue;
 }
 
 static int route_permits_cbq(const char *route)
 {
-	int permitted;
-	AST_RWLIST_RDLOCK(&routes);
-	permitted = route_has_any_calls(route);
-	AST_RWLIST_UNLOCK(&routes);
-	return permitted;
+	return route_has_any_calls(route);
 }
 
 static int off_hook_queue(struct ast_channel *chan, struct ccsa_call *call, int ohq)
@@ -1357,188 +1763,176 @@ enum facility_disp {
 	FACILITY_DISP_PREEMPTED = 6, /* Call was preempted */
 };
 
-/*! \brief CBQ monitor thread (per CBQ call) */
-static void *call_back_queue(void *data)
+/*! \brief Call back a CBQ caller, now that it's its turn for the facility */
+static void cbq_callback(struct ccsa_call *call)
 {
-	struct ccsa_call *call = data;
-	struct timeval queue_promo_start, route_advance_start;
-	int use_queue_promo_timer = 1, use_route_advance_timer = 1;
-	int res;
-
-	ast_debug(1, "Queue Promotion Timer: %u, Route Advance Timer: %u\n", call->queue_promo_timer, call->route_advance_timer);
-	/* Convert from s to ms */
-	if (call->queue_promo_timer) {
-		call->queue_promo_timer *= 1000;
-	} else {
-		use_queue_promo_timer = 0;
-	}
-	if (call->route_advance_timer) {
-		call->route_advance_timer *= 1000;
+	char cbq_dest[AST_MAX_CONTEXT]; /* Technically not enough for exten@context, but in practice, should be... */
+	struct ast_format_cap *capabilities;
+	char *caller_context, *dest_context;
+	int outgoing_status;
+	int total_queue_time;
+	int timeout = 0; /* Timeout in seconds */
+
+	dest_context = call->callback_dest_context;
+	caller_context = call->callback_caller_context;
+	ast_assert(!ast_strlen_zero(caller_context));
+	timeout = (int) (2.56 * strlen(call->called) + 10.00); /* This is the math that Nortel Meridians do, so why not? */
+
+	snprintf(cbq_dest, sizeof(cbq_dest), "%s@%s", call->cbqexten, caller_context);
+	capabilities = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT);
+	if (!capabilities) {
+		ast_log(LOG_WARNING, "Failed to allocate capabilities\n");
+		return;
+	}
+	ast_format_cap_append(capabilities, ast_format_slin, 0);
+	total_queue_time = (int) time(NULL) - call->start;
+
+	/* Spawn the callback. */
+	ast_verb(3, "Call Back Queue callback for %s -> %s (%ds elapsed, %ds timeout)\n", call->cbqexten, call->called, total_queue_time, timeout);
+	if (!ast_strlen_zero(dest_context)) {
+		/* Connect to a user-provided destination context. */
+		ast_pbx_outgoing_exten_predial("Local", capabilities, cbq_dest,
+			timeout * 1000, dest_context, call->called, 1, &outgoing_status,
+			AST_OUTGOING_NO_WAIT, call->called, "CALLBACK", NULL, NULL, NULL, 0, NULL, NULL);
 	} else {
-		use_route_advance_timer = 0;
-	}
-
-	/*
-	 * Nortel Meridian documentation has a Queue Promotion Timer and Route Advance Timer.
-	 * At QPT intervals, priority is incremented until it reaches the maximum (thus advancing within the queue)
-	 * When RAT is reached, extended routes are added to the routes against which the call was initially queued.
-	 * No limit on how long calls may stay in CBQ (if not cancelled using Ring-Again functionality).
-	 * BSPs do not mention limits on CBQ duration or whether they can be cancelled at all.
-	 * Outpulsing of Meridian on success is wait 10 seconds and then 2.56 seconds per digit, to allow for
-	 * answer within 10-30 seconds (and just 6 seconds for analog phones, for some reason).
-	 *
-	 * The implementation is similar to this, mainly differing in that this module is only set up
-	 * to allow queuing on one facility at a time, so route advance merely advances to the next route,
-	 * rather than adding the next route.
-	 */
-
-	queue_promo_start = ast_tvnow();
-	route_advance_start = ast_tvnow();
+		char app_args[256];
+		/* Connect the called back caller back to this module, with same exten,ccsa,route, with priority 3, just in case we miss it. Also add with the same FRL we had just now, so we don't have to enter an auth code to access this facility again. */
+		snprintf(app_args, sizeof(app_args), "%s,%s,%s,cp(3)f(%d)", call->called, call->ccsa, call->route, call->effective_frl);
+		/* Reconnect to the CCSA module using the same settings that we have now. */
+		ast_pbx_outgoing_app_predial("Local", capabilities, cbq_dest,
+			timeout * 1000, app, app_args, &outgoing_status,
+			AST_OUTGOING_NO_WAIT, call->called, "CALLBACK", NULL, NULL, NULL, NULL, NULL);
+	}
+	/* Async, because the callback needs to be able to seize the facility once we're gone.
+	 * By the time the called back caller answers, this call will long since have been freed. */
+
+	ao2_cleanup(capabilities);
+}
 
-	for (;;) {
-		struct pollfd fds = { call->queue_alert_pipe[0], POLLIN, 0 };
-		/* Sleep for (up to) 10 seconds.
-		 * If alertpipe is written to, we'll exit the poll immediately.
-		 * This means we don't need a tighter loop per se for module hold,
-		 * because at that point we could write to the pipe if we wanted
-		 * (ordinarily, we can't write to the alertpipe whenever because
-		 * it generally means the head queued call is free to proceed),
-		 * and a CLI hangup will *eventually* hang this up. */
-		res = ast_poll(&fds, 1, 10000);
-		if (res < 0) {
-			ast_log(LOG_WARNING, "Polling error: %s\n", strerror(errno));
-			break;
-		} else if (res) {
-			ast_alertpipe_read(call->queue_alert_pipe);
-			/* Something happened: perhaps it's our turn to do a callback? Or maybe we were aborted. */
-		}
-		if (call->aborted) { /* CBQ was cancelled. */
-			ast_debug(1, "CBQ thread %ld is ending early\n", (long) call->cbqthread);
-			break;
-		} else if (res) {
-			char cbq_dest[AST_MAX_CONTEXT]; /* Technically not enough for exten@context, but in practice, should be... */
-			struct ast_format_cap *capabilities;
-			char *caller_context, *dest_context;
-			int outgoing_status;
-			int total_queue_time;
-			int timeout = 0; /* Timeout in seconds */
-			/* It's our turn now for the facility, yay! */
-			/* This is kind of the whole reason that we have an alertpipe per individual call,
-			 * as opposed to a global once that everyone checks. That way we notify just specifically
-			 * the call whose turn it actually is, which means we can be sure it's our turn here without
-			 * checking anything. */
-
-			dest_context = call->callback_dest_context;
-			caller_context = call->callback_caller_context;
-			ast_assert(!ast_strlen_zero(caller_context));
-			timeout = (int) (2.56 * strlen(call->called) + 10.00); /* This is the math that Nortel Meridians do, so why not? */
-
-			snprintf(cbq_dest, sizeof(cbq_dest), "%s@%s", call->cbqexten, caller_context);
-			capabilities = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT);
-			if (!capabilities) {
-				ast_log(LOG_WARNING, "Failed to allocate capabilities\n");
-				break;
+/*!
+ * \brief Run a CBQ call's expired timers
+ * \retval 0 on success, -1 if the call couldn't be requeued, in which case it is no longer in any queue
+ * \note Must be called with list write locked, and the call out of the timer heap
+ */
+static int cbq_run_timers(struct ccsa_call *call, struct timeval now)
+{
+	if (!ast_tvzero(call->next_promo) && ast_tvcmp(call->next_promo, now) <= 0) {
+		ast_debug(1, "Queue Promotion Timer expired for %s\n", call->caller);
+		if (call->fq) { /* If detached, it's already its turn */
+			/* Move to the end of the next priority's queue */
+			call_detach(call);
+			call->queue_priority += 1;
+			if (call_attach(call)) {
+				ast_log(LOG_WARNING, "Queue Promotion failed for CBQ call\n");
+				return -1;
 			}
-			ast_format_cap_append(capabilities, ast_format_slin, 0);
-			total_queue_time = (int) time(NULL) - call->start;
-
-			/* Spawn the callback. */
-			ast_verb(3, "Call Back Queue callback for %s -> %s (%ds elapsed, %ds timeout)\n", call->cbqexten, call->called, total_queue_time, timeout);
-			if (!ast_strlen_zero(dest_context)) {
-				/* Connect to a user-provided destination context. */
-				res = ast_pbx_outgoing_exten_predial("Local", capabilities, cbq_dest,
-					timeout * 1000, dest_context, call->called, 1, &outgoing_status,
-					AST_OUTGOING_NO_WAIT, call->called, "CALLBACK", NULL, NULL, NULL, 0, NULL, NULL);
-			} else {
-				char app_args[256];
-				/* Connect the called back caller back to this module, with same exten,ccsa,route, with priority 3, just in case we miss it. Also add with the same FRL we had just now, so we don't have to enter an auth code to access this facility again. */
-				snprintf(app_args, sizeof(app_args), "%s,%s,%s,cp(3)f(%d)", call->called, call->ccsa, call->route, call->effective_frl);
-				/* Reconnect to the CCSA module using the same settings that we have now. */
-				res = ast_pbx_outgoing_app_predial("Local", capabilities, cbq_dest,
-					timeout * 1000, app, app_args, &outgoing_status,
-					AST_OUTGOING_NO_WAIT, call->called, "CALLBACK", NULL, NULL, NULL, NULL, NULL);
+		} else {
+			call->queue_priority += 1;
+		}
+		ast_debug(1, "CBQ priority is now %d\n", call->queue_priority);
+		if (call->queue_priority >= MAX_QUEUE_PRIORITY) {
+			ast_debug(1, "CBQ priority is now maximum, not incrementing priority anymore\n");
+			call->next_promo = ast_tv(0, 0);
+		} else {
+			call->next_promo = ast_tvadd(call->next_promo, ast_tv(call->queue_promo_timer, 0));
+		}
+	}
+	if (!ast_tvzero(call->next_advance) && ast_tvcmp(call->next_advance, now) <= 0) {
+		ast_debug(1, "Route Advance Timer expired for %s\n", call->caller);
+		call->next_advance = ast_tv(0, 0);
+		/* Swap the current route for the next one in the list. */
+		if (call->fq) {
+			call_detach(call);
+			ast_free(call->route);
+			ast_free(call->facility);
+			call->route = call->nextroute;
+			call->facility = call->nextfacility;
+			call->nextroute = call->nextfacility = NULL;
+			if (call_attach(call)) {
+				ast_log(LOG_WARNING, "Route Advance failed for CBQ call\n");
+				return -1;
 			}
-			/* Async, because we're still in the queue, and will block the callback from actually seizing the facility.
-			 * When we disappear, it'll free the spot that just became open in the queue and, barring any fantastic race
-			 * condition, the callback call should be able to grab it.
-			 * We don't need to artificially introduce a delay because the called back caller is not going to answer
-			 * instantly, so by the time that call is picked up, we'll be long gone already.
-			 */
-
-			ao2_cleanup(capabilities);
-			break;
 		}
-		if (use_queue_promo_timer && ast_remaining_ms(queue_promo_start, call->queue_promo_timer) <= 0) {
-			ast_debug(1, "Queue Promotion Timer expired for %s\n", call->caller);
-			if (call->queue_priority >= 3) {
-				ast_debug(1, "CBQ priority is already maximum, not incrementing priority anymore\n");
-				use_queue_promo_timer = 0;
-			} else {
-				call->queue_priority += 1;
-				ast_debug(1, "CBQ priority is now %d\n", call->queue_priority);
-				AST_RWLIST_WRLOCK(&calls);
-				/* Rather than trying to reorder the list, just brute force remove and reinsert,
-				 * which will reinsert at an appropriate spot. Much better than removing
-				 * the call itself and making a new one. */
+	}
+	return 0;
+}
+
+/*!
+ * \brief CBQ engine thread
+ * \details All CBQ calls are handled by this thread: it owns their timers
+ * (Queue Promotion and Route Advance), and calls back callers when it's their turn.
+ *
+ * Nortel Meridian documentation has a Queue Promotion Timer and Route Advance Timer.
+ * At QPT intervals, priority is incremented until it reaches the maximum (thus advancing within the queue)
+ * When RAT is reached, extended routes are added to the routes against which the call was initially queued.
+ * No limit on how long calls may stay in CBQ (if not cancelled using Ring-Again functionality).
+ * BSPs do not mention limits on CBQ duration or whether they can be cancelled at all.
+ * Outpulsing of Meridian on success is wait 10 seconds and then 2.56 seconds per digit, to allow for
+ * answer within 10-30 seconds (and just 6 seconds for analog phones, for some reason).
+ *
+ * The implementation is similar to this, mainly differing in that this module is only set up
+ * to allow queuing on one facility at a time, so route advance merely advances to the next route,
+ * rather than adding the next route.
+ */
+static void *cbq_engine(void *unused)
+{
+	for (;;) {
+		AST_LIST_HEAD_NOLOCK(, ccsa_call) callbacks = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+		AST_LIST_HEAD_NOLOCK(, ccsa_call) failed = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+		struct ccsa_call *call;
+		struct timeval now, next = { 0, };
+
+		AST_RWDLLIST_WRLOCK(&calls);
+		now = ast_tvnow();
+		while ((call = ast_heap_peek(cbq_timers, 1)) && ast_tvcmp(call->next_timer, now) <= 0) {
+			ast_heap_pop(cbq_timers);
+			call->timed = 0;
+			if (cbq_run_timers(call, now)) {
+				/* It's no longer in any queue, so it would never be called back. Drop it now, rather than leave it in limbo. */
 				call_queue_remove(call);
-				call_queue_insert(call, call->route);
-				AST_RWLIST_UNLOCK(&calls);
+				AST_LIST_INSERT_TAIL(&failed, call, rentry);
+				continue;
 			}
+			cbq_schedule(call);
+		}
+		while ((call = AST_LIST_REMOVE_HEAD(&cbq_ready, rentry))) {
+			call->ready = 0;
+			call_queue_remove(call); /* Nobody else can get to it now, so we can call back without the list locked */
+			AST_LIST_INSERT_TAIL(&callbacks, call, rentry);
 		}
-		if (use_route_advance_timer && ast_remaining_ms(route_advance_start, call->route_advance_timer) <= 0) {
-			ast_debug(1, "Route Advance Timer expired for %s\n", call->caller);
-			use_route_advance_timer = 0;
+		if ((call = ast_heap_peek(cbq_timers, 1))) {
+			next = call->next_timer;
+		}
+		AST_RWDLLIST_UNLOCK(&calls);
 
-			/* Swap the current route for the next one in the list, if there is one. */
-			if (call->nextroute) {
-				char *newroute, *newfacility;
-				char next_facility[AST_MAX_CONTEXT];
-				if (get_route_facility(call->nextroute, next_facility, sizeof(next_facility))) {
-					ast_log(LOG_WARNING, "Failed to determine facility used by route %s?\n", call->nextroute); /* Shouldn't ever happen. */
-				} else {
-					struct ccsa_call *ecall;
-					int advanced = 0;
-
-					newroute = ast_strdup(call->nextroute);
-					if (newroute) {
-						newfacility = ast_strdup(next_facility);
-						if (newfacility) {
-							AST_RWLIST_WRLOCK(&calls);
-							/* Make sure we're still in the list, too. */
-							AST_LIST_TRAVERSE(&calls, ecall, entry) {
-								if (call == ecall) {
-									/* Shift next to now. */
-									ast_free(call->route);
-									call->route = newroute;
-									call->facility = newfacility;
-									ast_free(call->nextroute); /* Don't actually need this guy anymore. */
-									advanced = 1;
-									break;
-								}
-							}
-
-							/* Just like in the above case, remove and reinsert to get it to the correct spot. */
-							if (advanced) {
-								call_queue_remove(call);
-								call_queue_insert(call, call->route);
-							} else {
-								ast_log(LOG_WARNING, "Route Advance failed for CBQ call\n");
-							}
-							AST_RWLIST_UNLOCK(&calls);
-						}
-					}
-				}
-			}
+		while ((call = AST_LIST_REMOVE_HEAD(&failed, rentry))) {
+			ast_log(LOG_WARNING, "Could not requeue CBQ call for %s, cancelling it\n", call->caller);
+			call_free(call, 0);
+		}
+		while ((call = AST_LIST_REMOVE_HEAD(&callbacks, rentry))) {
+			cbq_callback(call);
+			call_free(call, 0);
 		}
-	}
 
-	if (!call->aborted) {
-		/* Hey, we weren't aborted, which means nobody is going to clean up our mess for us. */
-		ast_debug(2, "Thread %ld is ending of its own volition\n", (long) call->cbqthread);
-		pthread_detach(call->cbqthread);
-		call_free(call, 1);
+		ast_mutex_lock(&engine_lock);
+		if (!engine_wakeup && !engine_unloading) {
+			if (ast_tvzero(next)) {
+				ast_cond_wait(&engine_cond, &engine_lock);
+			} else {
+				struct timespec ts = {
+					.tv_sec = next.tv_sec,
+					.tv_nsec = next.tv_usec * 1000,
+				};
+				ast_cond_timedwait(&engine_cond, &engine_lock, &ts);
+			}
+		}
+		engine_wakeup = 0;
+		if (engine_unloading) {
+			ast_mutex_unlock(&engine_lock);
+			break;
+		}
+		ast_mutex_unlock(&engine_lock);
 	}
-
 	return NULL;
 }
 
@@ -1712,53 +2106,52 @@ static int comma_count(const char *s)
 	return c;
 }
 
-static enum facility_disp ccsa_try_route(struct ast_channel *chan, int fd, int *have_mer, char try_preempt, const char *exten, const char *route, int *callerfrl, int *frl_upgraded, int mer_tone, int frl_allow_upgrade, int auth_code_remote_allowed, int remote, const char *auth_sub_context, const char *outgoing_clid)
+static enum facility_disp ccsa_try_route(struct ast_channel *chan, int fd, int *have_mer, char try_preempt, const char *exten, const struct route_plan_entry *rpe, int *callerfrl, int *frl_upgraded, int mer_tone, int frl_allow_upgrade, int auth_code_remote_allowed, int remote, const char *auth_sub_context, const char *outgoing_clid)
 {
 	int res;
-	struct route *f;
+	struct route *f = rpe->route;
+	const char *route = rpe->name;
 	char dialstr[PATH_MAX + 84]; /* Minimum needed to avoid snprintf truncation warnings */
 	char time[PATH_MAX];
 	char facility[AST_MAX_CONTEXT];
-	const char *aiod;
-	int frl, mer, busyiscongestion, limit;
-
-	dialstr[0] = time[0] = '\0';
+	char aiod[AST_MAX_CONTEXT];
+	int frl, mer, busyiscongestion, limit, time_restricted;
 
-	AST_RWLIST_RDLOCK(&routes);
-	f = find_route(route, 0);
 	if (!f) {
 		ast_log(LOG_WARNING, "No such route: %s\n", route);
-		AST_RWLIST_UNLOCK(&routes);
+		return FACILITY_DISP_FAILURE;
+	}
+
+	ao2_lock(f);
+	if (ast_strlen_zero(f->dialstr)) {
+		ao2_unlock(f);
+		ast_log(LOG_WARNING, "Route %s has no dial string?\n", route);
 		return FACILITY_DISP_FAILURE;
 	}
 	frl = f->frl;
 	mer = f->mer;
 	busyiscongestion = f->busyiscongestion;
 	limit = f->limit;
+	time_restricted = route_time_restricted(f);
 
 	ast_copy_string(time, f->time, sizeof(time));
 	ast_copy_string(facility, f->facility, sizeof(facility));
-	AST_RWLIST_UNLOCK(&routes);
-
-	if (ast_strlen_zero(f->dialstr)) {
-		ast_log(LOG_WARNING, "Route %s has no dial string?\n", route);
-		return FACILITY_DISP_FAILURE;
-	}
-	aiod = S_OR(outgoing_clid, f->aiod);
+	ast_copy_string(aiod, S_OR(outgoing_clid, f->aiod), sizeof(aiod));
 	if (!ast_strlen_zero(aiod)) {
 		int commas = comma_count(f->dialstr);
 		/* This is concatenated to the dial string, so it is assumed a URL is not present in the dialstr */
-		cdr_set_var(chan, cdrvar_aiod, aiod);
 		snprintf(dialstr, sizeof(dialstr), "%s%s%sf(%s)", f->dialstr, commas <= 0 ? "," : "", commas <= 1 ? "," : "", aiod);
 	} else {
-		cdr_set_var(chan, cdrvar_aiod, ""); /* Reset in case it was already set */
 		ast_copy_string(dialstr, f->dialstr, sizeof(dialstr));
 	}
+	ao2_unlock(f);
+
+	cdr_set_var(chan, cdrvar_aiod, aiod); /* Reset in case it was already set, if there's none */
 
 	ast_debug(4, "Route %s: Limit: %d, FRL: %d, MER: %d, Busy Is Cong.: %d, DSTR: %s, Time: %s\n", route, limit, frl, mer, busyiscongestion, dialstr, time);
 
 	/* If time condition exists, we need to satisfy it: consider if the caller is actually eligible for this route. */
-	if (!ast_strlen_zero(time) && time_matches(time)) {
+	if (time_restricted) {
 		ccsa_log(chan, fd, "Time condition '%s' is not satisfied\n", time);
 		return FACILITY_DISP_UNAVAILABLE;
 	}
@@ -1933,11 +2326,12 @@ static enum facility_disp ccsa_try_route(struct ast_channel *chan, int fd, int *
 /*! \param chan Channel, if running for real */
 /*! \param fd CLI fd, if simulating */
 /*! \param exten Destination, if running for real */
-static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const char *ccsa, const char *faclist, const char *musicclass, int remote, int cbq, int ohq, int priority, char preempt,
+static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const char *ccsa, struct route_plan *plan, const char *musicclass, int remote, int cbq, int ohq, int priority, char preempt,
 	int callerfrl, int no_frl_upgrade, const char *outgoing_clid)
 {
 	enum facility_disp fres;
-	char *route, *routes;
+	const struct route_plan_entry *rpe;
+	int i;
 	int have_mer = 0, frl_upgraded = -2; /* -2 = not prompted yet, -1 = invalid, 0-7 = FRL of auth code */
 	int total_attempted = 0, total_unavailable = 0, total_unauthorized = 0, total_preempt_fails = 0;
 	char try_preempt = 0;
@@ -1950,13 +2344,12 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 	unsigned int queue_promo_timer, route_advance_timer;
 	time_t start;
 
-	AST_RWLIST_RDLOCK(&ccsas);
-	c = find_ccsa(ccsa, 0);
+	c = find_ccsa(ccsa);
 	if (!c) {
-		AST_RWLIST_UNLOCK(&ccsas);
 		ast_log(LOG_WARNING, "No such CCSA: %s\n", ccsa);
 		return -1;
 	}
+	ao2_lock(c);
 	mer_tone = c->mer_tone;
 	frl_allow_upgrade = c->frl_allow_upgrade;
 	auth_code_remote_allowed = c->auth_code_remote_allowed;
@@ -1991,7 +2384,8 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 		frl_allow_upgrade = c->auth_code_len;
 	}
 
-	AST_RWLIST_UNLOCK(&ccsas);
+	ao2_unlock(c);
+	ao2_ref(c, -1);
 
 	/* General Notes:
 	 *
@@ -2032,10 +2426,10 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 	 * probably need to peruse the documentation.
 	 */
 
-	ccsa_log(chan, fd, "Eligible Routes: %s\n", faclist);
+	ccsa_log(chan, fd, "Eligible Routes: %s\n", plan->str);
 	ccsa_log(chan, fd, "Caller FRL: %d, Preempt: %c, Priority: %d, CBQ: %d, OHQ: %d\n", callerfrl, isprint(preempt) ? preempt : '?', priority, cbq, ohq);
 
-	if (ast_strlen_zero(faclist)) {
+	if (ast_strlen_zero(plan->str)) {
 		ast_log(LOG_WARNING, "No route eligible for CCSA route\n");
 		ccsa_set_result_val(chan, "NO_ROUTES");
 		return -1;
@@ -2045,14 +2439,14 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 	ccsa_log(chan, fd, "Beginning CCSA call\n");
 	start = time(NULL);
 
-	routes = ast_strdupa(faclist);
-	while ((route = strsep(&routes, "|"))) {
-		if (ast_strlen_zero(route)) {
+	for (i = 0; i < plan->num; i++) {
+		rpe = &plan->routes[i];
+		if (ast_strlen_zero(rpe->name)) {
 			ccsa_log(chan, fd, "Skipping empty route\n");
 			continue; /* Allow for empty routes so that using IFTIME in dialplan resolving to empty route is OK. */
 		}
 		total_attempted++;
-		fres = ccsa_try_route(chan, fd, &have_mer, try_preempt, exten, route, &callerfrl, &frl_upgraded, mer_tone, frl_allow_upgrade, auth_code_remote_allowed, remote, auth_sub_context, outgoing_clid);
+		fres = ccsa_try_route(chan, fd, &have_mer, try_preempt, exten, rpe, &callerfrl, &frl_upgraded, mer_tone, frl_allow_upgrade, auth_code_remote_allowed, remote, auth_sub_context, outgoing_clid);
 		switch (fres) {
 		case FACILITY_DISP_HANGUP:
 			return -1;
@@ -2105,13 +2499,13 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 		/* Now, try preempting an existing call before we queue. */
 		try_preempt = preempt;
 		ccsa_log(chan, fd, "Trying to preempt calls < '%c'\n", preempt);
-		routes = ast_strdupa(faclist);
-		while ((route = strsep(&routes, "|"))) {
-			if (ast_strlen_zero(route)) {
+		for (i = 0; i < plan->num; i++) {
+			rpe = &plan->routes[i];
+			if (ast_strlen_zero(rpe->name)) {
 				continue; /* Allow for empty facilities so that using IFTIME in dialplan resolving to empty route is OK. */
 			}
 			total_attempted++;
-			fres = ccsa_try_route(chan, fd, &have_mer, try_preempt, exten, route, &callerfrl, &frl_upgraded, mer_tone, frl_allow_upgrade, auth_code_remote_allowed, remote, auth_sub_context, outgoing_clid);
+			fres = ccsa_try_route(chan, fd, &have_mer, try_preempt, exten, rpe, &callerfrl, &frl_upgraded, mer_tone, frl_allow_upgrade, auth_code_remote_allowed, remote, auth_sub_context, outgoing_clid);
 			switch (fres) {
 			case FACILITY_DISP_HANGUP:
 				return -1;
@@ -2168,10 +2562,10 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 		/* Nortel Meridian doesn't do ERWT for queued calls, but we'll do it anyways */
 		have_mer = 0;
 
-		routes = ast_strdupa(faclist);
 		elapsed = time(NULL) - start;
-		while ((route = strsep(&routes, "|"))) {
-			if (route_permits_ohq(route, elapsed, fd != -1)) {
+		for (i = 0; i < plan->num; i++) {
+			rpe = &plan->routes[i];
+			if (route_permits_ohq(rpe->route, elapsed, fd != -1)) {
 				eligible = 1;
 				break; /* No need to check any more */
 			}
@@ -2181,16 +2575,15 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 			ccsa_log(chan, fd, "Ineligible for Off-Hook Queue\n");
 		} else { /* Offer OHQ on first choice route */
 			char ohq_facility[AST_MAX_CONTEXT];
-			ast_assert(route != NULL);
+			ast_assert(rpe->route != NULL);
 			ccsa_log(chan, fd, "Offering Off-Hook Queue\n");
 			if (offer_ohq(chan)) {
 				return -1;
 			}
 
-			if (get_route_facility(route, ohq_facility, sizeof(ohq_facility))) {
-				ast_log(LOG_WARNING, "Failed to determine facility used by route %s?\n", route);
-				return -1; /* Shouldn't ever happen. */
-			}
+			ao2_lock(rpe->route);
+			ast_copy_string(ohq_facility, rpe->route->facility, sizeof(ohq_facility));
+			ao2_unlock(rpe->route);
 
 			/* According to Nortel 553-2751-101, while in Off-Hook Queue, stations cannot do any kind of call modification
 			 * e.g. hook flash, 3-way calling, etc. Personally,
@@ -2211,7 +2604,7 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 				}
 
 				/* 553-2751-101: OHQ assigned max priority (3), because other network facilities can be held while call queued */
-				call = call_add(ast_channel_name(chan), ohq_facility, route, ast_channel_caller(chan)->id.number.str, exten, 0, preempt, 3);
+				call = call_add(ast_channel_name(chan), ohq_facility, rpe->name, ast_channel_caller(chan)->id.number.str, exten, 0, preempt, 3);
 				if (!call) {
 					ast_log(LOG_ERROR, "Failed to add call to call list, aborting\n");
 					ccsa_set_result_val(chan, "FAILURE");
@@ -2233,7 +2626,7 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 				}
 				if (res) {
 					/* Hopefully, we didn't lose our spot just now due to a race condition... */
-					fres = ccsa_try_route(chan, fd, &have_mer, try_preempt, exten, route, &callerfrl, &frl_upgraded, mer_tone, frl_allow_upgrade, auth_code_remote_allowed, remote, auth_sub_context, outgoing_clid);
+					fres = ccsa_try_route(chan, fd, &have_mer, try_preempt, exten, rpe, &callerfrl, &frl_upgraded, mer_tone, frl_allow_upgrade, auth_code_remote_allowed, remote, auth_sub_context, outgoing_clid);
 					switch (fres) {
 					case FACILITY_DISP_HANGUP:
 						return -1;
@@ -2253,7 +2646,7 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 					case FACILITY_DISP_INVALID_AUTH_CODE:
 					case FACILITY_DISP_FAILURE:
 					default:
-						ast_log(LOG_WARNING, "Off-Hook queued call on %s fail to complete using route %s\n", ast_channel_name(chan), route);
+						ast_log(LOG_WARNING, "Off-Hook queued call on %s fail to complete using route %s\n", ast_channel_name(chan), rpe->name);
 					}
 					return 0; /* The buck stops here, we're done no matter what. */
 				}
@@ -2262,12 +2655,13 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 			ccsa_log(chan, fd, "Off-Hook Queue timed out\n");
 
 			/* Now, examine the remaining routes (if any), and attempt them, including MER routes if needed, e.g. DDD/MTS overflow. */
-			while ((route = strsep(&routes, "|"))) {
-				if (ast_strlen_zero(route)) {
+			for (i++; i < plan->num; i++) {
+				rpe = &plan->routes[i];
+				if (ast_strlen_zero(rpe->name)) {
 					continue; /* Allow for empty facilities so that using IFTIME in dialplan resolving to empty route is OK. */
 				}
 				total_attempted++;
-				fres = ccsa_try_route(chan, fd, &have_mer, try_preempt, exten, route, &callerfrl, &frl_upgraded, mer_tone, frl_allow_upgrade, auth_code_remote_allowed, remote, auth_sub_context, outgoing_clid);
+				fres = ccsa_try_route(chan, fd, &have_mer, try_preempt, exten, rpe, &callerfrl, &frl_upgraded, mer_tone, frl_allow_upgrade, auth_code_remote_allowed, remote, auth_sub_context, outgoing_clid);
 				switch (fres) {
 				case FACILITY_DISP_HANGUP:
 					return -1;
@@ -2317,13 +2711,12 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 
 		if (fd == -1) {
 			/* If not simulation, ensure we can actually CBQ */
-			routes = ast_strdupa(faclist);
-			while ((route = strsep(&routes, "|"))) {
-				if (route_permits_cbq(route)) {
+			for (i = 0; i < plan->num; i++) {
+				if (route_permits_cbq(plan->routes[i].name)) {
 					break; /* No need to check any more */
 				}
 			}
-			if (!route) {
+			if (i == plan->num) {
 				ast_debug(3, "Call ineligible for Call Back Queue\n");
 				ccsa_set_result_val(chan, "UNROUTABLE");
 				return 0;
@@ -2359,19 +2752,21 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 			ccsa_log(chan, fd, "Caller %s already has %d pending CBQ call%s\n", ast_channel_caller(chan)->id.number.str, pending, ESS(pending));
 			ccsa_set_result_val(chan, "CBQ_FAILED");
 		} else {
-			char *nextroute;
+			const struct route_plan_entry *nextrpe;
 			struct ccsa_call *call;
 			char cbq_facility[AST_MAX_CONTEXT];
 			ccsa_log(chan, fd, "Starting CBQ for extension %s\n", cbq_exten);
 
 			/* Start by queuing on first choice first. */
-			routes = ast_strdupa(faclist);
-			route = strsep(&routes, "|");
-			nextroute = strsep(&routes, "|"); /* Unlike route, this could be NULL (if there was only one route to begin with) */
-			if (get_route_facility(route, cbq_facility, sizeof(cbq_facility))) {
-				ast_log(LOG_WARNING, "Failed to determine facility used by route %s?\n", route);
+			rpe = &plan->routes[0];
+			nextrpe = plan->num > 1 ? &plan->routes[1] : NULL; /* Unlike route, this could be NULL (if there was only one route to begin with) */
+			if (!rpe->route) {
+				ast_log(LOG_WARNING, "Failed to determine facility used by route %s?\n", rpe->name);
 				return -1; /* Shouldn't ever happen. */
 			}
+			ao2_lock(rpe->route);
+			ast_copy_string(cbq_facility, rpe->route->facility, sizeof(cbq_facility));
+			ao2_unlock(rpe->route);
 
 			if (ast_strlen_zero(callback_caller_context)) {
 				ast_log(LOG_WARNING, "Config option callback_caller_context is not defined, CBQ will fail!\n");
@@ -2379,40 +2774,55 @@ static int ccsa_run(struct ast_channel *chan, int fd, const char *exten, const c
 			}
 
 			/* Add to queue with initial CBQ priority */
-			call = call_add(ast_channel_name(chan), cbq_facility, route, ast_channel_caller(chan)->id.number.str, exten, 0, preempt, priority);
+			call = call_alloc(ast_channel_name(chan), cbq_facility, rpe->name, ast_channel_caller(chan)->id.number.str, exten, 0, 1, preempt, priority);
 			if (!call) {
 				ast_log(LOG_ERROR, "Failed to add call to call list, aborting\n");
 				return -1;
 			} else {
-				call->cbq = 1;
+				struct timeval now = ast_tvnow();
 				call->effective_frl = frl_upgraded >= 0 ? frl_upgraded : callerfrl;
 				call->queue_promo_timer = queue_promo_timer;
 				call->route_advance_timer = route_advance_timer;
 				call->cbqexten = ast_strdup(cbq_exten);
 				if (!call->cbqexten) {
 					ast_log(LOG_WARNING, "strdup failed\n");
-					call_free(call, 1);
+					call_free(call, 0);
 					return -1;
 				}
 				call->ccsa = ast_strdup(ccsa);
 				if (!call->ccsa) {
 					ast_log(LOG_WARNING, "strdup failed\n");
-					call_free(call, 1); /* No leak, call->cbqexten will get cleaned up here. */
+					call_free(call, 0); /* No leak, call->cbqexten will get cleaned up here. */
 					return -1;
 				}
-				if (nextroute) { /* If there's another route we should try if the Route Advance Timer expires, indicate so */
-					call->nextroute = ast_strdup(nextroute);
+				if (nextrpe) { /* If there's another route we should try if the Route Advance Timer expires, indicate so */
+					/* Look up the facility now, so the CBQ engine doesn't need to look up routes. */
+					if (!nextrpe->route) {
+						ast_log(LOG_WARNING, "Failed to determine facility used by route %s?\n", nextrpe->name); /* Shouldn't ever happen. */
+					} else {
+						call->nextroute = ast_strdup(nextrpe->name);
+						ao2_lock(nextrpe->route);
+						call->nextfacility = ast_strdup(nextrpe->route->facility);
+						ao2_unlock(nextrpe->route);
+					}
 				}
 				call->callback_caller_context = ast_strdup(callback_caller_context);
 				if (callback_dest_context) {
 					call->callback_dest_context = ast_strdup(callback_dest_context);
 				}
-				if (ast_pthread_create_background(&call->cbqthread, NULL, call_back_queue, (void *) call)) {
-					call_free(call, 1);
-					ast_log(LOG_WARNING, "Failed to create thread for Call Back Queue\n");
+				ast_debug(1, "Queue Promotion Timer: %u, Route Advance Timer: %u\n", call->queue_promo_timer, call->route_advance_timer);
+				if (call->queue_promo_timer && call->queue_priority < MAX_QUEUE_PRIORITY) {
+					call->next_promo = ast_tvadd(now, ast_tv(call->queue_promo_timer, 0));
+				}
+				if (call->route_advance_timer && call->nextroute && call->nextfacility) {
+					call->next_advance = ast_tvadd(now, ast_tv(call->route_advance_timer, 0));
+				}
+				if (call_link(call)) {
+					call_free(call, 0);
+					ast_log(LOG_WARNING, "Failed to add call to Call Back Queue\n");
 					ccsa_set_result_val(chan, "FAILURE");
 				} else {
-					/* Channel going to return immediately, without freeing this call. */
+					/* Channel going to return immediately, without freeing this call. The CBQ engine owns it now. */
 					ccsa_set_result_val(chan, "CBQ");
 				}
 			}
@@ -2481,7 +2891,7 @@ static int ccsa_exec(struct ast_channel *chan, const char *data)
 	int cbq = 0, ohq = 0;
 	char preempt = 0;
 	int remote = 0, priority = 1, callerfrl = 0;
-	const char *faclist;
+	struct route_plan *plan;
 	const char *musicclass = NULL;
 	const char *outgoing_clid = NULL;
 	int no_frl_upgrade = 0;
@@ -2494,23 +2904,27 @@ static int ccsa_exec(struct ast_channel *chan, const char *data)
 	CCSA_ARG_REQUIRE(args.exten, "an extension");
 	CCSA_ARG_REQUIRE(args.ccsa, "a CCSA");
 
-	AST_RWLIST_RDLOCK(&ccsas);
-	c = find_ccsa(args.ccsa, 0);
+	c = find_ccsa(args.ccsa);
 	if (!c) {
 		ast_log(LOG_WARNING, "No such CCSA: %s\n", args.ccsa);
 		ccsa_set_result_val(chan, "NO_CCSA");
-		goto initcleanup;
+		return -1;
 	}
 
 	/* Determine eligible routes */
 	if (!ast_strlen_zero(args.routes)) {
-		faclist = args.routes;
+		plan = route_plan_build(args.routes);
 	} else {
-		if (ast_strlen_zero(c->routes)) {
+		ao2_lock(c);
+		plan = ao2_bump(c->plan); /* Default: assume all routes are eligible for routing */
+		ao2_unlock(c);
+		if (!plan) {
 			ast_log(LOG_WARNING, "No routes defined for CCSA %s and none provided to CCSA()\n", args.ccsa);
-			goto initcleanup;
 		}
-		faclist = ast_strdupa(c->routes); /* Default: assume all routes are eligible for routing */
+	}
+	ao2_ref(c, -1);
+	if (!plan) {
+		return -1;
 	}
 
 	if (!ast_strlen_zero(args.options))	{
@@ -2550,15 +2964,33 @@ static int ccsa_exec(struct ast_channel *chan, const char *data)
 		no_frl_upgrade = ast_test_flag(&opts, OPT_NO_FRL_UPGRADE) ? 1 : 0;
 	}
 
-	res = 0;
-initcleanup:
-	AST_RWLIST_UNLOCK(&ccsas);
-	if (res) {
-		return -1;
+	pbx_builtin_setvar_helper(chan, "__CCSA_CHANNEL", ast_channel_name(chan));
+	res = ccsa_run(chan, -1, args.exten, args.ccsa, plan, musicclass, remote, cbq, ohq, priority, preempt, callerfrl, no_frl_upgrade, outgoing_clid);
+	ao2_ref(plan, -1);
+	return res;
+}
+
+/*! \brief CLI completion for route or CCSA names */
+static char *complete_profile(struct ao2_container *profiles, struct ast_cli_args *a)
+{
+	struct ao2_iterator i;
+	const char *name;
+	size_t wlen = strlen(a->word);
+	int which = 0;
+	char *ret = NULL;
+
+	i = ao2_iterator_init(profiles, 0);
+	while ((name = ao2_iterator_next(&i))) { /* Routes and CCSAs both start with their name */
+		if (!strncasecmp(a->word, name, wlen) && ++which > a->n) {
+			ret = ast_strdup(name);
+			ao2_ref((void *) name, -1);
+			break;
+		}
+		ao2_ref((void *) name, -1);
 	}
+	ao2_iterator_destroy(&i);
 
-	pbx_builtin_setvar_helper(chan, "__CCSA_CHANNEL", ast_channel_name(chan));
-	return ccsa_run(chan, -1, args.exten, args.ccsa, faclist, musicclass, remote, cbq, ohq, priority, preempt, callerfrl, no_frl_upgrade, outgoing_clid);
+	return ret;
 }
 
 static char *handle_simulate_route(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
@@ -2568,9 +3000,7 @@ static char *handle_simulate_route(struct ast_cli_entry *e, int cmd, struct ast_
 	struct ccsa *c;
 	int cbq = 1, ohq = 1;
 	int callerfrl = MAX_FRL;
-	const char *faclist;
-	char *ret = NULL;
-	int which = 0;
+	struct route_plan *plan;
 
 	switch(cmd) {
 	case CLI_INIT:
@@ -2581,47 +3011,37 @@ static char *handle_simulate_route(struct ast_cli_entry *e, int cmd, struct ast_
 		return NULL;
 	case CLI_GENERATE:
 		if (a->pos == 3) {
-			size_t wlen = strlen(a->word);
-			AST_RWLIST_RDLOCK(&ccsas);
-			AST_RWLIST_TRAVERSE(&ccsas, c, entry) {
-				if (!strncasecmp(a->word, c->name, wlen) && ++which > a->n) {
-					ret = ast_strdup(c->name);
-					break;
-				}
-			}
-			AST_RWLIST_UNLOCK(&ccsas);
+			return complete_profile(ccsa_profiles, a);
 		} else if (a->pos == 4) {
-			struct route *r;
-			size_t wlen = strlen(a->word);
-			AST_RWLIST_RDLOCK(&routes);
-			AST_RWLIST_TRAVERSE(&routes, r, entry) {
-				if (!strncasecmp(a->word, r->name, wlen) && ++which > a->n) {
-					ret = ast_strdup(r->name);
-					break;
-				}
-			}
-			AST_RWLIST_UNLOCK(&routes);
+			return complete_profile(route_profiles, a);
 		}
-		return ret;
+		return NULL;
 	}
 
 	if (a->argc < 4) {
 		return CLI_SHOWUSAGE;
 	}
 
-	AST_RWLIST_RDLOCK(&ccsas);
-	c = find_ccsa(a->argv[3], 0);
-	if (c) {
-		faclist = a->argc > 4 && !ast_strlen_zero(a->argv[4]) ? a->argv[4] : ast_strdupa(S_OR(c->routes, ""));
-		callerfrl = a->argc > 5 && !ast_strlen_zero(a->argv[5]) ? atoi(a->argv[5]) : callerfrl;
-	}
-	AST_RWLIST_UNLOCK(&ccsas);
+	c = find_ccsa(a->argv[3]);
 	if (!c) {
 		ast_cli(a->fd, "No such route: '%s'\n", a->argv[3]);
 		return CLI_FAILURE;
 	}
+	if (a->argc > 4 && !ast_strlen_zero(a->argv[4])) {
+		plan = route_plan_build(a->argv[4]);
+	} else {
+		ao2_lock(c);
+		plan = c->plan ? ao2_bump(c->plan) : route_plan_build("");
+		ao2_unlock(c);
+	}
+	ao2_ref(c, -1);
+	if (!plan) {
+		return CLI_FAILURE;
+	}
+	callerfrl = a->argc > 5 && !ast_strlen_zero(a->argv[5]) ? atoi(a->argv[5]) : callerfrl;
 
-	ccsa_run(NULL, a->fd, NULL, a->argv[3], faclist, NULL, 0, cbq, ohq, 1, 0, callerfrl, 0, NULL);
+	ccsa_run(NULL, a->fd, NULL, a->argv[3], plan, NULL, 0, cbq, ohq, 1, 0, callerfrl, 0, NULL);
+	ao2_ref(plan, -1);
 
 	return CLI_SUCCESS;
 #undef FORMAT
@@ -2635,14 +3055,16 @@ static char *cli_show_calls(int fd, const char *facname, int show_active, int sh
 	int now = (int) time(NULL);
 
 	if (facname) {
-		if (!find_route(facname, 1)) {
+		struct route *f = find_route(facname);
+		if (!f) {
 			ast_cli(fd, "No such route: %s\n", facname);
 			return CLI_FAILURE;
 		}
+		ao2_ref(f, -1);
 	}
 
-	AST_RWLIST_RDLOCK(&calls);
-	AST_LIST_TRAVERSE(&calls, call, entry) {
+	AST_RWDLLIST_RDLOCK(&calls);
+	AST_DLLIST_TRAVERSE(&calls, call, entry) {
 		int diff, hr, min, sec;
 		if (!ast_strlen_zero(facname) && strcmp(facname, call->route)) {
 			continue; /* Doesn't match filter */
@@ -2660,7 +3082,7 @@ static char *cli_show_calls(int fd, const char *facname, int show_active, int sh
 		ast_cli(fd, "%10s %15s %-30s %-6s %02d:%02d:%02d %4c %4c %10s %s\n",
 			call->caller, call->called, call->route, call->active ? "Active" : call->cbq ? "CBQ" : "OHQ", hr, min, sec, isprint(call->call_priority) ? call->call_priority : ' ', !call->active ? '0' + call->queue_priority : '-', S_OR(call->cbqexten, ""), call->channel);
 	}
-	AST_RWLIST_UNLOCK(&calls);
+	AST_RWDLLIST_UNLOCK(&calls);
 
 	if (!total) {
 		ast_cli(fd, "No calls\n");
@@ -2815,6 +3237,7 @@ static char *handle_show_routes(struct ast_cli_entry *e, int cmd, struct ast_cli
 #define FORMAT  "%-12s\n"
 #define FORMAT2 "%-12s\n"
 	struct route *f;
+	struct ao2_iterator i;
 
 	switch(cmd) {
 	case CLI_INIT:
@@ -2829,11 +3252,12 @@ static char *handle_show_routes(struct ast_cli_entry *e, int cmd, struct ast_cli
 
 	ast_cli(a->fd, FORMAT, "Name");
 	ast_cli(a->fd, FORMAT, "------------");
-	AST_RWLIST_RDLOCK(&routes);
-	AST_LIST_TRAVERSE(&routes, f, entry) {
+	i = ao2_iterator_init(route_profiles, 0);
+	while ((f = ao2_iterator_next(&i))) {
 		ast_cli(a->fd, FORMAT2, f->name);
+		ao2_ref(f, -1);
 	}
-	AST_RWLIST_UNLOCK(&routes);
+	ao2_iterator_destroy(&i);
 
 	return CLI_SUCCESS;
 #undef FORMAT
@@ -2845,8 +3269,6 @@ static char *handle_show_route(struct ast_cli_entry *e, int cmd, struct ast_cli_
 #define FORMAT  "%-32s : %s\n"
 #define FORMAT2 "%-32s : %d\n"
 	struct route *f;
-	int which = 0;
-	char *ret = NULL;
 
 	switch(cmd) {
 	case CLI_INIT:
@@ -2859,38 +3281,29 @@ static char *handle_show_route(struct ast_cli_entry *e, int cmd, struct ast_cli_
 		if (a->pos != 3) {
 			return NULL;
 		}
-		AST_LIST_TRAVERSE(&routes, f, entry) {
-			if (!strncasecmp(a->word, f->name, strlen(a->word)) && ++which > a->n) {
-				ret = ast_strdup(f->name);
-				break;
-			}
-		}
-
-		return ret;
+		return complete_profile(route_profiles, a);
 	}
 
 	if (a->argc != 4) {
 		return CLI_SHOWUSAGE;
 	}
 
-	AST_RWLIST_RDLOCK(&routes);
-	AST_LIST_TRAVERSE(&routes, f, entry) {
-		if (!strcasecmp(a->argv[3], f->name)) {
-			ast_cli(a->fd, FORMAT, "Name", f->name);
-			ast_cli(a->fd, FORMAT, "Facility Name", f->facility);
-			ast_cli(a->fd, FORMAT, "Facility Type", facility_type_str(f->factype));
-			ast_cli(a->fd, FORMAT, "Dial String", f->dialstr);
-			ast_cli(a->fd, FORMAT, "More Expensive Route", AST_CLI_YESNO(f->mer));
-			ast_cli(a->fd, FORMAT, "Busy is Congestion", AST_CLI_YESNO(f->busyiscongestion));
-			ast_cli(a->fd, FORMAT2, "Minimum FRL Req.", f->frl);
-			ast_cli(a->fd, FORMAT, "Time Restrictions", f->time);
-			ast_cli(a->fd, FORMAT2, "Threshold", f->threshold);
-			ast_cli(a->fd, FORMAT2, "Max Limit", f->limit);
-			break;
-		}
-	}
-	AST_RWLIST_UNLOCK(&routes);
-	if (!f) {
+	f = find_route(a->argv[3]);
+	if (f) {
+		ao2_lock(f);
+		ast_cli(a->fd, FORMAT, "Name", f->name);
+		ast_cli(a->fd, FORMAT, "Facility Name", f->facility);
+		ast_cli(a->fd, FORMAT, "Facility Type", facility_type_str(f->factype));
+		ast_cli(a->fd, FORMAT, "Dial String", f->dialstr);
+		ast_cli(a->fd, FORMAT, "More Expensive Route", AST_CLI_YESNO(f->mer));
+		ast_cli(a->fd, FORMAT, "Busy is Congestion", AST_CLI_YESNO(f->busyiscongestion));
+		ast_cli(a->fd, FORMAT2, "Minimum FRL Req.", f->frl);
+		ast_cli(a->fd, FORMAT, "Time Restrictions", f->time);
+		ast_cli(a->fd, FORMAT2, "Threshold", f->threshold);
+		ast_cli(a->fd, FORMAT2, "Max Limit", f->limit);
+		ao2_unlock(f);
+		ao2_ref(f, -1);
+	} else {
 		ast_cli(a->fd, "No such route: '%s'\n", a->argv[3]);
 	}
 
@@ -2904,6 +3317,7 @@ static char *handle_show_ccsas(struct ast_cli_entry *e, int cmd, struct ast_cli_
 #define FORMAT  "%-12s\n"
 #define FORMAT2 "%-12s\n"
 	struct ccsa *c;
+	struct ao2_iterator i;
 
 	switch(cmd) {
 	case CLI_INIT:
@@ -2918,11 +3332,12 @@ static char *handle_show_ccsas(struct ast_cli_entry *e, int cmd, struct ast_cli_
 
 	ast_cli(a->fd, FORMAT, "Name");
 	ast_cli(a->fd, FORMAT, "------------");
-	AST_RWLIST_RDLOCK(&ccsas);
-	AST_LIST_TRAVERSE(&ccsas, c, entry) {
+	i = ao2_iterator_init(ccsa_profiles, 0);
+	while ((c = ao2_iterator_next(&i))) {
 		ast_cli(a->fd, FORMAT2, c->name);
+		ao2_ref(c, -1);
 	}
-	AST_RWLIST_UNLOCK(&ccsas);
+	ao2_iterator_destroy(&i);
 
 	return CLI_SUCCESS;
 #undef FORMAT
@@ -2935,8 +3350,6 @@ static char *handle_show_ccsa(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 #define FORMAT2 "%-32s : %f\n"
 #define FORMAT3 "%-32s : %u\n"
 	struct ccsa *c;
-	int which = 0;
-	char *ret = NULL;
 
 	switch(cmd) {
 	case CLI_INIT:
@@ -2949,41 +3362,32 @@ static char *handle_show_ccsa(struct ast_cli_entry *e, int cmd, struct ast_cli_a
 		if (a->pos != 3) {
 			return NULL;
 		}
-		AST_LIST_TRAVERSE(&ccsas, c, entry) {
-			if (!strncasecmp(a->word, c->name, strlen(a->word)) && ++which > a->n) {
-				ret = ast_strdup(c->name);
-				break;
-			}
-		}
-
-		return ret;
+		return complete_profile(ccsa_profiles, a);
 	}
 
 	if (a->argc != 4) {
 		return CLI_SHOWUSAGE;
 	}
 
-	AST_RWLIST_RDLOCK(&ccsas);
-	AST_LIST_TRAVERSE(&ccsas, c, entry) {
-		if (!strcasecmp(a->argv[3], c->name)) {
-			ast_cli(a->fd, FORMAT, "Name", c->name);
-			ast_cli(a->fd, FORMAT, "MER Tone", AST_CLI_YESNO(c->mer_tone));
-			ast_cli(a->fd, FORMAT, "FRL Upgrades", AST_CLI_YESNO(c->frl_allow_upgrade));
-			ast_cli(a->fd, FORMAT, "Remote Auth", AST_CLI_YESNO(c->auth_code_remote_allowed));
-			ast_cli(a->fd, FORMAT3, "Auth Code Length", c->auth_code_len);
-			ast_cli(a->fd, FORMAT3, "Extension Length", c->extension_len);
-			ast_cli(a->fd, FORMAT, "Auth Code Validation Context", S_OR(c->auth_sub_context, ""));
-			ast_cli(a->fd, FORMAT, "Hold Announcement", S_OR(c->hold_announcement, ""));
-			ast_cli(a->fd, FORMAT, "Extension Prompt", S_OR(c->extension_prompt, ""));
-			ast_cli(a->fd, FORMAT3, "Queue Promo Timer", c->queue_promo_timer);
-			ast_cli(a->fd, FORMAT3, "Route Advance Timer", c->route_advance_timer);
-			ast_cli(a->fd, FORMAT, "Callback Caller Context", S_OR(c->callback_caller_context, ""));
-			ast_cli(a->fd, FORMAT, "Callback Dest. Context", S_OR(c->callback_dest_context, ""));
-			break;
-		}
-	}
-	AST_RWLIST_UNLOCK(&ccsas);
-	if (!c) {
+	c = find_ccsa(a->argv[3]);
+	if (c) {
+		ao2_lock(c);
+		ast_cli(a->fd, FORMAT, "Name", c->name);
+		ast_cli(a->fd, FORMAT, "MER Tone", AST_CLI_YESNO(c->mer_tone));
+		ast_cli(a->fd, FORMAT, "FRL Upgrades", AST_CLI_YESNO(c->frl_allow_upgrade));
+		ast_cli(a->fd, FORMAT, "Remote Auth", AST_CLI_YESNO(c->auth_code_remote_allowed));
+		ast_cli(a->fd, FORMAT3, "Auth Code Length", c->auth_code_len);
+		ast_cli(a->fd, FORMAT3, "Extension Length", c->extension_len);
+		ast_cli(a->fd, FORMAT, "Auth Code Validation Context", S_OR(c->auth_sub_context, ""));
+		ast_cli(a->fd, FORMAT, "Hold Announcement", S_OR(c->hold_announcement, ""));
+		ast_cli(a->fd, FORMAT, "Extension Prompt", S_OR(c->extension_prompt, ""));
+		ast_cli(a->fd, FORMAT3, "Queue Promo Timer", c->queue_promo_timer);
+		ast_cli(a->fd, FORMAT3, "Route Advance Timer", c->route_advance_timer);
+		ast_cli(a->fd, FORMAT, "Callback Caller Context", S_OR(c->callback_caller_context, ""));
+		ast_cli(a->fd, FORMAT, "Callback Dest. Context", S_OR(c->callback_dest_context, ""));
+		ao2_unlock(c);
+		ao2_ref(c, -1);
+	} else {
 		ast_cli(a->fd, "No such CCSA: '%s'\n", a->argv[3]);
 	}
 
@@ -3011,6 +3415,7 @@ static int ccsa_reload(int reload)
 	char *cat = NULL;
 	struct ccsa *c;
 	struct route *f;
+	struct ao2_iterator i;
 	struct ast_variable *var;
 	struct ast_config *cfg;
 	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
@@ -3025,9 +3430,6 @@ static int ccsa_reload(int reload)
 		return 0;
 	}
 
-	AST_RWLIST_WRLOCK(&ccsas);
-	AST_RWLIST_WRLOCK(&routes);
-
 	/* Reset Global Var Values (currently none) */
 
 	/* General section */
@@ -3092,7 +3494,7 @@ static int ccsa_reload(int reload)
 				continue;
 			}
 
-			f = find_route(cat, 0);
+			f = find_route(cat);
 
 			if (!f) {
 				f = alloc_route(cat);
@@ -3102,9 +3504,7 @@ static int ccsa_reload(int reload)
 				ast_log(LOG_WARNING, "Failed to create route profile for '%s'\n", cat);
 				continue;
 			}
-			if (!new) {
-				ast_mutex_lock(&f->lock);
-			}
+			ao2_lock(f);
 			/* Re-initialize the defaults (none currently) */
 
 			f->factype = factype;
@@ -3134,6 +3534,9 @@ static int ccsa_reload(int reload)
 				} else if (!strcasecmp(var->name, "limit") && !ast_strlen_zero(var->value)) {
 					f->limit = atoi(var->value);
 				} else if (!strcasecmp(var->name, "devstate")) {
+					if (f->devstate) {
+						ast_free(f->devstate);
+					}
 					f->devstate = ast_strdup(var->value);
 				} else {
 					ast_log(LOG_WARNING, "Unknown keyword in profile '%s': %s at line %d of %s\n", var->name, var->name, var->lineno, CONFIG_FILE);
@@ -3141,15 +3544,30 @@ static int ccsa_reload(int reload)
 				var = var->next;
 			} /* End while(var) loop */
 
-			if (!new) {
-				ast_mutex_unlock(&f->lock);
-			} else {
-				AST_RWLIST_INSERT_HEAD(&routes, f, entry);
+			/* Compile time restrictions now, rather than for every call */
+			if (f->has_timing) {
+				ast_destroy_timing(&f->timing);
+				f->has_timing = 0;
+			}
+			if (!ast_strlen_zero(f->time)) {
+				memset(&f->timing, 0, sizeof(f->timing));
+				if (ast_build_timing(&f->timing, f->time)) {
+					f->has_timing = 1;
+				} else {
+					ast_log(LOG_WARNING, "Invalid Time Spec for route %s: %s\n", f->name, f->time);
+					ast_destroy_timing(&f->timing);
+				}
 			}
+
+			ao2_unlock(f);
+			if (new) {
+				ao2_link(route_profiles, f);
+			}
+			ao2_ref(f, -1);
 		} else if (!strcasecmp(type, "ccsa")) {
 			char routes[PATH_MAX] = "";
 			char *facptr = routes;
-			c = find_ccsa(cat, 0);
+			c = find_ccsa(cat);
 			if (!c) {
 				c = alloc_ccsa(cat);
 				new = 1;
@@ -3158,9 +3576,7 @@ static int ccsa_reload(int reload)
 				ast_log(LOG_WARNING, "Failed to create CCSA profile for '%s'\n", cat);
 				continue;
 			}
-			if (!new) {
-				ast_mutex_lock(&c->lock);
-			}
+			ao2_lock(c);
 			/* Re-initialize the defaults */
 			c->mer_tone = 1;
 			c->auth_code_len = 6;
@@ -3211,57 +3627,77 @@ static int ccsa_reload(int reload)
 
 			ast_copy_string(c->routes, routes, sizeof(c->routes));
 
-			if (!new) {
-				ast_mutex_unlock(&c->lock);
-			} else {
-				AST_RWLIST_INSERT_HEAD(&ccsas, c, entry);
+			ao2_unlock(c);
+			if (new) {
+				ao2_link(ccsa_profiles, c);
 			}
+			ao2_ref(c, -1);
 		} else {
 			ast_log(LOG_WARNING, "Unknown type: '%s'\n", type);
 		}
 	}
 
 	ast_config_destroy(cfg);
-	AST_RWLIST_UNLOCK(&routes);
-	AST_RWLIST_UNLOCK(&ccsas);
+
+	/* Now that all routes exist, resolve each CCSA's routes once, rather than for every call */
+	i = ao2_iterator_init(ccsa_profiles, 0);
+	while ((c = ao2_iterator_next(&i))) {
+		struct route_plan *plan = NULL;
+		ao2_lock(c);
+		if (!ast_strlen_zero(c->routes) && !(plan = route_plan_build(c->routes))) {
+			ast_log(LOG_WARNING, "Failed to build route plan for CCSA %s\n", c->name);
+		}
+		ao2_cleanup(c->plan);
+		c->plan = plan;
+		ao2_unlock(c);
+		ao2_ref(c, -1);
+	}
+	ao2_iterator_destroy(&i);
 
 	return 0;
 }
 
 static int unload_module(void)
 {
-	struct ccsa *c;
-	struct route *f;
 	struct ccsa_call *call;
 
-	/* Signal any CBQ threads to abort now.
+	/* Stop the CBQ engine, then cancel any CBQ calls still queued.
 	 * We don't care about OHQ calls or active calls, because this module
 	 * can't be unloaded if there are calls in it anyways. */
+	if (engine_thread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&engine_lock);
+		engine_unloading = 1;
+		ast_cond_signal(&engine_cond);
+		ast_mutex_unlock(&engine_lock);
+		pthread_join(engine_thread, NULL);
+		engine_thread = AST_PTHREADT_NULL;
+	}
 	queue_cancel_cbq(-1, NULL); /* Cancel all of them. */
 
 	ast_unregister_application(app);
 	ast_cli_unregister_multiple(ccsa_cli, ARRAY_LEN(ccsa_cli));
 
-	AST_RWLIST_WRLOCK(&ccsas);
-	while ((c = AST_RWLIST_REMOVE_HEAD(&ccsas, entry))) {
-		ast_free(c);
-	}
-	AST_RWLIST_UNLOCK(&ccsas);
+	ao2_cleanup(ccsa_profiles);
+	ccsa_profiles = NULL;
+	ao2_cleanup(route_profiles);
+	route_profiles = NULL;
 
-	AST_RWLIST_WRLOCK(&routes);
-	while ((f = AST_RWLIST_REMOVE_HEAD(&routes, entry))) {
-		if (f->devstate) {
-			ast_free(f->devstate);
-		}
-		ast_free(f);
+	AST_RWDLLIST_WRLOCK(&calls);
+	while ((call = AST_DLLIST_REMOVE_HEAD(&calls, entry))) {
+		call_unschedule(call);
+		call_free(call, 0);
 	}
-	AST_RWLIST_UNLOCK(&routes);
+	AST_RWDLLIST_UNLOCK(&calls);
 
-	AST_RWLIST_WRLOCK(&calls);
-	while ((call = AST_RWLIST_REMOVE_HEAD(&calls, entry))) {
-		call_free(call, 0);
+	if (cbq_timers) {
+		cbq_timers = ast_heap_destroy(cbq_timers);
 	}
-	AST_RWLIST_UNLOCK(&calls);
+	ao2_cleanup(facility_queues);
+	facility_queues = NULL;
+	ao2_cleanup(route_calls_index);
+	route_calls_index = NULL;
+	ast_mutex_destroy(&engine_lock);
+	ast_cond_destroy(&engine_cond);
 
 	return 0;
 }
@@ -3270,8 +3706,34 @@ static int load_module(void)
 {
 	int res;
 
+	ast_mutex_init(&engine_lock);
+	ast_cond_init(&engine_cond, NULL);
+	cbq_timers = ast_heap_create(8, cbq_timer_cmp, offsetof(struct ccsa_call, __heap_index));
+	if (!cbq_timers) {
+		goto decline;
+	}
+
+	/* Protected by the calls lock, so they don't need locks of their own */
+	facility_queues = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, CALL_INDEX_BUCKETS, facility_queue_hash_fn, NULL, facility_queue_cmp_fn);
+	route_calls_index = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, CALL_INDEX_BUCKETS, route_calls_hash_fn, NULL, route_calls_cmp_fn);
+	if (!facility_queues || !route_calls_index) {
+		goto decline;
+	}
+
+	route_profiles = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, PROFILE_BUCKETS, route_hash_fn, NULL, route_cmp_fn);
+	ccsa_profiles = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, PROFILE_BUCKETS, ccsa_hash_fn, NULL, ccsa_cmp_fn);
+	if (!route_profiles || !ccsa_profiles) {
+		goto decline;
+	}
+
 	if (ccsa_reload(0)) {
-		return AST_MODULE_LOAD_DECLINE;
+		goto decline;
+	}
+
+	if (ast_pthread_create_background(&engine_thread, NULL, cbq_engine, NULL)) {
+		ast_log(LOG_ERROR, "Failed to create Call Back Queue thread\n");
+		engine_thread = AST_PTHREADT_NULL;
+		goto decline;
 	}
 
 	ast_cli_register_multiple(ccsa_cli, ARRAY_LEN(ccsa_cli));
@@ -3279,6 +3741,22 @@ static int load_module(void)
 	res = ast_register_application_xml(app, ccsa_exec);
 
 	return res;
+
+decline:
+	ao2_cleanup(ccsa_profiles);
+	ccsa_profiles = NULL;
+	ao2_cleanup(route_profiles);
+	route_profiles = NULL;
+	if (cbq_timers) {
+		cbq_timers = ast_heap_destroy(cbq_timers);
+	}
+	ao2_cleanup(facility_queues);
+	facility_queues = NULL;
+	ao2_cleanup(route_calls_index);
+	route_calls_index = NULL;
+	ast_mutex_destroy(&engine_lock);
+	ast_cond_destroy(&engine_cond);
+	return AST_MODULE_LOAD_DECLINE;
 }
 
 static int reload(void)
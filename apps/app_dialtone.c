@@ -37,6 +37,9 @@
 #include "asterisk/app.h"
 #include "asterisk/module.h"
 #include "asterisk/indications.h"
+#include "asterisk/cli.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/reload_sub.h"
 
 /*** DOCUMENTATION
 	<application name="DialTone" language="en_US">
@@ -125,6 +128,13 @@
 			for an additional digit and complete if it does not receive any.</para>
 			<para>This application does not automatically answer the channel and should
 			be preceded by <literal>Progress</literal> or <literal>Answer</literal>.</para>
+			<para>The digit map context (and any contexts it includes) is compiled into
+			an automaton the first time it is used, so that each digit dialed costs a single
+			state transition rather than a dialplan lookup. It is recompiled when next used
+			after any reload. Contexts that use switches are not compiled, and are looked up
+			in the dialplan as each digit is dialed. Includes are always followed, regardless
+			of any time restrictions. Use <literal>dialtone show digitmap</literal> to
+			see the compiled digit map.</para>
 			<example title="Simulated city dial tone">
 			same => n,DialTone(num,my-digit-map,custom/dialtone,custom/dialsounds/sound${RAND(1,6)},32,,,pr)
 			</example>
@@ -189,6 +199,670 @@ static int digit_map_match(struct ast_channel *chan, char *context, char *digits
 	return res;
 }
 
+/*! \brief Symbols that can be dialed, and so can appear in a compiled digit map */
+static const char digitmap_symbols[] = "0123456789*#ABCD";
+
+static int digitmap_symbol(int c)
+{
+	const char *s = c ? strchr(digitmap_symbols, c) : NULL;
+	return s ? s - digitmap_symbols : -1;
+}
+
+#define DIGITMAP_SYMBOLS 16
+#define DIGITMAP_ANY ((1 << DIGITMAP_SYMBOLS) - 1)
+#define DIGITMAP_LOOP (1 << DIGITMAP_SYMBOLS) /* Matches zero or more of anything, and nothing may follow */
+
+/*! \brief Digit maps that would need more states than this are not compiled */
+#define DIGITMAP_MAX_STATES 8192
+
+#define DIGITMAP_UNDIALABLE -2	/* Extension contains something that can't be dialed, so it never matches */
+
+#define DIGITMAP_NO_STATE -1	/* No extension can match, no matter what else is dialed */
+#define DIGITMAP_RUNTIME -2		/* Dialed something not in the digit map, so use dialplan lookups */
+
+struct digitmap_state {
+	int next[DIGITMAP_SYMBOLS];	/* State after each symbol */
+	int match;					/* Extension that matches in this state, -1 if none */
+};
+
+struct digitmap_exten {
+	char *name;
+	char *context;		/* Context containing the extension, which may be included */
+	char *data;			/* Digit map result, before substitution */
+	int value;			/* Digit map result, if no substitution is needed */
+	unsigned int dynamic:1;	/* Result contains variables */
+};
+
+/*! \brief Digit map context, compiled into a DFA */
+struct digitmap {
+	int numextens;
+	int numstates;
+	struct digitmap_exten *extens;
+	struct digitmap_state *states;	/* State 0 is the initial state */
+	size_t size;					/* Approximate memory usage */
+	unsigned int fingerprint;		/* Hash of the dialplan it was compiled from */
+	int64_t usec;					/* Time taken to compile */
+	unsigned int compiled:1;		/* If not, dialplan lookups must be used */
+	char context[0];
+};
+
+/*!
+ * \brief Parse an extension name into a sequence of sets of symbols
+ * \return Number of elements, -1 if too long, DIGITMAP_UNDIALABLE if some element can't be dialed
+ * \note Elements are never 0, since that marks the end of an extension in the NFA
+ */
+static int digitmap_parse_exten(const char *name, unsigned int *elems, int max)
+{
+	int n = 0, sym;
+
+	if (*name != '_') {
+		for (; *name; name++) {
+			if (*name == '-' || *name == ' ') {
+				continue; /* Ignored in extensions, as in the dialplan */
+			}
+			if (n >= max) {
+				return -1;
+			}
+			sym = digitmap_symbol(*name);
+			if (sym < 0) {
+				return DIGITMAP_UNDIALABLE; /* e.g. s, i, t */
+			}
+			elems[n++] = 1 << sym;
+		}
+		return n;
+	}
+
+	for (name++; *name; name++) {
+		unsigned int mask = 0;
+		const char *end;
+
+		switch (*name) {
+		case '-':
+		case ' ':
+			continue;
+		case 'X':
+		case 'x':
+			mask = 0x3FF;
+			break;
+		case 'Z':
+		case 'z':
+			mask = 0x3FE;
+			break;
+		case 'N':
+		case 'n':
+			mask = 0x3FC;
+			break;
+		case '.': /* One or more of anything. Anything after this is ignored. */
+			if (n + 2 > max) {
+				return -1;
+			}
+			elems[n++] = DIGITMAP_ANY;
+			elems[n++] = DIGITMAP_LOOP;
+			return n;
+		case '!': /* Zero or more of anything */
+			if (n >= max) {
+				return -1;
+			}
+			elems[n++] = DIGITMAP_LOOP;
+			return n;
+		case '[':
+			if (!(end = strchr(name, ']'))) {
+				ast_log(LOG_WARNING, "Unterminated range in pattern\n");
+				return -1;
+			}
+			for (name++; name < end; name++) {
+				if (name[1] == '-' && name + 2 < end) {
+					int c;
+					for (c = name[0]; c <= name[2]; c++) {
+						if ((sym = digitmap_symbol(c)) >= 0) {
+							mask |= 1 << sym;
+						}
+					}
+					name += 2;
+				} else if ((sym = digitmap_symbol(*name)) >= 0) {
+					mask |= 1 << sym;
+				}
+			}
+			name = end;
+			break;
+		default:
+			sym = digitmap_symbol(*name);
+			mask = sym < 0 ? 0 : 1 << sym;
+		}
+		if (!mask) {
+			return DIGITMAP_UNDIALABLE; /* Including sets like [a-d] with nothing dialable in them */
+		}
+		if (n >= max) {
+			return -1;
+		}
+		elems[n++] = mask;
+	}
+	return n;
+}
+
+/*! \brief NFA for all the extensions in a digit map, with one position per element, plus one for the end of each extension */
+struct digitmap_nfa {
+	unsigned int *elems;	/* Element at each position, 0 at the end of an extension */
+	int *exten;				/* Extension at each position */
+	int numpos;
+};
+
+static int digitmap_nfa_accepts(struct digitmap_nfa *nfa, int pos)
+{
+	return !nfa->elems[pos] || (nfa->elems[pos] & DIGITMAP_LOOP);
+}
+
+static int digitmap_nfa_next(struct digitmap_nfa *nfa, int pos, int sym)
+{
+	if (nfa->elems[pos] & DIGITMAP_LOOP) {
+		return pos;
+	}
+	return nfa->elems[pos] & (1 << sym) ? pos + 1 : -1;
+}
+
+static int digitmap_int_cmp(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+#define DIGITMAP_BUCKETS 1024
+
+/*!
+ * \brief Convert the NFA into a DFA (subset construction)
+ * \note Since positions are numbered in order of extension precedence, the first
+ * accepting position in a set is the extension that the dialplan would match.
+ * \retval 0 on success, -1 on failure (including too many states)
+ */
+static int digitmap_build_dfa(struct digitmap *map, struct digitmap_nfa *nfa)
+{
+	int **sets = NULL, *setlens = NULL, *chain = NULL;
+	int buckets[DIGITMAP_BUCKETS];
+	int *next, *seen;
+	int i, s, sym, numnext, res = -1;
+
+	next = ast_calloc(nfa->numpos, sizeof(*next));
+	seen = ast_calloc(nfa->numpos, sizeof(*seen));
+	if (!next || !seen) {
+		goto cleanup;
+	}
+	memset(buckets, -1, sizeof(buckets));
+	map->numstates = 0;
+
+	/* Initial state: the start of every extension */
+	numnext = 0;
+	for (i = 0; i < nfa->numpos; i++) {
+		if (!i || !nfa->elems[i - 1]) {
+			next[numnext++] = i;
+		}
+	}
+
+	for (s = -1; s < map->numstates; s++) {
+		for (sym = 0; sym < DIGITMAP_SYMBOLS; sym++) {
+			unsigned int hash = 0;
+			int existing;
+
+			if (s >= 0) {
+				numnext = 0;
+				for (i = 0; i < setlens[s]; i++) {
+					int pos = digitmap_nfa_next(nfa, sets[s][i], sym);
+					if (pos >= 0 && seen[pos] != (s * DIGITMAP_SYMBOLS + sym + 1)) {
+						seen[pos] = s * DIGITMAP_SYMBOLS + sym + 1;
+						next[numnext++] = pos;
+					}
+				}
+				if (!numnext) {
+					map->states[s].next[sym] = DIGITMAP_NO_STATE;
+					continue;
+				}
+				qsort(next, numnext, sizeof(*next), digitmap_int_cmp);
+			}
+
+			for (i = 0; i < numnext; i++) {
+				hash = hash * 31 + next[i];
+			}
+			hash %= DIGITMAP_BUCKETS;
+			for (existing = buckets[hash]; existing >= 0; existing = chain[existing]) {
+				if (setlens[existing] == numnext && !memcmp(sets[existing], next, numnext * sizeof(*next))) {
+					break;
+				}
+			}
+
+			if (existing < 0) {
+				/* New state */
+				if (map->numstates >= DIGITMAP_MAX_STATES) {
+					ast_log(LOG_WARNING, "Digit map for context '%s' needs more than %d states\n", map->context, DIGITMAP_MAX_STATES);
+					goto cleanup;
+				}
+				if (!(map->numstates % 64)) {
+					int newsize = map->numstates + 64;
+					void *tmp;
+					if (!(tmp = ast_realloc(map->states, newsize * sizeof(*map->states)))) {
+						goto cleanup;
+					}
+					map->states = tmp;
+					if (!(tmp = ast_realloc(sets, newsize * sizeof(*sets)))) {
+						goto cleanup;
+					}
+					sets = tmp;
+					if (!(tmp = ast_realloc(setlens, newsize * sizeof(*setlens)))) {
+						goto cleanup;
+					}
+					setlens = tmp;
+					if (!(tmp = ast_realloc(chain, newsize * sizeof(*chain)))) {
+						goto cleanup;
+					}
+					chain = tmp;
+				}
+				existing = map->numstates;
+				if (!(sets[existing] = ast_malloc(numnext * sizeof(*next)))) {
+					goto cleanup;
+				}
+				memcpy(sets[existing], next, numnext * sizeof(*next));
+				setlens[existing] = numnext;
+				chain[existing] = buckets[hash];
+				buckets[hash] = existing;
+				map->states[existing].match = -1;
+				for (i = 0; i < numnext; i++) {
+					if (digitmap_nfa_accepts(nfa, next[i])) {
+						map->states[existing].match = nfa->exten[next[i]];
+						break;
+					}
+				}
+				map->numstates++;
+			}
+
+			if (s < 0) {
+				break; /* That was the initial state */
+			}
+			map->states[s].next[sym] = existing;
+		}
+	}
+	res = 0;
+
+cleanup:
+	for (i = 0; i < map->numstates; i++) {
+		ast_free(sets[i]);
+	}
+	ast_free(sets);
+	ast_free(setlens);
+	ast_free(chain);
+	ast_free(next);
+	ast_free(seen);
+	return res;
+}
+
+static void digitmap_destructor(void *obj)
+{
+	struct digitmap *map = obj;
+	int i;
+
+	for (i = 0; i < map->numextens; i++) {
+		ast_free(map->extens[i].name);
+		ast_free(map->extens[i].context);
+		ast_free(map->extens[i].data);
+	}
+	ast_free(map->extens);
+	ast_free(map->states);
+}
+
+static int digitmap_add_exten(struct digitmap *map, const char *context, const char *name, const char *data)
+{
+	struct digitmap_exten *exten;
+
+	if (!(map->numextens % 32)) {
+		void *tmp = ast_realloc(map->extens, (map->numextens + 32) * sizeof(*map->extens));
+		if (!tmp) {
+			return -1;
+		}
+		map->extens = tmp;
+	}
+
+	exten = &map->extens[map->numextens];
+	memset(exten, 0, sizeof(*exten));
+	exten->name = ast_strdup(name);
+	exten->context = ast_strdup(context);
+	exten->data = ast_strdup(S_OR(data, ""));
+	map->numextens++; /* Even if allocations failed, so they're freed */
+	if (!exten->name || !exten->context || !exten->data) {
+		return -1;
+	}
+	exten->value = atoi(exten->data);
+	exten->dynamic = strchr(exten->data, '$') ? 1 : 0;
+	map->size += sizeof(*exten) + strlen(name) + strlen(context) + strlen(exten->data) + 3;
+	return 0;
+}
+
+/*!
+ * \brief Add the priority 1 extensions in a context and its includes to a digit map, in the order the dialplan searches them
+ * \param map Digit map, or NULL to only compute the fingerprint
+ * \param context
+ * \param searched
+ * \param numsearched
+ * \param[in,out] fingerprint Hash of everything in the dialplan that the digit map depends on
+ * \note Must be called with the contexts locked
+ * \retval 0 on success, -1 if the context can't be compiled
+ */
+static int digitmap_crawl(struct digitmap *map, const char *context, const char *searched[], int *numsearched, unsigned int *fingerprint)
+{
+	struct ast_context *c;
+	struct ast_exten *e = NULL;
+	struct ast_include *inc = NULL;
+	const char *includes[AST_PBX_MAX_STACK];
+	int i, numincludes = 0, res = 0;
+
+	/* Like the dialplan, search each context only once */
+	for (i = 0; i < *numsearched; i++) {
+		if (!strcmp(searched[i], context)) {
+			return 0;
+		}
+	}
+	if (*numsearched >= AST_PBX_MAX_STACK) {
+		ast_log(LOG_WARNING, "Too many includes in context '%s'\n", context);
+		return -1;
+	}
+
+	c = ast_context_find(context);
+	if (!c) {
+		return 0; /* Includes of contexts that don't exist are ignored */
+	}
+	searched[(*numsearched)++] = ast_get_context_name(c);
+	*fingerprint = ast_str_hash_add(context, *fingerprint);
+
+	ast_rdlock_context(c);
+	if (ast_walk_context_switches(c, NULL)) {
+		ast_debug(1, "Context '%s' has switches, so it can't be compiled\n", context);
+		ast_unlock_context(c);
+		return -1;
+	}
+	while ((e = ast_walk_context_extensions(c, e))) {
+		struct ast_exten *p = NULL;
+
+		if (ast_get_extension_matchcid(e)) {
+			continue; /* Digit map lookups have no caller ID, so these never match */
+		}
+		while ((p = ast_walk_extension_priorities(e, p))) {
+			if (ast_get_extension_priority(p) == 1) {
+				break;
+			}
+		}
+		if (!p) {
+			continue;
+		}
+		*fingerprint = ast_str_hash_add(ast_get_extension_name(e), *fingerprint);
+		*fingerprint = ast_str_hash_add(S_OR(ast_get_extension_app_data(p), ""), *fingerprint);
+		if (map && digitmap_add_exten(map, ast_get_context_name(c), ast_get_extension_name(e), ast_get_extension_app_data(p))) {
+			res = -1;
+			break;
+		}
+	}
+	while (!res && (inc = (struct ast_include*) ast_walk_context_includes(c, inc)) && numincludes < AST_PBX_MAX_STACK) {
+		const char *name = ast_get_include_name(inc);
+		if (strchr(name, '|')) {
+			ast_debug(1, "Context '%s' has an include with a prefix, so it can't be compiled\n", context);
+			res = -1;
+			break;
+		}
+		if (strchr(name, ',')) {
+			/* Whether a timed include applies depends on when we're asked */
+			ast_debug(1, "Context '%s' has a timed include, so it can't be compiled\n", context);
+			res = -1;
+			break;
+		}
+		includes[numincludes++] = name;
+		*fingerprint = ast_str_hash_add(name, *fingerprint);
+	}
+	ast_unlock_context(c);
+
+	for (i = 0; !res && i < numincludes; i++) {
+		res = digitmap_crawl(map, includes[i], searched, numsearched, fingerprint);
+	}
+	return res;
+}
+
+/*! \brief Compile the digit map for a context */
+static struct digitmap *digitmap_compile(const char *context)
+{
+	struct digitmap *map;
+	struct digitmap_nfa nfa = { 0, };
+	const char *searched[AST_PBX_MAX_STACK];
+	unsigned int elems[AST_MAX_EXTENSION];
+	struct timeval start = ast_tvnow();
+	int i, j, numsearched = 0, res;
+
+	map = ao2_alloc(sizeof(*map) + strlen(context) + 1, digitmap_destructor);
+	if (!map) {
+		return NULL;
+	}
+	strcpy(map->context, context); /* Safe */
+
+	ast_rdlock_contexts();
+	res = digitmap_crawl(map, context, searched, &numsearched, &map->fingerprint);
+	ast_unlock_contexts();
+	if (res) {
+		goto done;
+	}
+
+	/* Build the NFA, with the extensions in order of precedence */
+	for (i = 0; i < map->numextens; i++) {
+		int n = digitmap_parse_exten(map->extens[i].name, elems, ARRAY_LEN(elems));
+		void *tmp;
+
+		if (n == DIGITMAP_UNDIALABLE) {
+			continue; /* Can't match anything, so leave it out, rather than let it match a prefix */
+		} else if (n < 0) {
+			ast_log(LOG_WARNING, "Can't parse extension '%s' in context '%s'\n", map->extens[i].name, map->extens[i].context);
+			res = -1;
+			goto done;
+		}
+		if (!(tmp = ast_realloc(nfa.elems, (nfa.numpos + n + 1) * sizeof(*nfa.elems)))) {
+			res = -1;
+			goto done;
+		}
+		nfa.elems = tmp;
+		if (!(tmp = ast_realloc(nfa.exten, (nfa.numpos + n + 1) * sizeof(*nfa.exten)))) {
+			res = -1;
+			goto done;
+		}
+		nfa.exten = tmp;
+		for (j = 0; j < n; j++) {
+			nfa.elems[nfa.numpos] = elems[j];
+			nfa.exten[nfa.numpos++] = i;
+		}
+		nfa.elems[nfa.numpos] = 0;
+		nfa.exten[nfa.numpos++] = i;
+	}
+
+	res = digitmap_build_dfa(map, &nfa);
+
+done:
+	ast_free(nfa.elems);
+	ast_free(nfa.exten);
+	map->usec = ast_tvdiff_us(ast_tvnow(), start);
+	if (res) {
+		ast_log(LOG_NOTICE, "Could not compile digit map for context '%s', dialplan lookups will be used\n", context);
+		ast_free(map->states);
+		map->states = NULL;
+		map->numstates = 0;
+	} else {
+		map->compiled = 1;
+		map->size += sizeof(*map) + map->numstates * sizeof(*map->states);
+		ast_debug(1, "Compiled digit map for context '%s' (%d extensions, %d states) in %" PRId64 " us\n", context, map->numextens, map->numstates, map->usec);
+	}
+	return map;
+}
+
+#define DIGITMAP_CACHE_BUCKETS 31
+
+static struct ao2_container *digitmaps;
+static int digitmap_generation = 0;
+static struct stasis_subscription *reload_sub;
+
+static int digitmap_hash_fn(const void *obj, const int flags)
+{
+	const struct digitmap *map;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		map = obj;
+		key = map->context;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int digitmap_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct digitmap *map = obj, *right = arg;
+	const char *key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = right->context;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(map->context, key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+/*!
+ * \brief Whether the dialplan a digit map was compiled from is unchanged
+ * \note Reloads flush the cache, but extensions can also be added or removed at runtime,
+ * e.g. with dialplan add extension, and nothing tells us about that.
+ * Checking is much cheaper than compiling, since it doesn't allocate anything.
+ */
+static int digitmap_current(struct digitmap *map)
+{
+	const char *searched[AST_PBX_MAX_STACK];
+	unsigned int fingerprint = 0;
+	int numsearched = 0;
+
+	ast_rdlock_contexts();
+	digitmap_crawl(NULL, map->context, searched, &numsearched, &fingerprint);
+	ast_unlock_contexts();
+	return fingerprint == map->fingerprint;
+}
+
+/*! \brief Get the compiled digit map for a context, compiling it if needed */
+static struct digitmap *digitmap_get(const char *context)
+{
+	struct digitmap *map, *existing;
+	int generation;
+
+	map = ao2_find(digitmaps, context, OBJ_SEARCH_KEY);
+	if (map) {
+		if (digitmap_current(map)) {
+			return map;
+		}
+		ast_debug(2, "Dialplan for context '%s' changed, recompiling digit map\n", context);
+		ao2_unlink(digitmaps, map);
+		ao2_ref(map, -1);
+	}
+
+	generation = ast_atomic_fetchadd_int(&digitmap_generation, 0);
+	map = digitmap_compile(context);
+	if (!map) {
+		return NULL;
+	}
+
+	ao2_wrlock(digitmaps);
+	if (generation != digitmap_generation) {
+		/* Dialplan reloaded while compiling. Use it for now, but don't cache it. */
+	} else if ((existing = ao2_find(digitmaps, context, OBJ_SEARCH_KEY | OBJ_NOLOCK))) {
+		ao2_ref(map, -1);
+		map = existing;
+	} else {
+		ao2_link_flags(digitmaps, map, OBJ_NOLOCK);
+	}
+	ao2_unlock(digitmaps);
+	return map;
+}
+
+/*! \brief Discard all compiled digit maps, so they're recompiled when next used */
+static void digitmap_flush(void)
+{
+	ao2_wrlock(digitmaps);
+	ast_atomic_fetchadd_int(&digitmap_generation, 1);
+	ao2_callback(digitmaps, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE | OBJ_NOLOCK, NULL, NULL);
+	ao2_unlock(digitmaps);
+}
+
+static void reload_cb(void *data, struct stasis_subscription *sub, struct stasis_message *msg)
+{
+	if (!reload_sub_is_reload(msg)) {
+		return;
+	}
+
+	/* Any module could have changed the dialplan (pbx_config, pbx_ael, pbx_lua...) */
+	ast_debug(2, "Reload occurred, discarding compiled digit maps\n");
+	digitmap_flush();
+}
+
+/*! \brief Get the digit map result in a state */
+static int digitmap_value(struct ast_channel *chan, struct digitmap *map, int state, char *digits, int parse)
+{
+	struct digitmap_exten *exten;
+	int res;
+
+	if (state < 0 || map->states[state].match < 0) {
+		ast_debug(1, "Digit map result: no extension matches %s in context %s\n", digits, map->context);
+		return 0;
+	}
+
+	exten = &map->extens[map->states[state].match];
+	if (parse && exten->dynamic) {
+		char buf[BUFFER_LEN];
+
+		pbx_substitute_variables_helper_full_location(chan, ast_channel_varshead(chan), exten->data, buf, BUFFER_LEN, NULL, map->context, digits, 1);
+		res = atoi(buf);
+		ast_debug(1, "Substituted %s -> %s -> %d\n", exten->data, buf, res);
+	} else {
+		res = exten->value;
+	}
+	ast_debug(1, "Digit map result: %d (%s)\n", res, exten->name);
+	return res;
+}
+
+/*!
+ * \brief Check digits against the digit map, advancing the automaton by any digits not yet seen
+ * \param chan
+ * \param map Compiled digit map, or NULL to use dialplan lookups
+ * \param[in,out] state Current state
+ * \param[in,out] walked Number of digits already processed
+ * \param context
+ * \param digits All digits dialed so far
+ * \param parse Whether to substitute variables in the result
+ */
+static int dialtone_match(struct ast_channel *chan, struct digitmap *map, int *state, int *walked, char *context, char *digits, int parse)
+{
+	if (!map || !map->compiled || *state == DIGITMAP_RUNTIME) {
+		return digit_map_match(chan, context, digits, parse);
+	}
+
+	if ((int) strlen(digits) < *walked) {
+		*state = *walked = 0; /* Digits were removed, so start over */
+	}
+	for (; digits[*walked]; (*walked)++) {
+		int sym = digitmap_symbol(digits[*walked]);
+		if (sym < 0) {
+			*state = DIGITMAP_RUNTIME;
+			return digit_map_match(chan, context, digits, parse);
+		}
+		if (*state >= 0) {
+			*state = map->states[*state].next[sym];
+		}
+	}
+	return digitmap_value(chan, map, *state, digits, parse);
+}
+
 static int dialtone_exec(struct ast_channel *chan, const char *data)
 {
 	int res = 0;
@@ -204,6 +878,8 @@ static int dialtone_exec(struct ast_channel *chan, const char *data)
 	char *terminator = "";
 	int parse = 0;
 	int echodtmf = 0, echomf = 0;
+	int state = 0, walked = 0;
+	RAII_VAR(struct digitmap *, map, NULL, ao2_cleanup);
 
 	AST_DECLARE_APP_ARGS(arglist,
 		AST_APP_ARG(variable);
@@ -312,8 +988,11 @@ static int dialtone_exec(struct ast_channel *chan, const char *data)
 	if (!to && ast_strlen_zero(subsequentaudio)) {
 		ast_log(LOG_WARNING, "No timeout provided, but no subsequent filename(s) specified. This is unlikely to be the desired behavior!\n");
 	}
+	if (!ast_strlen_zero(arglist.context)) {
+		map = digitmap_get(arglist.context);
+	}
 	ast_stopstream(chan);
-	if (x && digit_map_match(chan, arglist.context, tmp, parse) > 0) { /* leading digits were passed in, so check the digit map before doing anything */
+	if (x && dialtone_match(chan, map, &state, &walked, arglist.context, tmp, parse) > 0) { /* leading digits were passed in, so check the digit map before doing anything */
 		done = 1;
 	}
 	if (!done) {
@@ -385,7 +1064,7 @@ static int dialtone_exec(struct ast_channel *chan, const char *data)
 					return -1;
 				}
 			}
-		} while (!done && ((timeoutoverride = digit_map_match(chan, arglist.context, tmp, parse)) <= 0) && x < maxdigits);
+		} while (!done && ((timeoutoverride = dialtone_match(chan, map, &state, &walked, arglist.context, tmp, parse)) <= 0) && x < maxdigits);
 	}
 
 	if (!ast_strlen_zero(tmp)) {
@@ -403,14 +1082,125 @@ static int dialtone_exec(struct ast_channel *chan, const char *data)
 	return res < 0 ? -1 : 0;
 }
 
+static void digitmap_format_symbols(char *buf, size_t len, int first, int last)
+{
+	if (first == last) {
+		snprintf(buf, len, "%c", digitmap_symbols[first]);
+	} else {
+		snprintf(buf, len, "%c-%c", digitmap_symbols[first], digitmap_symbols[last]);
+	}
+}
+
+static char *handle_show_digitmap(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct digitmap *map;
+	struct ast_str *buf;
+	int i, sym;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "dialtone show digitmap";
+		e->usage =
+			"Usage: dialtone show digitmap <context>\n"
+			"       Show the compiled digit map for a context, compiling it if needed.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+	if (!ast_context_find(a->argv[3])) {
+		ast_cli(a->fd, "No such context: %s\n", a->argv[3]);
+		return CLI_FAILURE;
+	}
+
+	map = digitmap_get(a->argv[3]);
+	if (!map) {
+		return CLI_FAILURE;
+	}
+	if (!map->compiled) {
+		ast_cli(a->fd, "Digit map for context '%s' could not be compiled, dialplan lookups are used\n", map->context);
+		ao2_ref(map, -1);
+		return CLI_SUCCESS;
+	}
+	if (!(buf = ast_str_create(256))) {
+		ao2_ref(map, -1);
+		return CLI_FAILURE;
+	}
+
+	ast_cli(a->fd, "%-6s %-24s %s\n", "State", "Match", "Transitions");
+	for (i = 0; i < map->numstates; i++) {
+		struct digitmap_state *state = &map->states[i];
+		int first = 0;
+
+		ast_str_reset(buf);
+		/* Group consecutive symbols that go to the same state */
+		for (sym = 1; sym <= DIGITMAP_SYMBOLS; sym++) {
+			if (sym < DIGITMAP_SYMBOLS && state->next[sym] == state->next[first]) {
+				continue;
+			}
+			if (state->next[first] != DIGITMAP_NO_STATE) {
+				char symbols[4];
+				digitmap_format_symbols(symbols, sizeof(symbols), first, sym - 1);
+				ast_str_append(&buf, 0, "%s%s->%d", ast_str_strlen(buf) ? ", " : "", symbols, state->next[first]);
+			}
+			first = sym;
+		}
+		ast_cli(a->fd, "%-6d %-24s %s\n", i, state->match >= 0 ? map->extens[state->match].name : "-", ast_str_buffer(buf));
+	}
+	ast_cli(a->fd, "Context '%s': %d extension%s, %d state%s, %lu bytes, compiled in %" PRId64 " us\n",
+		map->context, map->numextens, ESS(map->numextens), map->numstates, ESS(map->numstates), (unsigned long) map->size, map->usec);
+
+	ast_free(buf);
+	ao2_ref(map, -1);
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry dialtone_cli[] = {
+	AST_CLI_DEFINE(handle_show_digitmap, "Show a compiled digit map"),
+};
+
 static int unload_module(void)
 {
-	return ast_unregister_application(app);
+	int res;
+
+	res = ast_unregister_application(app);
+	ast_cli_unregister_multiple(dialtone_cli, ARRAY_LEN(dialtone_cli));
+	reload_sub = stasis_unsubscribe_and_join(reload_sub);
+	ao2_cleanup(digitmaps);
+	digitmaps = NULL;
+	return res;
 }
 
 static int load_module(void)
 {
+	digitmaps = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, DIGITMAP_CACHE_BUCKETS,
+		digitmap_hash_fn, NULL, digitmap_cmp_fn);
+	if (!digitmaps) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	reload_sub = reload_sub_subscribe(reload_cb, NULL);
+	if (!reload_sub) {
+		ao2_ref(digitmaps, -1);
+		digitmaps = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	ast_cli_register_multiple(dialtone_cli, ARRAY_LEN(dialtone_cli));
 	return ast_register_application_xml(app, dialtone_exec);
 }
 
-AST_MODULE_INFO_STANDARD_EXTENDED(ASTERISK_GPL_KEY, "Advanced dial tone application");
+static int reload_module(void)
+{
+	digitmap_flush();
+	return 0;
+}
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Advanced dial tone application",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.reload = reload_module,
+);
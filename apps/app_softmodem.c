@@ -36,6 +36,7 @@
 #include <errno.h>
 #include <tiffio.h>
 #include <time.h>
+#include <sys/resource.h>
 
 #ifdef HAVE_OPENSSL
 #include <openssl/ssl.h>
@@ -72,6 +73,7 @@
 #include "asterisk/utils.h"
 #include "asterisk/dsp.h"
 #include "asterisk/manager.h"
+#include "asterisk/cli.h"
 
 /*** DOCUMENTATION
 	<application name="Softmodem" language="en_US">
@@ -255,10 +257,81 @@ typedef struct {
 	unsigned int track_session:1;
 } modem_session;
 
-#define MODEM_BITBUFFER_SIZE 16
+#define MODEM_BITBUFFER_SIZE 32 /* Bits in bitbuffer. A frame is at most 12 bits. */
+#define MODEM_RING_SIZE 4096 /* Must be a power of 2 */
+
+/*! \brief Bounded byte FIFO between the socket and the modem */
+struct modem_ring {
+	unsigned char buf[MODEM_RING_SIZE];
+	unsigned int head;	/* Total bytes ever written */
+	unsigned int tail;	/* Total bytes ever read */
+};
+
+#define ring_used(r) ((r)->head - (r)->tail)
+#define ring_space(r) (MODEM_RING_SIZE - ring_used(r))
+
+/*! \brief Contiguous data at the front of the ring, to be followed by ring_consume */
+static unsigned int ring_data(struct modem_ring *r, unsigned char **ptr)
+{
+	unsigned int offset = r->tail & (MODEM_RING_SIZE - 1);
+	*ptr = r->buf + offset;
+	return MIN(ring_used(r), MODEM_RING_SIZE - offset);
+}
+
+static void ring_consume(struct modem_ring *r, unsigned int len)
+{
+	r->tail += len;
+}
+
+/*! \brief Contiguous free space at the back of the ring, to be followed by ring_commit */
+static unsigned int ring_free(struct modem_ring *r, unsigned char **ptr)
+{
+	unsigned int offset = r->head & (MODEM_RING_SIZE - 1);
+	*ptr = r->buf + offset;
+	return MIN(ring_space(r), MODEM_RING_SIZE - offset);
+}
+
+static void ring_commit(struct modem_ring *r, unsigned int len)
+{
+	r->head += len;
+}
+
+static unsigned int ring_put(struct modem_ring *r, const unsigned char *data, unsigned int len)
+{
+	unsigned int written = 0;
+
+	while (written < len) {
+		unsigned char *ptr;
+		unsigned int avail = ring_free(r, &ptr);
+		if (!avail) {
+			break;
+		}
+		avail = MIN(avail, len - written);
+		memcpy(ptr, data + written, avail);
+		ring_commit(r, avail);
+		written += avail;
+	}
+	return written;
+}
+
+static int ring_getc(struct modem_ring *r)
+{
+	unsigned char c;
+
+	if (!ring_used(r)) {
+		return -1;
+	}
+	c = r->buf[r->tail & (MODEM_RING_SIZE - 1)];
+	r->tail++;
+	return c;
+}
+
 typedef struct {
 	int answertone;		/* terminal is active (=sends data) */
 	int nulsent;		/* we sent a NULL as very first character (at least the DBT03 expects this) */
+	unsigned int eof:1;	/* server closed the connection */
+	struct modem_ring toline;	/* Read from the socket, waiting to be sent onto the line */
+	struct modem_ring tosock;	/* Received from the line, waiting to be written to the socket */
 } connection_state;
 
 typedef struct {
@@ -266,28 +339,151 @@ typedef struct {
 #ifdef HAVE_OPENSSL
 	SSL *ssl;
 #endif
-	int bitbuffer[MODEM_BITBUFFER_SIZE];
-	int writepos;
-	int readpos;
-	int fill;
+	uint32_t bitbuffer;	/* Bit FIFO, oldest bit in the LSB */
+	int fill;			/* Number of bits in bitbuffer */
 	connection_state *state;
 	modem_session *session;
 } modem_data;
 
+/*! \brief Write as much received data as the socket will take right now */
+static void modem_flush(modem_data *m)
+{
+	struct modem_ring *r = &m->state->tosock;
+
+	while (ring_used(r)) {
+		unsigned char *ptr;
+		int res, len = ring_data(r, &ptr);
+
+		if (m->sock < 0) {
+			return; /* Not connected to anything (loopback) */
+		}
+#ifdef HAVE_OPENSSL
+		if (m->ssl) {
+			res = SSL_write(m->ssl, ptr, len);
+			if (res <= 0) {
+				int err = SSL_get_error(m->ssl, res);
+				if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) {
+					ast_debug(1, "SSL_write failed: %s\n", ERR_error_string(ERR_get_error(), NULL));
+					ring_consume(r, ring_used(r));
+				}
+				return; /* Try again on the next frame */
+			}
+		} else
+#endif
+		{
+			res = send(m->sock, ptr, len, 0);
+			if (res < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+					ast_debug(1, "send failed: %s\n", strerror(errno));
+					ring_consume(r, ring_used(r));
+				}
+				return; /* Try again on the next frame */
+			}
+		}
+		ast_debug(7, "send: %d, %d/%d byte%s\n", m->sock, res, len, ESS(len));
+		ring_consume(r, res);
+		if (res < len) {
+			return; /* Socket buffer is full */
+		}
+	}
+}
+
+/*! \brief Read as much data from the socket as there is room for */
+static void modem_fill(modem_data *m)
+{
+	struct modem_ring *r = &m->state->toline;
+
+	while (!m->state->eof) {
+		unsigned char *ptr;
+		int res, len = ring_free(r, &ptr);
+
+		if (!len) {
+			return; /* Full. Leave the rest in the socket, until the modem makes room. */
+		}
+#ifdef HAVE_OPENSSL
+		if (m->ssl) {
+			res = SSL_read(m->ssl, ptr, len);
+			if (res <= 0) {
+				int err = SSL_get_error(m->ssl, res);
+				if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+					return;
+				}
+				res = 0;
+			}
+		} else
+#endif
+		{
+			res = recv(m->sock, ptr, len, 0);
+			if (res < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+					return;
+				}
+				ast_debug(1, "recv failed: %s\n", strerror(errno));
+				res = 0;
+			}
+		}
+		if (!res) {
+			ast_debug(1, "Socket closed, %u byte%s left to send\n", ring_used(r), ESS(ring_used(r)));
+			m->state->eof = 1;
+			return;
+		}
+		ring_commit(r, res);
+	}
+}
+
+/*! \brief Whether the TLS layer already has data that won't make the socket readable again */
+static int modem_pending(modem_data *m)
+{
+#ifdef HAVE_OPENSSL
+	return m->ssl && !m->state->eof && ring_space(&m->state->toline) && SSL_pending(m->ssl);
+#else
+	return 0;
+#endif
+}
+
+/*! \brief Queue received data for the socket. Data is written out once per frame, by modem_flush */
+static void modem_queue(modem_data *rx, const unsigned char *data, unsigned int len)
+{
+	unsigned int written = ring_put(&rx->state->tosock, data, len);
+
+	if (written < len) {
+		modem_flush(rx);
+		written += ring_put(&rx->state->tosock, data + written, len - written);
+		if (written < len) {
+			ast_debug(1, "Socket not accepting data, dropping %u byte%s\n", len - written, ESS(len - written));
+		}
+	}
+}
+
+/*! \brief Reverse the order of the lowest bits in a value */
+static unsigned int reverse_bits(unsigned int value, int bits)
+{
+	unsigned int res = 0;
+
+	while (bits--) {
+		res = (res << 1) | (value & 1);
+		value >>= 1;
+	}
+	return res;
+}
+
 /*! \brief This is called by spandsp whenever it filters a new bit from the line */
 static void modem_put_bit(void *user_data, int bit)
 {
-	int stop, stop2, i;
 	modem_data *rx = (modem_data*) user_data;
 
 	int databits = rx->session->databits;
 	int stopbits = rx->session->stopbits;
 	int paritybits = 0;
+	int framelen;
 
 	if (rx->session->paritytype) {
 		paritybits = 1;
 	}
 
+	/* full byte = 1 startbit + databits + paritybits + stopbits */
+	framelen = 1 + databits + paritybits + stopbits;
+
 	/* modem recognized us and starts responding through sending its pilot signal */
 	if (rx->state->answertone <= 0) {
 		if (bit == SIG_STATUS_CARRIER_UP) {
@@ -300,63 +496,33 @@ static void modem_put_bit(void *user_data, int bit)
 		ast_debug(1, "Bit is %d? Ignoring!\n", bit);
 	} else {
 		/* insert bit into our bitbuffer */
-		rx->bitbuffer[rx->writepos] = bit;
-		rx->writepos++;
-		if (rx->writepos >= MODEM_BITBUFFER_SIZE) {
-			rx->writepos = 0;
-		}
-		if (rx->fill < MODEM_BITBUFFER_SIZE) {
-			rx->fill++;
-		} else {
+		if (rx->fill == MODEM_BITBUFFER_SIZE) {
 			/* our bitbuffer is full, this probably won't happen */
 			ast_debug(3, "full buffer!\n");
-			rx->readpos++;
-			if (rx->readpos >= MODEM_BITBUFFER_SIZE) {
-				rx->readpos = 0;
-			}
+			rx->bitbuffer >>= 1;
+			rx->fill--;
 		}
-
-		/* full byte = 1 startbit + databits + paritybits + stopbits */
-		while (rx->fill >= (1 + databits + paritybits + stopbits)) {
-			if (rx->bitbuffer[rx->readpos] == 0) { /* check for startbit */
-				stop = (rx->readpos + 1 + paritybits + databits) % MODEM_BITBUFFER_SIZE;
-				stop2 = (rx->readpos + 2 + paritybits + databits) % MODEM_BITBUFFER_SIZE;
-				if ((rx->bitbuffer[stop] == 1) && (stopbits == 1 || (stopbits == 2 && rx->bitbuffer[stop2] == 1))) { /* check for stopbit -> valid framing */
-					char byte = 0;
-					for (i = 0; i < databits; i++) {	/* generate byte */
-						if (rx->session->lsb) { /* LSB first */
-							if (rx->bitbuffer[(rx->readpos + 1 + i) % MODEM_BITBUFFER_SIZE]) {
-								byte |= (1 << i);
-							}
-						} else { /* MSB first */
-							if (rx->bitbuffer[(rx->readpos + databits - i) % MODEM_BITBUFFER_SIZE]) {
-								byte |= (1 << i);
-							}
-						}
-					}
-
-					if (!paritybits || (paritybits && (rx->bitbuffer[(rx->readpos + databits + 1) % MODEM_BITBUFFER_SIZE] == ((rx->session->paritytype == 2) ^ __builtin_parity(byte))))) {
-						ast_debug(7, "send: %d, %c\n", rx->sock, byte);
-#ifdef HAVE_OPENSSL
-						if (rx->ssl) {
-							SSL_write(rx->ssl, &byte, 1);
-						} else
-#endif
-						{
-							send(rx->sock, &byte, 1, 0);
-						}
-					} /* else invalid parity, ignore byte */
-					rx->readpos= (rx->readpos + 10) % MODEM_BITBUFFER_SIZE; /* XXX Why does this increment by 10? */
-					rx->fill -= 10;
-				} else { /* no valid framing (no stopbit), remove first bit and maybe try again */
-					rx->fill--;
-					rx->readpos++;
-					rx->readpos %= MODEM_BITBUFFER_SIZE;
+		rx->bitbuffer |= (uint32_t) bit << rx->fill;
+		rx->fill++;
+
+		while (rx->fill >= framelen) {
+			uint32_t stopmask = ((1U << stopbits) - 1) << (1 + databits + paritybits);
+			/* check for startbit and stopbit(s) -> valid framing */
+			if (!(rx->bitbuffer & 1) && (rx->bitbuffer & stopmask) == stopmask) {
+				unsigned int byte = (rx->bitbuffer >> 1) & ((1U << databits) - 1); /* generate byte */
+				if (!rx->session->lsb) { /* MSB first */
+					byte = reverse_bits(byte, databits);
 				}
-			} else { /* no valid framing either (no startbit) */
+				if (!paritybits || ((rx->bitbuffer >> (databits + 1)) & 1) == ((rx->session->paritytype == 2) ^ __builtin_parity(byte))) {
+					unsigned char c = byte;
+					ast_debug(7, "queue: %d, %c\n", rx->sock, c);
+					modem_queue(rx, &c, 1);
+				} /* else invalid parity, ignore byte */
+				rx->bitbuffer >>= framelen;
+				rx->fill -= framelen;
+			} else { /* no valid framing, remove first bit and maybe try again */
+				rx->bitbuffer >>= 1;
 				rx->fill--;
-				rx->readpos++;
-				rx->readpos %= MODEM_BITBUFFER_SIZE;
 			}
 		}
 	}
@@ -365,21 +531,10 @@ static void modem_put_bit(void *user_data, int bit)
 static void tdd_put_msg(void *user_data, const unsigned char *msg, int len)
 {
 	modem_data *rx = (modem_data*) user_data;
-	/* In practice this function is called for every single byte, so len should be 1 */
-	if (len != 1) {
-		ast_log(LOG_WARNING, "Expected len 1 but have %d?\n", len);
-		return;
-	}
-	ast_debug(1, "put msg: %d (%c)\n", *msg, isprint(*msg) ? *msg : ' ');
-	/* We don't need modem_put_bit here, the other TDD functions already encapsulate this functionality, we can write to the socket directly */
-#ifdef HAVE_OPENSSL
-	if (rx->ssl) {
-		SSL_write(rx->ssl, msg, len);
-	} else
-#endif
-	{
-		send(rx->sock, msg, len, 0);
-	}
+
+	/* We don't need modem_put_bit here, the other TDD functions already encapsulate this functionality, we can queue for the socket directly */
+	ast_debug(1, "put msg: %d byte%s (%c)\n", len, ESS(len), len > 0 && isprint(*msg) ? *msg : ' ');
+	modem_queue(rx, msg, len);
 }
 
 /*! \brief Same as v18_tdd_put_async_byte in spandsp's v18.c, except flush every byte immediately, not after 256.
@@ -429,100 +584,66 @@ static void my_v18_tdd_put_async_byte(void *user_data, int byte)
 	}
 }
 
+/*! \brief Put the rest of a frame (everything after the startbit) for a byte into the bitbuffer */
+static void modem_frame_byte(modem_data *tx, unsigned char byte)
+{
+	int databits = tx->session->databits;
+	int stopbits = tx->session->stopbits;
+	unsigned int data = byte & ((1U << databits) - 1);
+	uint32_t frame;
+	int len = databits;
+
+	if (!tx->session->lsb) {
+		data = reverse_bits(data, databits);
+	}
+	frame = data;
+	if (tx->session->paritytype) {
+		frame |= (uint32_t) ((tx->session->paritytype == 2) ^ __builtin_parity(byte)) << len;
+		len++;
+	}
+	frame |= ((1U << stopbits) - 1) << len; /* stopbits */
+	len += stopbits;
+
+	tx->bitbuffer = frame;
+	tx->fill = len;
+}
+
 /*! \brief spandsp asks us for a bit to send onto the line */
 static int modem_get_bit(void *user_data)
 {
 	modem_data *tx = (modem_data*) user_data;
-	char byte = 0;
-	int i, rc;
+	int i, byte;
 
 	int databits = tx->session->databits;
 	int stopbits = tx->session->stopbits;
-	int paritybits = 0;
-
-	if (tx->session->paritytype) {
-		paritybits = 1;
-	}
 
 	/* no new data in send (bit)buffer,
 	 * either we just picked up the line, the terminal started to respond,
-	 * than we check for new data on the socket
+	 * than we check for new data from the socket
 	 * or there's no new data, so we send 1s (mark) */
-	if (tx->writepos == tx->readpos) {
-		if (tx->state->nulsent > 0) {	/* connection is established, look for data on socket */
-#ifdef HAVE_OPENSSL
-			if (tx->ssl) {
-				rc = SSL_read(tx->ssl, &byte, 1);
-			} else
-#endif
-			{
-				rc = recv(tx->sock, &byte, 1, 0);
-			}
-			if (rc > 0) {
-				/* new data on socket, we put that byte into our bitbuffer */
-				for (i = 0; i < (databits + paritybits + stopbits); i++) {
-					if (paritybits && (i == databits) ) {
-						tx->bitbuffer[tx->writepos] = (tx->session->paritytype == 2) ^ __builtin_parity( byte);
-					} else if (i >= databits) {
-						tx->bitbuffer[tx->writepos] = 1;	/* stopbits */
-					} else { /* databits */
-						if (tx->session->lsb) {
-							if (byte & (1 << i)) {
-								tx->bitbuffer[tx->writepos] = 1;
-							} else {
-								tx->bitbuffer[tx->writepos] = 0;
-							}
-						} else {
-							if (byte & (1 << (databits - 1 - i))) {
-								tx->bitbuffer[tx->writepos] = 1;
-							} else {
-								tx->bitbuffer[tx->writepos] = 0;
-							}
-						}
-					}
-					tx->writepos++;
-					if (tx->writepos >= MODEM_BITBUFFER_SIZE) {
-						tx->writepos = 0;
-					}
-				}
+	if (!tx->fill) {
+		if (tx->state->nulsent > 0) {	/* connection is established, look for data from socket */
+			byte = ring_getc(&tx->state->toline);
+			if (byte >= 0) {
+				/* new data from socket, we put that byte into our bitbuffer */
+				modem_frame_byte(tx, byte);
 				return 0; /* return startbit immediately */
-			} else if (rc == 0) {
+			} else if (tx->state->eof) {
 				if (!tx->session->finished) {
 					ast_verb(4, "TCP server closed connection, hanging up...\n");
 				}
 				tx->session->finished = 1;
 			}
 		} else {
-			int res;
 			/* check if socket was closed before connection was terminated */
-#ifdef HAVE_OPENSSL
-			if (tx->ssl) {
-				res = SSL_peek(tx->ssl, &byte, 1);
-			} else
-#endif
-			{
-				res = recv(tx->sock, &byte, 1, MSG_PEEK);
-			}
-			if (res == 0) {
+			if (tx->state->eof) {
 				tx->session->finished = 1;
 				return 1;
 			}
 			if (tx->state->answertone > 0) {
 				if (tx->session->sendnull) { /* send null byte */
 					ast_debug(3, "Got TE's tone, will send null-byte\n");
-					for (i = 0; i < (databits + paritybits + stopbits); i++) {
-						if (paritybits && i == databits) {
-							tx->bitbuffer[tx->writepos] = (tx->session->paritytype == 2) ^ __builtin_parity( 0 ); /* yes, I know! */
-						} else if (i >= databits) {
-							tx->bitbuffer[tx->writepos] = 1; /* stopbits */
-						} else {
-							tx->bitbuffer[tx->writepos] = 0; /* databits */
-						}
-						tx->writepos++;
-						if (tx->writepos >= MODEM_BITBUFFER_SIZE) {
-							tx->writepos = 0;
-						}
-					}
+					modem_frame_byte(tx, 0);
 				}
 				tx->state->nulsent = 1;
 
@@ -555,14 +676,7 @@ static int modem_get_bit(void *user_data)
 					}
 
 					headerlength = sprintf(header, "Version: 1\r\nTXspeed: %.2f\r\nRXspeed: %.2f\r\n\r\n", tx_baud /(1 + databits + stopbits), rx_baud / (1 + databits + stopbits));
-#ifdef HAVE_OPENSSL
-					if (tx->ssl) {
-						SSL_write(tx->ssl, header, headerlength);
-					} else
-#endif
-					{
-						send(tx->sock, header, headerlength, 0);
-					}
+					modem_queue(tx, (unsigned char *) header, headerlength);
 				}
 
 				if (tx->session->sendnull) {
@@ -573,15 +687,13 @@ static int modem_get_bit(void *user_data)
 			}
 		}
 
-		/* no new data on socket, NULL-byte already sent, send mark-frequency */
+		/* no new data from socket, NULL-byte already sent, send mark-frequency */
 		return 1;
 	} else {
 		/* there still is data in the bitbuffer, so we just send that out */
-		i = tx->bitbuffer[tx->readpos];
-		tx->readpos++;
-		if (tx->readpos >= MODEM_BITBUFFER_SIZE) {
-			tx->readpos = 0;
-		}
+		i = tx->bitbuffer & 1;
+		tx->bitbuffer >>= 1;
+		tx->fill--;
 		return i;
 	}
 }
@@ -798,6 +910,161 @@ static int manager_softmodem_sessions(struct mansession *s, const struct message
 	return 0;
 }
 
+#ifdef HAVE_OPENSSL
+/*! \brief Shared by all TLS connections, so that sessions can be resumed across calls */
+static SSL_CTX *ssl_ctx = NULL;
+
+/*! \brief Last TLS session with a server */
+struct tls_session {
+	SSL_SESSION *session;
+	AST_LIST_ENTRY(tls_session) entry;
+	char key[0]; /* host:port */
+};
+
+static AST_LIST_HEAD_STATIC(tls_sessions, tls_session);
+
+/*! \brief Called by OpenSSL whenever the server gives us a session we can resume later */
+static int tls_session_new_cb(SSL *ssl, SSL_SESSION *session)
+{
+	const char *key = SSL_get_app_data(ssl);
+	struct tls_session *ts;
+
+	if (!key) {
+		return 0;
+	}
+
+	AST_LIST_LOCK(&tls_sessions);
+	AST_LIST_TRAVERSE(&tls_sessions, ts, entry) {
+		if (!strcmp(ts->key, key)) {
+			break;
+		}
+	}
+	if (!ts) {
+		ts = ast_calloc(1, sizeof(*ts) + strlen(key) + 1);
+		if (!ts) {
+			AST_LIST_UNLOCK(&tls_sessions);
+			return 0;
+		}
+		strcpy(ts->key, key); /* Safe */
+		AST_LIST_INSERT_HEAD(&tls_sessions, ts, entry);
+	} else {
+		SSL_SESSION_free(ts->session);
+	}
+	ts->session = session;
+	AST_LIST_UNLOCK(&tls_sessions);
+
+	ast_debug(3, "Cached TLS session for %s\n", key);
+	return 1; /* We keep the reference */
+}
+
+static void tls_session_restore(SSL *ssl, const char *key)
+{
+	struct tls_session *ts;
+
+	AST_LIST_LOCK(&tls_sessions);
+	AST_LIST_TRAVERSE(&tls_sessions, ts, entry) {
+		if (!strcmp(ts->key, key)) {
+			SSL_set_session(ssl, ts->session); /* Takes its own reference */
+			break;
+		}
+	}
+	AST_LIST_UNLOCK(&tls_sessions);
+}
+
+static int tls_init(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	ssl_ctx = SSL_CTX_new(TLS_client_method());
+#else
+	ssl_ctx = SSL_CTX_new(TLSv1_method()); /* If the system is this old, it probably should use an old TLS version anyways */
+#endif
+	if (!ssl_ctx) {
+		ast_log(LOG_WARNING, "Failed to create SSL context: %s\n", ERR_error_string(ERR_get_error(), NULL));
+		return -1;
+	}
+	/* Sessions are cached by us, per server, not by OpenSSL's internal cache */
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl_ctx, tls_session_new_cb);
+	/* modem_flush retries writes that would block on the next frame, possibly with more data appended */
+	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	return 0;
+}
+
+static void tls_cleanup(void)
+{
+	struct tls_session *ts;
+
+	AST_LIST_LOCK(&tls_sessions);
+	while ((ts = AST_LIST_REMOVE_HEAD(&tls_sessions, entry))) {
+		SSL_SESSION_free(ts->session);
+		ast_free(ts);
+	}
+	AST_LIST_UNLOCK(&tls_sessions);
+
+	if (ssl_ctx) {
+		SSL_CTX_free(ssl_ctx);
+		ssl_ctx = NULL;
+	}
+}
+#endif
+
+/*! \brief FSK channel specs for each direction */
+static void fsk_specs(int version, int flipmode, int *txspec, int *rxspec)
+{
+	switch (version) {
+	case VERSION_V21:
+		*txspec = flipmode ? FSK_V21CH1 : FSK_V21CH2;
+		*rxspec = flipmode ? FSK_V21CH2 : FSK_V21CH1;
+		break;
+	case VERSION_V23:
+		*txspec = flipmode ? FSK_V23CH2 : FSK_V23CH1;
+		*rxspec = flipmode ? FSK_V23CH1 : FSK_V23CH2;
+		break;
+	case VERSION_BELL103:
+		*txspec = flipmode ? FSK_BELL103CH2 : FSK_BELL103CH1;
+		*rxspec = flipmode ? FSK_BELL103CH1 : FSK_BELL103CH2;
+		break;
+	case VERSION_BELL202:
+	default:
+		*txspec = *rxspec = FSK_BELL202;
+		break;
+	}
+}
+
+/*! \brief Give the TDD modem as much data from the socket as it will take right now */
+static void modem_feed_v18(v18_state_t *v18, connection_state *state, time_t *lastoutput)
+{
+	unsigned char *ptr;
+	unsigned int len;
+	time_t now;
+
+	if (!ring_used(&state->toline)) {
+		return;
+	}
+
+	now = time(NULL);
+	if (*lastoutput < now - 2) {
+		/* This is probably completely the wrong way to do this.
+		 * If carrier has paused and we get something again,
+		 * the first 2 characters can get clipped off by the time carrier has stabilized again.
+		 * Send 2 spaces to get things moving and then send the real output, if that's the case. */
+		v18_put(v18, "  ", 2);
+	}
+
+	while ((len = ring_data(&state->toline, &ptr))) {
+		int written = v18_put(v18, (const char *) ptr, len); /* v18_generator_generate will actually write the frames onto the channel towards the TDD */
+		ast_debug(3, "v18 put: %u bytes from socket onto modem, written: %d\n", len, written);
+		if (written <= 0) {
+			break; /* The SpanDSP buffer is full, the rest will wait until the generator has made room */
+		}
+		ring_consume(&state->toline, written);
+		*lastoutput = now;
+		if (written < len) {
+			break;
+		}
+	}
+}
+
 static int softmodem_communicate(modem_session *s, int tls)
 {
 	int res = -1;
@@ -805,7 +1072,7 @@ static int softmodem_communicate(modem_session *s, int tls)
 	struct ast_format *original_write_fmt;
 #ifdef HAVE_OPENSSL
 	SSL *ssl = NULL;
-	SSL_CTX *ctx = NULL;
+	char sesskey[256];
 #endif
 
 	modem_data rxdata, txdata;
@@ -825,10 +1092,7 @@ static int softmodem_communicate(modem_session *s, int tls)
 	connection_state state;
 
 	/* Used for TDD only */
-	struct pollfd pfd;
-	int pres;
-	int lastoutput = 0;
-	char buf[256] = "  ";
+	time_t lastoutput = 0;
 
 	original_read_fmt = ast_channel_readformat(s->chan);
 	if (original_read_fmt != ast_format_slin) {
@@ -864,6 +1128,7 @@ static int softmodem_communicate(modem_session *s, int tls)
 
 	if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0) {
 		ast_log(LOG_ERROR, "Cannot connect to remote host '%s': %s\n", s->host, strerror(errno));
+		close(sock);
 		ast_autoservice_stop(s->chan);
 		return res;
 	}
@@ -885,12 +1150,12 @@ static int softmodem_communicate(modem_session *s, int tls)
 
 	fcntl(sock, F_SETFL, O_NONBLOCK);
 
+	memset(&state, 0, sizeof(state));
 	state.answertone = -1; /* no carrier yet */
 	state.nulsent = 0;
 
 	rxdata.sock = sock;
-	rxdata.writepos = 0;
-	rxdata.readpos = 0;
+	rxdata.bitbuffer = 0;
 	rxdata.fill = 0;
 	rxdata.state = &state;
 	rxdata.session = s;
@@ -900,8 +1165,7 @@ static int softmodem_communicate(modem_session *s, int tls)
 #endif
 
 	txdata.sock = sock;
-	txdata.writepos = 0;
-	txdata.readpos = 0;
+	txdata.bitbuffer = 0;
 	txdata.fill = 0;
 	txdata.state = &state;
 	txdata.session = s;
@@ -909,18 +1173,13 @@ static int softmodem_communicate(modem_session *s, int tls)
 	if (tls) {
 #ifdef HAVE_OPENSSL
 		int sres;
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L
-		ctx = SSL_CTX_new(TLS_method());
-#else
-		ctx = SSL_CTX_new(TLSv1_method()); /* If the system is this old, it probably should use an old TLS version anyways */
-#endif
-		if (!ctx) {
+		if (!ssl_ctx) {
+			ast_log(LOG_ERROR, "TLS is not available\n");
 			close(sock);
 			return -1;
 		}
-		ssl = SSL_new(ctx);
+		ssl = SSL_new(ssl_ctx);
 		if (!ssl) {
-			SSL_CTX_free(ctx);
 			close(sock);
 			return -1;
 		}
@@ -930,20 +1189,27 @@ static int softmodem_communicate(modem_session *s, int tls)
 
 		if (SSL_set_fd(ssl, sock) != 1) {
 			ast_log(LOG_ERROR, "Failed to set SSL fd: %s\n", ERR_error_string(ERR_get_error(), NULL));
-			SSL_CTX_free(ctx);
+			SSL_free(ssl);
 			close(sock);
 			return -1;
 		}
+
+		/* Resume the last session with this server, if we have one, to skip a full handshake */
+		snprintf(sesskey, sizeof(sesskey), "%s:%d", s->host, s->port);
+		SSL_set_app_data(ssl, sesskey);
+		tls_session_restore(ssl, sesskey);
+
 		/* Since fd is nonblocking, retry as needed */
 		do {
 			sres = SSL_connect(ssl);
 		} while (sres == -1 && SSL_get_error(ssl, -1) == SSL_ERROR_WANT_READ);
 		if (sres == -1) {
 			ast_log(LOG_ERROR, "Failed to connect SSL: %s\n", ERR_error_string(ERR_get_error(), NULL));
-			SSL_CTX_free(ctx);
+			SSL_free(ssl);
 			close(sock);
 			return -1;
 		}
+		ast_debug(3, "TLS session with %s %s\n", sesskey, SSL_session_reused(ssl) ? "resumed" : "established");
 		/* XXX No certificate verification is done here currently
 		 * For that it would be good to reuse some of the logic in tcptls.c rather than recreating it here. */
 		rxdata.ssl = txdata.ssl = ssl;
@@ -955,33 +1221,11 @@ static int softmodem_communicate(modem_session *s, int tls)
 	}
 
 	/* initialise spandsp-stuff, give it our callback functions */
-	if (s->version == VERSION_V21) {
-		if (s->flipmode) {
-			modem_tx = fsk_tx_init(NULL, &preset_fsk_specs[FSK_V21CH1], modem_get_bit, &txdata);
-			modem_rx = fsk_rx_init(NULL, &preset_fsk_specs[FSK_V21CH2], FSK_FRAME_MODE_SYNC, modem_put_bit, &rxdata);
-		} else {
-			modem_tx = fsk_tx_init(NULL, &preset_fsk_specs[FSK_V21CH2], modem_get_bit, &txdata);
-			modem_rx = fsk_rx_init(NULL, &preset_fsk_specs[FSK_V21CH1], FSK_FRAME_MODE_SYNC, modem_put_bit, &rxdata);
-		}
-	} else if (s->version == VERSION_V23) {
-		if (s->flipmode) {
-			modem_tx = fsk_tx_init(NULL, &preset_fsk_specs[FSK_V23CH2], modem_get_bit, &txdata);
-			modem_rx = fsk_rx_init(NULL, &preset_fsk_specs[FSK_V23CH1], FSK_FRAME_MODE_SYNC, modem_put_bit, &rxdata);
-		} else {
-			modem_tx = fsk_tx_init(NULL, &preset_fsk_specs[FSK_V23CH1], modem_get_bit, &txdata);
-			modem_rx = fsk_rx_init(NULL, &preset_fsk_specs[FSK_V23CH2], FSK_FRAME_MODE_SYNC, modem_put_bit, &rxdata);
-		}
-	} else if (s->version == VERSION_BELL103) {
-		if (s->flipmode) {
-			modem_tx = fsk_tx_init(NULL, &preset_fsk_specs[FSK_BELL103CH2], modem_get_bit, &txdata);
-			modem_rx = fsk_rx_init(NULL, &preset_fsk_specs[FSK_BELL103CH1], FSK_FRAME_MODE_SYNC, modem_put_bit, &rxdata);
-		} else {
-			modem_tx = fsk_tx_init(NULL, &preset_fsk_specs[FSK_BELL103CH1], modem_get_bit, &txdata);
-			modem_rx = fsk_rx_init(NULL, &preset_fsk_specs[FSK_BELL103CH2], FSK_FRAME_MODE_SYNC, modem_put_bit, &rxdata);
-		}
-	} else if (s->version == VERSION_BELL202) {
-		modem_tx = fsk_tx_init(NULL, &preset_fsk_specs[FSK_BELL202], modem_get_bit, &txdata);
-		modem_rx = fsk_rx_init(NULL, &preset_fsk_specs[FSK_BELL202], FSK_FRAME_MODE_SYNC, modem_put_bit, &rxdata);
+	if (s->version == VERSION_V21 || s->version == VERSION_V23 || s->version == VERSION_BELL103 || s->version == VERSION_BELL202) {
+		int txspec, rxspec;
+		fsk_specs(s->version, s->flipmode, &txspec, &rxspec);
+		modem_tx = fsk_tx_init(NULL, &preset_fsk_specs[txspec], modem_get_bit, &txdata);
+		modem_rx = fsk_rx_init(NULL, &preset_fsk_specs[rxspec], FSK_FRAME_MODE_SYNC, modem_put_bit, &rxdata);
 	} else if (s->version == VERSION_V22) {
 		v22_modem = v22bis_init(NULL, 1200, 0, s->flipmode, modem_get_bit, &txdata, modem_put_bit, &rxdata);
 	} else if (s->version == VERSION_V22BIS) {
@@ -992,9 +1236,6 @@ static int softmodem_communicate(modem_session *s, int tls)
 		v18_modem = v18_init(NULL, 0, s->version == VERSION_V18_45 ? V18_MODE_5BIT_45 : V18_MODE_5BIT_50, tdd_put_msg, &rxdata);
 		fs = &v18_modem->fskrx;
 		fsk_rx_set_put_bit(fs, my_v18_tdd_put_async_byte, v18_modem); /* override v18_tdd_put_async_byte to my_v18_tdd_put_async_byte */
-		pfd.fd = sock;
-		pfd.events = POLLIN;
-		pfd.revents = 0;
 	} else {
 		ast_log(LOG_ERROR,"Unsupported modem type\n");
 		goto cleanup;
@@ -1016,120 +1257,102 @@ static int softmodem_communicate(modem_session *s, int tls)
 		ast_activate_generator(s->chan, &v18_generator, v18_modem);
 	}
 
+	res = 0;
 	while (!s->finished) {
-		res = ast_waitfor(s->chan, 20);
-		if (res < 0) {
-			break;
-		} else if (res > 0) {
-			res = 0;
-		}
-
-		inf = ast_read(s->chan);
-		if (!inf) {
-			ast_debug(1, "Channel hangup\n");
-			res = -1;
-			break;
-		}
+		struct ast_channel *c;
+		int ms = 1000, outfd = -1;
+		/* Only watch the socket while there is room for what it has for us.
+		 * Otherwise, leave it there (and let TCP flow control slow the server down)
+		 * until the modem has sent enough onto the line to make room. */
+		int nfds = !state.eof && ring_space(&state.toline) ? 1 : 0;
+
+		errno = 0;
+		c = ast_waitfor_nandfds(&s->chan, 1, &sock, nfds, NULL, &outfd, &ms);
+		if (c) {
+			inf = ast_read(s->chan);
+			if (!inf) {
+				ast_debug(1, "Channel hangup\n");
+				res = -1;
+				break;
+			}
 
-		/* Check the frame type. Format also must be checked because there is a chance
-		   that a frame in old format was already queued before we set chanel format
-		   to slinear so it will still be received by ast_read */
-		if (inf->frametype == AST_FRAME_VOICE && inf->subclass.format == ast_format_slin) {
-			if (s->version == VERSION_V21 || s->version == VERSION_V23 || s->version == VERSION_BELL103 || s->version ==  VERSION_BELL202) {
-				if (fsk_rx(modem_rx, inf->data.ptr, inf->samples) < 0) {
-					/* I know fsk_rx never returns errors. The check here is for good style only */
-					ast_log(LOG_WARNING, "softmodem returned error\n");
-					res = -1;
-					break;
-				}
-			} else if (s->version == VERSION_V22 || s->version == VERSION_V22BIS) {
-				if (v22bis_rx(v22_modem, inf->data.ptr, inf->samples) < 0) {
-					ast_log(LOG_WARNING, "softmodem returned error\n");
-					res = -1;
-					break;
-				}
-			} else if (s->version == VERSION_V18_45 || s->version == VERSION_V18_50) {
-				/* You might think it's sloppy to do it this way, since
-				 * we'll only be able to send or receive at any one time.
-				 * This is fine, since TDDs by nature are not full duplex devices.
-				 * If the TDD is receiving output from the server, then it will
-				 * itself buffer any input until the output has stopped,
-				 * so we won't get anything back from the TDD until output has
-				 * finished being sent. */
-				/* Data from channel to send to socket? */
-				if (v18_rx(v18_modem, inf->data.ptr, inf->samples) < 0) {
-					ast_log(LOG_WARNING, "softmodem returned error\n");
-					res = -1;
-					break;
-				}
-				/* Data from socket to send to channel? */
-				pres = poll(&pfd, 1, 0);
-				if (pres < 0) {
-					ast_debug(1, "Socket disconnected\n");
-					res = -1;
-					break;
-				} else if (pres > 0) {
-					char *writebuf;
-					int written, writelen, now = time(NULL);
-					int needspaces = lastoutput < now - 2;
-#ifdef HAVE_OPENSSL
-					if (ssl) {
-						pres = SSL_read(ssl, buf + 2, sizeof(buf) - 3);
-					} else
-#endif
-					{
-						pres = read(sock, buf + 2, sizeof(buf) - 3);
-					}
-					if (pres <= 0) {
-						ast_debug(1, "read returned %d, socket must have disconnected on us\n", pres); /* Socket hangup, read will return 0 */
+			/* Check the frame type. Format also must be checked because there is a chance
+			   that a frame in old format was already queued before we set chanel format
+			   to slinear so it will still be received by ast_read */
+			if (inf->frametype == AST_FRAME_VOICE && inf->subclass.format == ast_format_slin) {
+				if (s->version == VERSION_V21 || s->version == VERSION_V23 || s->version == VERSION_BELL103 || s->version ==  VERSION_BELL202) {
+					if (fsk_rx(modem_rx, inf->data.ptr, inf->samples) < 0) {
+						/* I know fsk_rx never returns errors. The check here is for good style only */
+						ast_log(LOG_WARNING, "softmodem returned error\n");
 						res = -1;
 						break;
 					}
-					buf[pres] = '\0'; /* Safe */
-					/* This is probably completely the wrong way to do this.
-					 * If carrier has paused and we get something again,
-					 * the first 2 characters can get clipped off by the time carrier has stabilized again.
-					 * Send 2 spaces to get things moving and then send the real output, if that's the case. */
-					writelen = needspaces ? pres + 2 : pres;
-					writebuf = needspaces ? buf : buf + 2;
-					written = v18_put(v18_modem, writebuf, writelen); /* v18_generator_generate will actually write the frames onto the channel towards the TDD */
-					ast_debug(3, "v18 put: %d+%d bytes from socket onto modem, written: %d\n", needspaces ? 2 : 0, pres, written);
-					while (written < writelen) {
-						writebuf += written;
-						writelen -= written;
-						/* v18_put couldn't accept all the data available for the modem,
-						 * because the SpanDSP buffer was full.
-						 * We need to retry and make sure all data gets sent. */
-						/* It will take time for the SpanDSP buffer to empty itself... we're in no hurry here. */
-						if (ast_safe_sleep(s->chan, 1000)) { /* Check if channel hung up while we were waiting */
-							res = -1;
-							break;
-						}
-						written = v18_put(v18_modem, writebuf, writelen);
-						ast_debug(3, "v18 put RETRY: %d bytes from socket onto modem, written: %d\n", writelen, written);
+				} else if (s->version == VERSION_V22 || s->version == VERSION_V22BIS) {
+					if (v22bis_rx(v22_modem, inf->data.ptr, inf->samples) < 0) {
+						ast_log(LOG_WARNING, "softmodem returned error\n");
+						res = -1;
+						break;
 					}
-					if (written <= 0) {
-						ast_debug(1, "v18_put returned %d?\n", written);
+				} else if (s->version == VERSION_V18_45 || s->version == VERSION_V18_50) {
+					/* TDDs by nature are not full duplex devices.
+					 * If the TDD is receiving output from the server, then it will
+					 * itself buffer any input until the output has stopped,
+					 * so we won't get anything back from the TDD until output has
+					 * finished being sent. */
+					if (v18_rx(v18_modem, inf->data.ptr, inf->samples) < 0) {
+						ast_log(LOG_WARNING, "softmodem returned error\n");
 						res = -1;
 						break;
 					}
-				} /* else, no new data */
+				}
+				/* Whatever was received in this frame goes out to the socket at once */
+				modem_flush(&rxdata);
 			}
+
+			ast_frfree(inf);
+			inf = NULL;
+		} else if (outfd == sock) {
+			modem_fill(&txdata);
+		} else if (ms && outfd < 0 && errno && errno != EINTR) {
+			ast_log(LOG_WARNING, "Failed to poll channel %s: %s\n", ast_channel_name(s->chan), strerror(errno));
+			res = -1;
+			break;
 		}
 
-		ast_frfree(inf);
-		inf = NULL;
+		if (modem_pending(&txdata)) {
+			modem_fill(&txdata);
+		}
+
+		if (v18_modem) {
+			/* The FSK and V.22 modems pull data as they need it, but the TDD modem must be given it */
+			modem_feed_v18(v18_modem, &state, &lastoutput);
+			if (state.eof && !ring_used(&state.toline)) {
+				ast_debug(1, "Socket disconnected\n");
+				res = -1;
+				break;
+			}
+		}
 	}
 
 cleanup:
+	if (inf) {
+		ast_frfree(inf);
+	}
+	ast_deactivate_generator(s->chan); /* Stop using the modem before we free it */
+	modem_flush(&rxdata); /* Anything received in the last frame */
 	close(sock);
 #ifdef HAVE_OPENSSL
 	if (ssl) {
 		SSL_free(ssl);
-		SSL_CTX_free(ctx);
 	}
 #endif
 
+	if (modem_tx) {
+		fsk_tx_free(modem_tx);
+	}
+	if (modem_rx) {
+		fsk_rx_free(modem_rx);
+	}
 	if (s->version == VERSION_V22 || s->version == VERSION_V22BIS) {
 		v22bis_release(v22_modem);
 		v22bis_free(v22_modem);
@@ -1302,17 +1525,269 @@ static int softmodem_exec(struct ast_channel *chan, const char *data)
 	return res;
 }
 
+/*! \brief One end of a loopback test */
+struct loopback_end {
+	modem_session session;
+	connection_state state;
+	modem_data rx;
+	modem_data tx;
+};
+
+static const struct {
+	int version;
+	const char *name;
+} loopback_versions[] = {
+	{ VERSION_V21, "V21" },
+	{ VERSION_V23, "V23" },
+	{ VERSION_BELL103, "Bell103" },
+	{ VERSION_BELL202, "Bell202" },
+	{ VERSION_V22, "V22" },
+	{ VERSION_V22BIS, "V22bis" },
+	{ VERSION_V18_45, "baudot45" },
+	{ VERSION_V18_50, "baudot50" },
+};
+
+/* Only characters that Baudot can encode, so the same pattern works for every version */
+static const char loopback_pattern[] = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789 ";
+
+#define LOOPBACK_SAMPLES 160 /* 20 ms */
+
+static void loopback_end_init(struct loopback_end *end, int version, int flipmode)
+{
+	end->session.version = version;
+	end->session.databits = 8;
+	end->session.stopbits = 1;
+	end->session.flipmode = flipmode;
+	end->state.answertone = -1; /* no carrier yet */
+	end->rx.sock = end->tx.sock = -1; /* Data stays in the ring buffers */
+	end->rx.state = end->tx.state = &end->state;
+	end->rx.session = end->tx.session = &end->session;
+}
+
+/*!
+ * \brief Send data from one modem to another, through the same paths used for a real session
+ * \param version Modem version
+ * \param seconds Line time to simulate
+ * \param[out] chars Characters received by the far end
+ * \param[out] errors Characters received that weren't the ones sent
+ * \retval 0 on success, -1 on failure
+ */
+static int loopback_run(int version, int seconds, int *chars, int *errors)
+{
+	struct loopback_end *a, *b;
+	fsk_tx_state_t *fsk_tx = NULL;
+	fsk_rx_state_t *fsk_rx = NULL;
+	v22bis_state_t *v22_a = NULL, *v22_b = NULL;
+	v18_state_t *v18_a = NULL, *v18_b = NULL;
+	int16_t amp[LOOPBACK_SAMPLES];
+	int block, len, offset = 0, expect = 0, res = -1;
+	int patlen = strlen(loopback_pattern);
+	time_t lastoutput = time(NULL); /* No need for the leading spaces here */
+
+	*chars = *errors = 0;
+
+	a = ast_calloc(1, sizeof(*a));
+	b = ast_calloc(1, sizeof(*b));
+	if (!a || !b) {
+		goto cleanup;
+	}
+	loopback_end_init(a, version, 0);
+	loopback_end_init(b, version, 1);
+
+	if (version == VERSION_V22 || version == VERSION_V22BIS) {
+		int bitrate = version == VERSION_V22 ? 1200 : 2400;
+		v22_a = v22bis_init(NULL, bitrate, 0, 0, modem_get_bit, &a->tx, modem_put_bit, &a->rx);
+		v22_b = v22bis_init(NULL, bitrate, 0, 1, modem_get_bit, &b->tx, modem_put_bit, &b->rx);
+		if (!v22_a || !v22_b) {
+			goto cleanup;
+		}
+	} else if (version == VERSION_V18_45 || version == VERSION_V18_50) {
+		int mode = version == VERSION_V18_45 ? V18_MODE_5BIT_45 : V18_MODE_5BIT_50;
+		v18_a = v18_init(NULL, 0, mode, tdd_put_msg, &a->rx);
+		v18_b = v18_init(NULL, 0, mode, tdd_put_msg, &b->rx);
+		if (!v18_a || !v18_b) {
+			goto cleanup;
+		}
+		fsk_rx_set_put_bit(&v18_b->fskrx, my_v18_tdd_put_async_byte, v18_b);
+	} else {
+		int txspec, rxspec;
+		fsk_specs(version, 0, &txspec, &rxspec);
+		/* Only one direction is tested (Bell 202 is half duplex anyways), so don't wait for the far end's carrier */
+		fsk_tx = fsk_tx_init(NULL, &preset_fsk_specs[txspec], modem_get_bit, &a->tx);
+		fsk_rx = fsk_rx_init(NULL, &preset_fsk_specs[txspec], FSK_FRAME_MODE_SYNC, modem_put_bit, &b->rx);
+		if (!fsk_tx || !fsk_rx) {
+			goto cleanup;
+		}
+		fsk_rx_signal_cutoff(fsk_rx, -35.0f);
+		a->state.answertone = 1;
+		a->state.nulsent = 1;
+	}
+
+	for (block = 0; block < seconds * (8000 / LOOPBACK_SAMPLES); block++) {
+		unsigned char *ptr;
+		unsigned int avail, i;
+
+		/* Keep the sending end's socket buffer full, as if the server were sending as fast as it can */
+		while (ring_space(&a->state.toline)) {
+			offset += ring_put(&a->state.toline, (const unsigned char *) loopback_pattern + offset, patlen - offset);
+			offset %= patlen;
+		}
+
+		if (fsk_tx) {
+			len = fsk_tx(fsk_tx, amp, LOOPBACK_SAMPLES);
+			memset(amp + len, 0, (LOOPBACK_SAMPLES - len) * sizeof(int16_t));
+			fsk_rx(fsk_rx, amp, LOOPBACK_SAMPLES);
+		} else if (v22_a) {
+			len = v22bis_tx(v22_a, amp, LOOPBACK_SAMPLES);
+			memset(amp + len, 0, (LOOPBACK_SAMPLES - len) * sizeof(int16_t));
+			v22bis_rx(v22_b, amp, LOOPBACK_SAMPLES);
+			len = v22bis_tx(v22_b, amp, LOOPBACK_SAMPLES);
+			memset(amp + len, 0, (LOOPBACK_SAMPLES - len) * sizeof(int16_t));
+			v22bis_rx(v22_a, amp, LOOPBACK_SAMPLES);
+		} else {
+			modem_feed_v18(v18_a, &a->state, &lastoutput);
+			len = v18_tx(v18_a, amp, LOOPBACK_SAMPLES);
+			memset(amp + len, 0, (LOOPBACK_SAMPLES - len) * sizeof(int16_t));
+			v18_rx(v18_b, amp, LOOPBACK_SAMPLES);
+		}
+
+		/* Check what came out the other end */
+		while ((avail = ring_data(&b->state.tosock, &ptr))) {
+			for (i = 0; i < avail; i++) {
+				(*chars)++;
+				if (ptr[i] == loopback_pattern[expect]) {
+					expect = (expect + 1) % patlen;
+				} else {
+					const char *resync = strchr(loopback_pattern, ptr[i]);
+					(*errors)++;
+					expect = resync ? (resync - loopback_pattern + 1) % patlen : 0;
+				}
+			}
+			ring_consume(&b->state.tosock, avail);
+		}
+	}
+	res = 0;
+
+cleanup:
+	if (fsk_tx) {
+		fsk_tx_free(fsk_tx);
+	}
+	if (fsk_rx) {
+		fsk_rx_free(fsk_rx);
+	}
+	if (v22_a) {
+		v22bis_release(v22_a);
+		v22bis_free(v22_a);
+	}
+	if (v22_b) {
+		v22bis_release(v22_b);
+		v22bis_free(v22_b);
+	}
+	if (v18_a) {
+		v18_release(v18_a);
+		v18_free(v18_a);
+	}
+	if (v18_b) {
+		v18_release(v18_b);
+		v18_free(v18_b);
+	}
+	ast_free(a);
+	ast_free(b);
+	return res;
+}
+
+/*!
+ * \brief CPU time used by the calling thread, in milliseconds
+ * \retval -1 if not available on this platform
+ */
+static int64_t thread_cpu_ms(void)
+{
+#ifdef RUSAGE_THREAD
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru)) {
+		return -1;
+	}
+	return ast_tvdiff_ms(ast_tvadd(ru.ru_utime, ru.ru_stime), ast_tv(0, 0));
+#else
+	return -1; /* Process CPU time would include every other thread */
+#endif
+}
+
+static char *handle_loopback(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int i, seconds = 10;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "softmodem loopback";
+		e->usage =
+			"Usage: softmodem loopback [<seconds>]\n"
+			"       Connect each modem version to another modem, without a channel or socket,\n"
+			"       and measure how many characters per second it gets across.\n"
+			"       Default is 10 seconds of line time per modem version.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc > 3) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc == 3) {
+		seconds = atoi(a->argv[2]);
+		if (seconds < 1 || seconds > 600) {
+			return CLI_SHOWUSAGE;
+		}
+	}
+
+	ast_cli(a->fd, "%-10s | %8s | %9s | %6s | %7s\n", "Version", "Chars", "Chars/sec", "Errors", "CPU ms");
+	for (i = 0; i < ARRAY_LEN(loopback_versions); i++) {
+		int chars, errors;
+		int64_t end, start = thread_cpu_ms();
+		char cpu[24] = "-";
+		if (loopback_run(loopback_versions[i].version, seconds, &chars, &errors)) {
+			ast_cli(a->fd, "%-10s | Failed to set up modems\n", loopback_versions[i].name);
+			continue;
+		}
+		end = thread_cpu_ms();
+		if (start >= 0 && end >= 0) {
+			snprintf(cpu, sizeof(cpu), "%" PRId64, end - start);
+		}
+		ast_cli(a->fd, "%-10s | %8d | %9.1f | %6d | %7s\n", loopback_versions[i].name, chars, (double) chars / seconds, errors, cpu);
+	}
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry softmodem_cli[] = {
+	AST_CLI_DEFINE(handle_loopback, "Measure softmodem throughput in loopback"),
+};
+
 static int unload_module(void)
 {
+	int res;
+
+	ast_cli_unregister_multiple(softmodem_cli, ARRAY_LEN(softmodem_cli));
 	ast_manager_unregister("SoftmodemSessions");
-	return ast_unregister_application(app);
+	res = ast_unregister_application(app);
+#ifdef HAVE_OPENSSL
+	tls_cleanup();
+#endif
+	return res;
 }
 
 static int load_module(void)
 {
+#ifdef HAVE_OPENSSL
+	tls_init(); /* Not fatal, only TLS connections will fail */
+#endif
 	if (ast_manager_register_xml("SoftmodemSessions", EVENT_FLAG_CALL, manager_softmodem_sessions)) {
+#ifdef HAVE_OPENSSL
+		tls_cleanup();
+#endif
 		return -1;
 	}
+	ast_cli_register_multiple(softmodem_cli, ARRAY_LEN(softmodem_cli));
 	return ast_register_application_xml(app, softmodem_exec);
 }
 
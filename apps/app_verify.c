@@ -40,6 +40,7 @@
 #include <regex.h>
 
 #include "asterisk/lock.h"
+#include "asterisk/astobj2.h"
 #include "asterisk/file.h"
 #include "asterisk/channel.h"
 #include "asterisk/pbx.h"
@@ -52,6 +53,7 @@
 #include "asterisk/utils.h"
 #include "asterisk/acl.h"
 #include "asterisk/enum.h"
+#include "asterisk/curl_pool.h"
 
 /*** DOCUMENTATION
 	<application name="Verify" language="en_US">
@@ -347,6 +349,26 @@
 				<configOption name="code_spoof">
 					<synopsis>Code to assign to local_var for spoofed calls.</synopsis>
 				</configOption>
+				<configOption name="async" default="no">
+					<synopsis>Whether to make verification requests in parallel, in advance.</synopsis>
+					<description>
+						<para>When enabled, all of the HTTP requests and DNS lookups that verification
+						may need are started in the background as soon as <literal>Verify</literal>
+						or <literal>OutVerify</literal> is called, rather than one after another as each
+						is needed. The channel continues to be serviced (e.g. ringing or early media
+						continue) while waiting for the results. Only applies when
+						<literal>requestmethod</literal> is <literal>curl</literal>.</para>
+						<para>The time saved compared to making the requests one at a time
+						is shown in <literal>verify show profile</literal>.</para>
+					</description>
+				</configOption>
+				<configOption name="asyncdeadline">
+					<synopsis>Maximum number of milliseconds to wait for background requests.</synopsis>
+					<description>
+						<para>Requests that have not completed by this time after the application
+						was called are treated as failed. Default is the global <literal>curltimeout</literal>.</para>
+					</description>
+				</configOption>
 				<configOption name="loglevel">
 					<synopsis>Name of log level at which to log incoming calls (e.g. WARNING, custom, etc.)</synopsis>
 				</configOption>
@@ -372,6 +394,8 @@ struct call_verify {
 	unsigned int out;						/*!< Total number of outgoing calls attempted to out verify under this profile */
 	unsigned int outsuccess;				/*!< Total number of outgoing calls out-verified under this profile */
 	unsigned int total_blacklisted;			/*!< Total number of incoming calls that have been rejected due to blacklisting */
+	unsigned int async_calls;				/*!< Total number of calls that used background requests */
+	uint64_t async_saved;					/*!< Total microseconds saved by background requests */
 	char verifymethod[PATH_MAX];			/*!< Algorithm to use for verification: direct or reverse */
 	char requestmethod[PATH_MAX];			/*!< Request method: curl or enum */
 	char verifyrequest[PATH_MAX];			/*!< Request URL or ENUM lookup */
@@ -403,6 +427,7 @@ struct call_verify {
 	char code_requestfail[PATH_MAX];		/*!< Result for failed verification request */
 	char code_spoof[PATH_MAX];				/*!< Result for spoofed calls */
 	int threshold;							/*!< Threshold at which to reject calls that failed to verify */
+	int asyncdeadline;						/*!< Milliseconds to wait for background requests */
 	char loglevel[AST_MAX_CONTEXT];			/*!< Log level */
 	char logmsg[PATH_MAX];					/*!< Log message */
 	AST_LIST_ENTRY(call_verify) entry;		/*!< Next Verify record */
@@ -414,6 +439,7 @@ struct call_verify {
 	unsigned int allowtoken:1;				/*!< Whether to allow verification tokens */
 	unsigned int flagprivateip:1;			/*!< Whether to flag private IP addresses as malicious */
 	unsigned int blacklist_failopen:1;		/*!< Allow blacklist to fail open */
+	unsigned int async:1;					/*!< Make requests in parallel, in advance */
 };
 
 #define DEFAULT_CURL_TIMEOUT 8
@@ -426,6 +452,8 @@ static AST_RWLIST_HEAD_STATIC(verifys, call_verify);
 unsigned int stir_shaken_stats[2][6];
 ast_mutex_t ss_lock;
 
+static struct curl_pool curl_pool;
+
 /*! \brief Allocate and initialize verify profile */
 static struct call_verify *alloc_profile(const char *vname)
 {
@@ -444,6 +472,8 @@ static struct call_verify *alloc_profile(const char *vname)
 	v->out = 0;
 	v->outsuccess = 0;
 	v->total_blacklisted = 0;
+	v->async_calls = 0;
+	v->async_saved = 0;
 
 	return v;
 }
@@ -518,6 +548,7 @@ static void profile_set_param(struct call_verify *v, const char *param, const ch
 	VERIFY_LOAD_STR_PARAM(blacklist_endpoint, val[0]);
 	VERIFY_LOAD_FLOAT_PARAM(blacklist_threshold, val[0]);
 	VERIFY_LOAD_INT_PARAM(blacklist_failopen, !strcasecmp(val, "yes") || !strcasecmp(val, "no"));
+	VERIFY_LOAD_INT_PARAM(async, !strcasecmp(val, "yes") || !strcasecmp(val, "no"));
 	VERIFY_LOAD_STR_PARAM(outregex, val[0]);
 	VERIFY_LOAD_STR_PARAM(exceptioncontext, val[0]);
 	VERIFY_LOAD_STR_PARAM(failureaction, !strcasecmp(val, "nothing") || !strcasecmp(val, "hangup") || !strcasecmp(val, "playback") || !strcasecmp(val, "redirect"));
@@ -540,6 +571,13 @@ static void profile_set_param(struct call_verify *v, const char *param, const ch
 		}
 		return;
 	}
+	if (!strcasecmp(param, "asyncdeadline")) {
+		if (ast_str_to_int(val, &v->asyncdeadline) || v->asyncdeadline < 0) {
+			ast_log(LOG_WARNING, "Invalid %s: '%s'\n", param, val);
+			v->asyncdeadline = 0;
+		}
+		return;
+	}
 	if (failunknown) {
 		if (linenum >= 0) {
 			ast_log(LOG_WARNING, "Unknown keyword in profile '%s': %s at line %d of verify.conf\n", v->name, param, linenum);
@@ -622,6 +660,8 @@ static int reload_verify(int reload)
 		v->flagprivateip = 1;
 		v->blacklist_threshold = 1;
 		v->blacklist_failopen = 0;
+		v->async = 0;
+		v->asyncdeadline = 0;
 		ast_copy_string(v->verifymethod, "reverse", sizeof(v->verifymethod));
 		ast_copy_string(v->requestmethod, "curl", sizeof(v->requestmethod));
 		/* Search Config */
@@ -700,10 +740,16 @@ static int verify_log(struct ast_channel *chan, char *level, char *msg)
 	return 0;
 }
 
-static int verify_curl(struct ast_channel *chan, struct ast_str *buf, char *url)
+/*!
+ * \brief Make an HTTP request
+ * \note This does not service any channel, so callers with a channel must autoservice it
+ */
+static int verify_curl_perform(struct ast_str **buf, const char *url)
 {
-	CURL **curl;
+	CURL *curl;
+	CURLcode res;
 	char curl_errbuf[CURL_ERROR_SIZE + 1];
+	struct timeval start;
 
 	ast_debug(1, "Planning to curl '%s'\n", url);
 
@@ -712,12 +758,12 @@ static int verify_curl(struct ast_channel *chan, struct ast_str *buf, char *url)
 		return -1;
 	}
 
-	if (!buf) {
+	if (!*buf) {
 		ast_log(LOG_WARNING, "Failed to allocate buffer\n");
 		return -1;
 	}
 
-	curl = curl_easy_init();
+	curl = curl_pool_get(&curl_pool);
 	if (!curl) {
 		return -1;
 	}
@@ -725,33 +771,303 @@ static int verify_curl(struct ast_channel *chan, struct ast_str *buf, char *url)
 	curl_easy_setopt(curl, CURLOPT_TIMEOUT, curltimeout);
 	curl_easy_setopt(curl, CURLOPT_USERAGENT, AST_CURL_USER_AGENT);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_string_callback);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, buf);
 	curl_easy_setopt(curl, CURLOPT_URL, url);
 	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_errbuf);
 
-	ast_autoservice_start(chan);
+	start = ast_tvnow();
+	res = curl_easy_perform(curl);
+	curl_pool_put(&curl_pool, curl, start, res);
 
-	if (curl_easy_perform(curl)) {
-		ast_autoservice_stop(chan);
+	if (res != CURLE_OK) {
 		ast_log(LOG_ERROR, "%s\n", curl_errbuf);
 		ast_log(LOG_ERROR, "Failed to curl URL '%s'\n", url);
-		curl_easy_cleanup(curl);
 		return -1;
 	}
 
-	curl_easy_cleanup(curl);
-	ast_autoservice_stop(chan);
-
-	if (!ast_str_buffer(buf)) {
+	if (!ast_str_buffer(*buf)) {
 		return -1;
 	}
-	if (ast_str_strlen(buf) < 1) { /* didn't get anything back? */
+	if (ast_str_strlen(*buf) < 1) { /* didn't get anything back? */
 		return -1;
 	}
 
 	return 0;
 }
 
+static int verify_curl(struct ast_channel *chan, struct ast_str *buf, char *url)
+{
+	int res;
+
+	ast_autoservice_start(chan);
+	res = verify_curl_perform(&buf, url);
+	ast_autoservice_stop(chan);
+
+	return res;
+}
+
+/* based on https://www.binarytides.com/hostname-to-ip-address-c-sockets-linux/ */
+/* not ideal, but ast_get_ip seems to have issues under the hood... */
+static int resolve_hostname(const char *hostname, char *ip)
+{
+	struct addrinfo hints, *servinfo, *p;
+	struct sockaddr_in *h;
+	int rv;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((rv = getaddrinfo(hostname, "4569", &hints, &servinfo)) != 0) {
+		ast_log(LOG_WARNING, "getaddrinfo: %s\n", gai_strerror(rv));
+		return 1;
+	}
+
+	/* loop through all the results and connect to the first we can */
+	for (p = servinfo; p != NULL; p = p->ai_next) {
+		h = (struct sockaddr_in *) p->ai_addr;
+		strcpy(ip, ast_inet_ntoa(h->sin_addr));
+	}
+
+	freeaddrinfo(servinfo);
+	ast_debug(1, "Hostname '%s' resolved to IP address '%s'\n", hostname, ip);
+
+	return 0;
+}
+
+static void parse_iax2_dial_string(char *data, struct ast_str *strbuf);
+
+/*! \brief Maximum number of background requests for a single call */
+#define VERIFY_ASYNC_MAX_REQUESTS 5
+
+/*! \brief A request made in the background */
+struct verify_request {
+	struct verify_async *async;
+	char url[SUB_BUFLEN];			/*!< URL to request, empty to only resolve host */
+	char host[256];					/*!< Host to resolve. If resolving the response, set once done. */
+	char ip[50];					/*!< IP address of host, once done */
+	struct ast_str *result;			/*!< Response, once done */
+	int64_t usec;					/*!< How long the request took */
+	int res;						/*!< 0 if the HTTP request succeeded, -1 if it failed */
+	unsigned int resolve:1;			/*!< Whether to resolve a host */
+	unsigned int resolved:1;		/*!< Whether the host was resolved */
+	unsigned int done:1;			/*!< Whether the request has completed */
+	unsigned int used:1;			/*!< Whether the result has been used */
+};
+
+/*!
+ * \brief Requests for a call that are made in parallel, ahead of when they're needed
+ * \note Requests are only modified by their threads while unfinished, with the object locked.
+ * Everything else belongs to the channel thread.
+ */
+struct verify_async {
+	ast_cond_t cond;
+	struct timeval start;			/*!< When the requests were started */
+	struct timeval deadline;		/*!< When to stop waiting for requests */
+	struct timeval end;				/*!< When the last result was used */
+	int64_t serial;					/*!< How long the results used would have taken to get one at a time */
+	int numreqs;
+	struct verify_request reqs[VERIFY_ASYNC_MAX_REQUESTS];
+};
+
+static void verify_async_destroy(void *obj)
+{
+	struct verify_async *async = obj;
+	int i;
+
+	for (i = 0; i < async->numreqs; i++) {
+		ast_free(async->reqs[i].result);
+	}
+	ast_cond_destroy(&async->cond);
+}
+
+static struct verify_async *verify_async_alloc(int deadline)
+{
+	struct verify_async *async;
+
+	async = ao2_alloc(sizeof(*async), verify_async_destroy);
+	if (!async) {
+		return NULL;
+	}
+
+	ast_cond_init(&async->cond, NULL);
+	async->start = async->end = ast_tvnow();
+	async->deadline = ast_tvadd(async->start, ast_samp2tv(deadline, 1000));
+	return async;
+}
+
+static void *verify_async_thread(void *data)
+{
+	struct verify_request *req = data;
+	struct verify_async *async = req->async;
+	struct timeval start = ast_tvnow();
+	char host[sizeof(req->host)];
+	char ip[sizeof(req->ip)] = "";
+	int res = 0, resolved = 0;
+
+	ast_copy_string(host, req->host, sizeof(host));
+
+	if (*req->url) {
+		res = verify_curl_perform(&req->result, req->url);
+	}
+	if (!res && req->resolve) {
+		if (!*host) {
+			/* Resolve the host of the IAX2 URI in the response, as verify_exec would */
+			struct ast_str *peer = ast_str_create(sizeof(host));
+			char *dialstring = ast_strdupa(ast_str_buffer(req->result));
+			if (peer && *dialstring) {
+				parse_iax2_dial_string(dialstring, peer);
+				ast_copy_string(host, ast_str_buffer(peer), sizeof(host));
+			}
+			ast_free(peer);
+		}
+		resolved = *host && !resolve_hostname(host, ip);
+	}
+
+	ao2_lock(async);
+	ast_copy_string(req->host, host, sizeof(req->host));
+	ast_copy_string(req->ip, ip, sizeof(req->ip));
+	req->res = res;
+	req->resolved = resolved;
+	req->usec = ast_tvdiff_us(ast_tvnow(), start);
+	req->done = 1;
+	ast_cond_broadcast(&async->cond);
+	ao2_unlock(async);
+
+	ao2_ref(async, -1);
+	ast_module_unref(AST_MODULE_SELF);
+	return NULL;
+}
+
+/*!
+ * \brief Start a request in the background
+ * \param chan
+ * \param async
+ * \param url URL to request (variables are substituted now), or NULL to only resolve host
+ * \param varg1 Value of VERIFYARG1 for substitution, if any
+ * \param host Host to resolve. NULL to not resolve anything, empty to resolve the host in the response.
+ */
+static void verify_async_start(struct ast_channel *chan, struct verify_async *async, const char *url, const char *varg1, const char *host)
+{
+	struct verify_request *req;
+	pthread_t thread;
+
+	if (async->numreqs >= VERIFY_ASYNC_MAX_REQUESTS) {
+		ast_log(LOG_WARNING, "Too many background requests, request will be made when needed\n");
+		return;
+	}
+
+	req = &async->reqs[async->numreqs];
+	if (url) {
+		if (varg1) {
+			pbx_builtin_setvar_helper(chan, "VERIFYARG1", varg1);
+		}
+		pbx_substitute_variables_helper(chan, url, req->url, sizeof(req->url) - 1);
+		if (varg1) {
+			pbx_builtin_setvar_helper(chan, "VERIFYARG1", "");
+		}
+		if (!(req->result = ast_str_create(512))) {
+			return;
+		}
+	}
+	if (host) {
+		req->resolve = 1;
+		ast_copy_string(req->host, host, sizeof(req->host));
+	}
+	req->async = async;
+
+	ao2_ref(async, +1);
+	ast_module_ref(AST_MODULE_SELF); /* Don't unload while requests are still running */
+	if (ast_pthread_create_detached(&thread, NULL, verify_async_thread, req)) {
+		ast_log(LOG_WARNING, "Failed to start background request, request will be made when needed\n");
+		ast_module_unref(AST_MODULE_SELF);
+		ao2_ref(async, -1);
+		ast_free(req->result);
+		memset(req, 0, sizeof(*req));
+		return;
+	}
+
+	async->numreqs++;
+	ast_debug(3, "Started background request %d: %s%s%s\n", async->numreqs, req->url, *req->url && host ? ", then resolve " : host ? "resolve " : "", host ? S_OR(host, "response") : "");
+}
+
+/*!
+ * \brief Wait until the deadline for a background request to finish
+ * \retval 0 if the request finished, -1 if not
+ */
+static int verify_async_wait(struct ast_channel *chan, struct verify_async *async, struct verify_request *req)
+{
+	int done;
+
+	ao2_lock(async);
+	done = req->done;
+	ao2_unlock(async);
+
+	if (!done) {
+		struct timespec ts = {
+			.tv_sec = async->deadline.tv_sec,
+			.tv_nsec = async->deadline.tv_usec * 1000,
+		};
+		ast_autoservice_start(chan);
+		ao2_lock(async);
+		while (!req->done && ast_tvcmp(ast_tvnow(), async->deadline) < 0) {
+			ast_cond_timedwait(&async->cond, ao2_object_get_lockaddr(async), &ts);
+		}
+		done = req->done;
+		if (!done) {
+			/* The thread may still set the host, so log while it can't */
+			ast_log(LOG_WARNING, "Background request for '%s' did not finish in time\n", S_OR(req->url, req->host));
+		}
+		ao2_unlock(async);
+		ast_autoservice_stop(chan);
+		if (!done) {
+			return -1;
+		}
+	}
+
+	if (!req->used) {
+		req->used = 1;
+		async->serial += req->usec;
+	}
+	async->end = ast_tvnow();
+	return 0;
+}
+
+/*!
+ * \brief Make an HTTP request, or use the result of the same request made in the background
+ * \retval 0 on success, -1 on failure
+ */
+static int verify_fetch(struct ast_channel *chan, struct verify_async *async, struct ast_str *buf, char *url)
+{
+	struct timeval start;
+	int i, res;
+
+	if (!async) {
+		return verify_curl(chan, buf, url);
+	}
+
+	for (i = 0; i < async->numreqs; i++) {
+		struct verify_request *req = &async->reqs[i];
+		if (strcmp(req->url, url)) {
+			continue;
+		}
+		if (verify_async_wait(chan, async, req) || req->res) {
+			return -1;
+		}
+		ast_debug(1, "Using result of background request for '%s'\n", url);
+		/* Don't let buf grow, since the caller wouldn't see the new buffer */
+		ast_str_set(&buf, -1, "%s", ast_str_buffer(req->result));
+		return 0;
+	}
+
+	/* Not requested in advance (e.g. variables changed), so request it now */
+	start = ast_tvnow();
+	res = verify_curl(chan, buf, url);
+	async->end = ast_tvnow();
+	async->serial += ast_tvdiff_us(async->end, start);
+	return res;
+}
+
 static void verify_set_var(struct ast_channel *chan, char *vname, char *vvalue)
 {
 	if (!vname || !(*vname)) {
@@ -765,7 +1081,7 @@ static void verify_set_var(struct ast_channel *chan, char *vname, char *vvalue)
 	pbx_builtin_setvar_helper(chan, vname, vvalue);
 }
 
-static int resolve_verify_request(struct ast_channel *chan, char *url, struct ast_str *strbuf, int curl, char *varg1)
+static int resolve_verify_request(struct ast_channel *chan, struct verify_async *async, char *url, struct ast_str *strbuf, int curl, char *varg1)
 {
 	char substituted[SUB_BUFLEN];
 
@@ -777,7 +1093,7 @@ static int resolve_verify_request(struct ast_channel *chan, char *url, struct as
 		pbx_builtin_setvar_helper(chan, "VERIFYARG1", "");
 	}
 	if (curl) {
-		if (verify_curl(chan, strbuf, substituted)) {
+		if (verify_fetch(chan, async, strbuf, substituted)) {
 			ast_debug(1, "curl failed\n");
 			return -1;
 		}
@@ -869,39 +1185,37 @@ static void parse_iax2_dial_string(char *data, struct ast_str *strbuf)
 	ast_str_set(&strbuf, 0, "%s", peer); /* piggyback of this ast_str, cause why not? */
 }
 
-/* based on https://www.binarytides.com/hostname-to-ip-address-c-sockets-linux/ */
-/* not ideal, but ast_get_ip seems to have issues under the hood... */
-static int hostname_to_ip(struct ast_channel *chan, char *hostname , char *ip)
+static int hostname_to_ip(struct ast_channel *chan, struct verify_async *async, char *hostname, char *ip)
 {
-	struct addrinfo hints, *servinfo, *p;
-	struct sockaddr_in *h;
-	int rv;
-
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
+	struct timeval start;
+	int i, res;
+
+	if (async) {
+		for (i = 0; i < async->numreqs; i++) {
+			struct verify_request *req = &async->reqs[i];
+			if (!req->resolve || verify_async_wait(chan, async, req) || strcmp(req->host, hostname)) {
+				continue;
+			}
+			if (!req->resolved) {
+				return 1;
+			}
+			ast_debug(1, "Using background resolution of '%s' to '%s'\n", hostname, req->ip);
+			strcpy(ip, req->ip);
+			return 0;
+		}
+	}
 
 	/* DNS lookups could potentially take a while, so autoservice the channel just in case. */
+	start = ast_tvnow();
 	ast_autoservice_start(chan);
-
-	if ((rv = getaddrinfo(hostname, "4569", &hints, &servinfo)) != 0) {
-		ast_log(LOG_WARNING, "getaddrinfo: %s\n", gai_strerror(rv));
-		ast_autoservice_stop(chan);
-		return 1;
-	}
-
-	/* loop through all the results and connect to the first we can */
-	for (p = servinfo; p != NULL; p = p->ai_next) {
-		h = (struct sockaddr_in *) p->ai_addr;
-		strcpy(ip, ast_inet_ntoa(h->sin_addr));
-	}
-
-	freeaddrinfo(servinfo);
-	ast_debug(1, "Hostname '%s' resolved to IP address '%s'\n", hostname, ip);
-
+	res = resolve_hostname(hostname, ip);
 	ast_autoservice_stop(chan);
 
-	return 0;
+	if (async) {
+		async->end = ast_tvnow();
+		async->serial += ast_tvdiff_us(async->end, start);
+	}
+	return res;
 }
 
 static int is_private_ipv4(char *ip)
@@ -1008,6 +1322,39 @@ static int v_success(char *name, int in)
 	return 0;
 }
 
+static int v_async(char *name, struct verify_async *async)
+{
+	struct call_verify *v = NULL;
+	int64_t saved;
+
+	/* Compared to making the same requests one at a time */
+	saved = async->serial - ast_tvdiff_us(async->end, async->start);
+	if (saved < 0) {
+		saved = 0;
+	}
+	ast_debug(1, "Background requests saved %" PRId64 " ms\n", saved / 1000);
+
+	AST_RWLIST_RDLOCK(&verifys);
+	AST_LIST_TRAVERSE(&verifys, v, entry) {
+		if (!strcasecmp(v->name, name)) {
+			break;
+		}
+	}
+	AST_RWLIST_UNLOCK(&verifys);
+
+	if (!v) {
+		ast_log(LOG_WARNING, "Verification profile '%s' unexpectedly disappeared\n", name);
+		return -1;
+	}
+
+	ast_mutex_lock(&v->lock);
+	v->async_calls++;
+	v->async_saved += saved;
+	ast_mutex_unlock(&v->lock);
+
+	return 0;
+}
+
 static const char *stir_shaken_name(char c)
 {
 	switch (c) {
@@ -1188,8 +1535,9 @@ static int verify_exec(struct ast_channel *chan, const char *data)
 	char *vresult, *argstr, *callerid;
 	struct ast_str *strbuf = NULL;
 	int blacklisted = 0, success = 0;
+	RAII_VAR(struct verify_async *, async, NULL, ao2_cleanup);
 
-	int curl, method, extendtrust, allowtoken, sanitychecks, threshold, blacklist_failopen;
+	int curl, method, extendtrust, allowtoken, sanitychecks, threshold, blacklist_failopen, async_enabled, asyncdeadline;
 	char name[AST_MAX_CONTEXT], verifyrequest[PATH_MAX], verifycontext[AST_MAX_CONTEXT], local_var[AST_MAX_CONTEXT], stirshaken_var[AST_MAX_CONTEXT], remote_stirshaken_var[AST_MAX_CONTEXT], remote_var[AST_MAX_CONTEXT], via_remote_var[AST_MAX_CONTEXT], token_remote_var[AST_MAX_CONTEXT], validatetokenrequest[PATH_MAX], code_good[PATH_MAX], code_fail[PATH_MAX], code_spoof[PATH_MAX], exceptioncontext[PATH_MAX], setinvars[PATH_MAX], failgroup[PATH_MAX], failureaction[PATH_MAX], failurefile[PATH_MAX], failurelocation[PATH_MAX], successregex[PATH_MAX], blacklist_endpoint[PATH_MAX], loglevel[AST_MAX_CONTEXT], logmsg[PATH_MAX];
 	float blacklist_threshold;
 	char via[64] = { 0 };
@@ -1241,6 +1589,8 @@ static int verify_exec(struct ast_channel *chan, const char *data)
 	threshold = v->threshold;
 	blacklist_threshold = v->blacklist_threshold;
 	blacklist_failopen = v->blacklist_failopen;
+	async_enabled = v->async;
+	asyncdeadline = v->asyncdeadline ? v->asyncdeadline : curltimeout * 1000;
 	VERIFY_STRDUP(name);
 	VERIFY_STRDUP(verifyrequest);
 	VERIFY_STRDUP(verifycontext);
@@ -1285,6 +1635,10 @@ static int verify_exec(struct ast_channel *chan, const char *data)
 	ast_debug(1, "Verifying call against number '%s'\n", callerid);
 	ast_channel_unlock(chan);
 
+	if (async_enabled && curl && method <= 2) {
+		async = verify_async_alloc(asyncdeadline); /* If this fails, everything is just done synchronously */
+	}
+
 	/* Analyze STIR/SHAKEN result, if applicable */
 	if (!ast_strlen_zero(stirshaken_var)) {
 		parse_stir_shaken(chan, stirshaken_var);
@@ -1312,7 +1666,13 @@ static int verify_exec(struct ast_channel *chan, const char *data)
 			ast_log(LOG_WARNING, "Request method %s is incompatible with verification method %s\n", "direct", "enum");
 			return -1;
 		}
-		if (!resolve_verify_request(chan, verifyrequest, strbuf, curl, callerid)) {
+		if (async) {
+			verify_async_start(chan, async, verifyrequest, callerid, NULL);
+			if (*blacklist_endpoint) {
+				verify_async_start(chan, async, blacklist_endpoint, NULL, NULL);
+			}
+		}
+		if (!resolve_verify_request(chan, async, verifyrequest, strbuf, curl, callerid)) {
 			vresult = ast_str_buffer(strbuf);
 			if (*code_good && !strncmp(code_good, vresult, strlen(code_good))) { /* if the result starts with the code_good value, then it's a success. There could be other stuff afterwards. */
 				success = 1;
@@ -1430,6 +1790,27 @@ static int verify_exec(struct ast_channel *chan, const char *data)
 		} /* call allegedly originated from the node from which we received this call. Use reverse lookups to confirm. */
 		ast_channel_unlock(chan);
 
+		if (async) {
+			/* Start everything we may need below now, rather than one at a time when needed */
+			int havetoken = 0;
+			if (allowtoken && *token_remote_var && *validatetokenrequest && *via) {
+				ast_channel_lock(chan);
+				havetoken = !ast_strlen_zero(pbx_builtin_getvar_helper(chan, token_remote_var));
+				ast_channel_unlock(chan);
+			}
+			if (havetoken) {
+				verify_async_start(chan, async, validatetokenrequest, NULL, NULL);
+			}
+			verify_async_start(chan, async, verifyrequest, viaverify ? via : callerid, ""); /* and the reverse IP check */
+			if (sanitychecks) {
+				verify_async_start(chan, async, verifyrequest, "", NULL);
+				verify_async_start(chan, async, verifyrequest, "0123456789876543210", NULL);
+			}
+			if (*blacklist_endpoint) {
+				verify_async_start(chan, async, blacklist_endpoint, NULL, NULL);
+			}
+		}
+
 		if (allowtoken && *token_remote_var) {
 			char *token;
 			ast_channel_lock(chan);
@@ -1442,7 +1823,7 @@ static int verify_exec(struct ast_channel *chan, const char *data)
 			} else if (!*via) {
 				ast_log(LOG_WARNING, "Token '%s' is present, but missing via_remote_var in configuration\n", token);
 			} else {
-				if (resolve_verify_request(chan, validatetokenrequest, strbuf, curl, NULL)) { /* this number is probably not valid on anything, anywhere */
+				if (resolve_verify_request(chan, async, validatetokenrequest, strbuf, curl, NULL)) { /* this number is probably not valid on anything, anywhere */
 					ast_log(LOG_WARNING, "Token verification failed, proceeding with regular verification\n");
 				}
 				if (!strcmp(via, ast_str_buffer(strbuf))) { /* token must return the same value that via_remote_var contains */
@@ -1465,7 +1846,7 @@ static int verify_exec(struct ast_channel *chan, const char *data)
 		}
 
 		ast_debug(1, "Verifying call against '%s' (%s)\n", viaverify ? via : callerid, viaverify ? "indirect" : "direct");
-		if (resolve_verify_request(chan, verifyrequest, strbuf, curl, viaverify ? via : callerid)) {
+		if (resolve_verify_request(chan, async, verifyrequest, strbuf, curl, viaverify ? via : callerid)) {
 			goto fail;
 		}
 		dialstring = ast_strdupa(ast_str_buffer(strbuf));
@@ -1474,13 +1855,13 @@ static int verify_exec(struct ast_channel *chan, const char *data)
 		if (sanitychecks) {
 			char *nonumber, *invalidnumber;
 			/* Check that the calling number is not simply blatantly stupid */
-			if (resolve_verify_request(chan, verifyrequest, strbuf, curl, "")) {
+			if (resolve_verify_request(chan, async, verifyrequest, strbuf, curl, "")) {
 				goto fail;
 			}
 			nonumber = ast_strdupa(ast_str_buffer(strbuf)); /* strdupa required since we'll overwrite strbuf */
 			ast_str_reset(strbuf);
 
-			if (resolve_verify_request(chan, verifyrequest, strbuf, curl, "0123456789876543210")) { /* this number is probably not valid on anything, anywhere */
+			if (resolve_verify_request(chan, async, verifyrequest, strbuf, curl, "0123456789876543210")) { /* this number is probably not valid on anything, anywhere */
 				goto fail;
 			}
 			invalidnumber = ast_strdupa(ast_str_buffer(strbuf));
@@ -1509,7 +1890,7 @@ static int verify_exec(struct ast_channel *chan, const char *data)
 		ast_debug(1, "Calling host is '%s'\n", peer);
 		ast_str_reset(strbuf);
 
-		if (hostname_to_ip(chan, peer, ip)) { /* yes, this works with both hostnames and IP addresses, so just try to resolve everything */
+		if (hostname_to_ip(chan, async, peer, ip)) { /* yes, this works with both hostnames and IP addresses, so just try to resolve everything */
 			goto fail;
 		}
 		ast_debug(1, "%s resolved to %s, next, comparing it with %s\n", peer, ip, peerip);
@@ -1602,7 +1983,7 @@ done:
 		char substituted[SUB_BUFLEN];
 
 		pbx_substitute_variables_helper(chan, blacklist_endpoint, substituted, sizeof(substituted) - 1);
-		if (verify_curl(chan, strbuf, substituted)) {
+		if (verify_fetch(chan, async, strbuf, substituted)) {
 			ast_debug(1, "Failed to check blacklist for number '%s', %s (%s)\n", callerid, blacklist_failopen ? "accepting" : "rejecting", ast_str_buffer(strbuf));
 		} else {
 			float blacklistfloat;
@@ -1622,6 +2003,10 @@ done:
 
 	ast_free(strbuf);
 
+	if (async) {
+		v_async(name, async);
+	}
+
 	if (blacklisted) {
 		v_blacklisted(name);
 		return -1; /* if caller is sufficiently blacklisted, then say goodbye */
@@ -1691,8 +2076,9 @@ static int outverify_exec(struct ast_channel *chan, const char *data)
 	char *cnam, *currentcode;
 	int success = 1;
 	int len;
+	RAII_VAR(struct verify_async *, async, NULL, ao2_cleanup);
 
-	int allowtoken, allowdisathru, allowpstnthru, flagprivateip;
+	int allowtoken, allowdisathru, allowpstnthru, flagprivateip, async_enabled, asyncdeadline;
 	char name[AST_MAX_CONTEXT], verifyrequest[PATH_MAX], local_var[AST_MAX_CONTEXT], remote_var[AST_MAX_CONTEXT], via_remote_var[AST_MAX_CONTEXT], setoutvars[PATH_MAX], token_remote_var[AST_MAX_CONTEXT], validatetokenrequest[AST_MAX_CONTEXT], obtaintokenrequest[PATH_MAX], via_number[AST_MAX_CONTEXT], clli[AST_MAX_CONTEXT], region[AST_MAX_CONTEXT], outregex[PATH_MAX];
 
 	AST_DECLARE_APP_ARGS(args,
@@ -1732,6 +2118,8 @@ static int outverify_exec(struct ast_channel *chan, const char *data)
 	allowdisathru = v->allowdisathru;
 	allowpstnthru = v->allowpstnthru;
 	flagprivateip = v->flagprivateip;
+	async_enabled = v->async;
+	asyncdeadline = v->asyncdeadline ? v->asyncdeadline : curltimeout * 1000;
 	VERIFY_STRDUP(name);
 	VERIFY_STRDUP(verifyrequest);
 	VERIFY_STRDUP(via_remote_var);
@@ -1752,6 +2140,16 @@ static int outverify_exec(struct ast_channel *chan, const char *data)
 	VERIFY_ASSERT_VAR_EXISTS(via_remote_var);
 	VERIFY_ASSERT_VAR_EXISTS(via_number);
 
+	if (async_enabled && !ast_strlen_zero(args.lookup)) {
+		/* Resolve the destination while the token is requested */
+		struct ast_str *hostbuf = ast_str_create(256);
+		if (hostbuf && (async = verify_async_alloc(asyncdeadline))) {
+			parse_iax2_dial_string(ast_strdupa(args.lookup), hostbuf);
+			verify_async_start(chan, async, NULL, NULL, ast_str_buffer(hostbuf));
+		}
+		ast_free(hostbuf);
+	}
+
 	localvar = local_var;
 
 	/* The config file var could be prefixed with 1 or 2 underscores, so that when the var is set, it increases the scope. */
@@ -1790,7 +2188,7 @@ static int outverify_exec(struct ast_channel *chan, const char *data)
 		}
 
 		pbx_substitute_variables_helper(chan, obtaintokenrequest, substituted, sizeof(substituted) - 1);
-		if (verify_curl(chan, strbuf, substituted)) {
+		if (verify_fetch(chan, async, strbuf, substituted)) {
 			ast_log(LOG_WARNING, "Failed to obtain verification token. This call may not succeed.\n");
 			pbx_builtin_setvar_helper(chan, "OUTVERIFYSTATUS", "FAILURE");
 			success = 0;
@@ -1854,7 +2252,7 @@ static int outverify_exec(struct ast_channel *chan, const char *data)
 
 			parse_iax2_dial_string(lookup, strbuf); /* get the host */
 			peer = ast_strdupa(ast_str_buffer(strbuf));
-			if (hostname_to_ip(chan, peer, ip)) { /* yes, this works with both hostnames and IP addresses, so just try to resolve everything */
+			if (hostname_to_ip(chan, async, peer, ip)) { /* yes, this works with both hostnames and IP addresses, so just try to resolve everything */
 				ast_debug(1, "Failed to resolve hostname '%s'\n", peer);
 				malicious = 1;
 			} else if (flagprivateip && is_private_ipv4(ip)) { /* make sure it's not a private IPv4 address */
@@ -1897,6 +2295,10 @@ static int outverify_exec(struct ast_channel *chan, const char *data)
 		pbx_builtin_setvar_helper(chan, "OUTVERIFYSTATUS", "PROCEED");
 	}
 
+	if (async) {
+		v_async(name, async);
+	}
+
 	return 0;
 }
 
@@ -2026,6 +2428,8 @@ static char *handle_show_profile(struct ast_cli_entry *e, int cmd, struct ast_cl
 			ast_cli(a->fd, FORMAT, "Blacklist Endpoint", v->blacklist_endpoint);
 			ast_cli(a->fd, FORMAT2, "Blacklist Threshold", v->blacklist_threshold);
 			ast_cli(a->fd, FORMAT, "Blacklist Fail Open", AST_CLI_YESNO(v->blacklist_failopen));
+			ast_cli(a->fd, FORMAT, "Async Requests", AST_CLI_YESNO(v->async));
+			ast_cli(a->fd, "%-32s : %d ms\n", "Async Deadline", v->asyncdeadline ? v->asyncdeadline : curltimeout * 1000);
 			ast_cli(a->fd, FORMAT, "Exception Context", v->exceptioncontext);
 			ast_cli(a->fd, FORMAT, "Failure Action", v->failureaction);
 			ast_cli(a->fd, FORMAT, "Failure Playback File", v->failurefile);
@@ -2045,6 +2449,10 @@ static char *handle_show_profile(struct ast_cli_entry *e, int cmd, struct ast_cl
 			ast_cli(a->fd, "%s%u of %u%s outgoing calls in profile '%s' have successfully been out-verified\n",
 				ast_term_color(v->outsuccess == 0 ? COLOR_RED : COLOR_GREEN, COLOR_BLACK),
 				v->outsuccess, v->out, ast_term_reset(), v->name);
+			if (v->async_calls) {
+				ast_cli(a->fd, "%u calls in profile '%s' used background requests, saving an average of %.1f ms per call\n",
+					v->async_calls, v->name, v->async_saved / 1000.0 / v->async_calls);
+			}
 			break;
 		}
 	}
@@ -2081,6 +2489,8 @@ static char *handle_reset_stats(struct ast_cli_entry *e, int cmd, struct ast_cli
 		v->insuccess = 0;
 		v->out = 0;
 		v->outsuccess = 0;
+		v->async_calls = 0;
+		v->async_saved = 0;
 	}
 	AST_RWLIST_UNLOCK(&verifys);
 
@@ -2095,11 +2505,30 @@ static char *handle_reset_stats(struct ast_cli_entry *e, int cmd, struct ast_cli
 	return CLI_SUCCESS;
 }
 
+/*! \brief CLI command to show HTTP connection statistics */
+static char *handle_show_http(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch(cmd) {
+	case CLI_INIT:
+		e->command = "verify show http";
+		e->usage =
+			"Usage: verify show http\n"
+			"       Display HTTP connection reuse and request latency.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	curl_pool_show(&curl_pool, a->fd);
+	return CLI_SUCCESS;
+}
+
 static struct ast_cli_entry verify_cli[] = {
 	AST_CLI_DEFINE(handle_show_stirshaken, "Display STIR/SHAKEN statistics"),
 	AST_CLI_DEFINE(handle_show_profiles, "Display statistics about verification profiles"),
 	AST_CLI_DEFINE(handle_show_profile, "Displays information about a verification profile"),
 	AST_CLI_DEFINE(handle_reset_stats, "Resets call verification statistics for all profiles"),
+	AST_CLI_DEFINE(handle_show_http, "Display HTTP connection statistics"),
 };
 
 static int unload_module(void)
@@ -2117,6 +2546,7 @@ static int unload_module(void)
 
 	AST_RWLIST_UNLOCK(&verifys);
 
+	curl_pool_destroy(&curl_pool);
 	ast_mutex_destroy(&ss_lock);
 	return 0;
 }
@@ -2135,9 +2565,14 @@ static int load_module(void)
 {
 	int res;
 
+	if (curl_pool_init(&curl_pool)) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
 	ast_mutex_init(&ss_lock);
 
 	if (reload_verify(0)) {
+		curl_pool_destroy(&curl_pool);
 		ast_mutex_destroy(&ss_lock);
 		return AST_MODULE_LOAD_DECLINE;
 	}
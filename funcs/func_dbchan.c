@@ -35,6 +35,7 @@
 #include "asterisk/utils.h"
 #include "asterisk/app.h"
 #include "asterisk/astdb.h"
+#include "asterisk/astobj2.h"
 
 /*** DOCUMENTATION
 	<function name="DB_CHANNEL" language="en_US">
@@ -120,9 +121,11 @@
 		</syntax>
 		<description>
 			<para>Returns the family/key of the smallest numerical key from a list of AstDB families.</para>
+			<para>Families indexed using <literal>DB_KEYINDEX</literal> are not read from the database.</para>
 		</description>
 		<see-also>
 			<ref type="function">DB_MAXKEY</ref>
+			<ref type="function">DB_KEYINDEX</ref>
 			<ref type="function">MIN</ref>
 			<ref type="function">MAX</ref>
 		</see-also>
@@ -138,13 +141,38 @@
 		</syntax>
 		<description>
 			<para>Returns the family/key of the largest numerical key from a list of AstDB families.</para>
+			<para>Families indexed using <literal>DB_KEYINDEX</literal> are not read from the database.</para>
 		</description>
 		<see-also>
 			<ref type="function">DB_MINKEY</ref>
+			<ref type="function">DB_KEYINDEX</ref>
 			<ref type="function">MIN</ref>
 			<ref type="function">MAX</ref>
 		</see-also>
 	</function>
+	<function name="DB_KEYINDEX" language="en_US">
+		<synopsis>
+			Keeps an in-memory numerically ordered index of the keys in an AstDB family.
+		</synopsis>
+		<syntax argsep="/">
+			<parameter name="family" required="true" />
+		</syntax>
+		<description>
+			<para>Writing a true value builds an index of the numerical keys in an AstDB family,
+			which <literal>DB_MINKEY</literal> and <literal>DB_MAXKEY</literal> will then use
+			instead of reading the entire family. Writing a false value removes the index.</para>
+			<para>Reading returns the number of keys in the index, or an empty string if the family is not indexed.</para>
+			<para>The index is kept up to date when keys are added using <literal>DB_UNIQUE</literal>
+			and deleted using the <literal>DB_CHANNEL</literal> functions. Keys deleted by other means
+			are dropped from the index when they are found to be missing, but keys added by other means
+			(e.g. using <literal>DB</literal>) are not seen until the index is built again.</para>
+		</description>
+		<see-also>
+			<ref type="function">DB_MINKEY</ref>
+			<ref type="function">DB_MAXKEY</ref>
+			<ref type="function">DB_UNIQUE</ref>
+		</see-also>
+	</function>
 	<function name="DB_UNIQUE" language="en_US">
 		<synopsis>
 			Returns a unique DB key that can be used to store a value in AstDB.
@@ -173,6 +201,298 @@
 	</function>
  ***/
 
+/*! \brief A key in a family index */
+struct index_key {
+	double value;
+	char key[0];
+};
+
+/*! \brief Numerical keys in a family, in ascending order */
+struct key_index {
+	struct index_key **keys;
+	int num;
+	int alloc;
+	AST_RWLIST_ENTRY(key_index) entry;
+	char family[0];
+};
+
+static AST_RWLIST_HEAD_STATIC(key_indexes, key_index);
+
+/*! \note Must be called with key_indexes locked */
+static struct key_index *index_find(const char *family)
+{
+	struct key_index *idx;
+
+	AST_RWLIST_TRAVERSE(&key_indexes, idx, entry) {
+		if (!strcmp(idx->family, family)) {
+			return idx;
+		}
+	}
+	return NULL;
+}
+
+static void index_free(struct key_index *idx)
+{
+	int i;
+
+	for (i = 0; i < idx->num; i++) {
+		ast_free(idx->keys[i]);
+	}
+	ast_free(idx->keys);
+	ast_free(idx);
+}
+
+/*! \brief Position of the first key that doesn't sort before value/key */
+static int index_position(struct key_index *idx, double value, const char *key)
+{
+	int low = 0, high = idx->num;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+		struct index_key *ik = idx->keys[mid];
+		int cmp = ik->value < value ? -1 : ik->value > value ? 1 : strcmp(ik->key, key);
+		if (cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*! \note Must be called with key_indexes write locked */
+static int index_insert(struct key_index *idx, const char *key)
+{
+	struct index_key *ik;
+	double value = atof(key);
+	int pos = index_position(idx, value, key);
+
+	if (pos < idx->num && !strcmp(idx->keys[pos]->key, key)) {
+		return 0; /* Already indexed */
+	}
+	if (idx->num == idx->alloc) {
+		int alloc = idx->alloc ? idx->alloc * 2 : 32;
+		struct index_key **keys = ast_realloc(idx->keys, alloc * sizeof(*keys));
+		if (!keys) {
+			return -1;
+		}
+		idx->keys = keys;
+		idx->alloc = alloc;
+	}
+	ik = ast_malloc(sizeof(*ik) + strlen(key) + 1);
+	if (!ik) {
+		return -1;
+	}
+	ik->value = value;
+	strcpy(ik->key, key); /* Safe */
+	/* Keys are usually added in increasing order, so this usually doesn't move anything */
+	memmove(&idx->keys[pos + 1], &idx->keys[pos], (idx->num - pos) * sizeof(*idx->keys));
+	idx->keys[pos] = ik;
+	idx->num++;
+	return 0;
+}
+
+/*! \note Must be called with key_indexes write locked */
+static void index_remove_at(struct key_index *idx, int pos)
+{
+	ast_free(idx->keys[pos]);
+	idx->num--;
+	memmove(&idx->keys[pos], &idx->keys[pos + 1], (idx->num - pos) * sizeof(*idx->keys));
+}
+
+/*! \note Must be called with key_indexes write locked */
+static void index_remove(struct key_index *idx, const char *key)
+{
+	int pos = index_position(idx, atof(key), key);
+
+	if (pos < idx->num && !strcmp(idx->keys[pos]->key, key)) {
+		index_remove_at(idx, pos);
+	}
+}
+
+/*! \brief Keep a family's index, if it has one, in sync with a key written to the database */
+static void index_sync(const char *family, const char *key, int added)
+{
+	struct key_index *idx;
+
+	AST_RWLIST_WRLOCK(&key_indexes);
+	idx = index_find(family);
+	if (idx) {
+		if (added) {
+			if (index_insert(idx, key)) {
+				ast_log(LOG_WARNING, "Failed to add %s/%s to index, dropping index\n", family, key);
+				AST_RWLIST_REMOVE(&key_indexes, idx, entry);
+				index_free(idx);
+			}
+		} else {
+			index_remove(idx, key);
+		}
+	}
+	AST_RWLIST_UNLOCK(&key_indexes);
+}
+
+/*! \brief Build (or rebuild) the index for a family */
+static int index_build(const char *family)
+{
+	struct ast_db_entry *dbe, *orig_dbe;
+	struct key_index *idx, *old;
+	size_t parselen = strlen(family);
+	const char *last = "";
+
+	idx = ast_calloc(1, sizeof(*idx) + parselen + 1);
+	if (!idx) {
+		return -1;
+	}
+	strcpy(idx->family, family); /* Safe */
+
+	/* Hold the lock from reading the tree until the new index replaces the old one.
+	 * Otherwise, keys written in the meantime would be added to the old index, and lost with it.
+	 * Writers update the database first, so anything they sync while we wait is either in the tree or applied after. */
+	AST_RWLIST_WRLOCK(&key_indexes);
+	orig_dbe = ast_db_gettree(family, NULL);
+	for (dbe = orig_dbe; dbe; dbe = dbe->next) {
+		/* Find the current component */
+		char *curkey = &dbe->key[parselen + 1], *slash;
+		if (*curkey == '/') {
+			curkey++;
+		}
+		/* Remove everything after the current component */
+		if ((slash = strchr(curkey, '/'))) {
+			*slash = '\0';
+		}
+		if (*curkey == '\0' || !strcmp(last, curkey)) {
+			continue;
+		}
+		last = curkey;
+		if (index_insert(idx, curkey)) {
+			AST_RWLIST_UNLOCK(&key_indexes);
+			ast_db_freetree(orig_dbe);
+			index_free(idx);
+			return -1;
+		}
+	}
+	ast_db_freetree(orig_dbe);
+
+	old = index_find(family);
+	if (old) {
+		AST_RWLIST_REMOVE(&key_indexes, old, entry);
+		index_free(old);
+	}
+	AST_RWLIST_INSERT_TAIL(&key_indexes, idx, entry);
+	AST_RWLIST_UNLOCK(&key_indexes);
+
+	ast_debug(1, "Indexed %d key%s in family '%s'\n", idx->num, ESS(idx->num), family);
+	return 0;
+}
+
+/*!
+ * \brief Smallest or largest key in an indexed family
+ * \retval 1 if the family is indexed and has a key, 0 if indexed but empty, -1 if not indexed
+ * \note Keys that no longer exist in the database are dropped from the index
+ */
+static int index_extreme(const char *family, int newest, double *value, char *key, size_t keylen)
+{
+	struct key_index *idx;
+	int res = -1;
+
+	AST_RWLIST_WRLOCK(&key_indexes);
+	idx = index_find(family);
+	if (idx) {
+		res = 0;
+		while (idx->num) {
+			int pos = 0;
+			char tmpbuf[1];
+			if (newest) {
+				/* Of equal keys, use the first one, same as when reading the family */
+				pos = idx->num - 1;
+				while (pos > 0 && idx->keys[pos - 1]->value == idx->keys[pos]->value) {
+					pos--;
+				}
+			}
+			if (ast_db_get(family, idx->keys[pos]->key, tmpbuf, 1)) { /* we don't actually care about the value */
+				ast_debug(1, "%s/%s was deleted from the database, dropping from index\n", family, idx->keys[pos]->key);
+				index_remove_at(idx, pos);
+				continue;
+			}
+			*value = idx->keys[pos]->value;
+			ast_copy_string(key, idx->keys[pos]->key, keylen);
+			res = 1;
+			break;
+		}
+	}
+	AST_RWLIST_UNLOCK(&key_indexes);
+	return res;
+}
+
+#define SNAPSHOT_BUCKETS 563
+
+/* Objects and search keys are both just channel names or unique IDs */
+static int snapshot_hash_fn(const void *obj, const int flags)
+{
+	return ast_str_case_hash(obj);
+}
+
+static int snapshot_cmp_fn(void *obj, void *arg, int flags)
+{
+	return !strcasecmp(obj, arg) ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static void snapshot_add(struct ao2_container *channels, const char *name)
+{
+	char *str = ao2_alloc_options(strlen(name) + 1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+	if (str) {
+		strcpy(str, name); /* Safe */
+		ao2_link(channels, str);
+		ao2_ref(str, -1);
+	}
+}
+
+/*! \brief Names and unique IDs of all channels that currently exist */
+static struct ao2_container *channel_snapshot(void)
+{
+	struct ao2_container *channels;
+	struct ast_channel_iterator *iter;
+	struct ast_channel *chan;
+
+	channels = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, SNAPSHOT_BUCKETS, snapshot_hash_fn, NULL, snapshot_cmp_fn);
+	if (!channels) {
+		return NULL;
+	}
+	iter = ast_channel_iterator_all_new();
+	if (!iter) {
+		ao2_ref(channels, -1);
+		return NULL;
+	}
+	for (; (chan = ast_channel_iterator_next(iter)); ast_channel_unref(chan)) {
+		ast_channel_lock(chan);
+		snapshot_add(channels, ast_channel_name(chan));
+		snapshot_add(channels, ast_channel_uniqueid(chan));
+		ast_channel_unlock(chan);
+	}
+	ast_channel_iterator_destroy(iter);
+	return channels;
+}
+
+/*! \brief Whether a channel name or unique ID belongs to a channel that still exists */
+static int channel_alive(struct ao2_container *channels, const char *name)
+{
+	if (channels) {
+		char *found = ao2_find(channels, name, OBJ_SEARCH_KEY);
+		if (found) {
+			ao2_ref(found, -1);
+			return 1;
+		}
+	} else {
+		struct ast_channel *chan_found = ast_channel_get_by_name(name);
+		if (chan_found) {
+			ast_channel_unref(chan_found);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 static int db_chan_helper(struct ast_channel *chan, const char *cmd, char *parse, char *buf, size_t len, int prune)
 {
 	struct ast_db_entry *dbe, *orig_dbe;
@@ -180,6 +500,7 @@ static int db_chan_helper(struct ast_channel *chan, const char *cmd, char *parse
 	const char *last = "";
 	int pruned = 0;
 	int epochparse = 0, found = 0;
+	struct ao2_container *channels = NULL;
 
 	if (prune == 2) { /* DB_CHANNEL_PRUNE_TIME */
 		char *epochthreshold = strsep(&parse, ",");
@@ -217,16 +538,23 @@ static int db_chan_helper(struct ast_channel *chan, const char *cmd, char *parse
 			family[--parselen] = '\0';
 		}
 
-		/* Nothing within the database at that prefix? */
+		/* Nothing within the database at that prefix? The tree includes the values, so this is the only query needed to read the family. */
 		if (!(orig_dbe = dbe = ast_db_gettree(family, NULL))) {
 			ast_debug(1, "Nothing within database at prefix '%s'\n", family);
 			continue;
 		}
 
+		/* DB_CHANNEL_PRUNE checks every key, so check them all against one snapshot of the channels,
+		 * rather than looking up each channel. The snapshot must be taken after reading the tree,
+		 * so that any channel in the tree that still exists is in the snapshot. */
+		if (prune == 1) {
+			channels = channel_snapshot();
+		}
+
 		for (; dbe; dbe = dbe->next) {
 #define BUFFER_SIZE 256
-			struct ast_channel *chan_found = NULL;
-			char channel[BUFFER_SIZE];
+			char channelbuf[BUFFER_SIZE];
+			const char *channel;
 			/* Find the current component */
 			char *curkey = &dbe->key[parselen + 1], *slash;
 			if (*curkey == '/') {
@@ -248,15 +576,17 @@ static int db_chan_helper(struct ast_channel *chan, const char *cmd, char *parse
 				continue;
 			}
 
-			if (ast_db_get(family, curkey, channel, BUFFER_SIZE)) {
+			if (!slash) {
+				channel = dbe->data; /* This is the entry for the key itself */
+			} else if (!ast_db_get(family, curkey, channelbuf, BUFFER_SIZE)) {
+				channel = channelbuf;
+			} else {
 				ast_log(LOG_WARNING, "%s: Couldn't find %s/%s in database\n", cmd, family, curkey);
 				continue;
 			}
 
 			if (prune != 2) { /* skip for DB_CHANNEL_PRUNE_TIME, because the values aren't channel names */
-				chan_found = ast_channel_get_by_name(channel);
-				if (chan_found) {
-					ast_channel_unref(chan_found);
+				if (channel_alive(channels, channel)) {
 					/* main difference between DB_CHANNEL and DB_CHANNEL_PRUNE is latter always checks all keys.
 						Former stops if/when we find a match. */
 					if (prune) {
@@ -281,16 +611,21 @@ static int db_chan_helper(struct ast_channel *chan, const char *cmd, char *parse
 			pruned++;
 			if (ast_db_del(family, curkey)) {
 				ast_log(LOG_WARNING, "%s: %s/%s could not be deleted from the database\n", cmd, family, curkey);
-			} else if (parallel) {
-				ast_debug(1, "%s: Also saying goodbye to %s/%s, if it exists\n", cmd, parallel, curkey);
-				if (!ast_db_get(parallel, curkey, buf, len - 1)) {
+			} else {
+				index_sync(family, curkey, 0);
+				if (parallel) {
+					ast_debug(1, "%s: Also saying goodbye to %s/%s, if it exists\n", cmd, parallel, curkey);
 					if (ast_db_del(parallel, curkey)) {
 						ast_debug(1, "%s/%s could not be deleted from the database\n", parallel, curkey);
+					} else {
+						index_sync(parallel, curkey, 0);
 					}
 				}
 			}
 		}
 		ast_db_freetree(orig_dbe);
+		ao2_cleanup(channels);
+		channels = NULL;
 		if (found) {
 			break;
 		}
@@ -323,10 +658,13 @@ static int db_extreme_helper(char *parse, char *buf, size_t len, int newest)
 	/* winner should be a float, not an int, to work properly with decimals, e.g. DB_UNIQUE */
 	double winner; /* meh, a float might be sufficient, but the extra precision might be worth it */
 	char *family;
-	char *parsedup = ast_strdupa(parse);
 
-	while ((family = strsep(&parsedup, ","))) {
+	while ((family = strsep(&parse, ","))) {
 		size_t parselen = strlen(family);
+		char indexkey[256];
+		double x;
+		int res;
+
 		ast_debug(1, "Traversing family '%s'\n", family);
 		/* Remove leading and trailing slashes */
 		while (family[0] == '/') {
@@ -337,6 +675,19 @@ static int db_extreme_helper(char *parse, char *buf, size_t len, int newest)
 			family[--parselen] = '\0';
 		}
 
+		/* If the family is indexed, we already know its smallest and largest keys */
+		res = index_extreme(family, newest, &x, indexkey, sizeof(indexkey));
+		if (res >= 0) {
+			/* Keep the first winner on ties, as if the family had been read */
+			if (res && (!winnerfound || (newest ? (x > winner) : (x < winner)))) {
+				winnerfound = 1;
+				winner = x;
+				snprintf(buf, len, "%s/%s", family, indexkey);
+				ast_debug(1, "Winner is now %f (%s, indexed)\n", winner, buf);
+			}
+			continue;
+		}
+
 		/* Nothing within the database at that prefix? */
 		if (!(orig_dbe = dbe = ast_db_gettree(family, NULL))) {
 			continue;
@@ -355,19 +706,13 @@ static int db_extreme_helper(char *parse, char *buf, size_t len, int newest)
 			if (*curkey == '\0') {
 				continue;
 			}
-			if (!winnerfound) {
+			x = atof(curkey);
+			if (!winnerfound || (newest ? (x > winner) : (x < winner))) { /* do we want the newest or oldest key? */
 				winnerfound = 1;
-				winner = atof(curkey);
-				ast_debug(1, "Winner is now %f (%s)\n", winner, curkey);
-			} else {
-				/* in reality, it'll probably be quicker to only keep track of the winning key,
-					and then iterate through a 2nd time just once to copy the name of the key,
-					as opposed to copying the key name each time there is a new winner */
-				double x = atof(curkey);
-				if (newest ? (x > winner) : (x < winner)) { /* do we want the newest or oldest key? */
-					winner = x;
-					ast_debug(1, "Winner is now %f (%s)\n", winner, curkey);
-				}
+				winner = x;
+				/* Remember where the winner came from, so we don't need to go back and find it */
+				snprintf(buf, len, "%s/%s", family, curkey);
+				ast_debug(1, "Winner is now %f (%s)\n", winner, buf);
 			}
 		}
 		ast_db_freetree(orig_dbe);
@@ -375,48 +720,6 @@ static int db_extreme_helper(char *parse, char *buf, size_t len, int newest)
 	if (!winnerfound) {
 		return -1;
 	}
-	/* now we know the key we want, so go back and find it */
-	while ((family = strsep(&parse, ","))) {
-		int found = 0;
-		size_t parselen = strlen(family);
-		/* Remove leading and trailing slashes */
-		while (family[0] == '/') {
-			family++;
-			parselen--;
-		}
-		while (family[parselen - 1] == '/') {
-			family[--parselen] = '\0';
-		}
-
-		/* Nothing within the database at that prefix? */
-		if (!(orig_dbe = dbe = ast_db_gettree(family, NULL))) {
-			continue;
-		}
-
-		for (; dbe; dbe = dbe->next) {
-			/* Find the current component */
-			char *curkey = &dbe->key[parselen + 1], *slash;
-			if (*curkey == '/') {
-				curkey++;
-			}
-			/* Remove everything after the current component */
-			if ((slash = strchr(curkey, '/'))) {
-				*slash = '\0';
-			}
-			if (atof(curkey) == winner) {
-				snprintf(buf, len, "%s/%s", family, curkey);
-				found =  1;
-				break;
-			}
-		}
-		ast_db_freetree(orig_dbe);
-		if (found) {
-			break;
-		}
-	}
-	if (ast_strlen_zero(buf)) {
-		ast_log(LOG_WARNING, "BUG! Found winner but buffer empty?\n");
-	}
 	return 0;
 }
 
@@ -476,6 +779,8 @@ static int db_unique_helper(char *family, int write, const char *value, char *bu
 		if (write) {
 			if (ast_db_put(family, fullkey, value)) {
 				ast_log(LOG_WARNING, "DB_UNIQUE: Error writing value to database.\n");
+			} else {
+				index_sync(family, fullkey, 1);
 			}
 		} else {
 			ast_copy_string(buf, fullkey, len); /* reading only, so write the key name into the buffer */
@@ -495,6 +800,66 @@ static int function_db_unique_write(struct ast_channel *chan, const char *cmd, c
 	return db_unique_helper(parse, 1, value, NULL, 0);
 }
 
+/*! \brief Normalize a family name the same way as the other functions */
+static char *index_family(char *family)
+{
+	size_t parselen;
+
+	while (family[0] == '/') {
+		family++;
+	}
+	parselen = strlen(family);
+	while (parselen && family[parselen - 1] == '/') {
+		family[--parselen] = '\0';
+	}
+	return family;
+}
+
+static int function_db_keyindex_read(struct ast_channel *chan, const char *cmd, char *parse, char *buf, size_t len)
+{
+	struct key_index *idx;
+	char *family = index_family(parse);
+
+	if (ast_strlen_zero(family)) {
+		ast_log(LOG_WARNING, "%s requires a family\n", cmd);
+		return -1;
+	}
+
+	AST_RWLIST_RDLOCK(&key_indexes);
+	idx = index_find(family);
+	if (idx) {
+		snprintf(buf, len, "%d", idx->num);
+	} else {
+		buf[0] = '\0';
+	}
+	AST_RWLIST_UNLOCK(&key_indexes);
+	return 0;
+}
+
+static int function_db_keyindex_write(struct ast_channel *chan, const char *cmd, char *parse, const char *value)
+{
+	struct key_index *idx;
+	char *family = index_family(parse);
+
+	if (ast_strlen_zero(family)) {
+		ast_log(LOG_WARNING, "%s requires a family\n", cmd);
+		return -1;
+	}
+
+	if (ast_true(value)) {
+		return index_build(family);
+	}
+
+	AST_RWLIST_WRLOCK(&key_indexes);
+	idx = index_find(family);
+	if (idx) {
+		AST_RWLIST_REMOVE(&key_indexes, idx, entry);
+		index_free(idx);
+	}
+	AST_RWLIST_UNLOCK(&key_indexes);
+	return 0;
+}
+
 static struct ast_custom_function db_chan_get_function = {
 	.name = "DB_CHANNEL",
 	.read = function_db_chan_get,
@@ -520,6 +885,12 @@ static struct ast_custom_function db_maxkey_function = {
 	.read = function_db_maxkey,
 };
 
+static struct ast_custom_function db_keyindex_function = {
+	.name = "DB_KEYINDEX",
+	.read = function_db_keyindex_read,
+	.write = function_db_keyindex_write,
+};
+
 static struct ast_custom_function db_unique_function = {
 	.name = "DB_UNIQUE",
 	.read = function_db_unique_read,
@@ -529,14 +900,22 @@ static struct ast_custom_function db_unique_function = {
 static int unload_module(void)
 {
 	int res = 0;
+	struct key_index *idx;
 
 	res |= ast_custom_function_unregister(&db_chan_get_function);
 	res |= ast_custom_function_unregister(&db_chan_prune_function);
 	res |= ast_custom_function_unregister(&db_chan_prune_time_function);
 	res |= ast_custom_function_unregister(&db_minkey_function);
 	res |= ast_custom_function_unregister(&db_maxkey_function);
+	res |= ast_custom_function_unregister(&db_keyindex_function);
 	res |= ast_custom_function_unregister(&db_unique_function);
 
+	AST_RWLIST_WRLOCK(&key_indexes);
+	while ((idx = AST_RWLIST_REMOVE_HEAD(&key_indexes, entry))) {
+		index_free(idx);
+	}
+	AST_RWLIST_UNLOCK(&key_indexes);
+
 	return res;
 }
 
@@ -549,6 +928,7 @@ static int load_module(void)
 	res |= ast_custom_function_register(&db_chan_prune_time_function);
 	res |= ast_custom_function_register(&db_minkey_function);
 	res |= ast_custom_function_register(&db_maxkey_function);
+	res |= ast_custom_function_register(&db_keyindex_function);
 	res |= ast_custom_function_register(&db_unique_function);
 
 	return res;
@@ -33,6 +33,7 @@
 #include "asterisk/channel.h"
 #include "asterisk/utils.h"
 #include "asterisk/cli.h"
+#include "asterisk/datastore.h"
 
 /*** DOCUMENTATION
 	<function name="EPHEMERAL_UNIQUEID" language="en_US">
@@ -43,10 +44,9 @@
 		<description>
 			<para>Returns an ephemerally unique ID for the channel across the current set of channels.</para>
 			<para>The first time this function is called, it will return 0.</para>
-			<para>On subsequent calls, it will return the next available ID after the highest numbered
-			ID that is still in use.</para>
+			<para>On subsequent calls, it will return the lowest numbered ID that is not in use.</para>
 			<para>For example, the second call would return 1, the third would return 2, etc.
-			If 2 were to hang up, then 2 would be reallocated on the next call.</para>
+			If 1 were to hang up, then 1 would be reallocated on the next call.</para>
 			<para>This provides an alternative the <literal>UNIQUEID</literal> function, when
 			purely numeric (and short and small) IDs are required that only need to be unique
 			as long as the channel exists.</para>
@@ -60,17 +60,84 @@ struct uniqueid {
 	int id;
 	time_t allocated;
 	const char *channel;
-	AST_RWLIST_ENTRY(uniqueid) entry;
+	AST_DLLIST_ENTRY(uniqueid) entry;
 	char data[];
 };
 
-static AST_RWLIST_HEAD_STATIC(uniqueids, uniqueid);
+/* Allocated IDs, for the CLI. Also protects the bitmap. */
+static AST_RWDLLIST_HEAD_STATIC(uniqueids, uniqueid);
+
+#define ID_WORD_BITS (sizeof(unsigned long) * 8)
+
+/* Bitmap of IDs in use */
+static unsigned long *id_words = NULL;
+static size_t id_num_words = 0;
+static size_t id_free_hint = 0;	/* No word before this one has a free bit */
+
+/*! \note Must be called with uniqueids write locked */
+static int id_alloc(void)
+{
+	size_t i;
+	int bit;
+
+	for (i = id_free_hint; i < id_num_words; i++) {
+		if (id_words[i] != ~0UL) {
+			break;
+		}
+	}
+	if (i == id_num_words) {
+		/* All IDs in use, grow the bitmap */
+		size_t num_words = id_num_words ? id_num_words * 2 : 4;
+		unsigned long *words = ast_realloc(id_words, num_words * sizeof(*words));
+		if (!words) {
+			return -1;
+		}
+		memset(words + id_num_words, 0, (num_words - id_num_words) * sizeof(*words));
+		id_words = words;
+		id_num_words = num_words;
+	}
+	id_free_hint = i;
+	bit = ffsl((long) ~id_words[i]) - 1;
+	id_words[i] |= 1UL << bit;
+	return (int) (i * ID_WORD_BITS) + bit;
+}
+
+/*! \note Must be called with uniqueids write locked */
+static void id_release(int id)
+{
+	size_t i = id / ID_WORD_BITS;
+
+	id_words[i] &= ~(1UL << (id % ID_WORD_BITS));
+	if (i < id_free_hint) {
+		id_free_hint = i;
+	}
+}
+
+/*! \brief Release the IDs a channel allocated when the channel goes away */
+static void uniqueid_destroy(void *data)
+{
+	struct uniqueid *u = data;
+
+	AST_RWDLLIST_WRLOCK(&uniqueids);
+	AST_DLLIST_REMOVE(&uniqueids, u, entry);
+	id_release(u->id);
+	AST_RWDLLIST_UNLOCK(&uniqueids);
+
+	ast_debug(5, "%s released ephemeral unique ID %d\n", u->channel, u->id);
+	ast_free(u);
+	ast_module_unref(ast_module_info->self);
+}
+
+static const struct ast_datastore_info euniqueid_datastore = {
+	.type = "EPHEMERAL_UNIQUEID",
+	.destroy = uniqueid_destroy,
+};
 
 static int euniqueid_read(struct ast_channel *chan, const char *function, char *data, char *buf, size_t maxlen)
 {
 	int id;
 	struct uniqueid *u;
-	int highest_id = -1;
+	struct ast_datastore *datastore;
 
 	if (!chan) {
 		ast_log(LOG_ERROR, "%s requires a channel\n", function);
@@ -78,38 +145,41 @@ static int euniqueid_read(struct ast_channel *chan, const char *function, char *
 		return -1;
 	}
 
-	AST_RWLIST_WRLOCK(&uniqueids);
-	/* First, purge any IDs that were requested by channels that no longer exist */
-	AST_RWLIST_TRAVERSE_SAFE_BEGIN(&uniqueids, u, entry) {
-		struct ast_channel *ochan = ast_channel_get_by_name(u->channel);
-		if (ochan) {
-			highest_id = u->id;
-			ast_channel_unref(ochan);
-		} else {
-			/* The channel that requested this unique ID doesn't exist anymore. No longer needed */
-			AST_RWLIST_REMOVE_CURRENT(entry);
-			ast_free(u);
-		}
-	}
-	AST_RWLIST_TRAVERSE_SAFE_END;
-	/* This is the ID we will use */
-	if (highest_id != -1) {
-		id = highest_id + 1;
-	} else {
-		id = 0;
-	}
 	u = ast_calloc(1, sizeof(*u) + strlen(ast_channel_name(chan)) + 1);
 	if (!u) {
-		AST_RWLIST_UNLOCK(&uniqueids);
+		snprintf(buf, maxlen, "%d", -1);
+		return -1;
+	}
+	/* Each ID gets its own datastore, since a channel can allocate more than one */
+	datastore = ast_datastore_alloc(&euniqueid_datastore, NULL);
+	if (!datastore) {
+		ast_free(u);
 		snprintf(buf, maxlen, "%d", -1);
 		return -1;
 	}
 	strcpy(u->data, ast_channel_name(chan)); /* Safe */
 	u->channel = u->data;
-	u->id = id;
 	u->allocated = time(NULL);
-	AST_RWLIST_INSERT_TAIL(&uniqueids, u, entry);
-	AST_RWLIST_UNLOCK(&uniqueids);
+
+	AST_RWDLLIST_WRLOCK(&uniqueids);
+	id = id_alloc();
+	if (id < 0) {
+		AST_RWDLLIST_UNLOCK(&uniqueids);
+		ast_datastore_free(datastore);
+		ast_free(u);
+		snprintf(buf, maxlen, "%d", -1);
+		return -1;
+	}
+	u->id = id;
+	AST_DLLIST_INSERT_TAIL(&uniqueids, u, entry);
+	AST_RWDLLIST_UNLOCK(&uniqueids);
+
+	/* The module can't go away while a channel still has an ID from it */
+	ast_module_ref(ast_module_info->self);
+	datastore->data = u;
+	ast_channel_lock(chan);
+	ast_channel_datastore_add(chan, datastore);
+	ast_channel_unlock(chan);
 
 	ast_verb(5, "%s has ephemeral unique ID %d\n", ast_channel_name(chan), id);
 
@@ -137,23 +207,12 @@ static char *handle_show_channels(struct ast_cli_entry *e, int cmd, struct ast_c
 	}
 
 	ast_cli(a->fd, "%4s %6s %s\n", "ID", "Age", "Channel");
-	AST_RWLIST_WRLOCK(&uniqueids);
-	/* Purge any stale items */
-	AST_RWLIST_TRAVERSE_SAFE_BEGIN(&uniqueids, u, entry) {
-		struct ast_channel *ochan = ast_channel_get_by_name(u->channel);
-		if (ochan) {
-			ast_channel_unref(ochan);
-		} else {
-			AST_RWLIST_REMOVE_CURRENT(entry);
-			ast_free(u);
-		}
-	}
-	AST_RWLIST_TRAVERSE_SAFE_END;
-	AST_RWLIST_TRAVERSE(&uniqueids, u, entry) {
+	AST_RWDLLIST_RDLOCK(&uniqueids);
+	AST_DLLIST_TRAVERSE(&uniqueids, u, entry) {
 		int diff = (int) (now - u->allocated);
 		ast_cli(a->fd, "%4d %6d %s\n", u->id, diff, u->channel);
 	}
-	AST_RWLIST_UNLOCK(&uniqueids);
+	AST_RWDLLIST_UNLOCK(&uniqueids);
 
 	return CLI_SUCCESS;
 }
@@ -169,14 +228,14 @@ static struct ast_custom_function tech_exists_function = {
 
 static int unload_module(void)
 {
-	struct uniqueid *u;
+	/* Channels with IDs hold a module reference, so there aren't any left by now */
 	ast_custom_function_unregister(&tech_exists_function);
 	ast_cli_unregister_multiple(euniqueid_cli, ARRAY_LEN(euniqueid_cli));
-	AST_RWLIST_WRLOCK(&uniqueids);
-	while ((u = AST_RWLIST_REMOVE_HEAD(&uniqueids, entry))) {
-		ast_free(u);
-	}
-	AST_RWLIST_UNLOCK(&uniqueids);
+	AST_RWDLLIST_WRLOCK(&uniqueids);
+	ast_free(id_words);
+	id_words = NULL;
+	id_num_words = id_free_hint = 0;
+	AST_RWDLLIST_UNLOCK(&uniqueids);
 	return 0;
 }
 
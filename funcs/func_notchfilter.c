@@ -41,6 +41,7 @@
  */
 
 /*** MODULEINFO
+	<depend>res_dsp_pipeline</depend>
 	<support_level>extended</support_level>
  ***/
 
@@ -58,6 +59,27 @@
 					<option name="d">
 						<para>Destroy the existing notch filter.</para>
 					</option>
+					<option name="e">
+						<para>Raise an <literal>SFStateChange</literal> AMI event whenever
+						the filtered tone begins or ends in a filtered direction.</para>
+					</option>
+					<option name="g">
+						<argument name="context" required="false" />
+						<argument name="extension" required="false" />
+						<argument name="priority" required="true" />
+						<para>Redirect the channel to the specified location when the filtered tone begins.</para>
+					</option>
+					<option name="h">
+						<argument name="context" required="false" />
+						<argument name="extension" required="false" />
+						<argument name="priority" required="true" />
+						<para>Redirect the channel to the specified location when the filtered tone ends.</para>
+					</option>
+					<option name="m">
+						<argument name="ms" required="true" />
+						<para>Number of milliseconds a change in tone state must persist
+						before it is reported. Default is 50.</para>
+					</option>
 					<option name="r">
 						<para>Apply the notch filter for received frames, rather than transmitted frames.
 						Default is both directions.</para>
@@ -87,6 +109,12 @@
 			<example title="Disable filtering of 1004 Hz">
 			same => n,Set(NOTCH_FILTER(1004,d)=)
 			</example>
+			<para>Since the filter measures the energy it removes, it can also report when the
+			tone starts and stops, without needing a separate tone detector on the channel.
+			Detection uses the same, already computed, energy, so this adds no DSP cost.</para>
+			<example title="Filter 2600 Hz on received audio, and go to sf,s,1 when it is seized">
+			same => n,Set(NOTCH_FILTER(2600,reg(sf,s,1)m(100))=10.0)
+			</example>
 		</description>
 	</function>
  ***/
@@ -98,9 +126,17 @@
 #include "asterisk/pbx.h"
 #include "asterisk/utils.h"
 #include "asterisk/audiohook.h"
+#include "asterisk/dsp_pipeline.h"
 #include "asterisk/app.h"
+#include "asterisk/manager.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/format.h"
+#include "asterisk/cli.h"
+#include "asterisk/conversions.h"
+#include "asterisk/biquad.h"
 
 #include <stdio.h>
+#include <limits.h>
 #include <math.h>
 #include <string.h>
 
@@ -258,49 +294,53 @@ struct pzrep
 	int numpoles, numzeros;
 };
 
-static pzrep zplane;
-static double raw_alpha1, raw_alpha2;
-static complex dc_gain, fc_gain, hf_gain;
-static unsigned int options;
-static double qfactor;
-static int infq;
-static unsigned int polemask;
-static double xcoeffs[MAXPZ+1], ycoeffs[MAXPZ+1];
+/*! \brief Filter design state. This is per design, rather than global, so that designs can run concurrently. */
+struct notch_design {
+	pzrep zplane;
+	double raw_alpha1, raw_alpha2;
+	complex dc_gain, fc_gain, hf_gain;
+	unsigned int options;
+	double qfactor;
+	int infq;
+	unsigned int polemask;
+	double xcoeffs[MAXPZ+1], ycoeffs[MAXPZ+1];
+};
 
-static void compute_notch(void);
-static void expandpoly(void), expand(complex[], int, complex[]), multin(complex, int, complex[]);
+static void compute_notch(struct notch_design *d);
+static void expandpoly(struct notch_design *d), expand(complex[], int, complex[]), multin(complex, int, complex[]);
 
 /* compute Z-plane pole & zero positions for bandpass resonator */
-static void compute_bpres(void)
+static void compute_bpres(struct notch_design *d)
 {
 	double theta;
-    zplane.numpoles = 2;
-	zplane.numzeros = 2;
-	zplane.zeros[0].re = 1.0;
-	zplane.zeros[0].im = 0.0;
-	zplane.zeros[1].re = -1.0;
-	zplane.zeros[1].im = 0.0;
-    theta = TWOPI * raw_alpha1; /* where we want the peak to be */
-    if (infq) { /* oscillator */
+	pzrep *zplane = &d->zplane;
+    zplane->numpoles = 2;
+	zplane->numzeros = 2;
+	zplane->zeros[0].re = 1.0;
+	zplane->zeros[0].im = 0.0;
+	zplane->zeros[1].re = -1.0;
+	zplane->zeros[1].im = 0.0;
+    theta = TWOPI * d->raw_alpha1; /* where we want the peak to be */
+    if (d->infq) { /* oscillator */
 		complex zp = expj(theta);
-		zplane.poles[0] = zp;
-		zplane.poles[1] = cconj(zp);
+		zplane->poles[0] = zp;
+		zplane->poles[1] = cconj(zp);
     } else { /* must iterate to find exact pole positions */
 		complex topcoeffs[MAXPZ+1];
 		double r, thm = theta, th1 = 0.0, th2 = PI;
 		int cvg, i;
-		expand(zplane.zeros, zplane.numzeros, topcoeffs);
-		r = exp(-theta / (2.0 * qfactor));
+		expand(zplane->zeros, zplane->numzeros, topcoeffs);
+		r = exp(-theta / (2.0 * d->qfactor));
 		cvg = 0;
 		for (i=0; i < 50 && !cvg; i++) {
 			complex botcoeffs[MAXPZ+1];
 			complex g;
 			double phi;
 			complex zp = complexmult(r, expj(thm));
-			zplane.poles[0] = zp;
-			zplane.poles[1] = cconj(zp);
-			expand(zplane.poles, zplane.numpoles, botcoeffs);
-			g = evaluate(topcoeffs, zplane.numzeros, botcoeffs, zplane.numpoles, expj(theta));
+			zplane->poles[0] = zp;
+			zplane->poles[1] = cconj(zp);
+			expand(zplane->poles, zplane->numpoles, botcoeffs);
+			g = evaluate(topcoeffs, zplane->numzeros, botcoeffs, zplane->numpoles, expj(theta));
 			phi = g.im / g.re; /* approx to atan2 */
 			if (phi > 0.0) th2 = thm; else th1 = thm;
 			if (fabs(phi) < EPS) cvg = 1;
@@ -310,35 +350,37 @@ static void compute_bpres(void)
 	}
 }
 
-static void compute_notch(void)
+static void compute_notch(struct notch_design *d)
 { /* compute Z-plane pole & zero positions for bandstop resonator (notch filter) */
 	complex zz;
 	double theta;
-	compute_bpres();		/* iterate to place poles */
-	theta = TWOPI * raw_alpha1;
+	pzrep *zplane = &d->zplane;
+	compute_bpres(d);		/* iterate to place poles */
+	theta = TWOPI * d->raw_alpha1;
 	zz = expj(theta);	/* place zeros exactly */
-	zplane.zeros[0] = zz;
-	zplane.zeros[1] = cconj(zz);
+	zplane->zeros[0] = zz;
+	zplane->zeros[1] = cconj(zz);
 }
 
-static void expandpoly(void) /* given Z-plane poles & zeros, compute top & bot polynomials in Z, and then recurrence relation */
+static void expandpoly(struct notch_design *d) /* given Z-plane poles & zeros, compute top & bot polynomials in Z, and then recurrence relation */
 {
 	complex topcoeffs[MAXPZ+1], botcoeffs[MAXPZ+1];
 	int i;
 	complex c1, c2;
 	double theta;
-	expand(zplane.zeros, zplane.numzeros, topcoeffs);
-	expand(zplane.poles, zplane.numpoles, botcoeffs);
+	pzrep *zplane = &d->zplane;
+	expand(zplane->zeros, zplane->numzeros, topcoeffs);
+	expand(zplane->poles, zplane->numpoles, botcoeffs);
 	c1.re = 1.0;
 	c1.im = 0.0;
-	dc_gain = evaluate(topcoeffs, zplane.numzeros, botcoeffs, zplane.numpoles, c1);
-	theta = TWOPI * 0.5 * (raw_alpha1 + raw_alpha2); /* "jwT" for centre freq. */
-	fc_gain = evaluate(topcoeffs, zplane.numzeros, botcoeffs, zplane.numpoles, expj(theta));
+	d->dc_gain = evaluate(topcoeffs, zplane->numzeros, botcoeffs, zplane->numpoles, c1);
+	theta = TWOPI * 0.5 * (d->raw_alpha1 + d->raw_alpha2); /* "jwT" for centre freq. */
+	d->fc_gain = evaluate(topcoeffs, zplane->numzeros, botcoeffs, zplane->numpoles, expj(theta));
 	c2.re = -1.0;
 	c2.im = 0.0;
-	hf_gain = evaluate(topcoeffs, zplane.numzeros, botcoeffs, zplane.numpoles, c2);
-	for (i = 0; i <= zplane.numzeros; i++) xcoeffs[i] = +(topcoeffs[i].re / botcoeffs[zplane.numpoles].re);
-	for (i = 0; i <= zplane.numpoles; i++) ycoeffs[i] = -(botcoeffs[i].re / botcoeffs[zplane.numpoles].re);
+	d->hf_gain = evaluate(topcoeffs, zplane->numzeros, botcoeffs, zplane->numpoles, c2);
+	for (i = 0; i <= zplane->numzeros; i++) d->xcoeffs[i] = +(topcoeffs[i].re / botcoeffs[zplane->numpoles].re);
+	for (i = 0; i <= zplane->numpoles; i++) d->ycoeffs[i] = -(botcoeffs[i].re / botcoeffs[zplane->numpoles].re);
 }
 
 static void expand(complex pz[], int npz, complex coeffs[])
@@ -376,78 +418,137 @@ static void multin(complex w, int npz, complex coeffs[])
 	coeffs[0] = complexmult2(nw, coeffs[0]);
 }
 
-void mknotch(float freq,float bw,long *p1, long *p2, long *p3);
-void mknotch(float freq, float bw, long *p1, long *p2, long *p3)
+/*! \retval 0 on success, -1 on failure */
+static int mknotch(float freq, float bw, int rate, long *p1, long *p2, long *p3)
 {
-#define	NB 14
 	float fsh;
-    options = opt_re;
-    qfactor = freq / bw;
-	infq = 0;
-    raw_alpha1 = freq / 8000.0;
-    polemask = ~0;
-
-    compute_notch();
-    expandpoly();
-
-    fsh = (float) (1 << NB);
-    *p1 = (long)(xcoeffs[1] * fsh);
-    *p2 = (long)(ycoeffs[0] * fsh);
-    *p3 = (long)(ycoeffs[1] * fsh);
+	struct notch_design *d;
+
+	/* This is too big to comfortably put on the stack */
+	d = ast_calloc(1, sizeof(*d));
+	if (!d) {
+		*p1 = *p2 = *p3 = 0;
+		return -1;
+	}
+
+    d->options = opt_re;
+    d->qfactor = (double) freq / bw;
+	d->infq = 0;
+    d->raw_alpha1 = (double) freq / rate;
+    d->polemask = ~0;
+
+    compute_notch(d);
+    expandpoly(d);
+
+    fsh = (float) (1 << BIQUAD_NB);
+    *p1 = (long)(d->xcoeffs[1] * fsh);
+    *p2 = (long)(d->ycoeffs[0] * fsh);
+    *p3 = (long)(d->ycoeffs[1] * fsh);
+	ast_free(d);
+	return 0;
+}
+
+/*! \brief Maximum number of distinct filter designs to cache */
+#define NOTCH_CACHE_MAX 256
+#define NOTCH_CACHE_BUCKETS 37
+
+/*! \brief Precomputed fixed point coefficients for a notch filter */
+struct notch_coeffs {
+	float frequency;
+	float bandwidth;
+	int rate;
+	struct biquad_notch_coeffs coeffs;
+};
+
+/*! \brief Process-wide cache of filter designs, so that each is only ever computed once */
+static struct ao2_container *notch_cache;
+
+static int notch_coeffs_hash_fn(const void *obj, const int flags)
+{
+	const struct notch_coeffs *nc = obj;
+	unsigned int hash = (unsigned int) (nc->frequency * 16) ^ ((unsigned int) (nc->bandwidth * 16) << 12) ^ ((unsigned int) nc->rate << 20);
+
+	return (int) (hash & INT_MAX);
+}
+
+static int notch_coeffs_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct notch_coeffs *nc1 = obj, *nc2 = arg;
+
+	return nc1->frequency == nc2->frequency && nc1->bandwidth == nc2->bandwidth && nc1->rate == nc2->rate ? CMP_MATCH | CMP_STOP : 0;
+}
+
+/*!
+ * \brief Get the coefficients for a notch filter, designing it only if it's not already cached
+ * \note This is safe to call from any number of threads concurrently
+ * \retval 0 on success, -1 if the filter couldn't be designed (the coefficients are then all 0)
+ */
+static int notch_coeffs_get(float freq, float bw, int rate, struct biquad_notch_coeffs *coeffs)
+{
+	struct notch_coeffs key = {
+		.frequency = freq,
+		.bandwidth = bw,
+		.rate = rate,
+	};
+	struct notch_coeffs *nc, *existing;
+
+	nc = ao2_find(notch_cache, &key, OBJ_POINTER);
+	if (nc) {
+		*coeffs = nc->coeffs;
+		ao2_ref(nc, -1);
+		return 0;
+	}
+
+	/* complex math to calculate the right parameters for notch filter.
+	 * This is done without holding the cache lock, so concurrent lookups don't wait on it. */
+	if (mknotch(freq, bw, rate, &coeffs->p1, &coeffs->p2, &coeffs->p3)) {
+		return -1; /* Don't cache a failed design, so it can be retried */
+	}
+	ast_debug(5, "Notch filter calculations for %f/%f at %d Hz: %ld, %ld, %ld\n", freq, bw, rate, coeffs->p1, coeffs->p2, coeffs->p3);
+
+	nc = ao2_alloc_options(sizeof(*nc), NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!nc) {
+		return 0; /* We still have the coefficients, they just won't be cached */
+	}
+	*nc = key;
+	nc->coeffs = *coeffs;
+
+	ao2_wrlock(notch_cache);
+	/* Somebody else may have designed the same filter in the meantime */
+	existing = ao2_find(notch_cache, &key, OBJ_POINTER | OBJ_NOLOCK);
+	if (existing) {
+		ao2_ref(existing, -1);
+	} else if (ao2_container_count(notch_cache) < NOTCH_CACHE_MAX) {
+		ao2_link_flags(notch_cache, nc, OBJ_NOLOCK);
+	}
+	ao2_unlock(notch_cache);
+	ao2_ref(nc, -1);
+	return 0;
 }
 
 typedef struct {
-	long	x1;
-	long	x2;
-	long	y1;
-	long	y2;
+	struct biquad_notch_state filter;
 	long	e1;
 	long	e2;
 	int	samps;
 } sf_detect_state;
 
+/*! Default chunk size */
+#define DAHDI_CHUNKSIZE		 8
+#define	SF_DETECT_SAMPLES (DAHDI_CHUNKSIZE * 5)
+#define	SF_DETECT_MIN_ENERGY 500
+
 /* return 0 if nothing detected, 1 if lack of tone, 2 if presence of tone */
 /* modifies buffer pointed to by 'amp' with notched-out values */
 static inline int sf_detect(sf_detect_state *s, short *amp,
-                 int samples, long p1, long p2, long p3)
+                 int samples, const struct biquad_notch_coeffs *coeffs)
 {
-	int i,rv = 0;
-	long x,y;
+	int rv = 0;
 
-/*! Default chunk size */
-#define DAHDI_CHUNKSIZE		 8
-#define	SF_DETECT_SAMPLES (DAHDI_CHUNKSIZE * 5)
-#define	SF_DETECT_MIN_ENERGY 500
-/* number of bits to shift left */
-#define	NB 14
-
-	/* determine energy level before filtering */
-	for (i = 0; i < samples; i++) {
-		if (amp[i] < 0) {
-			s->e1 -= amp[i];
-		} else {
-			s->e1 += amp[i];
-		}
-	}
 	/* do 2nd order IIR notch filter at given freq. and calculate
-	    energy */
-	for (i = 0; i < samples; i++) {
-		x = amp[i] << NB;
-		y = s->x2 + (p1 * (s->x1 >> NB)) + x;
-		y += (p2 * (s->y2 >> NB)) +
-		(p3 * (s->y1 >> NB));
-		s->x2 = s->x1;
-		s->x1 = x;
-		s->y2 = s->y1;
-		s->y1 = y;
-		amp[i] = y >> NB;
-		if (amp[i] < 0) {
-			s->e2 -= amp[i];
-		} else {
-			s->e2 += amp[i];
-		}
-	}
-	s->samps += i;
+	    energy before and after, all in one pass */
+	biquad_notch_process(&s->filter, coeffs, amp, samples, &s->e1, &s->e2);
+	s->samps += samples;
 	/* if time to do determination */
 	if ((s->samps) >= SF_DETECT_SAMPLES) {
 		rv = 1; /* default to no tone */
@@ -460,118 +561,232 @@ static inline int sf_detect(sf_detect_state *s, short *amp,
 	return(rv);
 }
 
+/*! \brief Default time a new SF state must persist before it's reported */
+#define SF_DEBOUNCE_MS 50
+
+/*! \brief Debounced SF tone state, for one direction */
+struct sf_state {
+	unsigned int tone:1;	/* Whether tone is currently present */
+	int pending_ms;			/* How long the opposite state has persisted */
+};
+
 struct notch_information {
-	struct ast_audiohook audiohook;
+	ast_mutex_t lock;	/* Protects everything below, so the filter can be reconfigured mid-call */
 	float frequency;
 	float bandwidth;
 	unsigned short int tx:1;
 	unsigned short int rx:1;
-	long rxp1;
-	long rxp2;
-	long rxp3;
+	unsigned short int events:1;
+	int rate;	/* Sample rate coeffs are for */
+	struct biquad_notch_coeffs coeffs;
 	sf_detect_state rd;
+	sf_detect_state td;
+	struct sf_state rxsf;
+	struct sf_state txsf;
+	int debounce;	/* ms */
+	char *gotoon;
+	char *gotooff;
 	unsigned int flags;
-	unsigned short int state;
 };
 
 enum notch_flags {
 	FLAG_TRANSMIT_DIR = (1 << 1),
 	FLAG_RECEIVE_DIR = (1 << 2),
 	FLAG_END_FILTER = (1 << 3),
+	FLAG_EVENTS = (1 << 4),
+	FLAG_GOTO_ON = (1 << 5),
+	FLAG_GOTO_OFF = (1 << 6),
+	FLAG_DEBOUNCE = (1 << 7),
+};
+
+enum {
+	OPT_ARG_GOTO_ON,
+	OPT_ARG_GOTO_OFF,
+	OPT_ARG_DEBOUNCE,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_ARRAY_SIZE,
 };
 
 AST_APP_OPTIONS(notch_opts, {
 	AST_APP_OPTION('t', FLAG_TRANSMIT_DIR),
 	AST_APP_OPTION('r', FLAG_RECEIVE_DIR),
 	AST_APP_OPTION('d', FLAG_END_FILTER),
+	AST_APP_OPTION('e', FLAG_EVENTS),
+	AST_APP_OPTION_ARG('g', FLAG_GOTO_ON, OPT_ARG_GOTO_ON),
+	AST_APP_OPTION_ARG('h', FLAG_GOTO_OFF, OPT_ARG_GOTO_OFF),
+	AST_APP_OPTION_ARG('m', FLAG_DEBOUNCE, OPT_ARG_DEBOUNCE),
 });
 
-static void destroy_callback(void *data)
+static void notch_destroy(void *data)
 {
 	struct notch_information *ni = data;
 
-	/* Destroy the audiohook, and destroy ourselves */
-	ast_audiohook_lock(&ni->audiohook);
-	ast_audiohook_detach(&ni->audiohook);
-	ast_audiohook_unlock(&ni->audiohook);
-	ast_audiohook_destroy(&ni->audiohook);
+	ast_mutex_destroy(&ni->lock);
+	ast_free(ni->gotoon);
+	ast_free(ni->gotooff);
 	ast_free(ni);
-
-	return;
 }
 
-/*! \brief Static structure for datastore information */
-static const struct ast_datastore_info notch_datastore = {
-	.type = "notch",
-	.destroy = destroy_callback
-};
-
-static int notch_callback(struct ast_audiohook *audiohook, struct ast_channel *chan, struct ast_frame *frame, enum ast_audiohook_direction direction)
+/*!
+ * \brief Debounce an SF detection result and report any state change
+ * \param chan Channel
+ * \param ni Notch information
+ * \param sf Debounced state for this direction
+ * \param detected Result of sf_detect
+ * \param ms Duration of the audio the result is for
+ * \param rx Whether this is the RX direction
+ * \return Location to redirect the channel to, if any
+ * \note Must be called with ni locked
+ */
+static const char *sf_state_update(struct ast_channel *chan, struct notch_information *ni, struct sf_state *sf, int detected, int ms, int rx)
 {
-	struct ast_datastore *datastore = NULL;
-	struct notch_information *ni = NULL;
+	int tone;
 
-	/* If the audiohook is stopping it means the channel is shutting down.... but we let the datastore destroy take care of it */
-	if (audiohook->status == AST_AUDIOHOOK_STATUS_DONE)
-		return 0;
+	if (!detected) {
+		return NULL; /* Not enough audio yet for a determination */
+	}
 
-	/* Grab datastore which contains our gain information */
-	if (!(datastore = ast_channel_datastore_find(chan, &notch_datastore, NULL)))
-		return 0;
+	tone = detected == 2;
+	if (tone == sf->tone) {
+		sf->pending_ms = 0;
+		return NULL;
+	}
+	sf->pending_ms += ms;
+	if (sf->pending_ms < ni->debounce) {
+		return NULL;
+	}
 
-	ni = datastore->data;
+	/* The new state has persisted long enough to be real */
+	sf->tone = tone;
+	sf->pending_ms = 0;
+	ast_debug(1, "%.0f Hz tone %s in %s direction on %s\n", ni->frequency, tone ? "began" : "ended", rx ? "RX" : "TX", ast_channel_name(chan));
+
+	if (ni->events) {
+		/*** DOCUMENTATION
+			<managerEvent language="en_US" name="SFStateChange">
+				<managerEventInstance class="EVENT_FLAG_CALL">
+					<synopsis>Raised when NOTCH_FILTER detects the start or end of the filtered tone.</synopsis>
+						<syntax>
+							<channel_snapshot/>
+							<parameter name="Frequency">
+								<para>The frequency of the notch filter, in Hz.</para>
+							</parameter>
+							<parameter name="Direction">
+								<enumlist>
+									<enum name="RX"/>
+									<enum name="TX"/>
+								</enumlist>
+							</parameter>
+							<parameter name="State">
+								<enumlist>
+									<enum name="On"><para>Tone is now present.</para></enum>
+									<enum name="Off"><para>Tone is no longer present.</para></enum>
+								</enumlist>
+							</parameter>
+						</syntax>
+				</managerEventInstance>
+			</managerEvent>
+		***/
+		manager_event(EVENT_FLAG_CALL, "SFStateChange",
+			"Channel: %s\r\n"
+			"ChannelState: %d\r\n"
+			"ChannelStateDesc: %s\r\n"
+			"CallerIDNum: %s\r\n"
+			"CallerIDName: %s\r\n"
+			"ConnectedLineNum: %s\r\n"
+			"ConnectedLineName: %s\r\n"
+			"Language: %s\r\n"
+			"AccountCode: %s\r\n"
+			"Context: %s\r\n"
+			"Exten: %s\r\n"
+			"Priority: %d\r\n"
+			"Uniqueid: %s\r\n"
+			"Linkedid: %s\r\n"
+			"Frequency: %.0f\r\n"
+			"Direction: %s\r\n"
+			"State: %s\r\n",
+			ast_channel_name(chan),
+			ast_channel_state(chan),
+			ast_state2str(ast_channel_state(chan)),
+			S_OR(ast_channel_caller(chan)->id.number.str, ""),
+			S_OR(ast_channel_caller(chan)->id.name.str, ""),
+			S_OR(ast_channel_connected(chan)->id.number.str, ""),
+			S_OR(ast_channel_connected(chan)->id.name.str, ""),
+			ast_channel_language(chan),
+			ast_channel_accountcode(chan),
+			ast_channel_context(chan),
+			ast_channel_exten(chan),
+			ast_channel_priority(chan),
+			ast_channel_uniqueid(chan),
+			ast_channel_linkedid(chan),
+			ni->frequency,
+			rx ? "RX" : "TX",
+			tone ? "On" : "Off");
+	}
 
-	if (frame->frametype == AST_FRAME_VOICE) { /* we're filtering out an in-band frequency */
-		int newstate;
-		/* Based on direction of frame, and confirm it is applicable */
-		if (!(direction == AST_AUDIOHOOK_DIRECTION_READ ? ni->rx : ni->tx)) {
-			return 0;
+	return tone ? ni->gotoon : ni->gotooff;
+}
+
+static void notch_process(struct ast_channel *chan, void *data, struct ast_frame *frame, enum ast_audiohook_direction direction)
+{
+	struct notch_information *ni = data;
+	int newstate, rate;
+	int rx = direction == AST_AUDIOHOOK_DIRECTION_READ;
+	const char *location = NULL;
+
+	ast_mutex_lock(&ni->lock);
+	/* Based on direction of frame, and confirm it is applicable */
+	if (!(rx ? ni->rx : ni->tx)) {
+		ast_mutex_unlock(&ni->lock);
+		return;
+	}
+	/* Audiohooks may give us audio at any rate, and the filter design depends on it */
+	rate = ast_format_get_sample_rate(frame->subclass.format);
+	if (rate != ni->rate && !notch_coeffs_get(ni->frequency, ni->bandwidth, rate, &ni->coeffs)) {
+		ni->rate = rate; /* If that failed, try again next frame */
+	}
+	/* Notch the sample now. Each direction has its own filter history. */
+	newstate = sf_detect(rx ? &ni->rd : &ni->td, frame->data.ptr, frame->samples, &ni->coeffs);
+	/* The detection comes for free with the filtering, so report state changes if anyone cares */
+	if (ni->events || ni->gotoon || ni->gotooff) {
+		location = sf_state_update(chan, ni, rx ? &ni->rxsf : &ni->txsf, newstate, frame->samples * 1000 / rate, rx);
+		if (location) {
+			location = ast_strdupa(location); /* The filter may be reconfigured once we unlock */
 		}
-		/* Notch the sample now */
-		newstate = sf_detect(&ni->rd, frame->data.ptr, frame->samples, ni->rxp1, ni->rxp2, ni->rxp3);
-		/* if ni->state > 0 && ni->state != newstate, a state change has occured on this channel */
-		ni->state = newstate;
 	}
+	ast_mutex_unlock(&ni->lock);
 
-	return 0;
+	if (location) {
+		ast_debug(1, "Redirecting %s to %s\n", ast_channel_name(chan), location);
+		ast_async_parseable_goto(chan, location);
+	}
 }
 
+static struct ast_dsp_stage_type notch_stage = {
+	.name = "NOTCH_FILTER",
+	.priority = AST_DSP_PRIORITY_FILTER,
+	.process = notch_process,
+	.destroy = notch_destroy,
+};
+
 /*! \internal \brief Disable notch filtering on the channel */
 static int remove_notch_filter(struct ast_channel *chan)
 {
-	struct ast_datastore *datastore = NULL;
-	struct notch_information *data;
-	SCOPED_CHANNELLOCK(chan_lock, chan);
-
-	datastore = ast_channel_datastore_find(chan, &notch_datastore, NULL);
-	if (!datastore) {
+	if (ast_dsp_pipeline_remove(chan, &notch_stage)) {
 		ast_log(AST_LOG_WARNING, "Cannot remove NOTCH_FILTER from %s: NOTCH_FILTER not currently enabled\n",
 		        ast_channel_name(chan));
 		return -1;
 	}
-	data = datastore->data;
-
-	if (ast_audiohook_remove(chan, &data->audiohook)) {
-		ast_log(AST_LOG_WARNING, "Failed to remove NOTCH_FILTER audiohook from channel %s\n", ast_channel_name(chan));
-		return -1;
-	}
-
-	if (ast_channel_datastore_remove(chan, datastore)) {
-		ast_log(AST_LOG_WARNING, "Failed to remove NOTCH_FILTER datastore from channel %s\n",
-		        ast_channel_name(chan));
-		return -1;
-	}
-	ast_datastore_free(datastore);
-
 	return 0;
 }
 
 static int notch_read(struct ast_channel *chan, const char *cmd, char *data, char *buffer, size_t buflen)
 {
 	char *parse;
-	struct ast_datastore *datastore = NULL;
 	struct notch_information *ni = NULL;
 	struct ast_flags flags = { 0 };
+	char *opt_args[OPT_ARG_ARRAY_SIZE];
+	int res = -1;
 	
 	AST_DECLARE_APP_ARGS(args,
 		AST_APP_ARG(frequency);
@@ -587,16 +802,14 @@ static int notch_read(struct ast_channel *chan, const char *cmd, char *data, cha
 	AST_STANDARD_APP_ARGS(args, parse);
 
 	ast_channel_lock(chan);
-	if (!(datastore = ast_channel_datastore_find(chan, &notch_datastore, NULL))) {
+	if (!(ni = ast_dsp_pipeline_find(chan, &notch_stage))) {
 		ast_channel_unlock(chan);
 		return -1; /* function not initiated yet, so nothing to read */
-	} else {
-		ast_channel_unlock(chan);
-		ni = datastore->data;
 	}
 
+	ast_mutex_lock(&ni->lock);
 	if (!ast_strlen_zero(args.options)) {
-		ast_app_parse_options(notch_opts, &flags, NULL, args.options);
+		ast_app_parse_options(notch_opts, &flags, opt_args, args.options);
 		ni->flags = flags.flags;
 	} else {
 		ni->flags = 0;
@@ -604,29 +817,31 @@ static int notch_read(struct ast_channel *chan, const char *cmd, char *data, cha
 
 	if (ast_strlen_zero(args.frequency)) {
 		ast_log(LOG_ERROR, "Frequency must be specified for NOTCH_FILTER function\n");
-		return -1;
-	}
-	if (sscanf(args.frequency, "%f", &ni->frequency) != 1) {
+	} else if (sscanf(args.frequency, "%f", &ni->frequency) != 1) {
 		ast_log(LOG_ERROR, "Frequency %s is invalid.\n", args.frequency);
-		return -1;
-	}
-
-	/* print bandwidth only if matches the direction */
-	if ((!ast_test_flag(&flags, FLAG_RECEIVE_DIR) && ni->tx == 1) ||
-		(ast_test_flag(&flags, FLAG_RECEIVE_DIR) && ni->rx == 1)) {
-		snprintf(buffer, buflen, "%f", ni->bandwidth);
+	} else {
+		/* print bandwidth only if matches the direction */
+		if ((!ast_test_flag(&flags, FLAG_RECEIVE_DIR) && ni->tx == 1) ||
+			(ast_test_flag(&flags, FLAG_RECEIVE_DIR) && ni->rx == 1)) {
+			snprintf(buffer, buflen, "%f", ni->bandwidth);
+		}
+		res = 0;
 	}
+	ast_mutex_unlock(&ni->lock);
+	ast_channel_unlock(chan);
 
-	return 0;
+	return res;
 }
 
 static int notch_write(struct ast_channel *chan, const char *cmd, char *data, const char *value)
 {
 	char *parse;
-	struct ast_datastore *datastore = NULL;
 	struct notch_information *ni = NULL;
-	int is_new = 0;
 	struct ast_flags flags = { 0 };
+	char *opt_args[OPT_ARG_ARRAY_SIZE];
+	float frequency, bandwidth;
+	int debounce = SF_DEBOUNCE_MS;
+	char *gotoon = NULL, *gotooff = NULL;
 	
 	AST_DECLARE_APP_ARGS(args,
 		AST_APP_ARG(frequency);
@@ -641,41 +856,21 @@ static int notch_write(struct ast_channel *chan, const char *cmd, char *data, co
 	parse = ast_strdupa(data);
 	AST_STANDARD_APP_ARGS(args, parse);
 
-	ast_channel_lock(chan);
-	if (!(datastore = ast_channel_datastore_find(chan, &notch_datastore, NULL))) {
-		ast_channel_unlock(chan);
-		/* Allocate a new datastore to hold the reference to this notch and audiohook information */
-		if (!(datastore = ast_datastore_alloc(&notch_datastore, NULL)))
-			return 0;
-		if (!(ni = ast_calloc(1, sizeof(*ni)))) {
-			ast_datastore_free(datastore);
-			return 0;
-		}
-		ast_audiohook_init(&ni->audiohook, AST_AUDIOHOOK_TYPE_MANIPULATE, "Notch Filter", AST_AUDIOHOOK_MANIPULATE_ALL_RATES);
-		ni->audiohook.manipulate_callback = notch_callback;
-		is_new = 1;
-	} else {
-		ast_channel_unlock(chan);
-		ni = datastore->data;
-	}
-
 	if (!ast_strlen_zero(args.options)) {
-		ast_app_parse_options(notch_opts, &flags, NULL, args.options);
-		ni->flags = flags.flags;
-	} else {
-		ni->flags = 0;
+		ast_app_parse_options(notch_opts, &flags, opt_args, args.options);
 	}
 
 	if (ast_test_flag(&flags, FLAG_END_FILTER)) {
 		return remove_notch_filter(chan);
 	}
 
+	/* Validate everything before touching the filter, since it may already be running */
 	if (ast_strlen_zero(args.frequency)) {
 		ast_log(LOG_ERROR, "Frequency must be specified for NOTCH_FILTER function\n");
 		return -1;
 	}
 
-	if (sscanf(args.frequency, "%f", &ni->frequency) != 1) {
+	if (sscanf(args.frequency, "%f", &frequency) != 1) {
 		ast_log(LOG_ERROR, "Frequency %s is invalid.\n", args.frequency);
 		return -1;
 	}
@@ -685,46 +880,164 @@ static int notch_write(struct ast_channel *chan, const char *cmd, char *data, co
 		return -1;
 	}
 
-	ni->bandwidth = atof(value); /* notch filter bandwidth, typically 10.0 */
+	bandwidth = atof(value); /* notch filter bandwidth, typically 10.0 */
 
-	if (ni->bandwidth == 0.0) {
+	if (bandwidth == 0.0) {
 		ast_log(LOG_ERROR, "Bandwidth %s is invalid.\n", value);
 		return -1;
 	}
 
+	if (ast_test_flag(&flags, FLAG_DEBOUNCE) && !ast_strlen_zero(opt_args[OPT_ARG_DEBOUNCE])) {
+		if (ast_str_to_int(opt_args[OPT_ARG_DEBOUNCE], &debounce) || debounce < 0) {
+			ast_log(LOG_WARNING, "Invalid debounce time '%s', using %d ms\n", opt_args[OPT_ARG_DEBOUNCE], SF_DEBOUNCE_MS);
+			debounce = SF_DEBOUNCE_MS;
+		}
+	}
+	if (ast_test_flag(&flags, FLAG_GOTO_ON) && !ast_strlen_zero(opt_args[OPT_ARG_GOTO_ON])) {
+		gotoon = ast_strdup(opt_args[OPT_ARG_GOTO_ON]);
+	}
+	if (ast_test_flag(&flags, FLAG_GOTO_OFF) && !ast_strlen_zero(opt_args[OPT_ARG_GOTO_OFF])) {
+		gotooff = ast_strdup(opt_args[OPT_ARG_GOTO_OFF]);
+	}
+
+	ast_channel_lock(chan);
+	if (!(ni = ast_dsp_pipeline_find(chan, &notch_stage))) {
+		if (!(ni = ast_calloc(1, sizeof(*ni)))) {
+			ast_channel_unlock(chan);
+			ast_free(gotoon);
+			ast_free(gotooff);
+			return 0;
+		}
+		ast_mutex_init(&ni->lock);
+		/* Nothing will be filtered until the pipeline has the filter and we release the channel */
+		if (ast_dsp_pipeline_add(chan, &notch_stage, ni)) {
+			ast_channel_unlock(chan);
+			ast_free(gotoon);
+			ast_free(gotooff);
+			notch_destroy(ni);
+			return -1;
+		}
+	}
+
+	/* The audio thread may be using the filter right now, so swap in the new configuration under its lock */
+	ast_mutex_lock(&ni->lock);
+	ni->flags = flags.flags;
+	ni->frequency = frequency;
+	ni->bandwidth = bandwidth;
+
 	ni->tx = 0;
 	ni->rx = 0;
-	if (ast_strlen_zero(args.options) || ast_test_flag(&flags, FLAG_TRANSMIT_DIR)) {
+	if (!ast_test_flag(&flags, FLAG_TRANSMIT_DIR | FLAG_RECEIVE_DIR)) {
 		ni->tx = 1;
+		ni->rx = 1;
 	}
-	if (ast_strlen_zero(args.options) || ast_test_flag(&flags, FLAG_RECEIVE_DIR)) {
+	if (ast_test_flag(&flags, FLAG_TRANSMIT_DIR)) {
+		ni->tx = 1;
+	}
+	if (ast_test_flag(&flags, FLAG_RECEIVE_DIR)) {
 		ni->rx = 1;
 	}
 
-	/* complex math to calculate the right parameters for notch filter */
-	mknotch(ni->frequency,ni->bandwidth,&ni->rxp1,&ni->rxp2,&ni->rxp3);
-	ast_debug(5, "Notch filter calculations for %f/%f: %ld, %ld, %ld", ni->frequency,ni->bandwidth,ni->rxp1,ni->rxp2,ni->rxp3);
+	ni->events = ast_test_flag(&flags, FLAG_EVENTS) ? 1 : 0;
+	ni->debounce = debounce;
+	ast_free(ni->gotoon);
+	ast_free(ni->gotooff);
+	ni->gotoon = gotoon;
+	ni->gotooff = gotooff;
+
+	/* If this fails, the audio callback will try again */
+	ni->rate = notch_coeffs_get(ni->frequency, ni->bandwidth, 8000, &ni->coeffs) ? 0 : 8000;
 
-	ni->rd.x1 = 0.0;
-	ni->rd.x2 = 0.0;
-	ni->rd.y1 = 0.0;
-	ni->rd.y2 = 0.0;
+	biquad_notch_reset(&ni->rd.filter);
 	ni->rd.e1 = 0.0;
 	ni->rd.e2 = 0.0;
 	ni->rd.samps = 0;
-	ni->state = 0;
+	ni->td = ni->rd;
+	memset(&ni->rxsf, 0, sizeof(ni->rxsf));
+	memset(&ni->txsf, 0, sizeof(ni->txsf));
+	ast_mutex_unlock(&ni->lock);
+	ast_channel_unlock(chan);
 
-	if (is_new) {
-		datastore->data = ni;
-		ast_channel_lock(chan);
-		ast_channel_datastore_add(chan, datastore);
-		ast_channel_unlock(chan);
-		ast_audiohook_attach(chan, &ni->audiohook);
+	return 0;
+}
+
+static char *handle_notch_benchmark(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int r, iterations = 200;
+	static const int rates[] = { 8000, 16000 };
+
+	switch(cmd) {
+	case CLI_INIT:
+		e->command = "notch benchmark";
+		e->usage =
+			"Usage: notch benchmark [seconds]\n"
+			"       Benchmarks the notch filter and SF detection kernel on\n"
+			"       the specified number of seconds of synthetic audio\n"
+			"       (default 200), at 8 kHz and 16 kHz.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
 	}
 
-	return 0;
+	if (a->argc > 3) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc == 3 && (ast_str_to_int(a->argv[2], &iterations) || iterations < 1)) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "%-6s %10s %10s %10s\n", "Rate", "Samples", "ns/sample", "ns/frame");
+	for (r = 0; r < ARRAY_LEN(rates); r++) {
+		int i, j, rate = rates[r], framelen = rates[r] / 50;
+		short *audio, *frame;
+		struct biquad_notch_coeffs coeffs;
+		sf_detect_state sd = { { 0, }, };
+		struct timeval start;
+		int64_t ns;
+		int tones = 0;
+
+		audio = ast_malloc(rate * sizeof(short));
+		frame = ast_malloc(framelen * sizeof(short));
+		if (!audio || !frame) {
+			ast_free(audio);
+			ast_free(frame);
+			return CLI_FAILURE;
+		}
+		/* 2600 Hz for half of each second, with some noise throughout */
+		for (i = 0; i < rate; i++) {
+			audio[i] = (ast_random() % 1001) - 500;
+			if (i < rate / 2) {
+				audio[i] += 8000 * sin(TWOPI * 2600 * i / rate);
+			}
+		}
+		notch_coeffs_get(2600, 10, rate, &coeffs);
+
+		start = ast_tvnow();
+		for (j = 0; j < iterations; j++) {
+			for (i = 0; i + framelen <= rate; i += framelen) {
+				/* The kernel filters in place, so work on a copy, as an audiohook would get */
+				memcpy(frame, audio + i, framelen * sizeof(short));
+				if (sf_detect(&sd, frame, framelen, &coeffs) == 2) {
+					tones++;
+				}
+			}
+		}
+		ns = ast_tvdiff_us(ast_tvnow(), start) * 1000;
+		ast_free(audio);
+		ast_free(frame);
+
+		ast_cli(a->fd, "%-6d %10" PRId64 " %10.2f %10.1f\n", rate, (int64_t) rate * iterations,
+			(double) ns / ((double) rate * iterations), (double) ns / (50.0 * iterations));
+		ast_debug(1, "Detected tone in %d frames\n", tones);
+	}
+
+	return CLI_SUCCESS;
 }
 
+static struct ast_cli_entry notch_cli[] = {
+	AST_CLI_DEFINE(handle_notch_benchmark, "Benchmark the notch filter kernel"),
+};
+
 static struct ast_custom_function notch_function = {
 	.name = "NOTCH_FILTER",
 	.read = notch_read,
@@ -733,12 +1046,41 @@ static struct ast_custom_function notch_function = {
 
 static int unload_module(void)
 {
-	return ast_custom_function_unregister(&notch_function);
+	int res = ast_custom_function_unregister(&notch_function);
+
+	ast_cli_unregister_multiple(notch_cli, ARRAY_LEN(notch_cli));
+	ast_dsp_stage_type_unregister(&notch_stage);
+
+	ao2_cleanup(notch_cache);
+	notch_cache = NULL;
+	return res;
 }
 
 static int load_module(void)
 {
-	return ast_custom_function_register(&notch_function);
+	notch_cache = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, NOTCH_CACHE_BUCKETS,
+		notch_coeffs_hash_fn, NULL, notch_coeffs_cmp_fn);
+	if (!notch_cache) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	if (ast_dsp_stage_type_register(&notch_stage)) {
+		ao2_ref(notch_cache, -1);
+		notch_cache = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	if (ast_custom_function_register(&notch_function)) {
+		ast_dsp_stage_type_unregister(&notch_stage);
+		ao2_ref(notch_cache, -1);
+		notch_cache = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	ast_cli_register_multiple(notch_cli, ARRAY_LEN(notch_cli));
+	return AST_MODULE_LOAD_SUCCESS;
 }
 
-AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Technology independent notch filter");
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Technology independent notch filter",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.requires = "res_dsp_pipeline",
+);
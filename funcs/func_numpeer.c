@@ -35,6 +35,7 @@
 #include "asterisk/app.h"
 #include "asterisk/conversions.h"
 #include "asterisk/callerid.h"
+#include "asterisk/astobj2.h"
 
 /*** DOCUMENTATION
 	<function name="NUM2DEVICE" language="en_US">
@@ -76,6 +77,8 @@
 			<para>Translates a telephone number into a tech/device that can be used with <literal>Dial</literal>.</para>
 			<para>This function requires no additional configuration to use. However, it is highly recommend
 			that you configure and use hints instead of this function (see the <literal>HINT</literal> function for usage).</para>
+			<para>Channel driver config files are indexed by caller ID number when first needed, and reindexed
+			when they change or on reload, so lookups do not need to parse them each time.</para>
 			<example title="Dial 5551212">
 			same => n,Dial(${NUM2DEVICE(5551212)})
 			</example>
@@ -89,83 +92,246 @@
 	</function>
  ***/
 
-static int number_to_device(char *buffer, size_t buflen, const char *number, int index, int *currindex,
-	const char *tech, const char *module, const char *cfgfile,
-	const char *clidfield, const char *clidonlyfield, const char *addfilter)
+#define NUMBER_BUCKETS 563
+
+/*! \brief A device with a given caller ID number */
+struct number_device {
+	AST_LIST_ENTRY(number_device) entry;
+	char name[0];
+};
+
+/*! \brief All the devices in a config file with a given caller ID number, in config file order */
+struct number_devices {
+	int num;
+	AST_LIST_HEAD_NOLOCK(, number_device) devices;
+	char number[0];
+};
+
+/*! \brief A channel driver config file, and its index of caller ID numbers to devices */
+struct device_source {
+	const char *tech;
+	const char *module;
+	const char *cfgfile;
+	const char *clidfield;
+	const char *addfilter;		/* Additional variable=value a category must have */
+	ast_mutex_t lock;
+	struct ao2_container *numbers;	/* Index, NULL if the config file couldn't be loaded */
+	unsigned int stale:1;		/* Rebuild index even if the config file is unchanged */
+};
+
+/* Channel technologies, in search order */
+static struct device_source sources[] = {
+	{ "DAHDI", "chan_dahdi", "chan_dahdi.conf", "callerid", NULL },
+	{ "IAX2", "chan_iax2", "iax.conf", "callerid", NULL },
+	{ "PJSIP", "chan_pjsip", "pjsip.conf", "callerid", "type=endpoint" },
+	{ "SIP", "chan_sip", "sip.conf", "callerid", NULL },
+};
+
+static int number_hash_fn(const void *obj, const int flags)
 {
-	struct ast_config *cfg;
-	struct ast_category *category = NULL;
-	struct ast_flags config_flags = { CONFIG_FLAG_WITHCOMMENTS | CONFIG_FLAG_NOCACHE };
-	char *filter;
-	int filterlen, res = -1;
+	const char *key;
 
-	if (!ast_module_check(module)) {
-		ast_debug(1, "Module %s is not loaded, skipping\n", module);
-		return -1; /* if module isn't loaded, how can it be relevant? */
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		key = ((const struct number_devices *) obj)->number;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
 	}
-	if (!(cfg = ast_config_load2(cfgfile, "func_numpeer", config_flags))) {
-		ast_debug(1, "Config file not found: %s\n", cfgfile);
-		return -1;
+	return ast_str_case_hash(key);
+}
+
+static int number_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct number_devices *nd = obj;
+	const char *key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = ((const struct number_devices *) arg)->number;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcasecmp(nd->number, key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
 	}
-	if (cfg == CONFIG_STATUS_FILEINVALID) {
-		ast_debug(1, "Config file has invalid format: %s\n", cfgfile);
-		/* do not destroy config, that will crash */
+}
+
+static void number_devices_destructor(void *obj)
+{
+	struct number_devices *nd = obj;
+	struct number_device *dev;
+
+	while ((dev = AST_LIST_REMOVE_HEAD(&nd->devices, entry))) {
+		ast_free(dev);
+	}
+}
+
+static int index_add(struct ao2_container *numbers, const char *number, const char *name)
+{
+	struct number_devices *nd;
+	struct number_device *dev;
+
+	dev = ast_malloc(sizeof(*dev) + strlen(name) + 1);
+	if (!dev) {
 		return -1;
 	}
+	strcpy(dev->name, name); /* Safe */
 
-	filterlen = strlen(clidfield);
-	if (clidonlyfield) {
-		int strlen2 = strlen(clidonlyfield);
-		if (strlen2 > filterlen) {
-			filterlen = strlen2; /* ensures big enough for either */
+	nd = ao2_find(numbers, number, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+	if (!nd) {
+		nd = ao2_alloc_options(sizeof(*nd) + strlen(number) + 1, number_devices_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+		if (!nd) {
+			ast_free(dev);
+			return -1;
 		}
+		strcpy(nd->number, number); /* Safe */
+		ao2_link_flags(numbers, nd, OBJ_NOLOCK);
 	}
-	if (addfilter) {
-		filterlen += strlen(addfilter) + 1; /* +1 for leading = that needs to be added */
-	}
-	filterlen += strlen(number);
-	filterlen += 2; /* '=' for first regex, null terminator */
+	AST_LIST_INSERT_TAIL(&nd->devices, dev, entry);
+	nd->num++;
+	ao2_ref(nd, -1);
+	return 0;
+}
 
-	filter = ast_malloc(filterlen);
-	/* it seems to work correctly even if the filter "regex" doesn't account for the caller ID name */
-	if (addfilter) {
-		snprintf(filter, filterlen, "%s=%s,%s", clidfield, number, addfilter);
-	} else {
-		snprintf(filter, filterlen, "%s=%s", clidfield, number);
+/*! \brief Index all the categories in a config file by caller ID number */
+static struct ao2_container *index_build(struct device_source *src, struct ast_config *cfg)
+{
+	struct ao2_container *numbers;
+	struct ast_category *category = NULL;
+	char *filtername = NULL, *filtervalue = NULL;
+	int devices = 0;
+
+	numbers = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, NUMBER_BUCKETS, number_hash_fn, NULL, number_cmp_fn);
+	if (!numbers) {
+		return NULL;
 	}
 
-	ast_debug(1, "Searching '%s' for categories with filter '%s' (filter len %d)\n", cfgfile, filter, filterlen);
+	if (src->addfilter) {
+		filtervalue = ast_strdupa(src->addfilter);
+		filtername = strsep(&filtervalue, "=");
+	}
 
-	while ((category = ast_category_browse_filtered(cfg, NULL, category, filter))) {
-		const char *catname, *callerid;
+	while ((category = ast_category_browse_filtered(cfg, NULL, category, NULL))) {
+		const char *callerid;
 		char *name, *location;
 
-		callerid = ast_variable_find(category, clidfield);
-
-		if (ast_callerid_parse((char*) callerid, &name, &location)) {
+		if (filtername && strcasecmp(S_OR(ast_variable_find(category, filtername), ""), filtervalue)) {
+			continue;
+		}
+		callerid = ast_variable_find(category, src->clidfield);
+		if (ast_strlen_zero(callerid)) {
+			continue;
+		}
+		/* ast_callerid_parse modifies its argument */
+		if (ast_callerid_parse(ast_strdupa(callerid), &name, &location) || ast_strlen_zero(location)) {
 			ast_debug(1, "Failed to parse '%s' as valid caller ID\n", callerid);
 			continue;
 		}
-		catname = ast_category_get_name(category);
-		if (!strcasecmp(location, number)) { /* this might be our guy */
-			ast_debug(1, "Caller ID match %d/%d: category %s has caller ID %s\n", ++(*currindex), index, catname, location);
-			/* but is it actually our guy? */
-			if (*currindex == index) {
-				/* yup, you're the one I want... */
+		if (index_add(numbers, location, ast_category_get_name(category))) {
+			ao2_ref(numbers, -1);
+			return NULL;
+		}
+		devices++;
+	}
+
+	ast_debug(1, "Indexed %d device%s with %d caller ID number%s in %s\n", devices, ESS(devices), ao2_container_count(numbers), ESS(ao2_container_count(numbers)), src->cfgfile);
+	return numbers;
+}
+
+/*!
+ * \brief Get a source's index, rebuilding it first if its config file has changed
+ * \note Returns a reference
+ */
+static struct ao2_container *source_numbers(struct device_source *src)
+{
+	struct ast_config *cfg;
+	struct ast_flags config_flags = { 0 };
+	struct ao2_container *numbers;
+
+	ast_mutex_lock(&src->lock);
+	if (src->numbers && !src->stale) {
+		/* Only stats the file (and anything it includes), doesn't parse it if it's unchanged */
+		ast_set_flag(&config_flags, CONFIG_FLAG_FILEUNCHANGED);
+	}
+	cfg = ast_config_load2(src->cfgfile, "func_numpeer", config_flags);
+	if (cfg == CONFIG_STATUS_FILEUNCHANGED) {
+		/* Index is up to date */
+	} else if (!cfg || cfg == CONFIG_STATUS_FILEINVALID) {
+		ast_debug(1, "Config file %s: %s\n", cfg ? "has invalid format" : "not found", src->cfgfile);
+		ao2_cleanup(src->numbers);
+		src->numbers = NULL;
+	} else {
+		numbers = index_build(src, cfg);
+		ast_config_destroy(cfg);
+		if (numbers) {
+			ao2_cleanup(src->numbers);
+			src->numbers = numbers;
+			src->stale = 0;
+		}
+	}
+	numbers = src->numbers;
+	if (numbers) {
+		ao2_ref(numbers, +1);
+	}
+	ast_mutex_unlock(&src->lock);
+	return numbers;
+}
+
+static int number_to_device(char *buffer, size_t buflen, const char *number, int index, int *currindex, struct device_source *src)
+{
+	struct ao2_container *numbers;
+	struct number_devices *nd;
+	struct number_device *dev;
+	int res = -1;
+
+	if (!ast_module_check(src->module)) {
+		ast_debug(1, "Module %s is not loaded, skipping\n", src->module);
+		return -1; /* if module isn't loaded, how can it be relevant? */
+	}
+
+	numbers = source_numbers(src);
+	if (!numbers) {
+		return -1;
+	}
+	nd = ao2_find(numbers, number, OBJ_SEARCH_KEY);
+	ao2_ref(numbers, -1);
+	if (!nd) {
+		ast_debug(1, "No devices in %s with caller ID %s\n", src->cfgfile, number);
+		return -1;
+	}
+
+	/* The index's entries are never modified once built, so no locking is needed */
+	if (*currindex + nd->num < index) {
+		*currindex += nd->num;
+	} else {
+		AST_LIST_TRAVERSE(&nd->devices, dev, entry) {
+			if (++(*currindex) == index) {
+				ast_debug(1, "Caller ID match %d/%d: category %s has caller ID %s\n", *currindex, index, dev->name, number);
 				/*! \todo this should be the right format for Dial in general, but DAHDI may have additional requirements? Group/Number? */
-				snprintf(buffer, buflen, "%s/%s", tech, catname);
+				snprintf(buffer, buflen, "%s/%s", src->tech, dev->name);
 				res = 0;
 				break;
 			}
-		} else {
-			ast_debug(1, "Caller ID non-match, skipping: category %s has caller ID %s\n", catname, location);
 		}
 	}
+	ao2_ref(nd, -1);
+	return res;
+}
 
-	ast_free(filter);
-	ast_config_destroy(cfg);
+static void sources_invalidate(void)
+{
+	int i;
 
-	return res;
+	for (i = 0; i < ARRAY_LEN(sources); i++) {
+		ast_mutex_lock(&sources[i].lock);
+		sources[i].stale = 1;
+		ast_mutex_unlock(&sources[i].lock);
+	}
 }
 
 enum num_opts {
@@ -222,16 +388,16 @@ static int acf_numpeer_exec(struct ast_channel *chan, const char *cmd,
 		}
 	}
 
-	if (dahdi && !number_to_device(buffer, buflen, args.number, index, &currindex, "DAHDI", "chan_dahdi", "chan_dahdi.conf", "callerid", "cid_number", NULL)) {
+	if (dahdi && !number_to_device(buffer, buflen, args.number, index, &currindex, &sources[0])) {
 		return 0;
 	}
-	if (iax2 && !number_to_device(buffer, buflen, args.number, index, &currindex, "IAX2", "chan_iax2", "iax.conf", "callerid", NULL, NULL)) {
+	if (iax2 && !number_to_device(buffer, buflen, args.number, index, &currindex, &sources[1])) {
 		return 0;
 	}
-	if (pjsip && !number_to_device(buffer, buflen, args.number, index, &currindex, "PJSIP", "chan_pjsip", "pjsip.conf", "callerid", NULL, "type=endpoint")) {
+	if (pjsip && !number_to_device(buffer, buflen, args.number, index, &currindex, &sources[2])) {
 		return 0;
 	}
-	if (sip && !number_to_device(buffer, buflen, args.number, index, &currindex, "SIP", "chan_sip", "sip.conf", "callerid", NULL, NULL)) {
+	if (sip && !number_to_device(buffer, buflen, args.number, index, &currindex, &sources[3])) {
 		return 0;
 	}
 
@@ -245,14 +411,48 @@ static struct ast_custom_function acf_numpeer = {
 
 static int unload_module(void)
 {
+	int i;
+
 	ast_custom_function_unregister(&acf_numpeer);
 
+	for (i = 0; i < ARRAY_LEN(sources); i++) {
+		ao2_cleanup(sources[i].numbers);
+		sources[i].numbers = NULL;
+		ast_mutex_destroy(&sources[i].lock);
+	}
+
 	return 0;
 }
 
 static int load_module(void)
 {
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(sources); i++) {
+		ast_mutex_init(&sources[i].lock);
+	}
+
+	/* Build the indexes now, rather than on the first call */
+	for (i = 0; i < ARRAY_LEN(sources); i++) {
+		if (ast_module_check(sources[i].module)) {
+			ao2_cleanup(source_numbers(&sources[i]));
+		}
+	}
+
 	return ast_custom_function_register(&acf_numpeer);
 }
 
-AST_MODULE_INFO_STANDARD_EXTENDED(ASTERISK_GPL_KEY, "Number to device peer function");
+static int reload_module(void)
+{
+	/* Changes are also picked up from the files' mtimes, but a reload is a good hint to start fresh */
+	ast_debug(2, "Reload occurred, rebuilding caller ID indexes on next use\n");
+	sources_invalidate();
+	return 0;
+}
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Number to device peer function",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.reload = reload_module,
+);
@@ -37,6 +37,9 @@
 #include "asterisk/frame.h"
 #include "asterisk/strings.h"
 #include "asterisk/conversions.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/channel.h"
+#include "asterisk/lock.h"
 
 /*** DOCUMENTATION
 	<function name="TEXT_QUERY" language="en_US">
@@ -44,12 +47,36 @@
 			Remote string querying
 		</synopsis>
 		<syntax>
-			<parameter name="dialstr" required="true">
-				<para>Dial string, such as provided to the Dial application</para>
+			<parameter name="dialstr" required="true" argsep="&amp;">
+				<argument name="dialstr1" required="true">
+					<para>Dial string, such as provided to the Dial application</para>
+				</argument>
+				<argument name="dialstr2" multiple="true">
+					<para>Additional dial strings. All of them are queried in parallel.</para>
+				</argument>
 			</parameter>
 			<parameter name="timeout" required="false">
 				<para>Timeout to wait, in seconds. Default is 5 seconds.</para>
 			</parameter>
+			<parameter name="options" required="false">
+				<optionlist>
+					<option name="a">
+						<para>Wait for answers from all of the dial strings, and return
+						all of them, comma-separated, in the order the dial strings were given.
+						An answer is empty if its query failed.
+						By default, the first answer received is returned.</para>
+					</option>
+					<option name="c">
+						<argument name="ttl" required="true" />
+						<para>Cache answers for <replaceable>ttl</replaceable> seconds.
+						While an answer is cached, queries for the same dial string return
+						it without placing a call. Concurrent queries for the same dial string
+						that also use this option share a single call.</para>
+						<para>Only use this if the answer does not depend on who is asking,
+						since the Caller ID of the first query is the one sent.</para>
+					</option>
+				</optionlist>
+			</parameter>
 		</syntax>
 		<description>
 			<para>Initiate a call and receive a text data transfer.</para>
@@ -70,64 +97,134 @@
 			exten => _2XXX,1,SendText(${DEVICE_STATE(${HINT(${EXTEN})})})
 				same => n,Hangup()
 			</example>
+			<example title="Ask two redundant nodes, using whichever answers first, and cache the answer for a minute">
+			exten => rx,1,Set(remotestate=${TEXT_QUERY(IAX2/branch-a/2368@device-state-context&amp;IAX2/branch-b/2368@device-state-context,5,c(60))})
+			</example>
 		</description>
 	</function>
  ***/
 
-static int acf_query_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
+#define MAX_QUERY_DESTINATIONS 16
+#define QUERY_BUCKETS 53
+
+/*! \brief A query of a single dial string, in progress or (if caching) answered */
+struct query {
+	char *result;			/* Answer, NULL if pending or failed */
+	struct timeval expires;	/* When a cached answer expires */
+	unsigned int seq;		/* Order in which queries completed */
+	unsigned int done:1;	/* Call completed */
+	unsigned int cached:1;	/* In the cache (or in flight, to be shared) */
+	char dialstr[0];
+};
+
+/*! \brief A call placed to answer a query */
+struct query_job {
+	struct query *query;
+	int timeout_ms;
+	char *callerid;
+};
+
+/* Everything in a query, and the cache itself, is protected by query_lock.
+ * Any query completing broadcasts query_cond, and waiters check their own queries. */
+static ast_mutex_t query_lock;
+static ast_cond_t query_cond;
+static struct ao2_container *queries;	/* Cached and shared in-flight queries, by dial string */
+static unsigned int query_seq = 0;
+static int query_jobs = 0;				/* Calls in progress */
+
+enum query_option_flags {
+	OPT_ALL = (1 << 0),
+	OPT_CACHE = (1 << 1),
+};
+
+enum {
+	OPT_ARG_CACHE,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(query_opts, {
+	AST_APP_OPTION('a', OPT_ALL),
+	AST_APP_OPTION_ARG('c', OPT_CACHE, OPT_ARG_CACHE),
+});
+
+static int query_hash_fn(const void *obj, const int flags)
 {
-	struct ast_format_cap *cap;
-	struct ast_channel *c;
-	char *parse, *rbuf;
-	char *tech, *destination;
-	int timeout_sec = 0, timeout_ms = 5000;
-	AST_DECLARE_APP_ARGS(args,
-		AST_APP_ARG(dialstr);
-		AST_APP_ARG(timeout);
-	);
-	struct ast_custom_function *cdr_prop_func = ast_custom_function_find("CDR_PROP");
+	const char *key;
 
-	if (ast_strlen_zero(data)) {
-		ast_log(LOG_WARNING, "Missing arguments: dialstring\n");
-		return -1;
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		key = ((const struct query *) obj)->dialstr;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
 	}
+	return ast_str_hash(key);
+}
 
-	parse = ast_strdupa(data);
-	AST_STANDARD_APP_ARGS(args, parse);
+static int query_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct query *q = obj;
+	const char *key = arg;
 
-	if (ast_strlen_zero(args.dialstr)) {
-		ast_log(LOG_WARNING, "Missing arguments: dialstring\n");
-		return -1;
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = ((const struct query *) arg)->dialstr;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(q->dialstr, key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
 	}
-	if (!ast_strlen_zero(args.timeout)) {
-		if ((ast_str_to_int(args.timeout, &timeout_sec) || timeout_sec < 0)) {
-			ast_log(LOG_WARNING, "Invalid timeout: %s\n", args.timeout);
-		} else {
-			timeout_ms *= 1000;
-		}
+}
+
+static int query_expired_cb(void *obj, void *arg, int flags)
+{
+	struct query *q = obj;
+	struct timeval *now = arg;
+
+	if (q->done && ast_tvcmp(q->expires, *now) <= 0) {
+		q->cached = 0;
+		return CMP_MATCH;
 	}
+	return 0;
+}
+
+static void query_destructor(void *obj)
+{
+	struct query *q = obj;
+
+	ast_free(q->result);
+}
 
-	tech = args.dialstr;
+/*! \brief Place a call and wait for a text data transfer */
+static char *query_call(const char *dialstr, const char *callerid, int timeout_ms)
+{
+	struct ast_format_cap *cap;
+	struct ast_channel *c;
+	char *tech, *destination;
+	char *rbuf;
+	struct ast_custom_function *cdr_prop_func = ast_custom_function_find("CDR_PROP");
+
+	tech = ast_strdupa(dialstr);
 	destination = strchr(tech, '/');
-	if (destination) {
-		*destination = '\0';
-		destination++;
-	} else {
-		ast_log(LOG_WARNING, "Dial string must have technology/resource\n");
-		return -1;
-	}
+	*destination++ = '\0'; /* Already validated */
 
 	cap = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT);
 	if (!cap) {
-		return -1;
+		return NULL;
 	}
 	ast_format_cap_append(cap, ast_format_slin, 0);
 
-	c = ast_request(tech, cap, NULL, chan, destination, NULL); /* null chan OK */
+	c = ast_request(tech, cap, NULL, NULL, destination, NULL); /* null chan OK */
 	ao2_cleanup(cap);
 
 	if (!c) {
-		return -1;
+		return NULL;
 	}
 
 	/* Disable CDR for this temporary channel. */
@@ -136,40 +233,264 @@ static int acf_query_read(struct ast_channel *chan, const char *cmd, char *data,
 	}
 
 	/* Copy Caller ID, if we have it. */
-	if (chan && ast_channel_caller(chan)->id.number.valid) {
+	if (callerid) {
 		ast_channel_caller(c)->id.number.valid = 1;
-		ast_channel_caller(c)->id.number.str = ast_strdup(ast_channel_caller(chan)->id.number.str);
+		ast_channel_caller(c)->id.number.str = ast_strdup(callerid);
 		/* It's really the connected line that matters here, not the caller id, because that's what'll be the Caller ID on the channel we call. */
 		ast_channel_connected(c)->id.number.valid = 1;
-		ast_channel_connected(c)->id.number.str = ast_strdup(ast_channel_caller(chan)->id.number.str);
+		ast_channel_connected(c)->id.number.str = ast_strdup(callerid);
 	}
 
 	if (ast_call(c, destination, 0)) {
 		ast_log(LOG_ERROR, "Unable to place outbound call to %s/%s\n", tech, destination);
 		ast_hangup(c);
-		return -1;
+		return NULL;
 	}
 
 	/* Wait for data transfer */
-	if (chan) {
-		ast_autoservice_start(chan);
-	}
 	ast_channel_ref(c);
 	rbuf = ast_recvtext(c, timeout_ms);
 	ast_channel_unref(c);
 	ast_hangup(c);
-	if (chan) {
-		ast_autoservice_stop(chan);
-	}
 
 	if (!rbuf) {
-		ast_log(LOG_WARNING, "No data received before channel hung up\n");
+		ast_log(LOG_WARNING, "No data received from %s before channel hung up\n", dialstr);
+	}
+	return rbuf;
+}
+
+static void *query_thread(void *data)
+{
+	struct query_job *job = data;
+	struct query *q = job->query;
+	char *rbuf;
+
+	rbuf = query_call(q->dialstr, job->callerid, job->timeout_ms);
+
+	ast_mutex_lock(&query_lock);
+	q->result = rbuf;
+	q->done = 1;
+	q->seq = ++query_seq;
+	if (q->cached && !rbuf) {
+		/* Don't cache failures, the next query should try again */
+		ao2_unlink_flags(queries, q, OBJ_NOLOCK);
+		q->cached = 0;
+	}
+	ast_cond_broadcast(&query_cond);
+	ast_mutex_unlock(&query_lock);
+
+	ao2_ref(q, -1);
+	ast_free(job->callerid);
+	ast_free(job);
+
+	/* unload_module waits for this, so it must be the very last thing we do */
+	ast_mutex_lock(&query_lock);
+	query_jobs--;
+	ast_cond_broadcast(&query_cond);
+	ast_mutex_unlock(&query_lock);
+	return NULL;
+}
+
+/*!
+ * \brief Get the query for a dial string, starting a call for it if needed
+ * \param ttl Seconds to cache the answer, 0 to not cache or share the query
+ * \note Must be called with query_lock held
+ * \note Returns a reference
+ */
+static struct query *query_start(const char *dialstr, const char *callerid, int timeout_ms, int ttl)
+{
+	struct query *q;
+	struct query_job *job;
+	pthread_t thread;
+
+	if (ttl) {
+		struct timeval now = ast_tvnow();
+		/* Expired answers are removed whenever a query is started, so the cache doesn't grow without bound */
+		ao2_callback(queries, OBJ_NODATA | OBJ_MULTIPLE | OBJ_UNLINK | OBJ_NOLOCK, query_expired_cb, &now);
+		q = ao2_find(queries, dialstr, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+		if (q) {
+			ast_debug(2, "%s answer for %s\n", q->done ? "Using cached" : "Waiting for pending", dialstr);
+			return q;
+		}
+	}
+
+	q = ao2_alloc_options(sizeof(*q) + strlen(dialstr) + 1, query_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!q) {
+		return NULL;
+	}
+	strcpy(q->dialstr, dialstr); /* Safe */
+
+	job = ast_calloc(1, sizeof(*job));
+	if (!job) {
+		ao2_ref(q, -1);
+		return NULL;
+	}
+	job->timeout_ms = timeout_ms;
+	job->callerid = callerid ? ast_strdup(callerid) : NULL;
+	job->query = q;
+	ao2_ref(q, +1); /* Job's reference */
+
+	if (ttl) {
+		q->expires = ast_tvadd(ast_tvnow(), ast_samp2tv(ttl, 1));
+		q->cached = 1;
+		ao2_link_flags(queries, q, OBJ_NOLOCK);
+	}
+
+	query_jobs++;
+	if (ast_pthread_create_detached(&thread, NULL, query_thread, job)) {
+		ast_log(LOG_ERROR, "Failed to create query thread\n");
+		query_jobs--;
+		if (q->cached) {
+			ao2_unlink_flags(queries, q, OBJ_NOLOCK);
+			q->cached = 0;
+		}
+		ao2_ref(q, -1); /* Job's reference */
+		ast_free(job->callerid);
+		ast_free(job);
+		q->done = 1; /* Failed */
+	}
+	return q;
+}
+
+static int acf_query_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
+{
+	struct query *qs[MAX_QUERY_DESTINATIONS];
+	char *dialstrs[MAX_QUERY_DESTINATIONS];
+	struct ast_flags flags = { 0 };
+	char *opt_args[OPT_ARG_ARRAY_SIZE];
+	char *parse, *dialstr, *callerid = NULL;
+	struct query *first = NULL;
+	struct timespec deadline;
+	struct timeval tv;
+	int i, ndialstrs = 0, num = 0, ttl = 0, answered = 0, res = -1;
+	int timeout_sec = 0, timeout_ms = 5000;
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(dialstr);
+		AST_APP_ARG(timeout);
+		AST_APP_ARG(options);
+	);
+
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_WARNING, "Missing arguments: dialstring\n");
 		return -1;
 	}
 
-	ast_copy_string(buf, rbuf, len);
+	parse = ast_strdupa(data);
+	AST_STANDARD_APP_ARGS(args, parse);
 
-	return 0;
+	if (ast_strlen_zero(args.dialstr)) {
+		ast_log(LOG_WARNING, "Missing arguments: dialstring\n");
+		return -1;
+	}
+	if (!ast_strlen_zero(args.timeout)) {
+		if ((ast_str_to_int(args.timeout, &timeout_sec) || timeout_sec < 0)) {
+			ast_log(LOG_WARNING, "Invalid timeout: %s\n", args.timeout);
+		} else {
+			timeout_ms = timeout_sec * 1000;
+		}
+	}
+	if (!ast_strlen_zero(args.options)) {
+		ast_app_parse_options(query_opts, &flags, opt_args, args.options);
+		if (ast_test_flag(&flags, OPT_CACHE)) {
+			if (ast_strlen_zero(opt_args[OPT_ARG_CACHE]) || ast_str_to_int(opt_args[OPT_ARG_CACHE], &ttl) || ttl < 0) {
+				ast_log(LOG_WARNING, "Invalid cache TTL: %s\n", S_OR(opt_args[OPT_ARG_CACHE], ""));
+				ttl = 0;
+			}
+		}
+	}
+
+	/* Validate all the dial strings before placing any calls */
+	for (parse = args.dialstr; (dialstr = strsep(&parse, "&")); ) {
+		if (ndialstrs == MAX_QUERY_DESTINATIONS) {
+			ast_log(LOG_WARNING, "Too many dial strings (max %d)\n", MAX_QUERY_DESTINATIONS);
+			return -1;
+		}
+		if (!strchr(dialstr, '/')) {
+			ast_log(LOG_WARNING, "Dial string must have technology/resource\n");
+			return -1;
+		}
+		dialstrs[ndialstrs++] = dialstr;
+	}
+
+	if (chan && ast_channel_caller(chan)->id.number.valid) {
+		callerid = ast_strdupa(S_OR(ast_channel_caller(chan)->id.number.str, ""));
+	}
+
+	if (chan) {
+		ast_autoservice_start(chan);
+	}
+
+	/* Place all the calls at once, so the remote lookups happen in parallel */
+	ast_mutex_lock(&query_lock);
+	for (i = 0; i < ndialstrs; i++) {
+		qs[num] = query_start(dialstrs[i], callerid, timeout_ms, ttl);
+		if (!qs[num]) {
+			break;
+		}
+		num++;
+	}
+
+	if (num) {
+		tv = ast_tvadd(ast_tvnow(), ast_samp2tv(timeout_ms, 1000));
+		deadline.tv_sec = tv.tv_sec;
+		deadline.tv_nsec = tv.tv_usec * 1000;
+
+		for (;;) {
+			int done = 0;
+			first = NULL;
+			for (i = 0; i < num; i++) {
+				if (qs[i]->done) {
+					done++;
+					if (qs[i]->result && (!first || qs[i]->seq < first->seq)) {
+						first = qs[i];
+					}
+				}
+			}
+			if (done == num || (first && !ast_test_flag(&flags, OPT_ALL))) {
+				break;
+			}
+			if (ast_cond_timedwait(&query_cond, &query_lock, &deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+
+		if (ast_test_flag(&flags, OPT_ALL)) {
+			char *pos = buf;
+			size_t left = len;
+			*buf = '\0';
+			for (i = 0; i < num; i++) {
+				int bytes;
+				if (qs[i]->done && qs[i]->result) {
+					answered++;
+				}
+				if (left <= 1) {
+					continue;
+				}
+				bytes = snprintf(pos, left, "%s%s", i ? "," : "", qs[i]->done ? S_OR(qs[i]->result, "") : "");
+				bytes = MIN(bytes, (int) left - 1);
+				pos += bytes;
+				left -= bytes;
+			}
+			res = answered ? 0 : -1;
+		} else if (first) {
+			ast_copy_string(buf, first->result, len);
+			res = 0;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		ao2_ref(qs[i], -1);
+	}
+	ast_mutex_unlock(&query_lock);
+
+	if (chan) {
+		ast_autoservice_stop(chan);
+	}
+
+	if (res) {
+		ast_debug(1, "No answers received for %s\n", data);
+	}
+	return res;
 }
 
 static struct ast_custom_function query_function = {
@@ -179,11 +500,29 @@ static struct ast_custom_function query_function = {
 
 static int unload_module(void)
 {
-	return ast_custom_function_unregister(&query_function);
+	int res = ast_custom_function_unregister(&query_function);
+
+	/* Calls in progress will time out on their own */
+	ast_mutex_lock(&query_lock);
+	while (query_jobs) {
+		ast_cond_wait(&query_cond, &query_lock);
+	}
+	ast_mutex_unlock(&query_lock);
+
+	ao2_ref(queries, -1);
+	ast_mutex_destroy(&query_lock);
+	ast_cond_destroy(&query_cond);
+	return res;
 }
 
 static int load_module(void)
 {
+	queries = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, QUERY_BUCKETS, query_hash_fn, NULL, query_cmp_fn);
+	if (!queries) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	ast_mutex_init(&query_lock);
+	ast_cond_init(&query_cond, NULL);
 	return ast_custom_function_register(&query_function);
 }
 
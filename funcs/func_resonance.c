@@ -29,6 +29,7 @@
  */
 
 /*** MODULEINFO
+	<depend>res_dsp_pipeline</depend>
 	<support_level>extended</support_level>
  ***/
 
@@ -43,6 +44,12 @@
 			</parameter>
 			<parameter name="options">
 				<optionlist>
+					<option name="o">
+						<argument name="order" required="true" />
+						<para>Order of the filter. Must be an even number from 2 to 8.
+						Each increase of 2 adds a biquad section, and 12 db/oct of roll-off.
+						Default is 4 (24 db/oct).</para>
+					</option>
 					<option name="r">
 						<para>Apply the resonance filter for received frames, rather than transmitted frames.
 						Default is both directions.</para>
@@ -61,6 +68,9 @@
 			<example title="Resonance filter at 3700 Hz in the TX direction">
 			same => n,Set(RESONANCE_FILTER(t)=3700)
 			</example>
+			<example title="8th order resonance filter at 3400 Hz in both directions">
+			same => n,Set(RESONANCE_FILTER(,o(8))=3400)
+			</example>
 			<example title="Disable filtering at 3700 Hz">
 			same => n,Set(RESONANCE_FILTER(t)=)
 			</example>
@@ -75,9 +85,14 @@
 #include "asterisk/pbx.h"
 #include "asterisk/utils.h"
 #include "asterisk/audiohook.h"
+#include "asterisk/dsp_pipeline.h"
 #include "asterisk/app.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/format.h"
+#include "asterisk/conversions.h"
 
 #include <stdio.h>
+#include <limits.h>
 #include <math.h>
 #include <string.h>
 
@@ -259,321 +274,312 @@ float *coef) /* pointer to 4 iir coefficients */
 	bilinear(*a0, *a1, *a2, *b0, *b1, *b2, k, fs, coef);
 }
 
-/**************************************************************************
+/*! \brief Maximum filter order supported */
+#define MAX_FILTER_ORDER 8
+/*! \brief Default filter order (4 for 24 db/oct filter) */
+#define DEFAULT_FILTER_ORDER 4
+#define MAX_FILTER_SECTIONS (MAX_FILTER_ORDER / 2)
+
+/*! \brief Number of samples filtered at a time */
+#define FILTER_BLOCK_SIZE 160
+
+/*! \brief z-domain coefficients for a cascade of biquad sections, computed once per frequency and sample rate */
+struct resonance_coeffs {
+	int sections;	/* Number of 2nd order sections */
+	int rate;		/* Sample rate these coefficients are for */
+	float gain;		/* Overall input scale factor */
+	/* beta1, beta2 (poles), alpha1, alpha2 (zeros), in the order bilinear() stores them */
+	float coef[MAX_FILTER_SECTIONS][4];
+};
 
-FILTER.C - Source code for filter functions
+/*! \brief Maximum number of distinct filter designs to cache */
+#define RESONANCE_CACHE_MAX 256
+#define RESONANCE_CACHE_BUCKETS 37
 
-iir_filter IIR filter floats sample by sample (real time)
+/*! \brief A cached filter design */
+struct resonance_design_entry {
+	int frequency;
+	int order;
+	struct resonance_coeffs coeffs;
+};
 
-*************************************************************************/
+/*! \brief Process-wide cache of filter designs, so that each is only ever computed once */
+static struct ao2_container *resonance_cache;
 
-/* FILTER INFORMATION STRUCTURE FOR FILTER ROUTINES */
+/*! \brief History of a cascade of biquad sections, for one direction of one channel */
+struct resonance_state {
+	/* Contiguous, so that consecutive sections can be run together */
+	float history[MAX_FILTER_SECTIONS][2];
+};
 
-typedef struct {
-unsigned int length; /* size of filter */
-float *history; /* pointer to history in filter */
-float *coef; /* pointer to coefficients of filter */
-} FILTER;
+/*!
+ * \brief Compute z-domain coefficients for a Butterworth low pass filter
+ * \param c Coefficients to fill in
+ * \param freq Cutoff frequency (Hz)
+ * \param rate Sampling frequency (Hz)
+ * \param order Filter order. Must be even, and at most MAX_FILTER_ORDER.
+ *
+ * The denominator of each 2nd order section of an nth order Butterworth
+ * polynomial is s^2 + 2sin((2k + 1)pi / 2n)s + 1, which gives the
+ * 0.765367 and 1.847759 coefficients of the 4th order filter above.
+ */
+static void resonance_design(struct resonance_coeffs *c, int freq, int rate, int order)
+{
+	int i;
+	double k = 1.0; /* Set overall filter gain */
+	double Q = 1; /* Resonance > 1.0 < 1000 */
+	double pi = 4.0 * atan(1.0);
 
-#define FILTER_SECTIONS 2 /* 2 filter sections for 24 db/oct filter */
+	c->sections = order / 2;
+	c->rate = rate;
 
-typedef struct {
-double a0, a1, a2; /* numerator coefficients */
-double b0, b1, b2; /* denominator coefficients */
-} BIQUAD;
+	/*
+	* Compute z-domain coefficients for each biquad section
+	* for the cutoff frequency and resonance
+	*/
+	for (i = 0; i < c->sections; i++) {
+		double a0 = 1.0, a1 = 0, a2 = 0;
+		double b0 = 1.0, b2 = 1.0;
+		double b1 = 2.0 * sin((2 * i + 1) * pi / (2 * order));
+		b1 /= Q; /* Divide by resonance or Q */
+		szxform(&a0, &a1, &a2, &b0, &b1, &b2, freq, rate, &k, c->coef[i]);
+		ast_debug(3, "Section %d: %15.10f %15.10f %15.10f %15.10f\n", i, c->coef[i][0], c->coef[i][1], c->coef[i][2], c->coef[i][3]);
+	}
 
-BIQUAD ProtoCoef[FILTER_SECTIONS]; /* Filter prototype coefficients,
-1 for each filter section */
+	c->gain = k;
+	ast_debug(1, "Designed order %d filter at %d Hz for %d Hz, gain %15.10f\n", order, freq, rate, c->gain);
+}
 
-/*
-* --------------------------------------------------------------------
-* 
-* iir_filter - Perform IIR filtering sample by sample on floats
-* 
-* Implements cascaded direct form II second order sections.
-* Requires FILTER structure for history and coefficients.
-* The length in the filter structure specifies the number of sections.
-* The size of the history array is 2*iir->length.
-* The size of the coefficient array is 4*iir->length + 1 because
-* the first coefficient is the overall scale factor for the filter.
-* Returns one output sample for each input sample. Allocates history
-* array if not previously allocated.
-* 
-* float iir_filter(float input,FILTER *iir)
-* 
-* float input new float input sample
-* FILTER *iir pointer to FILTER structure
-* 
-* Returns float value giving the current output.
-* 
-* Allocation errors cause an error message and a call to exit.
-* --------------------------------------------------------------------
-*/
-static float iir_filter(
-float input, /* new input sample */
-FILTER *iir /* pointer to FILTER structure */
-)
+static int resonance_design_hash_fn(const void *obj, const int flags)
 {
-	unsigned int i;
-	float *hist1_ptr,*hist2_ptr,*coef_ptr;
-	float output,new_hist,history1,history2;
-
-	/* allocate history array if different size than last call */
+	const struct resonance_design_entry *rd = obj;
+	unsigned int hash = (unsigned int) rd->frequency ^ ((unsigned int) rd->order << 14) ^ ((unsigned int) rd->coeffs.rate << 18);
 
-	if(!iir->history) {
-		iir->history = (float *) ast_calloc(2*iir->length,sizeof(float));
-		if(!iir->history) {
-			printf("\nUnable to allocate history array in iir_filter\n");
-			exit(1);
-		}
-	}
+	return (int) (hash & INT_MAX);
+}
 
-	coef_ptr = iir->coef; /* coefficient pointer */
+static int resonance_design_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct resonance_design_entry *rd1 = obj, *rd2 = arg;
 
-	hist1_ptr = iir->history; /* first history */
-	hist2_ptr = hist1_ptr + 1; /* next history */
+	return rd1->frequency == rd2->frequency && rd1->order == rd2->order && rd1->coeffs.rate == rd2->coeffs.rate ? CMP_MATCH | CMP_STOP : 0;
+}
 
-	/* 1st number of coefficients array is overall input scale factor,
-	* or filter gain */
-	output = input * (*coef_ptr++);
+/*!
+ * \brief Get the coefficients for a filter, designing it only if it's not already cached
+ * \note This is safe to call from any number of threads concurrently
+ */
+static void resonance_coeffs_get(struct resonance_coeffs *c, int freq, int rate, int order)
+{
+	struct resonance_design_entry key = {
+		.frequency = freq,
+		.order = order,
+		.coeffs.rate = rate,
+	};
+	struct resonance_design_entry *rd, *existing;
+
+	rd = ao2_find(resonance_cache, &key, OBJ_POINTER);
+	if (rd) {
+		*c = rd->coeffs;
+		ao2_ref(rd, -1);
+		return;
+	}
 
-	for (i = 0 ; i < iir->length; i++) {
-		history1 = *hist1_ptr; /* history values */
-		history2 = *hist2_ptr;
+	/* Design it without holding the cache lock, so concurrent lookups don't wait on it */
+	resonance_design(c, freq, rate, order);
 
-		output = output - history1 * (*coef_ptr++);
-		new_hist = output - history2 * (*coef_ptr++);	/* poles */
+	rd = ao2_alloc_options(sizeof(*rd), NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!rd) {
+		return; /* We still have the coefficients, they just won't be cached */
+	}
+	rd->frequency = freq;
+	rd->order = order;
+	rd->coeffs = *c;
+
+	ao2_wrlock(resonance_cache);
+	/* Somebody else may have designed the same filter in the meantime */
+	existing = ao2_find(resonance_cache, &key, OBJ_POINTER | OBJ_NOLOCK);
+	if (existing) {
+		ao2_ref(existing, -1);
+	} else if (ao2_container_count(resonance_cache) < RESONANCE_CACHE_MAX) {
+		ao2_link_flags(resonance_cache, rd, OBJ_NOLOCK);
+	}
+	ao2_unlock(resonance_cache);
+	ao2_ref(rd, -1);
+}
 
-		output = new_hist + history1 * (*coef_ptr++);
-		output = output + history2 * (*coef_ptr++); /* zeros */
+/*! \brief Run one biquad section over a block of audio */
+static inline void biquad_section(const float *coef, float *h, float *buf, int samples)
+{
+	int i;
+	const float beta1 = coef[0], beta2 = coef[1], alpha1 = coef[2], alpha2 = coef[3];
+	float h1 = h[0], h2 = h[1];
 
-		*hist2_ptr++ = *hist1_ptr;
-		*hist1_ptr++ = new_hist;
-		hist1_ptr++;
-		hist2_ptr++;
+	for (i = 0; i < samples; i++) {
+		float new_hist = buf[i] - h1 * beta1 - h2 * beta2; /* poles */
+		buf[i] = new_hist + h1 * alpha1 + h2 * alpha2; /* zeros */
+		h2 = h1;
+		h1 = new_hist;
 	}
 
-	return(output);
+	h[0] = h1;
+	h[1] = h2;
 }
 
-static void free_filter(FILTER *iir)
+/*!
+ * \brief Run two consecutive biquad sections over a block of audio
+ * \note Each section's recurrence is a serial dependency chain, but the second section
+ * for one sample doesn't depend on the first section for the next, so running them
+ * in the same loop lets the CPU overlap the two chains.
+ */
+static inline void biquad_section_pair(const float *c0, const float *c1, float *h, float *buf, int samples)
 {
-	ast_free(iir->coef);
-	ast_free(iir->history);
-	ast_free(iir);
-}
+	int i;
+	const float beta1 = c0[0], beta2 = c0[1], alpha1 = c0[2], alpha2 = c0[3];
+	const float beta3 = c1[0], beta4 = c1[1], alpha3 = c1[2], alpha4 = c1[3];
+	float h1 = h[0], h2 = h[1], h3 = h[2], h4 = h[3];
 
-/*
-* --------------------------------------------------------------------
-* 
-* main()
-* 
-* Example main function to show how to update filter coefficients.
-* We create a 4th order filter (24 db/oct roloff), consisting
-* of two second order sections.
-* --------------------------------------------------------------------
-*/
-static FILTER *create_filter(int freq)
-{
-	FILTER *iir;
-	float	*coef;
-	double fs, fc; /* Sampling frequency, cutoff frequency */
-	double Q; /* Resonance > 1.0 < 1000 */
-	unsigned nInd;
-	double a0, a1, a2, b0, b1, b2;
-	double k; /* overall gain factor */
-
-	iir = ast_calloc(1, sizeof(*iir));
-
-	if (!iir) {
-		ast_log(LOG_WARNING, "Failed to allocate filter\n");
-		return NULL;
-	}
+	for (i = 0; i < samples; i++) {
+		float new_hist, out;
 
-	/*
-	* Setup filter s-domain coefficients
-	*/
-	/* Section 1 */ 
-	ProtoCoef[0].a0 = 1.0;
-	ProtoCoef[0].a1 = 0;
-	ProtoCoef[0].a2 = 0;
-	ProtoCoef[0].b0 = 1.0;
-	ProtoCoef[0].b1 = 0.765367;
-	ProtoCoef[0].b2 = 1.0;
-
-	/* Section 2 */ 
-	ProtoCoef[1].a0 = 1.0;
-	ProtoCoef[1].a1 = 0;
-	ProtoCoef[1].a2 = 0;
-	ProtoCoef[1].b0 = 1.0;
-	ProtoCoef[1].b1 = 1.847759;
-	ProtoCoef[1].b2 = 1.0;
-
-	iir->length = FILTER_SECTIONS; /* Number of filter sections */
+		new_hist = buf[i] - h1 * beta1 - h2 * beta2;
+		out = new_hist + h1 * alpha1 + h2 * alpha2;
+		h2 = h1;
+		h1 = new_hist;
 
-	/*
-	* Allocate array of z-domain coefficients for each filter section
-	* plus filter gain variable
-	*/
-	iir->coef = (float *) ast_calloc(4 * iir->length + 1, sizeof(float));
-	if (!iir->coef) {
-		ast_free(iir);
-		ast_log(LOG_WARNING, "Unable to allocate coef array, exiting\n");
-		return NULL;
+		new_hist = out - h3 * beta3 - h4 * beta4;
+		buf[i] = new_hist + h3 * alpha3 + h4 * alpha4;
+		h4 = h3;
+		h3 = new_hist;
 	}
 
-	k = 1.0; /* Set overall filter gain */
-	coef = iir->coef + 1; /* Skip k, or gain */
+	h[0] = h1;
+	h[1] = h2;
+	h[2] = h3;
+	h[3] = h4;
+}
 
-	Q = 1; /* Resonance */
-	fc = freq; /* Filter cutoff (Hz) */
-	fs = 8000; /* Sampling frequency (Hz) */
+/*!
+ * \brief Filter audio in place through a cascade of biquads
+ *
+ * Implements cascaded direct form II second order sections.
+ * Rather than running every section for each sample, sections are
+ * run over a whole block at a time, so that their coefficients and
+ * history stay in registers for the duration of the inner loop.
+ */
+static void resonance_filter(const struct resonance_coeffs *c, struct resonance_state *s, short *amp, int samples)
+{
+	float buf[FILTER_BLOCK_SIZE];
 
-	/*
-	* Compute z-domain coefficients for each biquad section
-	* for new Cutoff Frequency and Resonance
-	*/
-	for (nInd = 0; nInd < iir->length; nInd++) {
-		a0 = ProtoCoef[nInd].a0;
-		a1 = ProtoCoef[nInd].a1;
-		a2 = ProtoCoef[nInd].a2;
-
-		b0 = ProtoCoef[nInd].b0;
-		b1 = ProtoCoef[nInd].b1 / Q; /* Divide by resonance or Q */
-		b2 = ProtoCoef[nInd].b2;
-		szxform(&a0, &a1, &a2, &b0, &b1, &b2, fc, fs, &k, coef);
-		coef += 4; /* Point to next filter section */
-	}
+	while (samples > 0) {
+		int i, j, len = MIN(samples, FILTER_BLOCK_SIZE);
 
-	/* Update overall filter gain in coef array */
-	iir->coef[0] = k;
+		/* 1st coefficient is overall input scale factor, or filter gain */
+		for (i = 0; i < len; i++) {
+			buf[i] = amp[i] * c->gain;
+		}
+		for (j = 0; j + 1 < c->sections; j += 2) {
+			biquad_section_pair(c->coef[j], c->coef[j + 1], &s->history[j][0], buf, len);
+		}
+		if (j < c->sections) {
+			biquad_section(c->coef[j], &s->history[j][0], buf, len);
+		}
+		for (i = 0; i < len; i++) {
+			/* Resonance can overshoot, so clip rather than wrap around */
+			amp[i] = buf[i] > SHRT_MAX ? SHRT_MAX : buf[i] < SHRT_MIN ? SHRT_MIN : (short) buf[i];
+		}
 
-	/* Display filter coefficients */
-	for (nInd = 0; nInd < (iir->length * 4 + 1); nInd++)
-		ast_debug(1, "C[%d] = %15.10f\n", nInd, iir->coef[nInd]);
-	/*
-	* To process audio samples, call function iir_filter()
-	* for each audio sample
-	*/
-	return iir;
+		amp += len;
+		samples -= len;
+	}
 }
 
 struct resonance_information {
-	struct ast_audiohook audiohook;
+	ast_mutex_t lock;	/* Protects everything below, so the filter can be reconfigured mid-call */
 	int frequency;
+	int order;
 	unsigned short int tx:1;
 	unsigned short int rx:1;
-	FILTER *iir;
+	struct resonance_coeffs coeffs;
+	struct resonance_state rxstate;
+	struct resonance_state txstate;
 };
 
 enum resonance_flags {
 	FLAG_TRANSMIT_DIR = (1 << 1),
 	FLAG_RECEIVE_DIR = (1 << 2),
 	FLAG_END_FILTER = (1 << 3),
+	FLAG_ORDER = (1 << 4),
+};
+
+enum {
+	OPT_ARG_ORDER,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_ARRAY_SIZE,
 };
 
 AST_APP_OPTIONS(resonance_opts, {
 	AST_APP_OPTION('t', FLAG_TRANSMIT_DIR),
 	AST_APP_OPTION('r', FLAG_RECEIVE_DIR),
 	AST_APP_OPTION('d', FLAG_END_FILTER),
+	AST_APP_OPTION_ARG('o', FLAG_ORDER, OPT_ARG_ORDER),
 });
 
-static void destroy_callback(void *data)
+static void resonance_destroy(void *data)
 {
 	struct resonance_information *ni = data;
 
-	/* Destroy the audiohook, and destroy ourselves */
-	ast_audiohook_lock(&ni->audiohook);
-	ast_audiohook_detach(&ni->audiohook);
-	ast_audiohook_unlock(&ni->audiohook);
-	ast_audiohook_destroy(&ni->audiohook);
-	free_filter(ni->iir);
+	ast_mutex_destroy(&ni->lock);
 	ast_free(ni);
-
-	return;
 }
 
-/*! \brief Static structure for datastore information */
-static const struct ast_datastore_info resonance_datastore = {
-	.type = "resonance",
-	.destroy = destroy_callback
-};
-
-static inline void resonance_filter(FILTER *iir, short *amp, int samples)
+static void resonance_process(struct ast_channel *chan, void *data, struct ast_frame *frame, enum ast_audiohook_direction direction)
 {
-	int i;
-	for (i = 0; i < samples; i++) {
-		amp[i] = iir_filter(amp[i], iir);
-	}
-}
-
-static int resonance_callback(struct ast_audiohook *audiohook, struct ast_channel *chan, struct ast_frame *frame, enum ast_audiohook_direction direction)
-{
-	struct ast_datastore *datastore = NULL;
-	struct resonance_information *ni = NULL;
-
-	/* If the audiohook is stopping it means the channel is shutting down.... but we let the datastore destroy take care of it */
-	if (audiohook->status == AST_AUDIOHOOK_STATUS_DONE) {
-		return 0;
-	}
+	struct resonance_information *ni = data;
+	int rate, rx = direction == AST_AUDIOHOOK_DIRECTION_READ;
 
-	/* Grab datastore which contains our gain information */
-	if (!(datastore = ast_channel_datastore_find(chan, &resonance_datastore, NULL))) {
-		return 0;
+	ast_mutex_lock(&ni->lock);
+	/* Based on direction of frame, and confirm it is applicable */
+	if (!(rx ? ni->rx : ni->tx)) {
+		ast_mutex_unlock(&ni->lock);
+		return;
 	}
-
-	ni = datastore->data;
-
-	if (frame->frametype == AST_FRAME_VOICE) { /* we're filtering out an in-band frequency */
-		/* Based on direction of frame, and confirm it is applicable */
-		if (!(direction == AST_AUDIOHOOK_DIRECTION_READ ? ni->rx : ni->tx)) {
-			return 0;
-		}
-		/* Filter the sample now */
-		resonance_filter(ni->iir, frame->data.ptr, frame->samples);
+	/* Audiohooks may give us audio at any rate, and the filter design depends on it */
+	rate = ast_format_get_sample_rate(frame->subclass.format);
+	if (rate != ni->coeffs.rate) {
+		resonance_coeffs_get(&ni->coeffs, ni->frequency, rate, ni->order);
 	}
-
-	return 0;
+	/* Filter the sample now. Each direction has its own filter history. */
+	resonance_filter(&ni->coeffs, rx ? &ni->rxstate : &ni->txstate, frame->data.ptr, frame->samples);
+	ast_mutex_unlock(&ni->lock);
 }
 
+static struct ast_dsp_stage_type resonance_stage = {
+	.name = "RESONANCE_FILTER",
+	.priority = AST_DSP_PRIORITY_FILTER,
+	.process = resonance_process,
+	.destroy = resonance_destroy,
+};
+
 /*! \internal \brief Disable resonance filtering on the channel */
 static int remove_resonance_filter(struct ast_channel *chan)
 {
-	struct ast_datastore *datastore = NULL;
-	struct resonance_information *data;
-	SCOPED_CHANNELLOCK(chan_lock, chan);
-
-	datastore = ast_channel_datastore_find(chan, &resonance_datastore, NULL);
-	if (!datastore) {
+	if (ast_dsp_pipeline_remove(chan, &resonance_stage)) {
 		ast_log(AST_LOG_WARNING, "Cannot remove RESONANCE_FILTER from %s: RESONANCE_FILTER not currently enabled\n",
 		        ast_channel_name(chan));
 		return -1;
 	}
-	data = datastore->data;
-
-	if (ast_audiohook_remove(chan, &data->audiohook)) {
-		ast_log(AST_LOG_WARNING, "Failed to remove RESONANCE_FILTER audiohook from channel %s\n", ast_channel_name(chan));
-		return -1;
-	}
-
-	if (ast_channel_datastore_remove(chan, datastore)) {
-		ast_log(AST_LOG_WARNING, "Failed to remove RESONANCE_FILTER datastore from channel %s\n",
-		        ast_channel_name(chan));
-		return -1;
-	}
-	ast_datastore_free(datastore);
-
 	return 0;
 }
 
 static int resonance_write(struct ast_channel *chan, const char *cmd, char *data, const char *value)
 {
 	char *parse;
-	struct ast_datastore *datastore = NULL;
 	struct resonance_information *ni = NULL;
-	int is_new = 0;
+	struct resonance_coeffs coeffs;
 	struct ast_flags flags = { 0 };
-	int freq;
+	char *opt_args[OPT_ARG_ARRAY_SIZE];
+	int freq, order = DEFAULT_FILTER_ORDER;
 	
 	AST_DECLARE_APP_ARGS(args,
 		AST_APP_ARG(frequency);
@@ -593,7 +599,7 @@ static int resonance_write(struct ast_channel *chan, const char *cmd, char *data
 	}
 
 	if (!ast_strlen_zero(args.options)) {
-		ast_app_parse_options(resonance_opts, &flags, NULL, args.options);
+		ast_app_parse_options(resonance_opts, &flags, opt_args, args.options);
 	}
 
 	freq = atoi(value);
@@ -603,49 +609,54 @@ static int resonance_write(struct ast_channel *chan, const char *cmd, char *data
 		return -1;
 	}
 
+	if (ast_test_flag(&flags, FLAG_ORDER) && !ast_strlen_zero(opt_args[OPT_ARG_ORDER])) {
+		if (ast_str_to_int(opt_args[OPT_ARG_ORDER], &order) || order < 2 || order > MAX_FILTER_ORDER || order % 2) {
+			ast_log(LOG_WARNING, "Invalid filter order: %s (must be an even number from 2 to %d)\n", opt_args[OPT_ARG_ORDER], MAX_FILTER_ORDER);
+			return -1;
+		}
+	}
+
+	/* Design the filter up front, so the audiohook only has to filter */
+	resonance_coeffs_get(&coeffs, freq, 8000, order);
+
 	ast_channel_lock(chan);
-	if (!(datastore = ast_channel_datastore_find(chan, &resonance_datastore, NULL))) {
-		ast_channel_unlock(chan);
-		/* Allocate a new datastore to hold the reference to this resonance and audiohook information */
-		if (!(datastore = ast_datastore_alloc(&resonance_datastore, NULL)))
-			return 0;
+	if (!(ni = ast_dsp_pipeline_find(chan, &resonance_stage))) {
 		if (!(ni = ast_calloc(1, sizeof(*ni)))) {
-			ast_datastore_free(datastore);
+			ast_channel_unlock(chan);
 			return 0;
 		}
-		ast_audiohook_init(&ni->audiohook, AST_AUDIOHOOK_TYPE_MANIPULATE, "Resonance Filter", AST_AUDIOHOOK_MANIPULATE_ALL_RATES);
-		ni->audiohook.manipulate_callback = resonance_callback;
-		is_new = 1;
-	} else {
-		ast_channel_unlock(chan);
-		ni = datastore->data;
+		ast_mutex_init(&ni->lock);
+		/* Nothing will be filtered until the pipeline has the filter and we release the channel */
+		if (ast_dsp_pipeline_add(chan, &resonance_stage, ni)) {
+			ast_channel_unlock(chan);
+			resonance_destroy(ni);
+			return -1;
+		}
 	}
 
+	/* The audio thread may be using the filter right now, so swap in the new configuration under its lock */
+	ast_mutex_lock(&ni->lock);
 	ni->frequency = freq;
+	ni->order = order;
 	ni->tx = 0;
 	ni->rx = 0;
-	if (ast_strlen_zero(args.options) || ast_test_flag(&flags, FLAG_TRANSMIT_DIR)) {
+	if (!ast_test_flag(&flags, FLAG_TRANSMIT_DIR | FLAG_RECEIVE_DIR)) {
 		ni->tx = 1;
-	}
-	if (ast_strlen_zero(args.options) || ast_test_flag(&flags, FLAG_RECEIVE_DIR)) {
 		ni->rx = 1;
 	}
-
-	ni->iir = create_filter(ni->frequency);
-	if (!ni->iir) {
-		ast_log(LOG_WARNING, "Failed to properly set up resonance filter\n");
-		remove_resonance_filter(chan);
-		return -1;
+	if (ast_test_flag(&flags, FLAG_TRANSMIT_DIR)) {
+		ni->tx = 1;
 	}
-
-	if (is_new) {
-		datastore->data = ni;
-		ast_channel_lock(chan);
-		ast_channel_datastore_add(chan, datastore);
-		ast_channel_unlock(chan);
-		ast_audiohook_attach(chan, &ni->audiohook);
+	if (ast_test_flag(&flags, FLAG_RECEIVE_DIR)) {
+		ni->rx = 1;
 	}
 
+	ni->coeffs = coeffs;
+	memset(&ni->rxstate, 0, sizeof(ni->rxstate));
+	memset(&ni->txstate, 0, sizeof(ni->txstate));
+	ast_mutex_unlock(&ni->lock);
+	ast_channel_unlock(chan);
+
 	return 0;
 }
 
@@ -656,12 +667,38 @@ static struct ast_custom_function resonance_function = {
 
 static int unload_module(void)
 {
-	return ast_custom_function_unregister(&resonance_function);
+	int res = ast_custom_function_unregister(&resonance_function);
+	ast_dsp_stage_type_unregister(&resonance_stage);
+
+	ao2_cleanup(resonance_cache);
+	resonance_cache = NULL;
+	return res;
 }
 
 static int load_module(void)
 {
-	return ast_custom_function_register(&resonance_function);
+	resonance_cache = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, RESONANCE_CACHE_BUCKETS,
+		resonance_design_hash_fn, NULL, resonance_design_cmp_fn);
+	if (!resonance_cache) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	if (ast_dsp_stage_type_register(&resonance_stage)) {
+		ao2_ref(resonance_cache, -1);
+		resonance_cache = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	if (ast_custom_function_register(&resonance_function)) {
+		ast_dsp_stage_type_unregister(&resonance_stage);
+		ao2_ref(resonance_cache, -1);
+		resonance_cache = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	return AST_MODULE_LOAD_SUCCESS;
 }
 
-AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Resonant low pass filter");
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Resonant low pass filter",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.requires = "res_dsp_pipeline",
+);
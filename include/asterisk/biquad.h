@@ -0,0 +1,106 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2021, Naveen Albert
+ *
+ * Naveen Albert <asterisk@phreaknet.org>
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Fixed point biquad kernels for in-band signaling
+ *
+ * \author Naveen Albert <asterisk@phreaknet.org>
+ *
+ * These are header-only, so that any module doing in-band
+ * signaling (SF, notch filtering, etc.) can use them without
+ * depending on another module being loaded.
+ */
+
+#ifndef _ASTERISK_BIQUAD_H
+#define _ASTERISK_BIQUAD_H
+
+/*! \brief Number of fractional bits in fixed point coefficients and filter state */
+#define BIQUAD_NB 14
+
+/*! \brief Coefficients for a 2nd order IIR notch filter, as computed by mknotch */
+struct biquad_notch_coeffs {
+	long p1;
+	long p2;
+	long p3;
+};
+
+/*! \brief History of a 2nd order IIR notch filter */
+struct biquad_notch_state {
+	long x1;
+	long x2;
+	long y1;
+	long y2;
+};
+
+static inline void biquad_notch_reset(struct biquad_notch_state *s)
+{
+	s->x1 = s->x2 = s->y1 = s->y2 = 0;
+}
+
+/*!
+ * \brief Notch filter audio in place, while integrating its energy before and after filtering
+ *
+ * This is the DAHDI SF detector's notch filter. It does in one pass over the audio
+ * what would otherwise take three (energy, filter, energy), with all of the filter
+ * state kept in locals for the duration of the loop.
+ *
+ * \note The filter is recursive, so samples can't be processed in parallel; the
+ * speedup comes from touching each sample once and keeping the state in registers.
+ *
+ * \param s Filter history
+ * \param c Filter coefficients
+ * \param amp Signed linear audio, which is replaced with the filtered audio
+ * \param samples Number of samples in amp
+ * \param[in,out] e_in Sum of absolute amplitudes before filtering is added to this
+ * \param[in,out] e_out Sum of absolute amplitudes after filtering is added to this
+ */
+static inline void biquad_notch_process(struct biquad_notch_state *s, const struct biquad_notch_coeffs *c,
+	short *amp, int samples, long *e_in, long *e_out)
+{
+	int i;
+	long x1 = s->x1, x2 = s->x2, y1 = s->y1, y2 = s->y2;
+	const long p1 = c->p1, p2 = c->p2, p3 = c->p3;
+	long ein = 0, eout = 0;
+
+	for (i = 0; i < samples; i++) {
+		long x, y;
+		short in = amp[i], out;
+
+		ein += in < 0 ? -in : in;
+		x = (long) in << BIQUAD_NB;
+		y = x2 + (p1 * (x1 >> BIQUAD_NB)) + x;
+		y += (p2 * (y2 >> BIQUAD_NB)) + (p3 * (y1 >> BIQUAD_NB));
+		x2 = x1;
+		x1 = x;
+		y2 = y1;
+		y1 = y;
+		out = y >> BIQUAD_NB;
+		amp[i] = out;
+		eout += out < 0 ? -out : out;
+	}
+
+	s->x1 = x1;
+	s->x2 = x2;
+	s->y1 = y1;
+	s->y2 = y2;
+	*e_in += ein;
+	*e_out += eout;
+}
+
+#endif /* _ASTERISK_BIQUAD_H */
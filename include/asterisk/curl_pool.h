@@ -0,0 +1,228 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2022, Naveen Albert
+ *
+ * Naveen Albert <asterisk@phreaknet.org>
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Reusable cURL handles
+ *
+ * \author Naveen Albert <asterisk@phreaknet.org>
+ *
+ * Creating a cURL easy handle for every request means every request
+ * needs a new TCP connection, TLS handshake, and DNS lookup. A pool
+ * keeps idle handles around for reuse, each with its own open connections,
+ * and shares DNS results and TLS sessions between all of its handles, so that
+ * repeat requests to the same server can skip most of that.
+ * (libcurl doesn't support sharing a connection cache between handles
+ * that are in use concurrently, so connections are not shared.)
+ *
+ * This is header-only, so that modules can use it without depending
+ * on another module. Each module that includes it has its own pool(s).
+ */
+
+#ifndef _ASTERISK_CURL_POOL_H
+#define _ASTERISK_CURL_POOL_H
+
+#include <curl/curl.h>
+
+#include "asterisk/lock.h"
+#include "asterisk/time.h"
+#include "asterisk/cli.h"
+
+/*! \brief Maximum number of idle handles kept for reuse */
+#define CURL_POOL_MAX_IDLE 8
+
+/*! \brief Number of recent requests whose latency is kept, for percentiles */
+#define CURL_POOL_LATENCY_SAMPLES 512
+
+struct curl_pool {
+	ast_mutex_t lock;
+	CURLSH *share;
+	ast_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+	CURL *idle[CURL_POOL_MAX_IDLE];
+	int numidle;
+	/* Statistics, protected by lock */
+	unsigned int requests;
+	unsigned int reused;	/* Requests that didn't need a new connection */
+	unsigned int failures;
+	unsigned int latencies[CURL_POOL_LATENCY_SAMPLES];	/* Microseconds, ring buffer */
+	unsigned int numlatencies;
+};
+
+static inline void curl_pool_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	struct curl_pool *pool = userptr;
+	ast_mutex_lock(&pool->share_locks[data]);
+}
+
+static inline void curl_pool_share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+	struct curl_pool *pool = userptr;
+	ast_mutex_unlock(&pool->share_locks[data]);
+}
+
+/*!
+ * \brief Initialize a pool
+ * \retval 0 on success, -1 on failure
+ */
+static inline int curl_pool_init(struct curl_pool *pool)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->share = curl_share_init();
+	if (!pool->share) {
+		return -1;
+	}
+
+	ast_mutex_init(&pool->lock);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		ast_mutex_init(&pool->share_locks[i]);
+	}
+
+	curl_share_setopt(pool->share, CURLSHOPT_LOCKFUNC, curl_pool_share_lock);
+	curl_share_setopt(pool->share, CURLSHOPT_UNLOCKFUNC, curl_pool_share_unlock);
+	curl_share_setopt(pool->share, CURLSHOPT_USERDATA, pool);
+	curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	return 0;
+}
+
+/*! \brief Destroy a pool. All handles must have been returned. */
+static inline void curl_pool_destroy(struct curl_pool *pool)
+{
+	int i;
+
+	if (!pool->share) {
+		return; /* Never initialized */
+	}
+
+	/* Handles must go before the share they use */
+	for (i = 0; i < pool->numidle; i++) {
+		curl_easy_cleanup(pool->idle[i]);
+	}
+	pool->numidle = 0;
+	curl_share_cleanup(pool->share);
+	pool->share = NULL;
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		ast_mutex_destroy(&pool->share_locks[i]);
+	}
+	ast_mutex_destroy(&pool->lock);
+}
+
+/*!
+ * \brief Get a handle from a pool
+ * \note The handle has default options, except that it uses the pool's shared
+ * data and TCP keepalives. It must be returned with curl_pool_put.
+ * \return Handle, or NULL on failure
+ */
+static inline CURL *curl_pool_get(struct curl_pool *pool)
+{
+	CURL *curl = NULL;
+
+	ast_mutex_lock(&pool->lock);
+	if (pool->numidle) {
+		curl = pool->idle[--pool->numidle];
+	}
+	ast_mutex_unlock(&pool->lock);
+
+	if (curl) {
+		/* Reset options from the last request. This keeps connections, caches, etc. */
+		curl_easy_reset(curl);
+	} else if (!(curl = curl_easy_init())) {
+		return NULL;
+	}
+
+	curl_easy_setopt(curl, CURLOPT_SHARE, pool->share);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); /* We're multithreaded */
+	return curl;
+}
+
+/*!
+ * \brief Return a handle to a pool after a request, and record the request's statistics
+ * \note Handles whose request failed are cleaned up rather than reused, since their connection may be in a bad state
+ * \param pool
+ * \param curl Handle from curl_pool_get
+ * \param start When the request started
+ * \param res Result of curl_easy_perform
+ */
+static inline void curl_pool_put(struct curl_pool *pool, CURL *curl, struct timeval start, CURLcode res)
+{
+	long connects = 1;
+	unsigned int usec = ast_tvdiff_us(ast_tvnow(), start);
+
+	if (res == CURLE_OK) {
+		curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+	}
+
+	ast_mutex_lock(&pool->lock);
+	pool->requests++;
+	if (res != CURLE_OK) {
+		pool->failures++;
+	} else if (!connects) {
+		pool->reused++;
+	}
+	pool->latencies[pool->numlatencies++ % CURL_POOL_LATENCY_SAMPLES] = usec;
+	if (res == CURLE_OK && pool->numidle < CURL_POOL_MAX_IDLE) {
+		pool->idle[pool->numidle++] = curl;
+		curl = NULL;
+	}
+	ast_mutex_unlock(&pool->lock);
+
+	if (curl) {
+		curl_easy_cleanup(curl); /* Request failed, or already have enough idle handles */
+	}
+}
+
+static inline int curl_pool_latency_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*! \brief Show a pool's connection reuse and recent latency on the CLI */
+static inline void curl_pool_show(struct curl_pool *pool, int fd)
+{
+	unsigned int sorted[CURL_POOL_LATENCY_SAMPLES];
+	unsigned int requests, reused, failures;
+	int num, idle;
+
+	ast_mutex_lock(&pool->lock);
+	requests = pool->requests;
+	reused = pool->reused;
+	failures = pool->failures;
+	idle = pool->numidle;
+	num = MIN(pool->numlatencies, CURL_POOL_LATENCY_SAMPLES);
+	memcpy(sorted, pool->latencies, num * sizeof(sorted[0]));
+	ast_mutex_unlock(&pool->lock);
+
+	ast_cli(fd, "%-28s %u\n", "Requests", requests);
+	ast_cli(fd, "%-28s %u\n", "Failed requests", failures);
+	ast_cli(fd, "%-28s %u (%.1f%%)\n", "Reused connections", reused, requests - failures ? 100.0 * reused / (requests - failures) : 0.0);
+	ast_cli(fd, "%-28s %d\n", "Idle handles", idle);
+	if (!num) {
+		return;
+	}
+	qsort(sorted, num, sizeof(sorted[0]), curl_pool_latency_cmp);
+	ast_cli(fd, "Latency of last %d request%s (ms): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n", num, ESS(num),
+		sorted[num * 50 / 100] / 1000.0, sorted[num * 90 / 100] / 1000.0, sorted[num * 99 / 100] / 1000.0, sorted[num - 1] / 1000.0);
+}
+
+#endif /* _ASTERISK_CURL_POOL_H */
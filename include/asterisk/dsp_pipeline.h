@@ -0,0 +1,109 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2022, Naveen Albert
+ *
+ * Naveen Albert <asterisk@phreaknet.org>
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief In-band DSP pipeline
+ *
+ * \author Naveen Albert <asterisk@phreaknet.org>
+ *
+ * Rather than each in-band signaling function attaching its own
+ * audiohook to a channel (and looking up its own datastore for
+ * every frame), functions register a stage type once, and then
+ * add stages to the channel's pipeline. Each channel has at most
+ * one pipeline audiohook, which runs its stages in priority order.
+ */
+
+#ifndef _ASTERISK_DSP_PIPELINE_H
+#define _ASTERISK_DSP_PIPELINE_H
+
+#include "asterisk/linkedlists.h"
+#include "asterisk/audiohook.h"
+
+/*! \brief Suggested stage priorities. Lower priorities run first. */
+enum ast_dsp_stage_priority {
+	/*! Stages that only analyze audio, and should see it as it was received */
+	AST_DSP_PRIORITY_DETECT = 100,
+	/*! Stages that modify audio */
+	AST_DSP_PRIORITY_FILTER = 200,
+};
+
+/*! \brief A type of DSP stage, e.g. a particular filter or detector */
+struct ast_dsp_stage_type {
+	/*! Name, for the CLI */
+	const char *name;
+	/*! Order in the pipeline. Stages with the same priority run in the order they were added. */
+	int priority;
+	/*!
+	 * \brief Process a frame of signed linear audio
+	 * \param chan Channel
+	 * \param data Stage data, as passed to ast_dsp_pipeline_add
+	 * \param frame Voice frame, which may be modified in place. The sample rate may vary.
+	 * \param direction Direction of the frame
+	 * \note This is called with the pipeline's audiohook locked.
+	 */
+	void (*process)(struct ast_channel *chan, void *data, struct ast_frame *frame, enum ast_audiohook_direction direction);
+	/*! \brief Free stage data, once the stage has been removed from the pipeline */
+	void (*destroy)(void *data);
+	/* Private, set and used by res_dsp_pipeline */
+	struct ast_module *module;
+	unsigned int channels;	/* Number of channels currently using this stage */
+	unsigned long frames;	/* Frames processed */
+	unsigned long nsec;		/* CPU time spent processing frames */
+	AST_RWLIST_ENTRY(ast_dsp_stage_type) entry;
+};
+
+/*!
+ * \brief Register a DSP stage type
+ * \param type Stage type, which must remain valid until unregistered
+ * \retval 0 on success, -1 on failure
+ */
+#define ast_dsp_stage_type_register(type) __ast_dsp_stage_type_register(type, AST_MODULE_SELF)
+int __ast_dsp_stage_type_register(struct ast_dsp_stage_type *type, struct ast_module *module);
+
+/*!
+ * \brief Unregister a DSP stage type
+ * \retval 0 on success, -1 if not registered
+ */
+int ast_dsp_stage_type_unregister(struct ast_dsp_stage_type *type);
+
+/*!
+ * \brief Add a stage to a channel's pipeline, creating the pipeline if needed
+ * \param chan Channel
+ * \param type Registered stage type
+ * \param data Stage data. On success, ownership passes to the pipeline, which will call the type's destroy callback.
+ * \retval 0 on success, -1 on failure (including if the channel already has a stage of this type)
+ */
+int ast_dsp_pipeline_add(struct ast_channel *chan, struct ast_dsp_stage_type *type, void *data);
+
+/*!
+ * \brief Find the data for a channel's stage of a given type
+ * \note The data remains valid as long as the stage isn't removed. This is only
+ * guaranteed while the channel is locked, or from the channel's own thread.
+ * \return Stage data, or NULL if the channel has no such stage
+ */
+void *ast_dsp_pipeline_find(struct ast_channel *chan, struct ast_dsp_stage_type *type);
+
+/*!
+ * \brief Remove a stage from a channel's pipeline, and destroy it
+ * \note If this was the last stage, the pipeline is removed from the channel
+ * \retval 0 on success, -1 if the channel has no such stage
+ */
+int ast_dsp_pipeline_remove(struct ast_channel *chan, struct ast_dsp_stage_type *type);
+
+#endif /* _ASTERISK_DSP_PIPELINE_H */
@@ -0,0 +1,81 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2022, Naveen Albert
+ *
+ * Naveen Albert <asterisk@phreaknet.org>
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Notification of reloads of any module
+ *
+ * \author Naveen Albert <asterisk@phreaknet.org>
+ *
+ * Modules that cache something derived from the dialplan need to know
+ * when it may have changed, and any module could change it (pbx_config,
+ * pbx_ael, pbx_lua...), so they watch for the manager's Reload event.
+ * The manager topic carries every AMI event, so the subscription only
+ * accepts generic manager messages, rather than having each one dispatched
+ * to a callback that would throw it away.
+ *
+ * This is header-only, so that modules can use it without depending
+ * on another module.
+ */
+
+#ifndef _ASTERISK_RELOAD_SUB_H
+#define _ASTERISK_RELOAD_SUB_H
+
+#include "asterisk/stasis.h"
+#include "asterisk/json.h"
+#include "asterisk/manager.h"
+
+/*!
+ * \brief Subscribe to reloads
+ * \param callback Subscription callback. Use reload_sub_is_reload to tell which messages are reloads.
+ * \param data Data for callback
+ * \return Subscription, to be released with stasis_unsubscribe_and_join
+ * \retval NULL on failure
+ */
+static inline struct stasis_subscription *reload_sub_subscribe(stasis_subscription_cb callback, void *data)
+{
+	struct stasis_subscription *sub = stasis_subscribe(ast_manager_get_topic(), callback, data);
+
+	if (!sub) {
+		return NULL;
+	}
+	/* Reloads are the only manager messages we care about */
+	stasis_subscription_accept_message_type(sub, ast_manager_get_generic_type());
+	stasis_subscription_set_filter(sub, STASIS_SUBSCRIPTION_FILTER_SELECTIVE);
+	return sub;
+}
+
+/*!
+ * \brief Whether a message received by a reload subscription is a reload
+ * \retval 1 if it is, 0 if not (e.g. the subscription's final message)
+ */
+static inline int reload_sub_is_reload(struct stasis_message *msg)
+{
+	struct ast_json_payload *payload;
+	const char *type;
+
+	if (stasis_message_type(msg) != ast_manager_get_generic_type()) {
+		return 0;
+	}
+
+	payload = stasis_message_data(msg);
+	type = ast_json_string_get(ast_json_object_get(payload->json, "type"));
+	return !strcmp(S_OR(type, ""), "Reload");
+}
+
+#endif /* _ASTERISK_RELOAD_SUB_H */
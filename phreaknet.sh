@@ -1378,6 +1378,7 @@ run_testsuite_tests() {
 	./setupVenv.sh
 
 	run_testsuite_test "apps/assert"
+	run_testsuite_test "apps/coin_denominations"
 	run_testsuite_test "apps/dialtone"
 	run_testsuite_test "apps/verify"
 	run_testsuite_test "funcs/func_dbchan"
@@ -1427,6 +1428,7 @@ add_phreak_testsuite() {
 	cd $AST_SOURCE_PARENT_DIR
 
 	install_phreak_testsuite_test "apps/assert"
+	install_phreak_testsuite_test "apps/coin_denominations"
 	install_phreak_testsuite_test "apps/dialtone"
 	install_phreak_testsuite_test "apps/verify"
 	install_phreak_testsuite_test "funcs/func_dbchan"
@@ -2780,6 +2782,11 @@ phreak_patches() {
 	phreak_tree_module "configs/samples/res_smdr_whozz.conf.sample" "1"
 	phreak_tree_module "configs/samples/res_telos_1a2.conf.sample" "1"
 
+	phreak_tree_module "include/asterisk/biquad.h" # shared by in-band signaling modules
+	phreak_tree_module "include/asterisk/dsp_pipeline.h" # used by res_dsp_pipeline and its stages
+	phreak_tree_module "include/asterisk/curl_pool.h" # used by res_phreaknet and app_verify
+	phreak_tree_module "include/asterisk/reload_sub.h" # used by app_dialtone and res_digitmap
+
 	phreak_tree_module "funcs/func_dbchan.c"
 	phreak_tree_module "funcs/func_dtmf_flash.c"
 	phreak_tree_module "funcs/func_dtmf_trace.c"
@@ -2793,6 +2800,7 @@ phreak_patches() {
 	phreak_tree_module "funcs/func_tech.c"
 
 	phreak_tree_module "res/res_coindetect.c"
+	phreak_tree_module "res/res_dsp_pipeline.c"
 	phreak_tree_module "res/res_alarmsystem.c"
 	phreak_tree_module "res/res_digitmap.c"
 	phreak_tree_module "res/res_irc.c"
@@ -26,6 +26,7 @@
  */
 
 /*** MODULEINFO
+	<depend>res_dsp_pipeline</depend>
 	<support_level>extended</support_level>
  ***/
 
@@ -40,11 +41,13 @@
 #include "asterisk/dsp.h"
 #include "asterisk/pbx.h"
 #include "asterisk/audiohook.h"
+#include "asterisk/dsp_pipeline.h"
 #include "asterisk/app.h"
 #include "asterisk/indications.h"
 #include "asterisk/conversions.h"
 #include "asterisk/ulaw.h"
 #include "asterisk/alaw.h"
+#include "asterisk/cli.h"
 
 /*** DOCUMENTATION
 	<application name="CoinDisposition" language="en_US">
@@ -166,8 +169,8 @@
 		<description>
 			<para>Waits for coin denomination tones to be detected before dialplan execution continues.</para>
 			<note><para>Accuracy of detection may vary with environment and is not guaranteed.</para>
-			<para>Nickels, dimes, and quarters are supported, though nickels and dimes work best.
-			Dollar coins are not currently supported.</para></note>
+			<para>Nickels, dimes, quarters, and dollar coins are supported. Coins are identified
+			by the cadence of their tone bursts, as specified in GR-506-CORE.</para></note>
 			<para>The following variables are set by this application:</para>
 			<variablelist>
 				<variable name="WAITFORDEPOSITSTATUS">
@@ -202,14 +205,22 @@
 						or <literal>h</literal> option. Default is none (collect deposits
 						indefinitely).</para>
 					</option>
+					<option name="b">
+						<para>Batch mode: rather than analyzing audio as each frame is
+						processed, queue it for a shared worker thread that analyzes
+						all batch mode channels in a single pass every 20 ms. This
+						reduces the work done in each channel's media path, at the
+						cost of up to 20 ms of additional detection latency.
+						This option only takes effect when the detector is first created.</para>
+					</option>
 					<option name="d">
 						<para>Delay threshold to use after the condition has matched to allow for
 						additional deposits to be received. Default is 0 (no delay).</para>
 					</option>
 					<option name="f">
-						<para>Flexible detection: if 3 are more coin denomination beeps are detected
-						in a single instance, round up as a quarter. This can be helpful if quarters
-						are underdetected.</para>
+						<para>Flexible detection: if 3 or 4 coin denomination beeps are detected
+						in a single coin, classify it as a quarter, even if the beeps were not
+						quarter length. This can be helpful if quarters are underdetected.</para>
 					</option>
 					<option name="g">
 						<para>Go to the specified context,exten,priority if tone is received on this channel.
@@ -241,20 +252,24 @@
 			</parameter>
 		</syntax>
 		<description>
-			<para>The COIN_DETECT function detects coin denomination tones and keeps
-			track of how many times the tone has been detected.</para>
+			<para>The COIN_DETECT function detects coin denomination tones, classifies
+			each coin by the cadence of its tone bursts, and keeps track of the amount
+			deposited.</para>
 			<para>When reading this function (instead of writing), supply <literal>tx</literal>
-			to get the number of times a tone has been detected in the TX direction and
-			<literal>rx</literal> to get the number of times a tone has been detected in the
-			RX direction.</para>
+			to get the amount, in cents, deposited in the TX direction and
+			<literal>rx</literal> to get the amount deposited in the RX direction.
+			A denomination may be provided as a second argument (<literal>nickel</literal>,
+			<literal>dime</literal>, <literal>quarter</literal>, or <literal>dollar</literal>)
+			to get the number of coins of that denomination deposited instead.</para>
 			<note><para>Accuracy of detection may vary with environment and is not guaranteed.</para>
-			<para>Nickels, dimes, and quarters are supported, though nickels and dimes work best.
-			Dollar coins are not currently supported.</para></note>
+			<para>Nickels, dimes, quarters, and dollar coins are supported. Coins are identified
+			by the cadence of their tone bursts, as specified in GR-506-CORE.</para></note>
 			<example title="intercept2600">
 			same => n,Set(COIN_DETECT(a(10)d(5)g(got-2600,s,1))=) ; wait for 10 cents, with 5 second grace period
 			for overtime deposits, and redirect to got-2600,s,1 afterwards
 			same => n,Wait(15) ; wait 15 seconds for deposits
 			same => n,NoOp(${COIN_DETECT(rx)}) ; amount, in cents, that has been deposited
+			same => n,NoOp(${COIN_DETECT(rx,quarter)}) ; number of quarters that have been deposited
 			</example>
 			<example title="removedetector">
 			same => n,Set(COIN_DETECT(x)=) ; remove the detector from the channel
@@ -309,24 +324,127 @@
 	</function>
  ***/
 
+/* Coin denomination tones are 1700 + 2200 Hz (or just 2200 Hz for single-frequency totalizers).
+ * We analyze 10 ms blocks, which gives a Goertzel bin width of 100 Hz, more than enough
+ * to separate the two tones, while still resolving the 33 ms on/off cadence of a quarter. */
+#define COIN_TONE_LOW 1700
+#define COIN_TONE_HIGH 2200
+#define COIN_BLOCK_MS 10
+
+/*! \brief Minimum mean power per sample for a block to be considered at all (approx. -54 dBFS) */
+#define COIN_MIN_ENERGY 2000.0
+/*! \brief Fraction of block energy that must be in the coin tone(s). A perfect tone yields 0.5. */
+#define COIN_TONE_RATIO 0.30
+#define COIN_TONE_RATIO_RELAXED 0.15
+/*! \brief Maximum allowed power ratio between the 1700 and 2200 Hz components (~10 dB) */
+#define COIN_MAX_TWIST 10.0
+/*! \brief Consecutive blocks required to consider the tone on or off */
+#define COIN_ON_BLOCKS 2
+#define COIN_OFF_BLOCKS 2
+
+/* Coin denomination tone cadences (GR-506-CORE 18.1.3):
+ * Nickel: one 66 ms tone burst
+ * Dime: two 66 ms tone bursts, 66 ms apart
+ * Quarter: five 33 ms tone bursts, 33 ms apart
+ * Dollar: one 650 ms tone burst */
+/*! \brief Bursts shorter than this are quarter beeps */
+#define COIN_QUARTER_MAX_MS 50
+/*! \brief Bursts at least this long are dollar tones */
+#define COIN_DOLLAR_MIN_MS 400
+/*! \brief Silence that ends a coin. Gaps within a coin are at most 66 ms. */
+#define COIN_GAP_MS 150
+/*! \brief Maximum coins that can be reported from one call to the detector */
+#define COIN_MAX_COINS 8
+
+enum coin_denomination {
+	COIN_NICKEL = 0,
+	COIN_DIME,
+	COIN_QUARTER,
+	COIN_DOLLAR,
+	/* note: this entry _MUST_ be the last one in the enum */
+	COIN_DENOMINATIONS,
+};
+
+static const struct {
+	const char *name;
+	int cents;
+} coin_types[] = {
+	[COIN_NICKEL] = { "nickel", 5 },
+	[COIN_DIME] = { "dime", 10 },
+	[COIN_QUARTER] = { "quarter", 25 },
+	[COIN_DOLLAR] = { "dollar", 100 },
+};
+
+/*! \brief Maximum buffered audio per direction in batch mode, in samples (enough for 200 ms at 16 kHz) */
+#define COIN_BATCH_SAMPLES 3200
+/*! \brief How often the batch worker makes a pass over all detectors */
+#define COIN_BATCH_INTERVAL_MS 20
+
+struct coin_goertzel {
+	float v2;
+	float v3;
+	float fac;
+};
+
+/*! \brief Coin tone detector state for one direction of audio */
+struct coin_detector {
+	struct coin_goertzel low;	/* 1700 Hz */
+	struct coin_goertzel high;	/* 2200 Hz */
+	float energy;		/* Total energy of the current block */
+	int rate;			/* Sample rate coefficients are computed for */
+	int blocksize;		/* Samples per block */
+	int current;		/* Samples processed in the current block */
+	int hits;			/* Consecutive blocks with tone */
+	int misses;			/* Consecutive blocks without tone */
+	/* Cadence of the coin currently being deposited */
+	int burst_blocks;	/* Length of the current tone burst */
+	int gap_blocks;		/* Silence since the last tone burst ended */
+	int bursts;			/* Tone bursts so far */
+	int short_bursts;	/* How many of those were quarter length */
+	int longest;		/* Longest burst, in blocks */
+	unsigned int tone_on:1;
+	unsigned int sf:1;	/* Single frequency (2200 Hz only) */
+	unsigned int relax:1;
+	unsigned int flexible:1;
+};
+
+/*! \brief Audio queued for the batch worker, for one direction */
+struct coin_batch_buffer {
+	int16_t samples[COIN_BATCH_SAMPLES];
+	int len;
+	int rate;
+};
+
 struct detect_information {
-	struct ast_dsp *dsp;
-	struct ast_audiohook audiohook;
+	struct coin_detector rxdet;
+	struct coin_detector txdet;
 	char *gototx;
 	char *gotorx;
 	unsigned short int tx:1;
 	unsigned short int rx:1;
-	int txcount;
-	int rxcount;
-	int hitsrequired;
+	unsigned short int batch:1;
+	int txcount;		/* Cents deposited in TX direction */
+	int rxcount;		/* Cents deposited in RX direction */
+	int txcoins[COIN_DENOMINATIONS];
+	int rxcoins[COIN_DENOMINATIONS];
+	int centsrequired;
 	int delay;
 	int actionflag;
-	int debounce;
-	int debouncedhits;
-	int flexible;
 	struct timeval delaytimer;
+	/* Batch mode only */
+	ast_mutex_t lock;
+	struct coin_batch_buffer rxbuf;
+	struct coin_batch_buffer txbuf;
+	char uniqueid[AST_MAX_UNIQUEID];
+	AST_LIST_ENTRY(detect_information) entry;
 };
 
+/*! \brief Detectors that are serviced by the batch worker, rather than in the audiohook */
+static AST_LIST_HEAD_STATIC(batch_detectors, detect_information);
+static ast_cond_t batch_cond;
+static pthread_t batch_thread = AST_PTHREADT_NULL;
+static int batch_shutdown = 0;
+
 enum td_opts {
 	OPT_TX = (1 << 1),
 	OPT_RX = (1 << 2),
@@ -338,6 +456,7 @@ enum td_opts {
 	OPT_RELAX = (1 << 8),
 	OPT_SF = (1 << 9),
 	OPT_FLEXIBLE = (1 << 10),
+	OPT_BATCH = (1 << 11),
 };
 
 enum {
@@ -351,6 +470,7 @@ enum {
 
 AST_APP_OPTIONS(td_opts, {
 	AST_APP_OPTION_ARG('a', OPT_HITS_REQ, OPT_ARG_HITS_REQ),
+	AST_APP_OPTION('b', OPT_BATCH),
 	AST_APP_OPTION_ARG('d', OPT_DELAY, OPT_ARG_DELAY),
 	AST_APP_OPTION('f', OPT_FLEXIBLE),
 	AST_APP_OPTION_ARG('g', OPT_GOTO_RX, OPT_ARG_GOTO_RX),
@@ -362,55 +482,216 @@ AST_APP_OPTIONS(td_opts, {
 	AST_APP_OPTION('x', OPT_END_DETECTOR),
 });
 
-static void destroy_callback(void *data)
+static inline void coin_goertzel_init(struct coin_goertzel *g, int freq, int rate)
+{
+	g->v2 = g->v3 = 0.0;
+	g->fac = 2.0 * cos(2.0 * M_PI * freq / rate);
+}
+
+static inline float coin_goertzel_result(struct coin_goertzel *g)
+{
+	return g->v3 * g->v3 + g->v2 * g->v2 - g->v2 * g->v3 * g->fac;
+}
+
+static void coin_detector_init(struct coin_detector *cd, int rate, int sf, int relax, int flexible)
+{
+	cd->rate = rate;
+	cd->blocksize = rate * COIN_BLOCK_MS / 1000;
+	coin_goertzel_init(&cd->low, COIN_TONE_LOW, rate);
+	coin_goertzel_init(&cd->high, COIN_TONE_HIGH, rate);
+	cd->energy = 0.0;
+	cd->current = 0;
+	cd->hits = cd->misses = 0;
+	cd->burst_blocks = cd->gap_blocks = 0;
+	cd->bursts = cd->short_bursts = cd->longest = 0;
+	cd->tone_on = 0;
+	cd->sf = sf;
+	cd->relax = relax;
+	cd->flexible = flexible;
+}
+
+/*! \brief Whether the block just completed contains a coin tone */
+static int coin_block_hit(struct coin_detector *cd)
+{
+	float low, high, total;
+	float ratio = cd->relax ? COIN_TONE_RATIO_RELAXED : COIN_TONE_RATIO;
+
+	if (cd->energy < COIN_MIN_ENERGY * cd->blocksize) {
+		return 0;
+	}
+	/* A tone's Goertzel power is on the order of the block energy times the block size */
+	total = cd->energy * cd->blocksize;
+	high = coin_goertzel_result(&cd->high);
+	if (cd->sf) {
+		return high > ratio * total;
+	}
+	low = coin_goertzel_result(&cd->low);
+	if (low * COIN_MAX_TWIST < high || high * COIN_MAX_TWIST < low) {
+		return 0;
+	}
+	return low + high > ratio * total;
+}
+
+/*!
+ * \brief Classify a completed coin by its tone burst cadence
+ * \param cd Detector
+ * \param[out] coins Denominations detected
+ * \param maxcoins Size of coins
+ * \return Number of coins stored in coins
+ */
+static int coin_classify(struct coin_detector *cd, enum coin_denomination *coins, int maxcoins)
+{
+	int i, num = 0;
+	int longest_ms = cd->longest * COIN_BLOCK_MS;
+
+	if (cd->bursts == 1 && longest_ms >= COIN_DOLLAR_MIN_MS) {
+		coins[num++] = COIN_DOLLAR;
+	} else if (cd->bursts == 5 || (cd->bursts >= 3 && cd->bursts <= 5 && 2 * cd->short_bursts > cd->bursts)) {
+		/* Quarter beeps are right on the edge of what we can reliably resolve, so one or two
+		 * may get lost, but if the beeps are quarter length, there's no other coin it can be. */
+		coins[num++] = COIN_QUARTER;
+	} else if (cd->flexible && cd->bursts >= 3 && cd->bursts <= 4) {
+		/* If we detect 15c or 20c, we can act as if we got 25c, because in reality, we probably did. */
+		ast_debug(1, "Received %d beeps, but pretending we got a quarter\n", cd->bursts);
+		coins[num++] = COIN_QUARTER;
+	} else if (cd->bursts == 1) {
+		coins[num++] = COIN_NICKEL;
+	} else if (cd->bursts == 2) {
+		coins[num++] = COIN_DIME;
+	} else {
+		/* Doesn't match any known cadence, fall back to counting each beep as 5 cents */
+		ast_debug(1, "Unrecognized coin cadence (%d bursts, %d short, longest %d ms)\n", cd->bursts, cd->short_bursts, longest_ms);
+		for (i = 0; i < cd->bursts && num < maxcoins; i++) {
+			coins[num++] = COIN_NICKEL;
+		}
+	}
+
+	cd->bursts = cd->short_bursts = cd->longest = 0;
+	return num;
+}
+
+/*!
+ * \brief Run signed linear audio through a coin tone detector
+ * \param cd Detector
+ * \param samples Audio, which is only read, not modified
+ * \param len Number of samples
+ * \param rate Sample rate of the audio
+ * \param[out] coins Denominations of coins whose deposit completed in this audio
+ * \param maxcoins Size of coins
+ * \return Number of coins stored in coins
+ */
+static int coin_detect_process(struct coin_detector *cd, const int16_t *samples, int len, int rate, enum coin_denomination *coins, int maxcoins)
+{
+	int num = 0;
+
+	if (rate != cd->rate) {
+		coin_detector_init(cd, rate, cd->sf, cd->relax, cd->flexible);
+	}
+
+	while (len > 0) {
+		int i, limit = MIN(len, cd->blocksize - cd->current);
+		float v2l = cd->low.v2, v3l = cd->low.v3, facl = cd->low.fac;
+		float v2h = cd->high.v2, v3h = cd->high.v3, fach = cd->high.fac;
+		float energy = cd->energy;
+
+		/* Both Goertzel filters and the energy integration in one pass */
+		for (i = 0; i < limit; i++) {
+			float samp = samples[i];
+			float v1;
+			energy += samp * samp;
+			v1 = v2l;
+			v2l = v3l;
+			v3l = facl * v2l - v1 + samp;
+			v1 = v2h;
+			v2h = v3h;
+			v3h = fach * v2h - v1 + samp;
+		}
+		cd->low.v2 = v2l;
+		cd->low.v3 = v3l;
+		cd->high.v2 = v2h;
+		cd->high.v3 = v3h;
+		cd->energy = energy;
+		cd->current += limit;
+		samples += limit;
+		len -= limit;
+
+		if (cd->current < cd->blocksize) {
+			break;
+		}
+
+		if (coin_block_hit(cd)) {
+			cd->misses = 0;
+			if (cd->tone_on) {
+				cd->burst_blocks++;
+			} else if (++cd->hits >= COIN_ON_BLOCKS) {
+				cd->tone_on = 1;
+				cd->burst_blocks = COIN_ON_BLOCKS; /* The burst started when the first hit did */
+			}
+		} else {
+			cd->hits = 0;
+			if (cd->tone_on) {
+				cd->burst_blocks++;
+				if (++cd->misses >= COIN_OFF_BLOCKS) {
+					/* The burst ended at the last hit */
+					int burst = cd->burst_blocks - COIN_OFF_BLOCKS;
+					cd->tone_on = 0;
+					cd->bursts++;
+					if (burst * COIN_BLOCK_MS < COIN_QUARTER_MAX_MS) {
+						cd->short_bursts++;
+					}
+					cd->longest = MAX(cd->longest, burst);
+					cd->gap_blocks = COIN_OFF_BLOCKS;
+				}
+			} else if (cd->bursts && ++cd->gap_blocks * COIN_BLOCK_MS >= COIN_GAP_MS && num < maxcoins) {
+				/* Silence long enough that this coin is done */
+				num += coin_classify(cd, coins + num, maxcoins - num);
+			}
+		}
+
+		cd->low.v2 = cd->low.v3 = 0.0;
+		cd->high.v2 = cd->high.v3 = 0.0;
+		cd->energy = 0.0;
+		cd->current = 0;
+	}
+
+	return num;
+}
+
+static void detect_destroy(void *data)
 {
 	struct detect_information *di = data;
-	ast_dsp_free(di->dsp);
+	if (di->batch) {
+		AST_LIST_LOCK(&batch_detectors);
+		AST_LIST_REMOVE(&batch_detectors, di, entry);
+		AST_LIST_UNLOCK(&batch_detectors);
+	}
+	ast_mutex_destroy(&di->lock);
 	if (di->gotorx) {
 		ast_free(di->gotorx);
 	}
 	if (di->gototx) {
 		ast_free(di->gototx);
 	}
-	ast_audiohook_lock(&di->audiohook);
-	ast_audiohook_detach(&di->audiohook);
-	ast_audiohook_unlock(&di->audiohook);
-	ast_audiohook_destroy(&di->audiohook);
 	ast_free(di);
 	return;
 }
 
-static const struct ast_datastore_info detect_datastore = {
-	.type = "detect",
-	.destroy = destroy_callback
+static void detect_process(struct ast_channel *chan, void *data, struct ast_frame *frame, enum ast_audiohook_direction direction);
+
+static struct ast_dsp_stage_type detect_stage = {
+	.name = "COIN_DETECT",
+	.priority = AST_DSP_PRIORITY_DETECT,
+	.process = detect_process,
+	.destroy = detect_destroy,
 };
 
 static int remove_detect(struct ast_channel *chan)
 {
-	struct ast_datastore *datastore = NULL;
-	struct detect_information *data;
-	SCOPED_CHANNELLOCK(chan_lock, chan);
-
-	datastore = ast_channel_datastore_find(chan, &detect_datastore, NULL);
-	if (!datastore) {
+	if (ast_dsp_pipeline_remove(chan, &detect_stage)) {
 		ast_log(AST_LOG_WARNING, "Cannot remove COIN_DETECT from %s: COIN_DETECT not currently enabled\n",
 		        ast_channel_name(chan));
 		return -1;
 	}
-	data = datastore->data;
-
-	if (ast_audiohook_remove(chan, &data->audiohook)) {
-		ast_log(AST_LOG_WARNING, "Failed to remove COIN_DETECT audiohook from channel %s\n", ast_channel_name(chan));
-		return -1;
-	}
-
-	if (ast_channel_datastore_remove(chan, datastore)) {
-		ast_log(AST_LOG_WARNING, "Failed to remove COIN_DETECT datastore from channel %s\n",
-		        ast_channel_name(chan));
-		return -1;
-	}
-	ast_datastore_free(datastore);
-
 	return 0;
 }
 
@@ -453,105 +734,91 @@ static char* goto_parser(struct ast_channel *chan, char *loc) {
 
 static int detect_read(struct ast_channel *chan, const char *cmd, char *data, char *buffer, size_t buflen)
 {
-	struct ast_datastore *datastore = NULL;
 	struct detect_information *di = NULL;
+	char *parse;
+	int *coins, cents, i;
+
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(direction);
+		AST_APP_ARG(denomination);
+	);
 
 	if (!chan) {
 		ast_log(LOG_WARNING, "No channel was provided to %s function.\n", cmd);
 		return -1;
 	}
 
-	ast_channel_lock(chan);
-	if (!(datastore = ast_channel_datastore_find(chan, &detect_datastore, NULL))) {
-		ast_channel_unlock(chan);
+	parse = ast_strdupa(data);
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (!(di = ast_dsp_pipeline_find(chan, &detect_stage))) {
 		return -1; /* function not initiated yet, so nothing to read */
-	} else {
-		ast_channel_unlock(chan);
-		di = datastore->data;
 	}
 
-	if (strchr(data, 't')) {
-		snprintf(buffer, buflen, "%d", 5 * di->txcount); /* each beep is 5 cents */
-	} else if (strchr(data, 'r')) {
-		snprintf(buffer, buflen, "%d", 5 * di->rxcount); /* each beep is 5 cents */
+	if (!ast_strlen_zero(args.direction) && strchr(args.direction, 't')) {
+		cents = di->txcount;
+		coins = di->txcoins;
+	} else if (!ast_strlen_zero(args.direction) && strchr(args.direction, 'r')) {
+		cents = di->rxcount;
+		coins = di->rxcoins;
 	} else {
-		ast_log(LOG_WARNING, "Invalid direction: %s\n", data);
-	}
-
-	return 0;
-}
-
-static int detect_callback(struct ast_audiohook *audiohook, struct ast_channel *chan, struct ast_frame *frame, enum ast_audiohook_direction direction)
-{
-	struct ast_datastore *datastore = NULL;
-	struct detect_information *di = NULL;
-	int now, success = 0;
-
-	/* If the audiohook is stopping it means the channel is shutting down.... but we let the datastore destroy take care of it */
-	if (audiohook->status == AST_AUDIOHOOK_STATUS_DONE) {
-		return 0;
-	}
-
-	/* Grab datastore which contains our gain information */
-	if (!(datastore = ast_channel_datastore_find(chan, &detect_datastore, NULL))) {
+		ast_log(LOG_WARNING, "Invalid direction: %s\n", S_OR(args.direction, ""));
 		return 0;
 	}
 
-	di = datastore->data;
-
-	if (!frame || frame->frametype != AST_FRAME_VOICE) {
+	if (ast_strlen_zero(args.denomination)) {
+		snprintf(buffer, buflen, "%d", cents);
 		return 0;
 	}
-
-	if (!(direction == AST_AUDIOHOOK_DIRECTION_READ ? di->rx : di->tx)) {
-		return 0;
-	}
-
-	/* So, this is a bit weird. In tests where relax is enabled and
-		silence is played instead of waiting (so probably the latter, mostly likely),
-		RX hits can be interpreted as TX hits (echo????). Bailing out
-		early if we don't care about one direction avoids this bug */
-	if (direction == AST_AUDIOHOOK_DIRECTION_READ && !di->rx) {
-		return 0;
-	}
-	if (direction != AST_AUDIOHOOK_DIRECTION_READ && !di->tx) {
-		return 0;
+	for (i = 0; i < COIN_DENOMINATIONS; i++) {
+		if (!strcasecmp(args.denomination, coin_types[i].name)) {
+			snprintf(buffer, buflen, "%d", coins[i]);
+			return 0;
+		}
 	}
+	ast_log(LOG_WARNING, "Invalid denomination: %s\n", args.denomination);
+	return -1;
+}
 
-	/* ast_dsp_process may free the frame and return a new one */
-	frame = ast_frdup(frame);
-	frame = ast_dsp_process(chan, di->dsp, frame);
-	if (frame->frametype == AST_FRAME_DTMF) {
-		char result = frame->subclass.integer;
-		if (result == '$' || result == 'q') {
-			if (direction == AST_AUDIOHOOK_DIRECTION_READ) {
-				di->rxcount = di->rxcount + 1;
+/*!
+ * \brief Update deposit accounting after analyzing some audio
+ * \param di Detector information
+ * \param rx Whether the audio was in the RX direction
+ * \param coins Coins whose deposit completed in the audio
+ * \param num Number of coins
+ * \return Location to which the channel should be redirected, or NULL if none
+ */
+static const char *coin_update(struct detect_information *di, int rx, enum coin_denomination *coins, int num)
+{
+	const char *location = NULL;
+	int i, now, success = 0;
+
+	if (num > 0) {
+		for (i = 0; i < num; i++) {
+			if (rx) {
+				di->rxcount += coin_types[coins[i]].cents;
+				di->rxcoins[coins[i]]++;
 				now = di->rxcount;
 			} else {
-				di->txcount = di->txcount + 1;
+				di->txcount += coin_types[coins[i]].cents;
+				di->txcoins[coins[i]]++;
 				now = di->txcount;
 			}
-			/* Nickel and dime are one and two 66 ms tones. Quarter is five 33 ms tones.
-			 * BELLCORE GR-506-CORE 18.1.3 also specifies a single 650 ms tone for dollar coins.
-			 * That currently isn't handled here. */
-			ast_debug(1, "COIN_DETECT just got a hit (#%d in %s direction, waiting for %d total)\n", now, direction == AST_AUDIOHOOK_DIRECTION_READ ? "RX" : "TX", di->hitsrequired);
-			if (di->hitsrequired && now >= di->hitsrequired) {
-				if (di->delay > 0) {
-					di->delaytimer = ast_tvnow();
-					ast_debug(1, "Deposit threshold met, waiting for %d ms before we return\n", ast_remaining_ms(di->delaytimer, di->delay));
-				} else {
-					success = 1;
-				}
-				di->actionflag = 1;
+			ast_verb(3, "%d cents (%s) just deposited (%d total so far)\n", coin_types[coins[i]].cents, coin_types[coins[i]].name, now);
+		}
+		ast_debug(1, "COIN_DETECT now has %d cents in %s direction, waiting for %d total\n", now, rx ? "RX" : "TX", di->centsrequired);
+		if (di->centsrequired && now >= di->centsrequired) {
+			if (di->delay > 0) {
+				di->delaytimer = ast_tvnow();
+				ast_debug(1, "Deposit threshold met, waiting for %d ms before we return\n", ast_remaining_ms(di->delaytimer, di->delay));
+			} else {
+				success = 1;
 			}
-			di->debounce = 0;
-			di->debouncedhits++;
-		} else {
-			ast_debug(1, "Ignoring DTMF '%c'\n", result);
+			di->actionflag = 1;
 		}
 	} else if (di->delay > 0) {
-		now = (direction == AST_AUDIOHOOK_DIRECTION_READ) ? di->rxcount : di->txcount;
-		if (now >= di->hitsrequired && di->actionflag) { /* requirement has already been met, but how about the delay? */
+		now = rx ? di->rxcount : di->txcount;
+		if (now >= di->centsrequired && di->actionflag) { /* requirement has already been met, but how about the delay? */
 			/* delaytimer is guaranteed to be non-NULL here */
 			int remaining_delay = ast_remaining_ms(di->delaytimer, di->delay);
 			if (remaining_delay <= 0) {
@@ -560,61 +827,157 @@ static int detect_callback(struct ast_audiohook *audiohook, struct ast_channel *
 			}
 		}
 	}
-	if (di->debounce >= 0) {
-		di->debounce++;
-	}
-	if (di->debounce > 10) { /* this is enough to debounce a single coin, e.g. a dime will show up as one 10c deposit, rather than two 5c deposits */
-		now = (direction == AST_AUDIOHOOK_DIRECTION_READ) ? di->rxcount : di->txcount;
-		if (di->flexible && di->debouncedhits >= 3 && di->debouncedhits <= 4) {
-			int difference;
-			/* Because quarter tones are quite short (33 ms on/off), it's right on the edge of what the Goertzel algorithm
-			 * can reliably detect. Consequently, quarters are often undercounted even while nickels and dimes work fine.
-			 * To counteract this, if we detect 15c or 20c, we can act as if we got 25c, because in reality, we probably did. */
-			ast_debug(1, "Received %d beeps, but pretending we got %d\n", di->debouncedhits, 5);
-			difference = 5 - di->debouncedhits;
-			di->debouncedhits = 5; /* Update assessment of this coin */
-			/* Update overall total stats */
-			if (direction == AST_AUDIOHOOK_DIRECTION_READ) {
-				di->rxcount += difference;
-			} else {
-				di->txcount += difference;
-			}
-			now += difference;
-		}
-		ast_verb(3, "%d cents just deposited (%d total so far)\n", 5 * di->debouncedhits, 5 * now);
-		di->debouncedhits = 0;
-		di->debounce = -1;
-	}
 	if (success && di->actionflag) { /* this will only execute if we specified a threshold for deposits */
-		now = (direction == AST_AUDIOHOOK_DIRECTION_READ) ? di->rxcount : di->txcount;
-		ast_verb(3, "%d total cents deposited\n", 5 * now);
-		if (di->rxcount >= di->hitsrequired && di->gotorx) {
-			ast_debug(1, "Redirecting channel to %s\n", di->gotorx);
-			ast_async_parseable_goto(chan, di->gotorx);
-		} else if (di->txcount >= di->hitsrequired && di->gototx) {
-			ast_debug(1, "Redirecting channel to %s\n", di->gototx);
-			ast_async_parseable_goto(chan, di->gototx);
+		now = rx ? di->rxcount : di->txcount;
+		ast_verb(3, "%d total cents deposited\n", now);
+		if (di->rxcount >= di->centsrequired && di->gotorx) {
+			location = di->gotorx;
+		} else if (di->txcount >= di->centsrequired && di->gototx) {
+			location = di->gototx;
 		} else {
 			ast_log(LOG_WARNING, "Reached threshold, but missing goto location (shouldn't happen, if you see this, this is a bug...)\n"); /* should never happen */
 		}
 		di->actionflag = 0; /* prevent redirecting the channel multiple times on the same success */
 	}
-	/* this could be the duplicated frame or a new one, doesn't matter */
-	ast_frfree(frame);
-	return 0;
+	return location;
+}
+
+static void detect_process(struct ast_channel *chan, void *data, struct ast_frame *frame, enum ast_audiohook_direction direction)
+{
+	struct detect_information *di = data;
+	enum coin_denomination coins[COIN_MAX_COINS];
+	const char *location;
+	int rx = direction == AST_AUDIOHOOK_DIRECTION_READ;
+	int rate, num;
+
+	/* So, this is a bit weird. In tests where relax is enabled and
+		silence is played instead of waiting (so probably the latter, mostly likely),
+		RX hits can be interpreted as TX hits (echo????). Bailing out
+		early if we don't care about one direction avoids this bug */
+	if (!(rx ? di->rx : di->tx)) {
+		return;
+	}
+
+	/* Manipulate audiohooks always get signed linear, at whatever rate the channel is using */
+	rate = ast_format_get_sample_rate(frame->subclass.format);
+
+	if (di->batch) {
+		/* Just queue the audio, the batch worker will analyze it along with all the other channels */
+		struct coin_batch_buffer *buf = rx ? &di->rxbuf : &di->txbuf;
+		int len;
+		ast_mutex_lock(&di->lock);
+		if (buf->rate != rate) {
+			buf->rate = rate;
+			buf->len = 0;
+		}
+		len = MIN(frame->samples, COIN_BATCH_SAMPLES - buf->len);
+		if (len < frame->samples) {
+			ast_debug(1, "Coin detection batch buffer full on %s, dropping %d samples\n", ast_channel_name(chan), frame->samples - len);
+		}
+		memcpy(buf->samples + buf->len, frame->data.ptr, len * sizeof(int16_t));
+		buf->len += len;
+		ast_mutex_unlock(&di->lock);
+		return;
+	}
+
+	/* Analyze the frame directly, we don't need to modify it */
+	num = coin_detect_process(rx ? &di->rxdet : &di->txdet, frame->data.ptr, frame->samples, rate, coins, ARRAY_LEN(coins));
+	location = coin_update(di, rx, coins, num);
+	if (location) {
+		ast_debug(1, "Redirecting channel to %s\n", location);
+		ast_async_parseable_goto(chan, location);
+	}
+}
+
+struct coin_redirect {
+	AST_LIST_ENTRY(coin_redirect) entry;
+	char uniqueid[AST_MAX_UNIQUEID];
+	char location[0];
+};
+
+AST_LIST_HEAD_NOLOCK(coin_redirects, coin_redirect);
+
+/*! \brief Analyze all audio queued for a batch detector. Must be called with the batch list locked. */
+static void batch_service(struct detect_information *di, struct coin_redirects *redirects)
+{
+	int rx;
+
+	ast_mutex_lock(&di->lock);
+	for (rx = 0; rx <= 1; rx++) {
+		struct coin_batch_buffer *buf = rx ? &di->rxbuf : &di->txbuf;
+		enum coin_denomination coins[COIN_MAX_COINS];
+		const char *location;
+		int num;
+
+		if (!buf->len) {
+			continue;
+		}
+		num = coin_detect_process(rx ? &di->rxdet : &di->txdet, buf->samples, buf->len, buf->rate, coins, ARRAY_LEN(coins));
+		buf->len = 0;
+		location = coin_update(di, rx, coins, num);
+		if (location) {
+			/* Can't redirect the channel while holding locks it may be waiting on, so defer that */
+			struct coin_redirect *redirect = ast_calloc(1, sizeof(*redirect) + strlen(location) + 1);
+			if (redirect) {
+				ast_copy_string(redirect->uniqueid, di->uniqueid, sizeof(redirect->uniqueid));
+				strcpy(redirect->location, location); /* Safe */
+				AST_LIST_INSERT_TAIL(redirects, redirect, entry);
+			}
+		}
+	}
+	ast_mutex_unlock(&di->lock);
+}
+
+static void *batch_worker(void *unused)
+{
+	for (;;) {
+		struct coin_redirects redirects = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+		struct coin_redirect *redirect;
+		struct detect_information *di;
+
+		AST_LIST_LOCK(&batch_detectors);
+		if (!batch_shutdown && AST_LIST_EMPTY(&batch_detectors)) {
+			/* Nothing to do until somebody enables a batch detector */
+			ast_cond_wait(&batch_cond, &batch_detectors.lock);
+		} else if (!batch_shutdown) {
+			struct timeval wait = ast_tvadd(ast_tvnow(), ast_samp2tv(COIN_BATCH_INTERVAL_MS, 1000));
+			struct timespec ts = {
+				.tv_sec = wait.tv_sec,
+				.tv_nsec = wait.tv_usec * 1000,
+			};
+			ast_cond_timedwait(&batch_cond, &batch_detectors.lock, &ts);
+		}
+		if (batch_shutdown) {
+			AST_LIST_UNLOCK(&batch_detectors);
+			break;
+		}
+		/* One pass over every active coin channel */
+		AST_LIST_TRAVERSE(&batch_detectors, di, entry) {
+			batch_service(di, &redirects);
+		}
+		AST_LIST_UNLOCK(&batch_detectors);
+
+		while ((redirect = AST_LIST_REMOVE_HEAD(&redirects, entry))) {
+			struct ast_channel *chan = ast_channel_get_by_name(redirect->uniqueid);
+			if (chan) {
+				ast_debug(1, "Redirecting channel %s to %s\n", ast_channel_name(chan), redirect->location);
+				ast_async_parseable_goto(chan, redirect->location);
+				ast_channel_unref(chan);
+			}
+			ast_free(redirect);
+		}
+	}
+	return NULL;
 }
 
 static int detect_write(struct ast_channel *chan, const char *cmd, char *data, const char *value)
 {
 	char *parse;
-	struct ast_datastore *datastore = NULL;
 	struct detect_information *di = NULL;
 	struct ast_flags flags = { 0 };
 	char *opt_args[OPT_ARG_ARRAY_SIZE];
-	struct ast_dsp *dsp;
 	double delayf = 0;
-	int hitsrequired = 0, delay = 0;
-	int features = 0, digitfeatures = 0;
+	int centsrequired = 0, delay = 0;
 
 	AST_DECLARE_APP_ARGS(args,
 		AST_APP_ARG(options);
@@ -639,12 +1002,12 @@ static int detect_write(struct ast_channel *chan, const char *cmd, char *data, c
 		return remove_detect(chan);
 	}
 	if (ast_test_flag(&flags, OPT_HITS_REQ) && !ast_strlen_zero(opt_args[OPT_ARG_HITS_REQ])) {
-		if ((ast_str_to_int(opt_args[OPT_ARG_HITS_REQ], &hitsrequired) || hitsrequired < 1)) {
+		if ((ast_str_to_int(opt_args[OPT_ARG_HITS_REQ], &centsrequired) || centsrequired < 1)) {
 			ast_log(LOG_WARNING, "Invalid minimum deposit: %s\n", opt_args[OPT_ARG_HITS_REQ]);
 			return -1;
 		}
-		/* Each beep is 5 cents. If amount required doesn't evenly divide by 5, ALWAYS round up (ceiling) */
-		hitsrequired = (hitsrequired % 5 == 0) ? hitsrequired / 5 : (hitsrequired / 5) + 1;
+		/* If amount required doesn't evenly divide by 5, ALWAYS round up (ceiling) to the nearest nickel */
+		centsrequired = (centsrequired % 5 == 0) ? centsrequired : centsrequired + 5 - centsrequired % 5;
 	}
 	if (ast_test_flag(&flags, OPT_DELAY) && !ast_strlen_zero(opt_args[OPT_ARG_DELAY])) {
 		if (!ast_strlen_zero(opt_args[OPT_ARG_DELAY]) && (sscanf(opt_args[OPT_ARG_DELAY], "%30lf", &delayf) != 1 || delayf < 0)) {
@@ -655,45 +1018,42 @@ static int detect_write(struct ast_channel *chan, const char *cmd, char *data, c
 	}
 
 	ast_channel_lock(chan);
-	if (!(datastore = ast_channel_datastore_find(chan, &detect_datastore, NULL))) {
-		if (!(datastore = ast_datastore_alloc(&detect_datastore, NULL))) {
-			ast_channel_unlock(chan);
-			return 0;
-		}
+	if (!(di = ast_dsp_pipeline_find(chan, &detect_stage))) {
 		if (!(di = ast_calloc(1, sizeof(*di)))) {
-			ast_datastore_free(datastore);
 			ast_channel_unlock(chan);
 			return 0;
 		}
-		ast_audiohook_init(&di->audiohook, AST_AUDIOHOOK_TYPE_MANIPULATE, "Coin Denomination Tone Detector", AST_AUDIOHOOK_MANIPULATE_ALL_RATES);
-		di->audiohook.manipulate_callback = detect_callback;
-		if (!(dsp = ast_dsp_new())) {
-			ast_datastore_free(datastore);
+		ast_mutex_init(&di->lock);
+		di->txcount = 0;
+		di->rxcount = 0;
+		/* Batch mode can only be selected when the detector is created */
+		di->batch = ast_test_flag(&flags, OPT_BATCH) ? 1 : 0;
+		ast_copy_string(di->uniqueid, ast_channel_uniqueid(chan), sizeof(di->uniqueid));
+		/* Nothing will be detected until the pipeline has the detector and we release the channel */
+		if (ast_dsp_pipeline_add(chan, &detect_stage, di)) {
 			ast_channel_unlock(chan);
-			ast_log(LOG_WARNING, "Unable to allocate DSP!\n");
+			ast_mutex_destroy(&di->lock);
+			ast_free(di);
 			return -1;
 		}
-		di->dsp = dsp;
-		di->txcount = 0;
-		di->rxcount = 0;
-		datastore->data = di;
-		ast_channel_datastore_add(chan, datastore);
-		ast_audiohook_attach(chan, &di->audiohook);
-	} else {
-		di = datastore->data;
-		dsp = di->dsp;
+		if (di->batch) {
+			AST_LIST_LOCK(&batch_detectors);
+			AST_LIST_INSERT_TAIL(&batch_detectors, di, entry);
+			ast_cond_signal(&batch_cond);
+			AST_LIST_UNLOCK(&batch_detectors);
+		}
 	}
-	if (ast_test_flag(&flags, OPT_RELAX)) {
-		digitfeatures |= DSP_DIGITMODE_RELAXDTMF;
+	ast_mutex_lock(&di->lock);
+	coin_detector_init(&di->rxdet, 8000, ast_test_flag(&flags, OPT_SF) ? 1 : 0, ast_test_flag(&flags, OPT_RELAX) ? 1 : 0, ast_test_flag(&flags, OPT_FLEXIBLE) ? 1 : 0);
+	coin_detector_init(&di->txdet, 8000, ast_test_flag(&flags, OPT_SF) ? 1 : 0, ast_test_flag(&flags, OPT_RELAX) ? 1 : 0, ast_test_flag(&flags, OPT_FLEXIBLE) ? 1 : 0);
+	if (di->gotorx) {
+		ast_free(di->gotorx);
+		di->gotorx = NULL;
 	}
-	if (ast_test_flag(&flags, OPT_SF)) {
-		features |= DSP_FEATURE_FREQ_DETECT;
-		ast_dsp_set_freqmode(di->dsp, 2200, 50, 16, 0);
+	if (di->gototx) {
+		ast_free(di->gototx);
+		di->gototx = NULL;
 	}
-	ast_dsp_set_features(di->dsp, DSP_FEATURE_DIGIT_DETECT | features);
-	ast_dsp_set_digitmode(di->dsp, DSP_DIGITMODE_DTMF | digitfeatures);
-	di->gotorx = NULL;
-	di->gototx = NULL;
 	/* resolve gotos now, in case a full context,exten,pri wasn't specified */
 	if (ast_test_flag(&flags, OPT_GOTO_RX) && !ast_strlen_zero(opt_args[OPT_ARG_GOTO_RX])) {
 		di->gotorx = goto_parser(chan, opt_args[OPT_ARG_GOTO_RX]);
@@ -701,11 +1061,8 @@ static int detect_write(struct ast_channel *chan, const char *cmd, char *data, c
 	if (ast_test_flag(&flags, OPT_GOTO_TX) && !ast_strlen_zero(opt_args[OPT_ARG_GOTO_TX])) {
 		di->gototx = goto_parser(chan, opt_args[OPT_ARG_GOTO_TX]);
 	}
-	di->flexible = ast_test_flag(&flags, OPT_FLEXIBLE) ? 1 : 0;
-	di->hitsrequired = hitsrequired;
+	di->centsrequired = centsrequired;
 	di->delay = delay;
-	di->debounce = -1;
-	di->debouncedhits = 0;
 	di->tx = 1;
 	di->rx = 1;
 	ast_debug(1, "Keeping our ears open for coin denomination tones, post-match delay %d ms, %s\n", delay, ast_test_flag(&flags, OPT_RELAX) ? "relaxed" : "unrelaxed");
@@ -717,6 +1074,7 @@ static int detect_write(struct ast_channel *chan, const char *cmd, char *data, c
 		di->rx = 1;
 		di->tx = 0;
 	}
+	ast_mutex_unlock(&di->lock);
 	ast_channel_unlock(chan);
 
 	return 0;
@@ -737,12 +1095,12 @@ static int wait_exec(struct ast_channel *chan, const char *data)
 	char *appdata;
 	struct ast_flags flags = {0};
 	double timeoutf = 0, delayf = 0;
-	int timeout = 0, times = 1, delay = 0;
+	int timeout = 0, times = 5, delay = 0;
 	struct ast_frame *frame = NULL;
-	struct ast_dsp *dsp;
+	struct ast_format *origformat;
+	struct coin_detector cd;
 	struct timeval start, delaytimer;
-	int remaining_time = 0, hits = 0, features = 0, digitfeatures=0;
-	int debounce = -1, debouncedhits = 0;
+	int remaining_time = 0, cents = 0;
 	AST_DECLARE_APP_ARGS(args,
 		AST_APP_ARG(times);
 		AST_APP_ARG(timeout);
@@ -771,26 +1129,22 @@ static int wait_exec(struct ast_channel *chan, const char *data)
 		ast_log(LOG_WARNING, "Invalid minimum deposit: %s\n", args.times);
 		goto error;
 	}
-	/* Each beep is 5 cents. If amount required doesn't evenly divide by 5, ALWAYS round up (ceiling) */
-	times = (times % 5 == 0) ? times / 5 : (times / 5) + 1;
-	if (!(dsp = ast_dsp_new())) {
-		ast_log(LOG_WARNING, "Unable to allocate DSP!\n");
+	/* If amount required doesn't evenly divide by 5, ALWAYS round up (ceiling) to the nearest nickel */
+	times = (times % 5 == 0) ? times : times + 5 - times % 5;
+
+	origformat = ao2_bump(ast_channel_readformat(chan));
+	if (ast_set_read_format(chan, ast_format_slin)) {
+		ast_log(LOG_WARNING, "Unable to set to linear read mode on %s\n", ast_channel_name(chan));
+		ao2_ref(origformat, -1);
 		goto error;
 	}
-	if (ast_test_flag(&flags, OPT_APP_RELAX)) {
-		digitfeatures |= DSP_DIGITMODE_RELAXDTMF;
-	}
-	if (ast_test_flag(&flags, OPT_APP_SF)) {
-		features |= DSP_FEATURE_FREQ_DETECT;
-		ast_dsp_set_freqmode(dsp, 2200, 50, 16, 0);
-	}
-	ast_dsp_set_features(dsp, DSP_FEATURE_DIGIT_DETECT | features);
-	ast_dsp_set_digitmode(dsp, DSP_DIGITMODE_DTMF | digitfeatures);
+	coin_detector_init(&cd, 8000, ast_test_flag(&flags, OPT_APP_SF) ? 1 : 0, ast_test_flag(&flags, OPT_APP_RELAX) ? 1 : 0, 0);
+
 	pbx_builtin_setvar_helper(chan, "WAITFORDEPOSITAMOUNT", "0");
-	ast_debug(1, "Waiting for coins, %d time(s), timeout %d ms, post-match delay %d ms\n", times, timeout, delay);
+	ast_debug(1, "Waiting for %d cents, timeout %d ms, post-match delay %d ms\n", times, timeout, delay);
 	start = ast_tvnow();
 	do {
-		if (hits < times && timeout > 0) {
+		if (cents < times && timeout > 0) {
 			remaining_time = ast_remaining_ms(start, timeout);
 			if (remaining_time <= 0) {
 				pbx_builtin_setvar_helper(chan, "WAITFORDEPOSITSTATUS", "TIMEOUT");
@@ -802,57 +1156,50 @@ static int wait_exec(struct ast_channel *chan, const char *data)
 				ast_debug(1, "Channel '%s' did not return a frame; probably hung up.\n", ast_channel_name(chan));
 				pbx_builtin_setvar_helper(chan, "WAITFORDEPOSITSTATUS", "HANGUP");
 				break;
-			} else if (frame->frametype == AST_FRAME_VOICE) {
-				frame = ast_dsp_process(chan, dsp, frame);
-				if (frame->frametype == AST_FRAME_DTMF) {
-					char result = frame->subclass.integer;
-					if (result == '$' || result == 'q') {
-						hits++;
-						debouncedhits++;
-						debounce = 0;
-						ast_debug(1, "We just detected a coin (hit #%d)\n", hits);
-						if (hits >= times) {
-							pbx_builtin_setvar_helper(chan, "WAITFORDEPOSITSTATUS", "SUCCESS");
-							if (delay > 0) { /* allow additional deposits, beyond the requirement, if desired */
-								delaytimer = ast_tvnow();
-								ast_debug(1, "Deposit threshold met, waiting for %d ms before we return\n", ast_remaining_ms(delaytimer, delay));
-							} else {
-								ast_frfree(frame);
-								pbx_builtin_setvar_helper(chan, "WAITFORDEPOSITSTATUS", "SUCCESS");
-								break;
-							}
+			} else if (frame->frametype == AST_FRAME_VOICE && frame->samples) {
+				enum coin_denomination coins[COIN_MAX_COINS];
+				int i, num;
+
+				num = coin_detect_process(&cd, frame->data.ptr, frame->samples, ast_format_get_sample_rate(frame->subclass.format), coins, ARRAY_LEN(coins));
+				if (num > 0) {
+					for (i = 0; i < num; i++) {
+						cents += coin_types[coins[i]].cents;
+						ast_verb(3, "%d cents (%s) just deposited (%d total so far)\n", coin_types[coins[i]].cents, coin_types[coins[i]].name, cents);
+					}
+					if (cents >= times) {
+						pbx_builtin_setvar_helper(chan, "WAITFORDEPOSITSTATUS", "SUCCESS");
+						if (delay > 0) { /* allow additional deposits, beyond the requirement, if desired */
+							delaytimer = ast_tvnow();
+							ast_debug(1, "Deposit threshold met, waiting for %d ms before we return\n", ast_remaining_ms(delaytimer, delay));
+						} else {
+							ast_frfree(frame);
+							break;
 						}
-					} else {
-						ast_debug(1, "Ignoring DTMF '%c'\n", result);
 					}
-				} else if (hits >= times) { /* requirement has already been met, but how about the delay? */
-					/* delaytimer is guaranteed to be non-NULL here. No need to check delay > 0, that's implicitly true if hits >= times. */
+				} else if (cents >= times) { /* requirement has already been met, but how about the delay? */
+					/* delaytimer is guaranteed to be non-NULL here. No need to check delay > 0, that's implicitly true if cents >= times. */
 					int remaining_delay = ast_remaining_ms(delaytimer, delay);
 					if (remaining_delay <= 0) {
 						ast_debug(1, "Post-match delay of %d ms (without additional deposits) has been exceeded (%d)\n", delay, remaining_delay);
+						ast_frfree(frame);
 						break;
 					}
 				}
-				if (debounce >= 0) {
-					debounce++;
-				}
-				if (debounce > 10) { /* this is enough to debounce a single coin, e.g. a dime will show up as one 10c deposit, rather than two 5c deposits */
-					ast_verb(3, "%d cents just deposited (%d total so far)\n", 5 * debouncedhits, 5 * hits);
-					debouncedhits = 0;
-					debounce = -1;
-				}
 			}
 			ast_frfree(frame);
 		} else {
 			pbx_builtin_setvar_helper(chan, "WAITFORDEPOSITSTATUS", "HANGUP");
 		}
 	} while (timeout == 0 || remaining_time > 0);
-	ast_dsp_free(dsp);
 
-	if (hits > 0) { /* even if the threshold wasn't met, some amount could've been deposited */
+	if (origformat) {
+		ast_set_read_format(chan, origformat);
+		ao2_ref(origformat, -1);
+	}
+
+	if (cents > 0) { /* even if the threshold wasn't met, some amount could've been deposited */
 		char amt[12];
-		int cents = 5 * hits; /* each beep is 5 cents */
-		snprintf(amt, 12, "%d", cents);
+		snprintf(amt, sizeof(amt), "%d", cents);
 		pbx_builtin_setvar_helper(chan, "WAITFORDEPOSITAMOUNT", amt);
 		ast_verb(3, "%d total cents deposited\n", cents);
 	} else {
@@ -1263,6 +1610,265 @@ static struct ast_custom_function eis_function = {
 	.write = eis_helper,
 };
 
+#define BENCH_FRAME_SAMPLES 160 /* 20 ms at 8 kHz */
+#define BENCH_PATTERN_FRAMES 50 /* 1 second */
+
+/*! \brief Fill a buffer with 8 kHz audio of dimes being deposited (two 66 ms beeps, then silence) */
+static void bench_generate(int16_t *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		int ms = (i / 8) % 500; /* One dime every 500 ms */
+		if (ms < 66 || (ms >= 132 && ms < 198)) {
+			double t = (double) i / 8000;
+			buf[i] = 4000 * sin(2 * M_PI * COIN_TONE_LOW * t) + 4000 * sin(2 * M_PI * COIN_TONE_HIGH * t);
+		} else {
+			buf[i] = 0;
+		}
+	}
+}
+
+static char *handle_benchmark(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int16_t *audio;
+	struct ast_dsp *dsp;
+	struct coin_detector cd;
+	struct timeval start;
+	enum coin_denomination coins[COIN_MAX_COINS];
+	int i, frames = 50000;
+	int oldhits = 0, newhits = 0;
+	int64_t oldms, newms;
+
+	switch(cmd) {
+	case CLI_INIT:
+		e->command = "coindetect benchmark";
+		e->usage =
+			"Usage: coindetect benchmark [frames]\n"
+			"       Benchmarks coin tone detection on synthetic 20 ms frames,\n"
+			"       using the generic DSP and the dedicated coin detector.\n"
+			"       Default is 50000 frames.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc > 3) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc == 3 && (ast_str_to_int(a->argv[2], &frames) || frames < 1)) {
+		return CLI_SHOWUSAGE;
+	}
+
+	audio = ast_malloc(BENCH_FRAME_SAMPLES * BENCH_PATTERN_FRAMES * sizeof(int16_t));
+	if (!audio) {
+		return CLI_FAILURE;
+	}
+	bench_generate(audio, BENCH_FRAME_SAMPLES * BENCH_PATTERN_FRAMES);
+
+	if (!(dsp = ast_dsp_new())) {
+		ast_free(audio);
+		return CLI_FAILURE;
+	}
+	ast_dsp_set_features(dsp, DSP_FEATURE_DIGIT_DETECT);
+	ast_dsp_set_digitmode(dsp, DSP_DIGITMODE_DTMF);
+
+	/* What COIN_DETECT used to do: duplicate every frame and run it through the generic DSP */
+	start = ast_tvnow();
+	for (i = 0; i < frames; i++) {
+		struct ast_frame fr = {
+			.frametype = AST_FRAME_VOICE,
+			.datalen = BENCH_FRAME_SAMPLES * sizeof(int16_t),
+			.samples = BENCH_FRAME_SAMPLES,
+			.src = "coindetect benchmark",
+			.data.ptr = audio + BENCH_FRAME_SAMPLES * (i % BENCH_PATTERN_FRAMES),
+		};
+		struct ast_frame *f;
+		fr.subclass.format = ast_format_slin;
+		f = ast_frdup(&fr);
+		f = ast_dsp_process(NULL, dsp, f);
+		if (f->frametype == AST_FRAME_DTMF && f->subclass.integer == '$') {
+			oldhits++;
+		}
+		ast_frfree(f);
+	}
+	oldms = ast_tvdiff_ms(ast_tvnow(), start);
+	ast_dsp_free(dsp);
+
+	coin_detector_init(&cd, 8000, 0, 0, 0);
+	start = ast_tvnow();
+	for (i = 0; i < frames; i++) {
+		int j, num = coin_detect_process(&cd, audio + BENCH_FRAME_SAMPLES * (i % BENCH_PATTERN_FRAMES), BENCH_FRAME_SAMPLES, 8000, coins, ARRAY_LEN(coins));
+		for (j = 0; j < num; j++) {
+			newhits += coin_types[coins[j]].cents / 5; /* Count beeps, for comparison with the generic DSP */
+		}
+	}
+	newms = ast_tvdiff_ms(ast_tvnow(), start);
+	ast_free(audio);
+
+	/* Avoid dividing by zero on very short runs */
+	oldms = MAX(oldms, 1);
+	newms = MAX(newms, 1);
+
+	ast_cli(a->fd, "%-20s %8s %12s %10s %8s\n", "Detector", "Frames", "Frames/sec", "Channels", "Beeps");
+	ast_cli(a->fd, "%-20s %8d %12" PRId64 " %10" PRId64 " %8d\n", "Generic DSP", frames,
+		(int64_t) frames * 1000 / oldms, (int64_t) frames * 1000 / oldms / 50, oldhits);
+	ast_cli(a->fd, "%-20s %8d %12" PRId64 " %10" PRId64 " %8d\n", "Coin detector", frames,
+		(int64_t) frames * 1000 / newms, (int64_t) frames * 1000 / newms / 50, newhits);
+	/* Each second of audio contains two dimes, i.e. 4 beeps */
+	ast_cli(a->fd, "Channels is the number of channels one core can keep up with. ~%d beeps were sent.\n",
+		4 * frames / BENCH_PATTERN_FRAMES);
+
+	return CLI_SUCCESS;
+}
+
+/*! \brief Synthetic test signal conditions */
+static const struct {
+	int rate;
+	int amplitude;	/* Of each tone */
+	int noise;		/* Peak amplitude of white noise */
+	int twist;		/* Attenuation of the 1700 Hz tone, in dB */
+} corpus_conditions[] = {
+	{ 8000, 4000, 0, 0 },
+	{ 8000, 1000, 0, 0 },
+	{ 8000, 250, 0, 0 },
+	{ 8000, 4000, 1000, 0 },
+	{ 8000, 1000, 1000, 0 },
+	{ 8000, 4000, 0, 6 },
+	{ 16000, 4000, 0, 0 },
+	{ 16000, 1000, 500, 3 },
+};
+
+#define CORPUS_COINS 20
+#define CORPUS_SPACING_MS 300
+
+/*!
+ * \brief Generate the tone cadence for a coin
+ * \return Number of samples generated
+ */
+static int corpus_coin(int16_t *buf, int rate, int amplitude, int twist, enum coin_denomination coin, int offset)
+{
+	int burst, bursts, on_ms, off_ms;
+	int i = 0;
+	double low = amplitude * pow(10, -twist / 20.0);
+
+	switch (coin) {
+	case COIN_NICKEL:
+		bursts = 1, on_ms = 66, off_ms = 66;
+		break;
+	case COIN_DIME:
+		bursts = 2, on_ms = 66, off_ms = 66;
+		break;
+	case COIN_QUARTER:
+		bursts = 5, on_ms = 33, off_ms = 33;
+		break;
+	case COIN_DOLLAR:
+	default:
+		bursts = 1, on_ms = 650, off_ms = 0;
+		break;
+	}
+
+	for (burst = 0; burst < bursts; burst++) {
+		int end = i + on_ms * rate / 1000;
+		for (; i < end; i++) {
+			double t = (double) (offset + i) / rate;
+			buf[i] = low * sin(2 * M_PI * COIN_TONE_LOW * t) + amplitude * sin(2 * M_PI * COIN_TONE_HIGH * t);
+		}
+		if (burst < bursts - 1) {
+			end = i + off_ms * rate / 1000;
+			for (; i < end; i++) {
+				buf[i] = 0;
+			}
+		}
+	}
+	return i;
+}
+
+static char *handle_corpus(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int16_t *audio;
+	int c, d, maxlen;
+
+	switch(cmd) {
+	case CLI_INIT:
+		e->command = "coindetect corpus";
+		e->usage =
+			"Usage: coindetect corpus\n"
+			"       Runs the coin detector against a synthetic corpus of\n"
+			"       coin deposits of each denomination, under various signal\n"
+			"       conditions, and reports classification accuracy and the\n"
+			"       processing cost per 20 ms frame.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 2) {
+		return CLI_SHOWUSAGE;
+	}
+
+	/* Longest coin is the dollar, plus spacing, at the highest rate */
+	maxlen = CORPUS_COINS * (650 + CORPUS_SPACING_MS) * 16000 / 1000;
+	audio = ast_malloc(maxlen * sizeof(int16_t));
+	if (!audio) {
+		return CLI_FAILURE;
+	}
+
+	ast_cli(a->fd, "%-8s %5s %5s %5s %5s | %8s %7s %7s %8s\n", "Coin", "Rate", "Amp", "Noise", "Twist", "Correct", "Missed", "Wrong", "ns/frame");
+	for (d = 0; d < COIN_DENOMINATIONS; d++) {
+		for (c = 0; c < ARRAY_LEN(corpus_conditions); c++) {
+			struct coin_detector cd;
+			enum coin_denomination coins[COIN_MAX_COINS];
+			struct timeval start;
+			int64_t us;
+			int i, len = 0, framelen, frames = 0;
+			int correct = 0, wrong = 0;
+			int rate = corpus_conditions[c].rate;
+
+			for (i = 0; i < CORPUS_COINS; i++) {
+				int spacing = CORPUS_SPACING_MS * rate / 1000;
+				len += corpus_coin(audio + len, rate, corpus_conditions[c].amplitude, corpus_conditions[c].twist, d, len);
+				memset(audio + len, 0, spacing * sizeof(int16_t));
+				len += spacing;
+			}
+			if (corpus_conditions[c].noise) {
+				for (i = 0; i < len; i++) {
+					int noise = (ast_random() % (2 * corpus_conditions[c].noise + 1)) - corpus_conditions[c].noise;
+					audio[i] = MAX(-32768, MIN(32767, audio[i] + noise));
+				}
+			}
+
+			coin_detector_init(&cd, rate, 0, 0, 0);
+			framelen = rate / 50;
+			start = ast_tvnow();
+			for (i = 0; i + framelen <= len; i += framelen) {
+				int j, num = coin_detect_process(&cd, audio + i, framelen, rate, coins, ARRAY_LEN(coins));
+				for (j = 0; j < num; j++) {
+					if (coins[j] == d) {
+						correct++;
+					} else {
+						wrong++;
+					}
+				}
+				frames++;
+			}
+			us = ast_tvdiff_us(ast_tvnow(), start);
+
+			ast_cli(a->fd, "%-8s %5d %5d %5d %5d | %8d %7d %7d %8" PRId64 "\n",
+				coin_types[d].name, rate, corpus_conditions[c].amplitude, corpus_conditions[c].noise, corpus_conditions[c].twist,
+				correct, MAX(0, CORPUS_COINS - correct), wrong, frames ? us * 1000 / frames : 0);
+		}
+	}
+	ast_free(audio);
+
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry coindetect_cli[] = {
+	AST_CLI_DEFINE(handle_benchmark, "Benchmark coin tone detection"),
+	AST_CLI_DEFINE(handle_corpus, "Measure coin detection accuracy against a synthetic corpus"),
+};
+
 static char *waitapp = "WaitForDeposit";
 static char *dispositionapp = "CoinDisposition";
 
@@ -1280,6 +1886,18 @@ static int unload_module(void)
 	res |= ast_unregister_application(dispositionapp);
 	res |= ast_custom_function_unregister(&detect_function);
 	res |= ast_custom_function_unregister(&eis_function);
+	ast_cli_unregister_multiple(coindetect_cli, ARRAY_LEN(coindetect_cli));
+	ast_dsp_stage_type_unregister(&detect_stage);
+
+	if (batch_thread != AST_PTHREADT_NULL) {
+		AST_LIST_LOCK(&batch_detectors);
+		batch_shutdown = 1;
+		ast_cond_signal(&batch_cond);
+		AST_LIST_UNLOCK(&batch_detectors);
+		pthread_join(batch_thread, NULL);
+		batch_thread = AST_PTHREADT_NULL;
+	}
+	ast_cond_destroy(&batch_cond);
 
 	return res;
 }
@@ -1288,12 +1906,37 @@ static int load_module(void)
 {
 	int res;
 
+	ast_cond_init(&batch_cond, NULL);
+	batch_shutdown = 0;
+	if (ast_pthread_create(&batch_thread, NULL, batch_worker, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start coin detection batch worker\n");
+		ast_cond_destroy(&batch_cond);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if (ast_dsp_stage_type_register(&detect_stage)) {
+		AST_LIST_LOCK(&batch_detectors);
+		batch_shutdown = 1;
+		ast_cond_signal(&batch_cond);
+		AST_LIST_UNLOCK(&batch_detectors);
+		pthread_join(batch_thread, NULL);
+		batch_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&batch_cond);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
 	res = ast_register_application_xml(waitapp, wait_exec);
 	res |= ast_register_application_xml(dispositionapp, disposition_exec);
 	res |= ast_custom_function_register(&detect_function);
 	res |= ast_custom_function_register(&eis_function);
+	res |= ast_cli_register_multiple(coindetect_cli, ARRAY_LEN(coindetect_cli));
 
 	return res;
 }
 
-AST_MODULE_INFO_STANDARD_EXTENDED(ASTERISK_GPL_KEY, "Coin detection module");
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Coin detection module",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.requires = "res_dsp_pipeline",
+);
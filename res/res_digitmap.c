@@ -42,6 +42,8 @@
 #include "asterisk/module.h"
 #include "asterisk/pbx.h"
 #include "asterisk/manager.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/reload_sub.h"
 
 /*** DOCUMENTATION
 	<manager name="GenerateDigitMap" language="en_US" module="res_xmpp">
@@ -53,40 +55,64 @@
 			<parameter name="Context" required="true">
 				<para>Name of dialplan context for which to generate a digit map.</para>
 			</parameter>
+			<parameter name="TimeoutSuffix">
+				<para>If true, suffix a T to any extensions that prefix other valid extensions.</para>
+			</parameter>
+			<parameter name="Optimize">
+				<para>If true, merge patterns to shorten the digit map, e.g. <literal>22|23|24</literal> becomes <literal>2[2-4]</literal>.</para>
+			</parameter>
+			<parameter name="MaxLength">
+				<para>Maximum length of the digit map supported by the device. Default is 2048. 0 for no limit.</para>
+				<para>If the digit map is longer than this, an error is returned.</para>
+			</parameter>
 		</syntax>
 		<description>
 			<para>Generates the digit map for the specified dialplan context.</para>
 			<para>Digit maps are used by many SIP devices when digits are collected locally,
 			and the digit map should correspond to the dial plan allowed by a device's context.</para>
+			<para>Digit maps are cached until the dialplan is reloaded.</para>
+		</description>
+	</manager>
+	<manager name="GenerateDigitMaps" language="en_US" module="res_xmpp">
+		<synopsis>
+			Generate digit maps for multiple contexts.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Contexts" required="true">
+				<para>Comma-separated list of dialplan contexts for which to generate digit maps.</para>
+			</parameter>
+			<xi:include xpointer="xpointer(/docs/manager[@name='GenerateDigitMap']/syntax/parameter[@name='TimeoutSuffix'])" />
+			<xi:include xpointer="xpointer(/docs/manager[@name='GenerateDigitMap']/syntax/parameter[@name='Optimize'])" />
+			<xi:include xpointer="xpointer(/docs/manager[@name='GenerateDigitMap']/syntax/parameter[@name='MaxLength'])" />
+		</syntax>
+		<description>
+			<para>Generates the digit maps for the specified dialplan contexts, with the same options as <literal>GenerateDigitMap</literal>.</para>
+			<para>A <literal>DigitMap</literal> event is returned for each context, containing either a <literal>DigitMap</literal> or an <literal>Error</literal> header,
+			followed by a <literal>DigitMapsComplete</literal> event.</para>
 		</description>
 	</manager>
 ***/
 
-#define BUF_SIZE 2048 /* Grandstream devices only support a digit map of max length 2048 */
+#define DEFAULT_MAX_LENGTH 2048 /* Grandstream devices only support a digit map of max length 2048 */
 
-#define buf_append(buf, len, fmt, ...) { \
-	bytes = snprintf(buf, len, fmt, ## __VA_ARGS__); \
-	if (bytes >= len) { \
-		res = -1; \
-		break; \
-	} \
-	buf += bytes; \
-	len -= bytes; \
-}
+#define buf_append(fmt, ...) ast_str_append(buf, 0, fmt, ## __VA_ARGS__)
 
 struct map_geninfo {
 	int includecount;
 };
 
-/*! \retval -1 on failure, number of bytes written on success */
-static int generate_digit_map(const char *prefix, const char *rootcontext, const char *context, struct map_geninfo *geninfo, const char *includes[], char *buf, size_t len, int timeoutsuffix)
+/*!
+ * \brief Append the digit map for a context (and its includes) to a buffer
+ * \note Each pattern is preceded by a |, including the first one
+ * \retval 0 on success, -1 on failure
+ */
+static int generate_digit_map(const char *prefix, const char *rootcontext, const char *context, struct map_geninfo *geninfo, const char *includes[], struct ast_str **buf, int timeoutsuffix)
 {
 	int idx;
 	struct ast_context *c;
 	struct ast_exten *e = NULL;
 	int i, res = 0;
-	int bytes;
-	char *start = buf;
 
 	if (!prefix) {
 		prefix = "";
@@ -108,7 +134,8 @@ static int generate_digit_map(const char *prefix, const char *rootcontext, const
 		int ignorepat = 0;
 		int needtimeout = 0;
 		int complex_exten = 0;
-		const char *startbuf, *name = ast_get_extension_name(e);
+		size_t startpos; /* Start of this extension's pattern in buf */
+		const char *name = ast_get_extension_name(e);
 		/* XXX use macro for this */
 		if (!strcmp(name, "a") || !strcmp(name, "i") || !strcmp(name, "s") || !strcmp(name, "t")) {
 			continue; /* Skip special dialplan extensions */
@@ -138,11 +165,9 @@ static int generate_digit_map(const char *prefix, const char *rootcontext, const
 			}
 		}
 
-		buf_append(buf, len, "|");
-		startbuf = buf;
-		if (prefix) {
-			buf_append(buf, len, "%s", prefix);
-		}
+		buf_append("|");
+		startpos = ast_str_strlen(*buf);
+		buf_append("%s", prefix);
 
 		/* Process the pattern, one character at a time. */
 		while (*name) {
@@ -150,24 +175,24 @@ static int generate_digit_map(const char *prefix, const char *rootcontext, const
 			if (!ast_strlen_zero(prefix) && ignorepat) {
 				/* If there's an ignorepat for this prefix, insert a comma for second dial tone */
 				/* Note that Grandstream does not currently support 2nd dial tones, but this won't cause any issues otherwise. */
-				buf_append(buf, len, ",");
+				buf_append(",");
 				ignorepat = 0;
 			}
 
 			/* Digit maps don't understand N or Z, so expand them */
 			if (*name == 'N') {
-				buf_append(buf, len, "[2-9]");
+				buf_append("[2-9]");
 				complex_exten = 1;
 			} else if (*name == 'Z') {
-				buf_append(buf, len, "[1-9]");
+				buf_append("[1-9]");
 				complex_exten = 1;
 			} else if (*name == 'X') {
-				buf_append(buf, len, "x"); /* Digit maps do recognize 'x', but they use lowercase x, not uppercase X */
+				buf_append("x"); /* Digit maps do recognize 'x', but they use lowercase x, not uppercase X */
 				complex_exten = 1;
 			} else if (*name == '!') {
 #if 0
 				/* S0 is not support by Grandstream. So we should just ignore ! characters. */
-				buf_append(buf, len, "S0"); /* Translate ! into immediate match */
+				buf_append("S0"); /* Translate ! into immediate match */
 #endif
 			} else {
 				/* Process [] ranges as an entire unit */
@@ -208,7 +233,7 @@ static int generate_digit_map(const char *prefix, const char *rootcontext, const
 							ast_debug(4, "Range from %c to %c must be expanded for %s\n", range_first, range_last, ast_get_extension_name(e));
 							range_first++; /* Add 1, since we already wrote the first character in the range the previous iteration of the loop. */
 							while (range_first <= range_last) { /* Write out the entire range */
-								buf_append(buf, len, "%c", range_first);
+								buf_append("%c", range_first);
 								range_first++;
 							}
 							range_first = 0;
@@ -217,24 +242,24 @@ static int generate_digit_map(const char *prefix, const char *rootcontext, const
 #ifdef EXTRA_DEBUG
 							ast_debug(3, "Appending %c\n", *range_start);
 #endif
-							buf_append(buf, len, "%c", *range_start);
+							buf_append("%c", *range_start);
 							range_first = 0; /* It's just a single range in the [], nothing special */
 						}
 						range_start++;
 					}
-					buf_append(buf, len, "%c", ']'); /* End the range */
+					buf_append("%c", ']'); /* End the range */
 					ast_assert(!range_first);
 				} else {
 					/* Copy literally, including the . character. */
 #ifdef EXTRA_DEBUG
 					ast_debug(3, "XXXXXX Appending %c\n", *name);
 #endif
-					buf_append(buf, len, "%c", *name);
+					buf_append("%c", *name);
 				}
 			}
 			if (ast_strlen_zero(prefix) && ignorepat) {
 				/* If there's an ignorepat for this prefix, insert a comma for second dial tone */
-				buf_append(buf, len, ",");
+				buf_append(",");
 				ignorepat = 0;
 			}
 			name++;
@@ -251,7 +276,7 @@ static int generate_digit_map(const char *prefix, const char *rootcontext, const
 				char *dst = sample_exten;
 				int in_pattern = 0;
 				char start_digit = 0, end_digit = 0;
-				const char *src = startbuf;
+				const char *src = ast_str_buffer(*buf) + startpos;
 				/* If we have a pattern like _[2-9] and the pattern, say, _[2-4]XXX
 				 * then the first pattern is a prefix of the second one (at least when the first digit is 2-4).
 				 * Ideally, we would split the first pattern into _[2-4]T and _[5-9],
@@ -320,7 +345,7 @@ static int generate_digit_map(const char *prefix, const char *rootcontext, const
 					}
 					dst++;
 				}
-				ast_debug(3, "Instantiated pattern '%s' as %s@%s\n", startbuf, sample_exten, rootcontext);
+				ast_debug(3, "Instantiated pattern '%s' as %s@%s\n", ast_str_buffer(*buf) + startpos, sample_exten, rootcontext);
 				/* It could match in a context that includes the current one, so use the root context for comparison.
 				 * When doing this, we need to include the prefix. */
 				if (ast_matchmore_extension(NULL, rootcontext, sample_exten, 1, NULL)) {
@@ -331,13 +356,9 @@ static int generate_digit_map(const char *prefix, const char *rootcontext, const
 
 		if (needtimeout) {
 			ast_debug(2, "Extension %s %s prefixes other valid extension(s)\n", ast_get_extension_name(e), complex_exten ? "probably" : "definitely");
-			buf_append(buf, len, "%c", 'T');
+			buf_append("%c", 'T');
 		}
-		ast_debug(3, "%p: Added to digit map: %s\n", startbuf, startbuf);
-	}
-
-	if (res && len <= 0) {
-		ast_log(LOG_WARNING, "No space left in digit map buffer\n"); /* Truncation occured */
+		ast_debug(3, "Added to digit map: %s\n", ast_str_buffer(*buf) + startpos);
 	}
 
 	/* Skip if res */
@@ -388,12 +409,7 @@ static int generate_digit_map(const char *prefix, const char *rootcontext, const
 					char newprefix[32];
 					snprintf(newprefix, sizeof(newprefix), "%s%s", prefix, tmp2); /* prefix is non NULL so no need for S_OR */
 
-					res = generate_digit_map(newprefix, rootcontext, includename, geninfo, includes, buf, len, timeoutsuffix);
-
-					if (res > 0) {
-						buf += res;
-						len -= res;
-					}
+					res = generate_digit_map(newprefix, rootcontext, includename, geninfo, includes, buf, timeoutsuffix);
 				} else {
 					ast_log(LOG_WARNING, "Avoiding circular include of %s within %s\n", ast_get_include_name(i), context);
 				}
@@ -410,41 +426,396 @@ static int generate_digit_map(const char *prefix, const char *rootcontext, const
 	geninfo->includecount -= 1;
 	includes[geninfo->includecount] = NULL;
 
-	return res < 0 ? res : (buf - start);
+	return res;
 }
 
-static int generate_digit_map_all(int fd, const char *context_name, int timeoutsuffix)
+/*! \brief Element of a digit map pattern */
+struct dm_token {
+	unsigned short mask;	/* Digits matched, if this is a digit or set of digits */
+	char c;					/* Otherwise, a character with special meaning (e.g. . , T) */
+};
+
+struct dm_pattern {
+	int numtokens;
+	struct dm_token tokens[0];
+};
+
+static const char dm_digits[] = "0123456789*#ABCD";
+
+#define DM_ANY_DIGIT 0x3FF /* x */
+
+static int dm_digit(char c)
 {
-	int res = 0;
+	const char *s = c ? strchr(dm_digits, c) : NULL;
+	return s ? s - dm_digits : -1;
+}
+
+static struct dm_pattern *dm_pattern_parse(const char *s, size_t len)
+{
+	struct dm_pattern *p;
+	const char *end = s + len;
+
+	p = ast_calloc(1, sizeof(*p) + len * sizeof(p->tokens[0])); /* Never more tokens than characters */
+	if (!p) {
+		return NULL;
+	}
+	while (s < end) {
+		struct dm_token *t = &p->tokens[p->numtokens++];
+		int d;
+		if (*s == 'x') {
+			t->mask = DM_ANY_DIGIT;
+		} else if (*s == '[') {
+			const char *close = memchr(s, ']', end - s);
+			if (!close) {
+				ast_free(p);
+				return NULL;
+			}
+			for (s++; s < close; s++) {
+				if (s + 2 < close && s[1] == '-') {
+					int c;
+					for (c = s[0]; c <= s[2]; c++) {
+						if ((d = dm_digit(c)) >= 0) {
+							t->mask |= 1 << d;
+						}
+					}
+					s += 2;
+				} else if ((d = dm_digit(*s)) >= 0) {
+					t->mask |= 1 << d;
+				}
+			}
+			if (!t->mask) {
+				ast_free(p);
+				return NULL;
+			}
+		} else if ((d = dm_digit(*s)) >= 0) {
+			t->mask = 1 << d;
+		} else {
+			t->c = *s;
+		}
+		s++;
+	}
+	return p;
+}
+
+static void dm_pattern_append(struct ast_str **buf, struct dm_pattern *p)
+{
+	int i, d;
+
+	for (i = 0; i < p->numtokens; i++) {
+		unsigned short mask = p->tokens[i].mask;
+		int first = -1, last = -1, count = 0;
+
+		if (!mask) {
+			ast_str_append(buf, 0, "%c", p->tokens[i].c);
+			continue;
+		} else if (mask == DM_ANY_DIGIT) {
+			ast_str_append(buf, 0, "x");
+			continue;
+		}
+		for (d = 0; d < 16; d++) {
+			if (mask & (1 << d)) {
+				if (first < 0) {
+					first = d;
+				}
+				last = d;
+				count++;
+			}
+		}
+		if (count == 1) {
+			ast_str_append(buf, 0, "%c", dm_digits[first]);
+		} else if (count >= 3 && last <= 9 && last - first + 1 == count) {
+			/* Only a single range is allowed in a set, e.g. [02-9] is not valid for some devices */
+			ast_str_append(buf, 0, "[%c-%c]", dm_digits[first], dm_digits[last]);
+		} else {
+			ast_str_append(buf, 0, "[");
+			for (d = first; d <= last; d++) {
+				if (mask & (1 << d)) {
+					ast_str_append(buf, 0, "%c", dm_digits[d]);
+				}
+			}
+			ast_str_append(buf, 0, "]");
+		}
+	}
+}
+
+/*!
+ * \brief Compare two patterns for merging
+ * \retval -1 if they can't be merged
+ * \retval numtokens if a matches a subset of what b matches
+ * \return Otherwise, the position of the only element that differs
+ */
+static int dm_pattern_compare(struct dm_pattern *a, struct dm_pattern *b)
+{
+	int i, diff = -1, subset = 1;
+
+	if (a->numtokens != b->numtokens) {
+		return -1;
+	}
+	for (i = 0; i < a->numtokens; i++) {
+		struct dm_token *x = &a->tokens[i], *y = &b->tokens[i];
+		if (x->c != y->c || !x->mask != !y->mask) {
+			return -1;
+		}
+		if (x->mask == y->mask) {
+			continue;
+		}
+		/* A set followed by . (repeat) can't be changed without changing what the repetitions match */
+		if (i + 1 < a->numtokens && a->tokens[i + 1].c == '.') {
+			return -1;
+		}
+		if ((x->mask & y->mask) != x->mask) {
+			subset = 0;
+		}
+		if (diff >= 0) {
+			diff = -2; /* More than one difference, only useful if a subset */
+		} else if (diff == -1) {
+			diff = i;
+		}
+	}
+	if (subset) {
+		return a->numtokens;
+	}
+	return diff >= 0 ? diff : -1;
+}
+
+/*!
+ * \brief Shorten a digit map by removing redundant patterns and merging patterns that differ in a single digit (e.g. 22|23|24 becomes 2[2-4])
+ * \param map Digit map, with patterns separated by |
+ * \param[out] buf Optimized digit map
+ * \retval 0 on success, -1 on failure
+ */
+static int dm_optimize(const char *map, struct ast_str **buf)
+{
+	struct dm_pattern **patterns;
+	const char *s;
+	int i, j, numpatterns = 1, changed, res = -1;
+
+	for (s = map; *s; s++) {
+		if (*s == '|') {
+			numpatterns++;
+		}
+	}
+	patterns = ast_calloc(numpatterns, sizeof(*patterns));
+	if (!patterns) {
+		return -1;
+	}
+
+	numpatterns = 0;
+	for (s = map; *s; ) {
+		const char *end = strchr(s, '|');
+		if (!end) {
+			end = s + strlen(s);
+		}
+		if (end > s && !(patterns[numpatterns++] = dm_pattern_parse(s, end - s))) {
+			ast_log(LOG_WARNING, "Failed to parse digit map pattern '%.*s'\n", (int) (end - s), s);
+			goto cleanup;
+		}
+		s = *end ? end + 1 : end;
+	}
+
+	do {
+		changed = 0;
+		for (i = 0; i < numpatterns; i++) {
+			for (j = 0; j < numpatterns; j++) {
+				int pos;
+				if (i == j || (pos = dm_pattern_compare(patterns[j], patterns[i])) < 0) {
+					continue;
+				}
+				if (pos < patterns[j]->numtokens) {
+					/* Differ in only one place, so j's digits can be added to i */
+					patterns[i]->tokens[pos].mask |= patterns[j]->tokens[pos].mask;
+				} /* else, i already matches everything j does */
+				ast_free(patterns[j]);
+				memmove(&patterns[j], &patterns[j + 1], (numpatterns - j - 1) * sizeof(*patterns));
+				numpatterns--;
+				if (j < i) {
+					i--;
+				}
+				j--;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	ast_str_reset(*buf);
+	for (i = 0; i < numpatterns; i++) {
+		if (i) {
+			ast_str_append(buf, 0, "|");
+		}
+		dm_pattern_append(buf, patterns[i]);
+	}
+	res = 0;
+
+cleanup:
+	for (i = 0; i < numpatterns; i++) {
+		ast_free(patterns[i]);
+	}
+	ast_free(patterns);
+	return res;
+}
+
+#define DIGITMAP_CACHE_BUCKETS 31
+
+/*! \brief A generated digit map */
+struct cached_map {
+	char *map;
+	char key[0];	/* context/options */
+};
+
+static struct ao2_container *maps;
+static int maps_generation = 0;
+static struct stasis_subscription *reload_sub;
+
+static int cached_map_hash_fn(const void *obj, const int flags)
+{
+	const struct cached_map *cm;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		cm = obj;
+		key = cm->key;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int cached_map_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct cached_map *cm = obj, *right = arg;
+	const char *key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = right->key;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(cm->key, key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+static void cached_map_destructor(void *obj)
+{
+	struct cached_map *cm = obj;
+	ast_free(cm->map);
+}
+
+/*!
+ * \brief Get the digit map for a context, generating it if it hasn't been since the dialplan was last reloaded
+ * \param context
+ * \param timeoutsuffix Whether to suffix T to extensions that prefix other extensions
+ * \param optimize Whether to merge patterns to shorten the digit map
+ * \return Digit map, which must be unreferenced, or NULL on failure
+ */
+static struct cached_map *digit_map_get(const char *context, int timeoutsuffix, int optimize)
+{
+	struct cached_map *cm, *existing;
+	struct ast_str *buf;
 	const char *includes[AST_PBX_MAX_STACK];
-	char buf[BUF_SIZE];
 	struct map_geninfo geninfo = {
 		.includecount = 0,
 	};
+	char key[AST_MAX_CONTEXT + 8];
+	int generation;
 
-	res = generate_digit_map(NULL, context_name, context_name, &geninfo, includes, buf, sizeof(buf), timeoutsuffix);
+	snprintf(key, sizeof(key), "%s/%s%s", context, timeoutsuffix ? "T" : "", optimize ? "O" : "");
+	cm = ao2_find(maps, key, OBJ_SEARCH_KEY);
+	if (cm) {
+		ast_debug(3, "Using cached digit map for %s\n", key);
+		return cm;
+	}
 
-	if (res <= 0) {
-		return res;
+	generation = ast_atomic_fetchadd_int(&maps_generation, 0);
+	buf = ast_str_create(DEFAULT_MAX_LENGTH);
+	if (!buf) {
+		return NULL;
+	}
+	if (generate_digit_map(NULL, context, context, &geninfo, includes, &buf, timeoutsuffix) || !ast_str_strlen(buf)) {
+		ast_free(buf);
+		return NULL;
 	}
+	ast_debug(1, "Generated digit map length: %d\n", (int) ast_str_strlen(buf) - 1);
 
-	/* XXX Would be nice if we could condense the direct translation of dialplan => digit map into a condensed form, e.g. 22|23|24 -> 2[2-4] */
+	cm = ao2_alloc(sizeof(*cm) + strlen(key) + 1, cached_map_destructor);
+	if (!cm) {
+		ast_free(buf);
+		return NULL;
+	}
+	strcpy(cm->key, key); /* Safe */
 
-	/* Print */
-	ast_debug(1, "Generated digit map length: %d\n", res);
-	ast_cli(fd, "%s\n", buf + 1); /* Skip leading | */
-	return 0;
+	if (optimize) {
+		struct ast_str *optimized = ast_str_create(ast_str_strlen(buf));
+		if (!optimized || dm_optimize(ast_str_buffer(buf) + 1, &optimized)) { /* Skip leading | */
+			ast_free(optimized);
+			ast_free(buf);
+			ao2_ref(cm, -1);
+			return NULL;
+		}
+		ast_debug(1, "Optimized digit map length: %d\n", (int) ast_str_strlen(optimized));
+		cm->map = ast_strdup(ast_str_buffer(optimized));
+		ast_free(optimized);
+	} else {
+		cm->map = ast_strdup(ast_str_buffer(buf) + 1); /* Skip leading | */
+	}
+	ast_free(buf);
+	if (!cm->map) {
+		ao2_ref(cm, -1);
+		return NULL;
+	}
+
+	ao2_wrlock(maps);
+	if (generation != maps_generation) {
+		/* Dialplan reloaded while generating. Use it for now, but don't cache it. */
+	} else if ((existing = ao2_find(maps, key, OBJ_SEARCH_KEY | OBJ_NOLOCK))) {
+		ao2_ref(cm, -1);
+		cm = existing;
+	} else {
+		ao2_link_flags(maps, cm, OBJ_NOLOCK);
+	}
+	ao2_unlock(maps);
+	return cm;
+}
+
+static void digit_map_flush(void)
+{
+	ao2_wrlock(maps);
+	ast_atomic_fetchadd_int(&maps_generation, 1);
+	ao2_callback(maps, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE | OBJ_NOLOCK, NULL, NULL);
+	ao2_unlock(maps);
+}
+
+static void reload_cb(void *data, struct stasis_subscription *sub, struct stasis_message *msg)
+{
+	if (!reload_sub_is_reload(msg)) {
+		return;
+	}
+
+	ast_debug(2, "Reload occurred, discarding generated digit maps\n");
+	digit_map_flush();
 }
 
 static char *handle_dialplan_generate_digitmap(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
+	struct cached_map *cm;
+	int i, timeoutsuffix = 0, optimize = 0;
+	size_t len;
+
 	switch (cmd) {
 	case CLI_INIT:
 		e->command = "dialplan generate digitmap";
 		e->usage =
-			"Usage: dialplan generate digitmap <context> [T]\n"
+			"Usage: dialplan generate digitmap <context> [T] [optimize]\n"
 			"       Generate device digit maps for a dialplan context\n"
-			"       The argument T will suffix a T for any extensions that prefix other valid extensions.\n";
+			"       The argument T will suffix a T for any extensions that prefix other valid extensions.\n"
+			"       The argument optimize will merge patterns to shorten the digit map, e.g. 22|23|24 becomes 2[2-4]\n";
 		return NULL;
 	case CLI_GENERATE:
 #if 0
@@ -455,65 +826,215 @@ static char *handle_dialplan_generate_digitmap(struct ast_cli_entry *e, int cmd,
 #endif
 	}
 
-	if (a->argc != 4 && a->argc != 5) {
+	if (a->argc < 4 || a->argc > 6) {
 		return CLI_SHOWUSAGE;
 	}
+	for (i = 4; i < a->argc; i++) {
+		if (!strcasecmp(a->argv[i], "T")) {
+			timeoutsuffix = 1;
+		} else if (!strcasecmp(a->argv[i], "optimize")) {
+			optimize = 1;
+		} else {
+			return CLI_SHOWUSAGE;
+		}
+	}
 
-	return generate_digit_map_all(a->fd, a->argv[3], a->argc == 5) ? CLI_FAILURE : CLI_SUCCESS;
+	cm = digit_map_get(a->argv[3], timeoutsuffix, optimize);
+	if (!cm) {
+		return CLI_FAILURE;
+	}
+	ast_cli(a->fd, "%s\n", cm->map);
+	len = strlen(cm->map);
+	if (len > DEFAULT_MAX_LENGTH) {
+		ast_cli(a->fd, "Warning: digit map is %d bytes, longer than many devices support (%d)%s\n", (int) len, DEFAULT_MAX_LENGTH,
+			optimize ? "" : ", try optimizing it");
+	}
+	ao2_ref(cm, -1);
+	return CLI_SUCCESS;
+}
+
+static char *handle_dialplan_flush_digitmaps(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "dialplan flush digitmaps";
+		e->usage =
+			"Usage: dialplan flush digitmaps\n"
+			"       Discard cached digit maps, so they are generated again.\n"
+			"       This is done automatically whenever the dialplan is reloaded.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args) {
+		return CLI_SHOWUSAGE;
+	}
+
+	digit_map_flush();
+	return CLI_SUCCESS;
+}
+
+/*! \brief Parse the options common to the digit map manager actions */
+static void manager_digitmap_options(const struct message *m, int *timeoutsuffix, int *optimize, int *maxlen)
+{
+	const char *timeoutsuffix_s = astman_get_header(m, "TimeoutSuffix");
+	const char *optimize_s = astman_get_header(m, "Optimize");
+	const char *maxlen_s = astman_get_header(m, "MaxLength");
+
+	*timeoutsuffix = !ast_strlen_zero(timeoutsuffix_s) && ast_true(timeoutsuffix_s);
+	*optimize = !ast_strlen_zero(optimize_s) && ast_true(optimize_s);
+	*maxlen = DEFAULT_MAX_LENGTH;
+	if (!ast_strlen_zero(maxlen_s) && (sscanf(maxlen_s, "%d", maxlen) != 1 || *maxlen < 0)) {
+		ast_log(LOG_WARNING, "Invalid MaxLength '%s', using %d\n", maxlen_s, DEFAULT_MAX_LENGTH);
+		*maxlen = DEFAULT_MAX_LENGTH;
+	}
 }
 
 static int manager_digitmap(struct mansession *s, const struct message *m)
 {
-	int res = 0;
-	int timeoutsuffix;
-	const char *includes[AST_PBX_MAX_STACK];
-	char buf[BUF_SIZE];
-	struct map_geninfo geninfo = {
-		.includecount = 0,
-	};
+	struct cached_map *cm;
+	int timeoutsuffix, optimize, maxlen, len;
 	const char *id = astman_get_header(m, "ActionID");
 	const char *context = astman_get_header(m, "Context");
-	const char *timeoutsuffix_s = astman_get_header(m, "TimeoutSuffix");
 
 	if (ast_strlen_zero(context)) {
 		astman_send_error(s, m, "No context specified");
 		return 0;
 	}
 
-	timeoutsuffix = !ast_strlen_zero(timeoutsuffix_s) && ast_true(timeoutsuffix_s);
+	manager_digitmap_options(m, &timeoutsuffix, &optimize, &maxlen);
 
-	res = generate_digit_map(NULL, context, context, &geninfo, includes, buf, sizeof(buf), timeoutsuffix);
-	if (res <= 0) {
+	cm = digit_map_get(context, timeoutsuffix, optimize);
+	if (!cm) {
 		astman_send_error(s, m, "Could not generate digit map for requested context");
 		return 0;
 	}
+	len = strlen(cm->map);
+	if (maxlen && len > maxlen) {
+		ao2_ref(cm, -1);
+		astman_send_error(s, m, "Digit map exceeds maximum length");
+		return 0;
+	}
 
-	ast_debug(1, "Generated digit map length: %d: '%s'\n", res, buf + 1);
 	astman_append(s, "Response: Success\r\n");
 	if (!ast_strlen_zero(id)) {
 		astman_append(s, "ActionID: %s\r\n", id);
 	}
-	astman_append(s, "DigitMap: %s\r\n\r\n", buf + 1); /* Skip leading | */
+	astman_append(s, "DigitMap: %s\r\n\r\n", cm->map);
+	ao2_ref(cm, -1);
+	return 0;
+}
+
+static int manager_digitmaps(struct mansession *s, const struct message *m)
+{
+	int timeoutsuffix, optimize, maxlen;
+	int maps_found = 0;
+	char *contexts, *context;
+	char idText[256];
+	const char *actionid = astman_get_header(m, "ActionID");
+	const char *contexts_s = astman_get_header(m, "Contexts");
+
+	if (ast_strlen_zero(contexts_s)) {
+		astman_send_error(s, m, "No contexts specified");
+		return 0;
+	}
+
+	manager_digitmap_options(m, &timeoutsuffix, &optimize, &maxlen);
+
+	if (!ast_strlen_zero(actionid)) {
+		snprintf(idText, sizeof(idText), "ActionID: %s\r\n", actionid);
+	} else {
+		idText[0] = '\0';
+	}
+	astman_send_listack(s, m, "Digit maps will follow", "start");
+
+	contexts = ast_strdupa(contexts_s);
+	while ((context = strsep(&contexts, ","))) {
+		struct cached_map *cm;
+		const char *error = NULL;
+
+		context = ast_strip(context);
+		if (ast_strlen_zero(context)) {
+			continue;
+		}
+		cm = digit_map_get(context, timeoutsuffix, optimize);
+		if (!cm) {
+			error = "Could not generate digit map for requested context";
+		} else if (maxlen && (int) strlen(cm->map) > maxlen) {
+			error = "Digit map exceeds maximum length";
+		}
+		maps_found++;
+		astman_append(s,
+			"Event: DigitMap\r\n"
+			"%s"
+			"Context: %s\r\n"
+			"%s: %s\r\n"
+			"\r\n",
+			idText,
+			context,
+			error ? "Error" : "DigitMap", error ? error : cm->map);
+		ao2_cleanup(cm);
+	}
+
+	astman_send_list_complete_start(s, m, "DigitMapsComplete", maps_found);
+	astman_send_list_complete_end(s);
 	return 0;
 }
 
 static struct ast_cli_entry generate_cli[] = {
 	AST_CLI_DEFINE(handle_dialplan_generate_digitmap, "Generate device digit maps from the dialplan"),
+	AST_CLI_DEFINE(handle_dialplan_flush_digitmaps, "Discard cached device digit maps"),
 };
 
 static int unload_module(void)
 {
 	ast_manager_unregister("GenerateDigitMap");
+	ast_manager_unregister("GenerateDigitMaps");
 	ast_cli_unregister_multiple(generate_cli, ARRAY_LEN(generate_cli));
+	reload_sub = stasis_unsubscribe_and_join(reload_sub);
+	ao2_cleanup(maps);
+	maps = NULL;
 	return 0;
 }
 
 static int load_module(void)
 {
 	int res = 0;
+
+	maps = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, DIGITMAP_CACHE_BUCKETS,
+		cached_map_hash_fn, NULL, cached_map_cmp_fn);
+	if (!maps) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* Any module could change the dialplan (pbx_config, pbx_ael, pbx_lua...), so flush on any reload */
+	reload_sub = reload_sub_subscribe(reload_cb, NULL);
+	if (!reload_sub) {
+		ao2_ref(maps, -1);
+		maps = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
 	res |= ast_cli_register_multiple(generate_cli, ARRAY_LEN(generate_cli));
 	res |= ast_manager_register_xml("GenerateDigitMap", EVENT_FLAG_CONFIG | EVENT_FLAG_REPORTING, manager_digitmap);
-	return res;
+	res |= ast_manager_register_xml("GenerateDigitMaps", EVENT_FLAG_CONFIG | EVENT_FLAG_REPORTING, manager_digitmaps);
+	if (res) {
+		unload_module();
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+static int reload_module(void)
+{
+	digit_map_flush();
+	return 0;
 }
 
-AST_MODULE_INFO_STANDARD_EXTENDED(ASTERISK_GPL_KEY, "Device Digit Map Generation");
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Device Digit Map Generation",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.reload = reload_module,
+);
@@ -0,0 +1,416 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2022, Naveen Albert
+ *
+ * Naveen Albert <asterisk@phreaknet.org>
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief In-band DSP pipeline
+ *
+ * \author Naveen Albert <asterisk@phreaknet.org>
+ *
+ * \ingroup resources
+ */
+
+/*** MODULEINFO
+	<support_level>extended</support_level>
+ ***/
+
+#include "asterisk.h"
+
+#include <time.h>
+
+#include "asterisk/module.h"
+#include "asterisk/channel.h"
+#include "asterisk/audiohook.h"
+#include "asterisk/cli.h"
+#include "asterisk/utils.h"
+#include "asterisk/dsp_pipeline.h"
+
+/*! \brief A stage in a channel's pipeline */
+struct dsp_stage {
+	struct ast_dsp_stage_type *type;
+	void *data;
+	AST_LIST_ENTRY(dsp_stage) entry;
+};
+
+/*! \brief A channel's pipeline */
+struct dsp_pipeline {
+	struct ast_audiohook audiohook;
+	/* Modified with both the channel and the audiohook locked, so holding either is enough to traverse */
+	AST_LIST_HEAD_NOLOCK(, dsp_stage) stages;
+};
+
+static AST_RWLIST_HEAD_STATIC(stage_types, ast_dsp_stage_type);
+
+int __ast_dsp_stage_type_register(struct ast_dsp_stage_type *type, struct ast_module *module)
+{
+	struct ast_dsp_stage_type *t;
+
+	if (ast_strlen_zero(type->name) || !type->process) {
+		ast_log(LOG_ERROR, "DSP stage type is missing a name or process callback\n");
+		return -1;
+	}
+
+	AST_RWLIST_WRLOCK(&stage_types);
+	AST_RWLIST_TRAVERSE(&stage_types, t, entry) {
+		if (!strcasecmp(t->name, type->name)) {
+			AST_RWLIST_UNLOCK(&stage_types);
+			ast_log(LOG_WARNING, "DSP stage type '%s' is already registered\n", type->name);
+			return -1;
+		}
+	}
+	type->module = module;
+	type->channels = 0;
+	type->frames = 0;
+	type->nsec = 0;
+	AST_RWLIST_INSERT_TAIL(&stage_types, type, entry);
+	AST_RWLIST_UNLOCK(&stage_types);
+
+	ast_debug(1, "Registered DSP stage type '%s'\n", type->name);
+	return 0;
+}
+
+int ast_dsp_stage_type_unregister(struct ast_dsp_stage_type *type)
+{
+	struct ast_dsp_stage_type *t;
+
+	AST_RWLIST_WRLOCK(&stage_types);
+	t = AST_RWLIST_REMOVE(&stage_types, type, entry);
+	AST_RWLIST_UNLOCK(&stage_types);
+
+	if (!t) {
+		return -1;
+	}
+	ast_debug(1, "Unregistered DSP stage type '%s'\n", type->name);
+	return 0;
+}
+
+static void stage_destroy(struct dsp_stage *stage)
+{
+	struct ast_dsp_stage_type *type = stage->type;
+
+	if (type->destroy) {
+		type->destroy(stage->data);
+	}
+	ast_atomic_fetch_add(&type->channels, -1, __ATOMIC_RELAXED);
+	ast_free(stage);
+	/* Only now can the stage's module go away */
+	ast_module_unref(type->module);
+}
+
+static void pipeline_destroy(void *data)
+{
+	struct dsp_pipeline *pipeline = data;
+	struct dsp_stage *stage;
+
+	ast_audiohook_lock(&pipeline->audiohook);
+	ast_audiohook_detach(&pipeline->audiohook);
+	ast_audiohook_unlock(&pipeline->audiohook);
+	ast_audiohook_destroy(&pipeline->audiohook);
+
+	while ((stage = AST_LIST_REMOVE_HEAD(&pipeline->stages, entry))) {
+		stage_destroy(stage);
+	}
+	ast_free(pipeline);
+	ast_module_unref(AST_MODULE_SELF);
+}
+
+static const struct ast_datastore_info pipeline_datastore = {
+	.type = "dsp_pipeline",
+	.destroy = pipeline_destroy,
+};
+
+static int pipeline_callback(struct ast_audiohook *audiohook, struct ast_channel *chan, struct ast_frame *frame, enum ast_audiohook_direction direction)
+{
+	/* The audiohook is embedded in the pipeline, so there's no need to look up the datastore */
+	struct dsp_pipeline *pipeline = (struct dsp_pipeline *) ((char *) audiohook - offsetof(struct dsp_pipeline, audiohook));
+	struct dsp_stage *stage;
+	struct timespec start, end;
+
+	/* If the audiohook is stopping it means the channel is shutting down.... but we let the datastore destroy take care of it */
+	if (audiohook->status == AST_AUDIOHOOK_STATUS_DONE) {
+		return 0;
+	}
+
+	if (!frame || frame->frametype != AST_FRAME_VOICE || !frame->samples) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	AST_LIST_TRAVERSE(&pipeline->stages, stage, entry) {
+		struct ast_dsp_stage_type *type = stage->type;
+		type->process(chan, stage->data, frame, direction);
+		/* The end of one stage is the start of the next */
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ast_atomic_fetch_add(&type->frames, 1, __ATOMIC_RELAXED);
+		ast_atomic_fetch_add(&type->nsec, (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec), __ATOMIC_RELAXED);
+		start = end;
+	}
+
+	return 0;
+}
+
+/*! \note Must be called with the channel locked */
+static struct dsp_pipeline *pipeline_get(struct ast_channel *chan)
+{
+	struct ast_datastore *datastore = ast_channel_datastore_find(chan, &pipeline_datastore, NULL);
+	return datastore ? datastore->data : NULL;
+}
+
+/*! \note Must be called with the channel locked */
+static struct dsp_stage *stage_get(struct dsp_pipeline *pipeline, struct ast_dsp_stage_type *type)
+{
+	struct dsp_stage *stage;
+
+	AST_LIST_TRAVERSE(&pipeline->stages, stage, entry) {
+		if (stage->type == type) {
+			return stage;
+		}
+	}
+	return NULL;
+}
+
+int ast_dsp_pipeline_add(struct ast_channel *chan, struct ast_dsp_stage_type *type, void *data)
+{
+	struct dsp_pipeline *pipeline;
+	struct dsp_stage *stage, *cur;
+	struct ast_datastore *datastore = NULL;
+
+	if (!type->module) {
+		ast_log(LOG_ERROR, "DSP stage type '%s' is not registered\n", type->name);
+		return -1;
+	}
+
+	stage = ast_calloc(1, sizeof(*stage));
+	if (!stage) {
+		return -1;
+	}
+	stage->type = type;
+	stage->data = data;
+
+	ast_channel_lock(chan);
+	pipeline = pipeline_get(chan);
+	if (!pipeline) {
+		datastore = ast_datastore_alloc(&pipeline_datastore, NULL);
+		if (!datastore) {
+			ast_channel_unlock(chan);
+			ast_free(stage);
+			return -1;
+		}
+		pipeline = ast_calloc(1, sizeof(*pipeline));
+		if (!pipeline) {
+			ast_channel_unlock(chan);
+			ast_datastore_free(datastore);
+			ast_free(stage);
+			return -1;
+		}
+		ast_audiohook_init(&pipeline->audiohook, AST_AUDIOHOOK_TYPE_MANIPULATE, "DSP Pipeline", AST_AUDIOHOOK_MANIPULATE_ALL_RATES);
+		pipeline->audiohook.manipulate_callback = pipeline_callback;
+		ast_module_ref(AST_MODULE_SELF);
+	} else if (stage_get(pipeline, type)) {
+		ast_channel_unlock(chan);
+		ast_free(stage);
+		ast_log(LOG_WARNING, "Channel %s already has a %s stage\n", ast_channel_name(chan), type->name);
+		return -1;
+	}
+
+	/* Keep the chain ordered by priority */
+	ast_audiohook_lock(&pipeline->audiohook);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&pipeline->stages, cur, entry) {
+		if (cur->type->priority > type->priority) {
+			AST_LIST_INSERT_BEFORE_CURRENT(stage, entry);
+			stage = NULL;
+			break;
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	if (stage) {
+		AST_LIST_INSERT_TAIL(&pipeline->stages, stage, entry);
+	}
+	ast_audiohook_unlock(&pipeline->audiohook);
+
+	ast_module_ref(type->module);
+	ast_atomic_fetch_add(&type->channels, 1, __ATOMIC_RELAXED);
+
+	if (datastore) {
+		datastore->data = pipeline;
+		ast_channel_datastore_add(chan, datastore);
+		ast_audiohook_attach(chan, &pipeline->audiohook);
+	}
+	ast_channel_unlock(chan);
+
+	ast_debug(1, "Added %s stage to DSP pipeline on %s\n", type->name, ast_channel_name(chan));
+	return 0;
+}
+
+void *ast_dsp_pipeline_find(struct ast_channel *chan, struct ast_dsp_stage_type *type)
+{
+	struct dsp_pipeline *pipeline;
+	struct dsp_stage *stage = NULL;
+
+	ast_channel_lock(chan);
+	pipeline = pipeline_get(chan);
+	if (pipeline) {
+		stage = stage_get(pipeline, type);
+	}
+	ast_channel_unlock(chan);
+
+	return stage ? stage->data : NULL;
+}
+
+int ast_dsp_pipeline_remove(struct ast_channel *chan, struct ast_dsp_stage_type *type)
+{
+	struct ast_datastore *datastore;
+	struct dsp_pipeline *pipeline;
+	struct dsp_stage *stage;
+	int empty;
+
+	ast_channel_lock(chan);
+	datastore = ast_channel_datastore_find(chan, &pipeline_datastore, NULL);
+	if (!datastore) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+	pipeline = datastore->data;
+	stage = stage_get(pipeline, type);
+	if (!stage) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+
+	/* Once it's unlinked with the audiohook locked, the stage can't be in use */
+	ast_audiohook_lock(&pipeline->audiohook);
+	AST_LIST_REMOVE(&pipeline->stages, stage, entry);
+	empty = AST_LIST_EMPTY(&pipeline->stages);
+	ast_audiohook_unlock(&pipeline->audiohook);
+
+	if (empty) {
+		/* Nothing left to do, so don't make the channel keep calling us */
+		if (ast_audiohook_remove(chan, &pipeline->audiohook)) {
+			ast_log(LOG_WARNING, "Failed to remove DSP pipeline audiohook from channel %s\n", ast_channel_name(chan));
+		} else if (ast_channel_datastore_remove(chan, datastore)) {
+			ast_log(LOG_WARNING, "Failed to remove DSP pipeline datastore from channel %s\n", ast_channel_name(chan));
+		} else {
+			ast_datastore_free(datastore);
+		}
+	}
+	ast_channel_unlock(chan);
+
+	ast_debug(1, "Removed %s stage from DSP pipeline on %s\n", type->name, ast_channel_name(chan));
+	stage_destroy(stage);
+	return 0;
+}
+
+static char *handle_show_stages(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ast_dsp_stage_type *type;
+
+	switch(cmd) {
+	case CLI_INIT:
+		e->command = "dsp show stages";
+		e->usage =
+			"Usage: dsp show stages\n"
+			"       Show registered DSP pipeline stages and the CPU time spent in them.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "%-20s %8s %8s %12s %12s %10s\n", "Stage", "Priority", "Channels", "Frames", "CPU (ms)", "ns/frame");
+	AST_RWLIST_RDLOCK(&stage_types);
+	AST_RWLIST_TRAVERSE(&stage_types, type, entry) {
+		unsigned long frames = type->frames, nsec = type->nsec;
+		ast_cli(a->fd, "%-20s %8d %8u %12lu %12lu %10lu\n", type->name, type->priority, type->channels,
+			frames, nsec / 1000000, frames ? nsec / frames : 0);
+	}
+	AST_RWLIST_UNLOCK(&stage_types);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_show_channel(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ast_channel *chan;
+	struct dsp_pipeline *pipeline;
+	struct dsp_stage *stage;
+	int i = 0;
+
+	switch(cmd) {
+	case CLI_INIT:
+		e->command = "dsp show channel";
+		e->usage =
+			"Usage: dsp show channel <channel>\n"
+			"       Show the DSP pipeline stages on a channel, in the order they run.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return ast_complete_channels(a->line, a->word, a->pos, a->n, 3);
+	}
+
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	chan = ast_channel_get_by_name(a->argv[3]);
+	if (!chan) {
+		ast_cli(a->fd, "No such channel: %s\n", a->argv[3]);
+		return CLI_FAILURE;
+	}
+
+	ast_channel_lock(chan);
+	pipeline = pipeline_get(chan);
+	if (!pipeline) {
+		ast_cli(a->fd, "Channel %s has no DSP pipeline\n", ast_channel_name(chan));
+	} else {
+		AST_LIST_TRAVERSE(&pipeline->stages, stage, entry) {
+			ast_cli(a->fd, "%2d. %s (priority %d)\n", ++i, stage->type->name, stage->type->priority);
+		}
+	}
+	ast_channel_unlock(chan);
+	ast_channel_unref(chan);
+
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry dsp_pipeline_cli[] = {
+	AST_CLI_DEFINE(handle_show_stages, "Show DSP pipeline stages"),
+	AST_CLI_DEFINE(handle_show_channel, "Show the DSP pipeline on a channel"),
+};
+
+static int unload_module(void)
+{
+	ast_cli_unregister_multiple(dsp_pipeline_cli, ARRAY_LEN(dsp_pipeline_cli));
+	return 0;
+}
+
+static int load_module(void)
+{
+	if (ast_cli_register_multiple(dsp_pipeline_cli, ARRAY_LEN(dsp_pipeline_cli))) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_GLOBAL_SYMBOLS | AST_MODFLAG_LOAD_ORDER, "In-band DSP Pipeline",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.load_pri = AST_MODPRI_APP_DEPEND,
+);
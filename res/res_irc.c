@@ -35,8 +35,6 @@
 
 #include "asterisk.h"
 
-#include <signal.h> /* use pthread_kill */
-
 #include "asterisk/lock.h"
 #include "asterisk/channel.h"
 #include "asterisk/pbx.h"
@@ -47,6 +45,7 @@
 #include "asterisk/app.h"
 #include "asterisk/utils.h"
 #include "asterisk/acl.h"
+#include "asterisk/alertpipe.h"
 
 #ifdef HAVE_OPENSSL
 #include <openssl/bio.h>
@@ -60,13 +59,32 @@
 			Sends a message to an IRC channel
 		</synopsis>
 		<syntax>
-			<parameter name="channel" required="true">
-				<para>Should start with # for IRC channels.</para>
+			<parameter name="channel" required="true" argsep="@">
+				<argument name="channel" required="true">
+					<para>Should start with # for IRC channels.</para>
+				</argument>
+				<argument name="server">
+					<para>Name of the server to use, as configured in <literal>irc.conf</literal>.</para>
+					<para>Defaults to the server configured in the <literal>general</literal> section,
+					or the first server configured if there isn't one.</para>
+				</argument>
 			</parameter>
 			<parameter name="message" required="true" />
 		</syntax>
 		<description>
 			<para>Sends a message to an IRC channel.</para>
+			<para>The message is queued and sent by the IRC client in the background,
+			subject to flood control, so this returns without waiting for the IRC server.</para>
+			<variablelist>
+				<variable name="IRCSENDSTATUS">
+					<value name="QUEUED">
+						The message was queued to be sent.
+					</value>
+					<value name="FAILURE">
+						The message could not be queued, e.g. if the client is not connected.
+					</value>
+				</variable>
+			</variablelist>
 		</description>
 	</application>
 	<manager name="IRCSendMessage" language="en_US">
@@ -81,9 +99,13 @@
 			<parameter name="Message" required="true">
 				<para>The message to be sent.</para>
 			</parameter>
+			<parameter name="Server">
+				<para>Name of the server to use. Defaults to the default server.</para>
+			</parameter>
 		</syntax>
 		<description>
 			<para>This action sends a message to an IRC channel using the built-in IRC client.</para>
+			<para>The message is queued, and a successful response means it was queued, not that it was delivered.</para>
 			<para>If the IRC client is not already present in the specified channel, the action will silently fail.</para>
 		</description>
 	</manager>
@@ -91,6 +113,13 @@
 
 #define IRC_DEFAULT_PORT 6667
 #define IRC_BUFFER_SIZE 512
+#define IRC_SEND_BUFFER_SIZE 4096
+#define IRC_MAX_QUEUED 1000
+#define IRC_DEFAULT_SEND_BURST 5
+#define IRC_DEFAULT_SEND_INTERVAL 2000
+#define IRC_DEFAULT_SERVER "default"
+#define IRC_SEND_TIMEOUT 10 /* Seconds a write may block before we give up on the connection */
+#define IRC_CONNECT_TIMEOUT 15000 /* ms to wait for a connection to be established, including any TLS handshake */
 #define CONFIG_FILE "irc.conf"
 
 /* Helpful sources:
@@ -101,15 +130,13 @@
 
 const char *send_msg_app = "IRCSendMessage";
 
-int irc_socket = -1;
-static pthread_t irc_thread;
-static int authenticated;
-ast_mutex_t irc_lock;
-
-#ifdef HAVE_OPENSSL
-SSL*     ssl = NULL;
-SSL_CTX* ctx = NULL;
-#endif
+/*! \brief An outgoing IRC message, already terminated with CR LF */
+struct irc_outmsg {
+	struct irc_outmsg *next;
+	struct timeval queued;
+	size_t len;
+	char data[0];
+};
 
 struct irc_server {
 	char *hostname;
@@ -121,23 +148,89 @@ struct irc_server {
 	unsigned int tlsverify:1;
 	unsigned int sasl:1;
 	unsigned int events:1;
-#if 0
-	/*! \note Not currently used, but in the future if this were part of a linked list, it could be */
-	AST_LIST_ENTRY(irc_server) entry;	/*!< Next record */
+	unsigned int sendburst;		/* Messages that can be sent at once before flood control applies */
+	unsigned int sendinterval;	/* ms per message under flood control, 0 to disable */
+
+	/* Connection */
+	int socket;
+	pthread_t thread;
+	int stop;					/* Set to tell the server's thread to exit */
+	int running;				/* Thread is connecting or connected. Cleared by the thread itself as it exits. */
+	unsigned int authenticated:1;
+	ast_mutex_t lock;			/* Serializes writes to the connection */
+#ifdef HAVE_OPENSSL
+	SSL *ssl;
+	SSL_CTX *ctx;
 #endif
-};
 
-/*! \todo allow multiple servers using linked list instead of just one global server (above) */
+	/*
+	 * Outgoing messages are queued by any thread, and written out by the server's own thread,
+	 * so a slow server only delays its own messages.
+	 * The queue is an intrusive multi-producer, single-consumer list:
+	 * producers atomically swap themselves in as the tail and then link the previous tail to themselves,
+	 * and only the server's thread ever touches the head. The stub node keeps the list from ever being empty.
+	 */
+	struct irc_outmsg outq_stub;
+	struct irc_outmsg *outq_head;		/* Server thread only */
+	struct irc_outmsg *outq_tail;		/* Producers */
+	struct irc_outmsg *outq_pending;	/* Dequeued, waiting for flood control (server thread only) */
+	int outq_count;
+	int outq_signaled;
+	int outq_alert_pipe[2];
+
+	/* Flood control (server thread only) */
+	int flood_credit;				/* ms worth of messages that may be sent right now */
+	struct timeval flood_last;
+
+	/* Statistics */
+	struct timeval connected;
+	int msgs_queued;
+	int msgs_dropped;
+	unsigned int msgs_sent;			/* Written by server thread only */
+	unsigned int msgs_received;		/* Written by server thread only */
+	unsigned int writes;			/* Protected by lock */
+	uint64_t bytes_sent;			/* Protected by lock */
+	uint64_t bytes_received;		/* Written by server thread only */
+	uint64_t latency_total;			/* Time from queuing to sending, in ms, for all messages sent */
+	unsigned int latency_max;
+
+	AST_RWLIST_ENTRY(irc_server) entry;
+	char name[0];
+};
 
-struct irc_server *ircserver; /* THE IRC server */
+static AST_RWLIST_HEAD_STATIC(servers, irc_server);
 
 #define free_if(prop) if (prop) ast_free(prop);
 #define update_value(irc, prop, val) free_if(irc->prop); irc->prop = ast_strdup(val);
 #define contains_space(str) (strchr(str, ' '))
 #define irc_debug(...) ast_debug(__VA_ARGS__)
 
+static struct irc_server *alloc_server(const char *name)
+{
+	struct irc_server *server = ast_calloc(1, sizeof(*server) + strlen(name) + 1);
+
+	if (!server) {
+		return NULL;
+	}
+	strcpy(server->name, name); /* Safe */
+	if (ast_alertpipe_init(server->outq_alert_pipe)) {
+		ast_free(server);
+		return NULL;
+	}
+	server->socket = -1;
+	server->thread = AST_PTHREADT_NULL;
+	server->outq_head = server->outq_tail = &server->outq_stub;
+	ast_mutex_init(&server->lock);
+	return server;
+}
+
+static void outq_purge(struct irc_server *server);
+
 static void free_server(struct irc_server *server)
 {
+	outq_purge(server); /* Server thread is gone, so we're the consumer now */
+	ast_alertpipe_close(server->outq_alert_pipe);
+	ast_mutex_destroy(&server->lock);
 	free_if(server->hostname);
 	free_if(server->username);
 	free_if(server->password);
@@ -145,111 +238,311 @@ static void free_server(struct irc_server *server)
 	ast_free(server);
 }
 
+/*!
+ * \brief Find a server by name
+ * \note If no name is given, this is the default server if there is one, or the first one configured otherwise
+ * \note Must be called with servers locked
+ */
+static struct irc_server *find_server(const char *name)
+{
+	struct irc_server *server;
+
+	AST_RWLIST_TRAVERSE(&servers, server, entry) {
+		if (!strcasecmp(server->name, S_OR(name, IRC_DEFAULT_SERVER))) {
+			return server;
+		}
+	}
+	return ast_strlen_zero(name) ? AST_RWLIST_FIRST(&servers) : NULL;
+}
+
 #ifdef HAVE_OPENSSL
-static void free_ssl_and_ctx(void)
+static void free_ssl_and_ctx(struct irc_server *server)
 {
-	SSL_CTX_free(ctx);
-	SSL_free(ssl);
-	ctx = NULL;
-	ssl = NULL;
+	SSL_CTX_free(server->ctx);
+	SSL_free(server->ssl);
+	server->ctx = NULL;
+	server->ssl = NULL;
 }
 #endif
 
-static void irc_cleanup(void)
+static void irc_cleanup(struct irc_server *server)
 {
-	close(irc_socket);
-	irc_socket = -1;
+	ast_mutex_lock(&server->lock);
+	close(server->socket);
+	server->socket = -1;
 #ifdef HAVE_OPENSSL
-	if (ssl) {
-		SSL_shutdown(ssl);
-		SSL_free(ssl);
-		ssl = NULL;
+	if (server->ssl) {
+		SSL_shutdown(server->ssl);
+		SSL_free(server->ssl);
+		server->ssl = NULL;
 	}
-	if (ctx) {
-		SSL_CTX_free(ctx);
-		ctx = NULL;
+	if (server->ctx) {
+		SSL_CTX_free(server->ctx);
+		server->ctx = NULL;
 	}
 #endif
+	ast_mutex_unlock(&server->lock);
 }
 
-static int irc_disconnect(void)
+static int irc_disconnect(struct irc_server *server)
 {
-	if (irc_socket < 0) {
+	if (server->thread == AST_PTHREADT_NULL) {
 		return -1;
 	}
-	pthread_cancel(irc_thread);
-	pthread_kill(irc_thread, SIGURG);
-	pthread_join(irc_thread, NULL);
-	if (irc_socket >= 0) {
-		irc_debug(1, "Since we killed the IRC connection, manually cleaning up\n");
-		irc_cleanup();
-	}
+	/* Ask the thread to exit, rather than cancelling it, since it may be in the middle of a write, holding the lock.
+	 * Writes can't block indefinitely, so it will notice soon enough, and clean up after itself. */
+	__atomic_store_n(&server->stop, 1, __ATOMIC_RELEASE);
+	ast_alertpipe_write(server->outq_alert_pipe);
+	pthread_join(server->thread, NULL);
+	server->thread = AST_PTHREADT_NULL;
+	server->stop = 0;
 	return 0;
 }
 
-static int __attribute__ ((format (gnu_printf, 1, 2))) irc_send(const char *fmt, ...)
+static void outq_push(struct irc_server *server, struct irc_outmsg *msg)
 {
-	int res = 0, bytes = 0;
-	char *buf = NULL, *fullbuf = NULL;
-	int len = 0;
-	va_list ap;
+	struct irc_outmsg *prev;
 
-	if (irc_socket < 0) {
-		ast_log(LOG_WARNING, "No established IRC connection\n");
-		return -1;
+	__atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&server->outq_tail, msg, __ATOMIC_ACQ_REL);
+	/* Between the exchange and this store, the consumer sees the list end at prev, and just tries again later */
+	__atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+/*! \note Must only be called from the server's thread (or once it's gone) */
+static struct irc_outmsg *outq_pop(struct irc_server *server)
+{
+	struct irc_outmsg *head = server->outq_head;
+	struct irc_outmsg *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+	if (head == &server->outq_stub) {
+		if (!next) {
+			return NULL; /* Empty */
+		}
+		server->outq_head = head = next;
+		next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
 	}
+	if (next) {
+		server->outq_head = next;
+		ast_atomic_fetchadd_int(&server->outq_count, -1);
+		return head;
+	}
+	if (head != __atomic_load_n(&server->outq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL; /* A producer is in the middle of adding a message, we'll get it on the next wakeup */
+	}
+	/* head is the last message, put the stub back behind it so it can be removed */
+	outq_push(server, &server->outq_stub);
+	next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		server->outq_head = next;
+		ast_atomic_fetchadd_int(&server->outq_count, -1);
+		return head;
+	}
+	return NULL;
+}
 
-	/* Action Name and ID */
-	va_start(ap, fmt);
-	len = ast_vasprintf(&buf, fmt, ap);
-	va_end(ap);
+/*! \note Must only be called from the server's thread (or once it's gone) */
+static void outq_purge(struct irc_server *server)
+{
+	struct irc_outmsg *msg;
 
-	if (len < 0 || !buf) {
-		ast_log(LOG_WARNING, "Failed to write dynamic buffer\n");
-		return -1;
+	if (server->outq_pending) {
+		ast_free(server->outq_pending);
+		server->outq_pending = NULL;
 	}
+	while ((msg = outq_pop(server))) {
+		ast_free(msg);
+	}
+}
 
-	ast_mutex_lock(&irc_lock); /* Acquire lock before sending. No other thread can send */
+static struct irc_outmsg *irc_format(const char *fmt, va_list ap)
+{
+	struct irc_outmsg *msg;
+	va_list aq;
+	int len;
+
+	va_copy(aq, ap);
+	len = vsnprintf(NULL, 0, fmt, aq);
+	va_end(aq);
+	if (len < 0) {
+		ast_log(LOG_WARNING, "Failed to format message\n");
+		return NULL;
+	}
 
-	if (len > 2 && strncmp(buf + len - 2, "\r\n", 2)) {
+	msg = ast_malloc(sizeof(*msg) + len + 3); /* Enough space for \r\n at the end */
+	if (!msg) {
+		return NULL;
+	}
+	vsnprintf(msg->data, len + 1, fmt, ap);
+	if (len < 2 || strcmp(msg->data + len - 2, "\r\n")) {
 		/* No CR LF at the end. Add it now. */
-		fullbuf = ast_malloc(len + 3); /* Enough space for \r\n at the end */
-		if (!fullbuf) {
-			ast_log(LOG_WARNING, "Memory allocation failed\n");
-			goto cleanup;
-		}
-		strcpy(fullbuf, buf); /* Safe */
-		strcpy(fullbuf + len, "\r\n"); /* Safe */
+		strcpy(msg->data + len, "\r\n"); /* Safe */
 		len += 2;
-		*(fullbuf + len) = '\0'; /* Null terminate, for printf-style debugging */
 	}
+	msg->len = len;
+	return msg;
+}
+
+static int irc_write(struct irc_server *server, const char *buf, size_t len)
+{
+	int bytes;
 
-	irc_debug(3, "IRC=>%s", fullbuf ? fullbuf : buf); /* Message already ends with CR LF, don't add another new line */
+	ast_mutex_lock(&server->lock); /* Acquire lock before sending. No other thread can send */
+	if (server->socket < 0) {
+		ast_mutex_unlock(&server->lock);
+		return -1;
+	}
+	irc_debug(3, "IRC(%s)=>%.*s", server->name, (int) len, buf); /* Messages already end with CR LF, don't add another new line */
 #ifdef HAVE_OPENSSL
-	if (ircserver->tls) {
-		bytes = SSL_write(ssl, fullbuf ? fullbuf : buf, len);
+	if (server->tls) {
+		bytes = SSL_write(server->ssl, buf, len);
 	} else
 #endif
 	{
-		bytes = write(irc_socket, fullbuf ? fullbuf : buf, len);
+		bytes = write(server->socket, buf, len);
+	}
+	if (bytes > 0) {
+		server->writes++;
+		server->bytes_sent += bytes;
 	}
+	ast_mutex_unlock(&server->lock);
 
 	if (bytes < 1) {
-		ast_log(LOG_WARNING, "Failed to write to socket\n");
-		res = -1;
+		ast_log(LOG_WARNING, "Failed to write to socket for IRC server %s\n", server->name);
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * \brief Queue a message to an IRC server. Returns as soon as it's queued, without waiting for it to be sent.
+ * \retval 0 if queued, -1 on failure
+ */
+static int __attribute__ ((format (gnu_printf, 2, 3))) irc_send(struct irc_server *server, const char *fmt, ...)
+{
+	struct irc_outmsg *msg;
+	va_list ap;
+
+	if (server->socket < 0) {
+		ast_log(LOG_WARNING, "No established connection to IRC server %s\n", server->name);
+		return -1;
+	}
+	if (ast_atomic_fetchadd_int(&server->outq_count, +1) >= IRC_MAX_QUEUED) {
+		ast_atomic_fetchadd_int(&server->outq_count, -1);
+		ast_atomic_fetchadd_int(&server->msgs_dropped, +1);
+		ast_log(LOG_WARNING, "Send queue for IRC server %s is full, dropping message\n", server->name);
+		return -1;
+	}
+
+	va_start(ap, fmt);
+	msg = irc_format(fmt, ap);
+	va_end(ap);
+
+	if (!msg) {
+		ast_atomic_fetchadd_int(&server->outq_count, -1);
+		return -1;
 	}
-	if (fullbuf) {
-		ast_free(fullbuf);
+
+	msg->queued = ast_tvnow();
+	outq_push(server, msg);
+	ast_atomic_fetchadd_int(&server->msgs_queued, +1);
+	/* Only wake up the server's thread if it hasn't been woken up since it last drained the queue */
+	if (!__atomic_exchange_n(&server->outq_signaled, 1, __ATOMIC_ACQ_REL)) {
+		ast_alertpipe_write(server->outq_alert_pipe);
+	}
+	return 0;
+}
+
+/*! \brief Send a message immediately, ahead of anything queued and regardless of flood control */
+static int __attribute__ ((format (gnu_printf, 2, 3))) irc_send_now(struct irc_server *server, const char *fmt, ...)
+{
+	struct irc_outmsg *msg;
+	va_list ap;
+	int res;
+
+	if (server->socket < 0) {
+		ast_log(LOG_WARNING, "No established connection to IRC server %s\n", server->name);
+		return -1;
 	}
 
-cleanup:
-	ast_mutex_unlock(&irc_lock);
-	ast_free(buf);
+	va_start(ap, fmt);
+	msg = irc_format(fmt, ap);
+	va_end(ap);
 
+	if (!msg) {
+		return -1;
+	}
+	res = irc_write(server, msg->data, msg->len);
+	ast_free(msg);
 	return res;
 }
 
-static int irc_authenticate(const char *username, const char *password, const char *realname)
+/*! \brief Account for a queued message that has been written */
+static void irc_sent(struct irc_server *server, struct irc_outmsg *msg, struct timeval now)
+{
+	int64_t latency = ast_tvdiff_ms(now, msg->queued);
+
+	server->msgs_sent++;
+	server->latency_total += latency;
+	if (latency > server->latency_max) {
+		server->latency_max = latency;
+	}
+}
+
+/*!
+ * \brief Write out as many queued messages as flood control allows, several per write
+ * \return Number of ms until more messages can be sent, -1 if nothing is waiting
+ * \note Must only be called from the server's thread
+ */
+static int irc_flush(struct irc_server *server)
+{
+	char buf[IRC_SEND_BUFFER_SIZE];
+	struct irc_outmsg *msg = server->outq_pending;
+	int interval = server->sendinterval;
+	struct timeval now = ast_tvnow();
+	size_t used;
+
+	if (interval) {
+		/* Token bucket: credit accrues in real time, up to a burst's worth, and each message costs one interval */
+		int64_t elapsed = ast_tvdiff_ms(now, server->flood_last);
+		server->flood_last = now;
+		server->flood_credit = MIN((int64_t) server->flood_credit + elapsed, (int64_t) server->sendburst * interval);
+	}
+
+	do {
+		used = 0;
+		while (!interval || server->flood_credit >= interval) {
+			if (!msg && !(msg = outq_pop(server))) {
+				break;
+			}
+			if (msg->len > sizeof(buf) - used) {
+				if (used) {
+					break; /* Send what we have first */
+				}
+				/* Too big to coalesce with anything, send it by itself */
+				irc_write(server, msg->data, msg->len);
+			} else {
+				memcpy(buf + used, msg->data, msg->len);
+				used += msg->len;
+			}
+			irc_sent(server, msg, now);
+			ast_free(msg);
+			msg = NULL;
+			server->flood_credit -= interval;
+		}
+		if (used) {
+			irc_write(server, buf, used);
+		}
+	} while (used && msg); /* Buffer filled up before flood control kicked in */
+
+	if (!msg) {
+		msg = outq_pop(server); /* Is anything still waiting? */
+	}
+	server->outq_pending = msg;
+	return msg ? interval - server->flood_credit : -1;
+}
+
+static int irc_authenticate(struct irc_server *server, const char *username, const char *password, const char *realname)
 {
 	int res = 0;
 
@@ -260,16 +553,16 @@ static int irc_authenticate(const char *username, const char *password, const ch
 
 	/* PASS must be sent before both USER and JOIN, if it exists */
 	if (!ast_strlen_zero(password)) {
-		res |= irc_send("PASS %s", password); /* Password, if applicable (not actually used all that much) */
+		res |= irc_send(server, "PASS %s", password); /* Password, if applicable (not actually used all that much) */
 	}
 
 	/* Confused about the difference between the two? See https://stackoverflow.com/questions/31666247/ */
-	res |= irc_send("NICK %s", username); /* Actual IRC nickname */
-	res |= irc_send("USER %s 0 * :%s", username, S_OR(realname, username)); /* User part of hostmask, mode, unused, real name for WHOIS */
+	res |= irc_send(server, "NICK %s", username); /* Actual IRC nickname */
+	res |= irc_send(server, "USER %s 0 * :%s", username, S_OR(realname, username)); /* User part of hostmask, mode, unused, real name for WHOIS */
 	return 0;
 }
 
-static int irc_nickserv_login(const char *username, const char *password)
+static int irc_nickserv_login(struct irc_server *server, const char *username, const char *password)
 {
 	int res = 0;
 
@@ -283,53 +576,53 @@ static int irc_nickserv_login(const char *username, const char *password)
 	}
 
 	/* Confused about the difference between the two? See https://stackoverflow.com/questions/31666247/ */
-	res |= irc_send("PRIVMSG NickServ :IDENTIFY %s %s", username, password); /* Actual IRC nickname */
+	res |= irc_send(server, "PRIVMSG NickServ :IDENTIFY %s %s", username, password); /* Actual IRC nickname */
 	return 0;
 }
 
 /*! \brief # is not automatic, channels should include leading # or & */
-static int irc_channel_join(const char *channel)
+static int irc_channel_join(struct irc_server *server, const char *channel)
 {
 	int res;
 	if (ast_strlen_zero(channel)) {
 		ast_log(LOG_WARNING, "Empty channel name\n");
 		return -1;
 	}
-	res = irc_send("JOIN %s", channel);
+	res = irc_send(server, "JOIN %s", channel);
 	if (!res) {
-		ast_verb(4, "Joined IRC channel %s\n", channel);
+		ast_verb(4, "Joined IRC channel %s on %s\n", channel, server->name);
 	}
 	return res;
 }
 
-static int irc_autojoin(void)
+static int irc_autojoin(struct irc_server *server)
 {
-	if (ircserver->autojoin) {
-		char *channel, *channels = ast_strdupa(ircserver->autojoin);
+	if (server->autojoin) {
+		char *channel, *channels = ast_strdupa(server->autojoin);
 		while ((channel = strsep(&channels, ","))) {
-			irc_channel_join(channel);
+			irc_channel_join(server, channel);
 		}
 	}
 	return 0;
 }
 
-static void logged_in_callback(void)
+static void logged_in_callback(struct irc_server *server)
 {
-	if (!authenticated) {
-		ast_verb(3, "IRC client now authenticated to IRC server\n");
-		authenticated = 1;
-		irc_autojoin();
+	if (!server->authenticated) {
+		ast_verb(3, "IRC client now authenticated to IRC server %s\n", server->name);
+		server->authenticated = 1;
+		irc_autojoin(server);
 	}
 }
 
-static int irc_incoming(char *raw)
+static int irc_incoming(struct irc_server *server, char *raw)
 {
 	char *from, *action, *tmp;
 
-	irc_debug(3, "IRC<=%s\n", raw);
+	irc_debug(3, "IRC(%s)<=%s\n", server->name, raw);
 
 	if (!strncmp(raw, "PING :", 6)) { /* Ping? Pong! */
-		irc_send("PONG :Ping pong!!");
+		irc_send_now(server, "PONG :Ping pong!!"); /* Don't let flood control hold this up, or the server will think we're gone */
 		return 0;
 	}
 
@@ -365,7 +658,7 @@ static int irc_incoming(char *raw)
 		}
 		irc_debug(1, "Message from %s: %s\n", from, tmp);
 
-		if (!strcasecmp(from, ircserver->username)) {
+		if (!strcasecmp(from, server->username)) {
 			ast_log(LOG_WARNING, "Copycat! Got message from myself to myself?\n");
 		}
 
@@ -376,12 +669,15 @@ static int irc_incoming(char *raw)
 			*tmp++ = '\0';
 		}
 
-		if (ircserver->events) { /* Only raise an event if this flag is enabled */
+		if (server->events) { /* Only raise an event if this flag is enabled */
 			/*** DOCUMENTATION
 				<managerEvent language="en_US" name="IRCMessage">
 					<managerEventInstance class="EVENT_FLAG_USER">
 						<synopsis>Raised when a message is sent in an IRC channel.</synopsis>
 						<syntax>
+							<parameter name="Server">
+								<para>Name of the IRC server the message was received from.</para>
+							</parameter>
 							<parameter name="Channel">
 								<para>IRC channel name (or user, for private messages).</para>
 							</parameter>
@@ -400,9 +696,11 @@ static int irc_incoming(char *raw)
 				</managerEvent>
 			***/
 			manager_event(EVENT_FLAG_USER, "IRCMessage",
+				"Server: %s\r\n"
 				"Channel: %s\r\n"
 				"User: %s\r\n"
 				"Message: %s\r\n",
+				server->name,
 				to,
 				from,
 				tmp);
@@ -422,7 +720,7 @@ static int irc_incoming(char *raw)
 		irc_debug(1, "Notice from %s: %s\n", from, tmp);
 		if (strstr(tmp, "now identified")) {
 			/* No IRC numeric for successful login if not using SASL */
-			logged_in_callback();
+			logged_in_callback(server);
 		}
 	} else if (!strcasecmp(action, "MODE")) {
 		/* MODE: Don't care */
@@ -438,13 +736,13 @@ static int irc_incoming(char *raw)
 			ast_log(LOG_WARNING, "%s\n", tmp); /* Failed to send message to channel (probably not in it) */
 			break;
 		case 900: /* Successful log in */
-			logged_in_callback();
+			logged_in_callback(server);
 			break;
 		case 903: /* Successful SASL log in */
-			ast_verb(4, "IRC SASL authentication successful\n");
+			ast_verb(4, "IRC SASL authentication to %s successful\n", server->name);
 			break;
 		case 904: /* SASL login error */
-			ast_log(LOG_WARNING, "SASL authentication failed\n");
+			ast_log(LOG_WARNING, "SASL authentication to %s failed\n", server->name);
 			break;
 		case 0:
 			/* XXX currently lots of unhandled stuff here */
@@ -459,7 +757,7 @@ static int irc_incoming(char *raw)
 	return 0;
 }
 
-static void *irc_loop(void *vargp)
+static void irc_loop(struct irc_server *server)
 {
 	int res;
 	char inbuf[IRC_BUFFER_SIZE];
@@ -467,42 +765,52 @@ static void *irc_loop(void *vargp)
 	char *readinbuf;
 	char *message, *messages;
 
-	if (irc_socket < 0) {
-		return NULL;
+	if (server->socket < 0) {
+		return;
 	}
 
-	fds[0].fd = irc_socket;
+	fds[0].fd = server->socket;
 	fds[0].events = POLLIN;
+	fds[1].fd = server->outq_alert_pipe[0];
+	fds[1].events = POLLIN;
 	readinbuf = inbuf;
 
+	/* Anything left over from a previous connection isn't meant for this one */
+	outq_purge(server);
+	__atomic_store_n(&server->outq_signaled, 0, __ATOMIC_RELEASE);
+	server->flood_credit = server->sendburst * server->sendinterval;
+	server->flood_last = ast_tvnow();
+
 	/* Kind of simple, but just blindly send all the setup info at once, without really having a 2-way conversation with the server. */
-	authenticated = 0;
+	server->authenticated = 0;
 
-	if (ircserver->sasl) {
-		irc_send("CAP LS 302");
+	if (server->sasl) {
+		irc_send(server, "CAP LS 302");
 	}
-	if (irc_authenticate(ircserver->username, NULL, NULL)) {
-		ast_log(LOG_WARNING, "Failed to authenticate... IRC client now suspending\n");
-		return NULL;
+	if (irc_authenticate(server, server->username, NULL, NULL)) {
+		ast_log(LOG_WARNING, "Failed to authenticate to %s... IRC client now suspending\n", server->name);
+		irc_cleanup(server);
+		return;
 	}
-	if (ircserver->sasl) {
+	if (server->sasl) {
 		int len;
 		char base64encoded[401];
 		char base64decoded[256];
-		irc_send("CAP REQ :multi-prefix sasl");
+		irc_send(server, "CAP REQ :multi-prefix sasl");
 		/* Plain SASL: https://www.rfc-editor.org/rfc/rfc4616.html */
 		/* Base64 encode authentication identity, authorization identity, password (nick, name, password, separated by NUL) */
-		len = snprintf(base64decoded, sizeof(base64decoded), "%s%c%s%c%s", ircserver->username, '\0', ircserver->username, '\0', ircserver->password);
+		len = snprintf(base64decoded, sizeof(base64decoded), "%s%c%s%c%s", server->username, '\0', server->username, '\0', server->password);
 		ast_base64encode(base64encoded, (unsigned char *) base64decoded, len, sizeof(base64encoded));
-		irc_send("AUTHENTICATE PLAIN");
+		irc_send(server, "AUTHENTICATE PLAIN");
 		/* Expect: AUTHENTICATE + */
-		irc_send("AUTHENTICATE %s", base64encoded);
-		irc_send("CAP END");
-	}
-	if (ircserver->password) { /* Authenticate to NickServ if we have a password */
-		if (irc_nickserv_login(ircserver->username, ircserver->password)) {
-			ast_log(LOG_WARNING, "Failed to authenticate... IRC client now suspending\n");
-			return NULL;
+		irc_send(server, "AUTHENTICATE %s", base64encoded);
+		irc_send(server, "CAP END");
+	}
+	if (server->password) { /* Authenticate to NickServ if we have a password */
+		if (irc_nickserv_login(server, server->username, server->password)) {
+			ast_log(LOG_WARNING, "Failed to authenticate to %s... IRC client now suspending\n", server->name);
+			irc_cleanup(server);
+			return;
 		}
 	} else {
 		/* If we're authenticating, wait for a successful login.
@@ -510,12 +818,12 @@ static void *irc_loop(void *vargp)
 		 * until we're fully logged in. This ensures that if we have a cloak,
 		 * it gets applied, so we don't leak our IP address.
 		 */
-		irc_autojoin();
+		irc_autojoin(server);
 	}
 
 	for (;;) {
-		res = ast_poll(fds, 1, -1);
-		pthread_testcancel();
+		int timeout = irc_flush(server);
+		res = ast_poll(fds, 2, timeout);
 		if (res < 0) {
 			if (errno == EINTR) {
 				continue;
@@ -523,20 +831,29 @@ static void *irc_loop(void *vargp)
 			ast_log(LOG_WARNING, "poll returned error: %s\n", strerror(errno));
 			break;
 		}
+		/* Messages queued? */
+		if (fds[1].revents) {
+			ast_alertpipe_read(server->outq_alert_pipe);
+			__atomic_store_n(&server->outq_signaled, 0, __ATOMIC_RELEASE); /* Next message queued will wake us up again */
+		}
+		if (__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE)) {
+			break; /* irc_disconnect wants us gone */
+		}
 		/* Data from IRC server? */
 		if (fds[0].revents) {
 #ifdef HAVE_OPENSSL
-			if (ircserver->tls) {
-				res = SSL_read(ssl, readinbuf, IRC_BUFFER_SIZE - 2 - (readinbuf - inbuf));
+			if (server->tls) {
+				res = SSL_read(server->ssl, readinbuf, IRC_BUFFER_SIZE - 2 - (readinbuf - inbuf));
 			} else
 #endif
 			{
-				res = recv(irc_socket, readinbuf, IRC_BUFFER_SIZE - 2 - (readinbuf - inbuf), 0);
+				res = recv(server->socket, readinbuf, IRC_BUFFER_SIZE - 2 - (readinbuf - inbuf), 0);
 			}
 			if (res < 1) {
-				ast_log(LOG_WARNING, "Socket read returned %d\n", res);
+				ast_log(LOG_WARNING, "Socket read from %s returned %d\n", server->name, res);
 				break;
 			}
+			server->bytes_received += res;
 			*(readinbuf + res) = '\0';
 			*(readinbuf + res + 1) = '\0';
 			readinbuf = inbuf; /* Reset pointer to beginning before we dup */
@@ -560,29 +877,93 @@ static void *irc_loop(void *vargp)
 					end = readinbuf + IRC_BUFFER_SIZE - 1;
 				}
 				*end = '\0'; /* Don't pass CR to message processor, just the message itself */
-				irc_incoming(message); /* Got a complete message. */
+				server->msgs_received++;
+				irc_incoming(server, message); /* Got a complete message. */
 			}
 		}
 	}
 
-	irc_debug(1, "IRC connection terminated\n");
+	irc_debug(1, "IRC connection to %s terminated\n", server->name);
 
-	irc_cleanup();
-	return NULL;
+	irc_cleanup(server);
+}
+
+/*!
+ * \brief Wait for a non-blocking socket to become ready while connecting
+ * \param server
+ * \param fd
+ * \param events POLLIN or POLLOUT
+ * \param start When we started connecting
+ * \retval 0 if ready, -1 if it failed, timed out, or we were told to stop
+ */
+static int irc_connect_wait(struct irc_server *server, int fd, short events, struct timeval start)
+{
+	struct pollfd pfds[2];
+	int res;
+
+	pfds[0].fd = fd;
+	pfds[0].events = events;
+	pfds[1].fd = server->outq_alert_pipe[0];
+	pfds[1].events = POLLIN;
+
+	for (;;) {
+		int ms = ast_remaining_ms(start, IRC_CONNECT_TIMEOUT);
+		if (!ms) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		res = ast_poll(pfds, 2, ms);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE)) {
+			errno = ECANCELED;
+			return -1;
+		}
+		if (pfds[1].revents) {
+			ast_alertpipe_read(server->outq_alert_pipe); /* Nothing can be queued yet, so this was stale */
+		}
+		if (pfds[0].revents) {
+			return 0;
+		}
+	}
 }
 
-static int irc_connect(const char *hostname, int port)
+/*! \brief Get the result of a non-blocking connect, once the socket is writable */
+static int irc_connect_result(int fd)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len)) {
+		return -1;
+	}
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+static int irc_connect(struct irc_server *server)
 {
 	int fd;
 	struct ast_sockaddr saddr;
+	struct timeval send_timeout = { .tv_sec = IRC_SEND_TIMEOUT, };
+	struct timeval start;
+	const char *hostname = server->hostname;
+	int port = server->port;
 
 	if (ast_strlen_zero(hostname)) {
 		ast_log(LOG_WARNING, "No hostname specified\n");
 		return -1;
 	}
 
-	if (irc_socket >= 0) {
-		irc_debug(2, "IRC socket already registered as fd %d\n", irc_socket);
+	if (server->socket >= 0) {
+		irc_debug(2, "IRC socket for %s already registered as fd %d\n", server->name, server->socket);
 		return -1;
 	}
 
@@ -598,21 +979,21 @@ static int irc_connect(const char *hostname, int port)
 	}
 	ast_sockaddr_set_port(&saddr, port);
 
-	if (ircserver->tls) {
+	if (server->tls) {
 #ifdef HAVE_OPENSSL
 		OpenSSL_add_ssl_algorithms();
 		SSL_load_error_strings();
-		ctx = SSL_CTX_new(TLS_client_method());
-		if (!ctx) {
+		server->ctx = SSL_CTX_new(TLS_client_method());
+		if (!server->ctx) {
 			ast_log(LOG_ERROR, "Failed to setup new SSL context\n");
 			return -1;
 		}
-		SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3); /* Only use TLS */
-		ssl = SSL_new(ctx);
-		if (!ssl) {
+		SSL_CTX_set_options(server->ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3); /* Only use TLS */
+		server->ssl = SSL_new(server->ctx);
+		if (!server->ssl) {
 			ast_log(LOG_WARNING, "Failed to create new SSL\n");
-			SSL_CTX_free(ctx);
-			ctx = NULL;
+			SSL_CTX_free(server->ctx);
+			server->ctx = NULL;
 			return -1;
 		}
 #else
@@ -627,54 +1008,77 @@ static int irc_connect(const char *hostname, int port)
 	if (fd < 0) {
 		ast_log(LOG_WARNING, "Unable to create socket: %s\n", strerror(errno));
 #ifdef HAVE_OPENSSL
-		if (ctx) {
-			SSL_CTX_free(ctx);
-			ctx = NULL;
+		if (server->ctx) {
+			SSL_CTX_free(server->ctx);
+			server->ctx = NULL;
 		}
 #endif
 		return -1;
 	}
 
-	if (ast_connect(fd, &saddr)) {
+	/* Connect (and handshake) without blocking, so an unreachable or stalled server
+	 * can be given up on, or stopped while we're still trying */
+	start = ast_tvnow();
+	if (ast_fd_set_flags(fd, O_NONBLOCK)
+		|| (ast_connect(fd, &saddr) && errno != EINPROGRESS)
+		|| irc_connect_wait(server, fd, POLLOUT, start)
+		|| irc_connect_result(fd)) {
 		ast_log(LOG_WARNING, "Failed to connect to %s: %s\n", ast_sockaddr_stringify(&saddr), strerror(errno));
 #ifdef HAVE_OPENSSL
-		if (ctx) {
-			SSL_CTX_free(ctx);
-			ctx = NULL;
-		}
+		free_ssl_and_ctx(server);
 #endif
+		close(fd);
 		return -1;
 	}
 
+	/* Don't let a write to a stalled server block forever, so the server's thread can always be stopped */
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout))) {
+		ast_log(LOG_WARNING, "Failed to set send timeout: %s\n", strerror(errno));
+	}
+
 #ifdef HAVE_OPENSSL
-	if (ircserver->tls) {
+	if (server->tls) {
 		X509 *server_cert;
 		char *str;
-		if (SSL_set_fd(ssl, fd) != 1) {
+		if (SSL_set_fd(server->ssl, fd) != 1) {
 			ast_log(LOG_WARNING, "Failed to connect SSL: %s\n", ERR_error_string(ERR_get_error(), NULL));
-			free_ssl_and_ctx();
+			free_ssl_and_ctx(server);
 			close(fd);
 			return -1;
 		}
-		if (SSL_connect(ssl) == -1) {
+		for (;;) {
+			int res = SSL_connect(server->ssl);
+			if (res == 1) {
+				break;
+			}
+			res = SSL_get_error(server->ssl, res);
+			if (res == SSL_ERROR_WANT_READ || res == SSL_ERROR_WANT_WRITE) {
+				if (irc_connect_wait(server, fd, res == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, start)) {
+					ast_log(LOG_WARNING, "Failed to connect SSL: %s\n", strerror(errno));
+					free_ssl_and_ctx(server);
+					close(fd);
+					return -1;
+				}
+				continue;
+			}
 			ast_log(LOG_WARNING, "Failed to connect SSL: %s\n", ERR_error_string(ERR_get_error(), NULL));
 			ERR_print_errors_fp(stderr);
-			free_ssl_and_ctx();
+			free_ssl_and_ctx(server);
 			close(fd);
 			return -1;
 		}
 		/* Verify cert */
-		server_cert = SSL_get_peer_certificate(ssl);
+		server_cert = SSL_get_peer_certificate(server->ssl);
 		if (!server_cert) {
 			ast_log(LOG_WARNING, "Failed to get peer certificate\n");
-			free_ssl_and_ctx();
+			free_ssl_and_ctx(server);
 			close(fd);
 			return -1;
 		}
 		str = X509_NAME_oneline(X509_get_subject_name(server_cert), 0, 0);
 		if (!str) {
 			ast_log(LOG_WARNING, "Failed to get peer certificate\n");
-			free_ssl_and_ctx();
+			free_ssl_and_ctx(server);
 			close(fd);
 			return -1;
 		}
@@ -683,19 +1087,19 @@ static int irc_connect(const char *hostname, int port)
 		str = X509_NAME_oneline(X509_get_issuer_name (server_cert), 0, 0);
 		if (!str) {
 			ast_log(LOG_WARNING, "Failed to get peer certificate\n");
-			free_ssl_and_ctx();
+			free_ssl_and_ctx(server);
 			close(fd);
 			return -1;
 		}
 		ast_debug(8, "TLS Issuer: %s\n", str);
 		OPENSSL_free(str);
 		X509_free(server_cert);
-		if (ircserver->tlsverify) { /* If we're verifying the cert, go for it. */
+		if (server->tlsverify) { /* If we're verifying the cert, go for it. */
 			long verify_result;
-			verify_result = SSL_get_verify_result(ssl);
+			verify_result = SSL_get_verify_result(server->ssl);
 			if (verify_result != X509_V_OK) {
 				ast_log(LOG_WARNING, "SSL verify failed: %ld (%s)\n", verify_result, X509_verify_cert_error_string(verify_result));
-				free_ssl_and_ctx();
+				free_ssl_and_ctx(server);
 				close(fd);
 				return -1;
 			}
@@ -703,25 +1107,58 @@ static int irc_connect(const char *hostname, int port)
 	}
 #endif
 
-	ast_verb(3, "Established %s IRC connection to %s\n", ircserver->tls ? "secure" : "plain text", ast_sockaddr_stringify(&saddr));
-	irc_socket = fd;
-
-	if (ast_pthread_create(&irc_thread, NULL, irc_loop, NULL)) {
-		ast_log(LOG_WARNING, "Failed to create IRC thread\n");
+	if (ast_fd_clear_flags(fd, O_NONBLOCK)) {
+		ast_log(LOG_WARNING, "Failed to make socket blocking: %s\n", strerror(errno));
 #ifdef HAVE_OPENSSL
-		if (ircserver->tls) {
-			free_ssl_and_ctx();
-		}
+		free_ssl_and_ctx(server);
 #endif
 		close(fd);
 		return -1;
 	}
 
+	ast_verb(3, "Established %s IRC connection to %s (%s)\n", server->tls ? "secure" : "plain text", ast_sockaddr_stringify(&saddr), server->name);
+	server->socket = fd;
+	server->connected = ast_tvnow();
+
 	return 0;
 }
 
-static int irc_send_user_message(const char *user, const char *message)
+/*! \brief A server's thread: connect, then handle the connection until it's lost or we're told to stop */
+static void *irc_thread(void *varg)
 {
+	struct irc_server *server = varg;
+
+	/* Resolving, connecting and the TLS handshake can all take a while, so do them here, rather than holding up other servers */
+	if (!irc_connect(server)) {
+		irc_loop(server);
+	}
+	__atomic_store_n(&server->running, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*! \brief Start a server's thread, unless it's already running */
+static int irc_start(struct irc_server *server)
+{
+	if (__atomic_load_n(&server->running, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	/* If the thread exited on its own, e.g. because the connection was lost, reap it before starting over */
+	irc_disconnect(server);
+	server->running = 1;
+	if (ast_pthread_create(&server->thread, NULL, irc_thread, server)) {
+		ast_log(LOG_WARNING, "Failed to create IRC thread for %s\n", server->name);
+		server->thread = AST_PTHREADT_NULL;
+		server->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static int irc_send_user_message(const char *servername, const char *user, const char *message)
+{
+	struct irc_server *server;
+	int res;
+
 	if (ast_strlen_zero(user)) {
 		ast_log(LOG_WARNING, "Empty recipient\n");
 		return -1;
@@ -730,13 +1167,23 @@ static int irc_send_user_message(const char *user, const char *message)
 		ast_log(LOG_WARNING, "Empty message\n");
 		return -1;
 	}
-	return irc_send("PRIVMSG %s :%s", user, message);
+
+	AST_RWLIST_RDLOCK(&servers);
+	server = find_server(servername);
+	if (!server) {
+		AST_RWLIST_UNLOCK(&servers);
+		ast_log(LOG_WARNING, "No such IRC server '%s'\n", S_OR(servername, IRC_DEFAULT_SERVER));
+		return -1;
+	}
+	res = irc_send(server, "PRIVMSG %s :%s", user, message);
+	AST_RWLIST_UNLOCK(&servers);
+	return res;
 }
 
 static int irc_msg_exec(struct ast_channel *chan, const char *data)
 {
 	int res;
-	char *parse;
+	char *parse, *server = NULL;
 
 	AST_DECLARE_APP_ARGS(args,
 		AST_APP_ARG(channel);
@@ -749,18 +1196,22 @@ static int irc_msg_exec(struct ast_channel *chan, const char *data)
 	parse = ast_strdupa(data);
 	AST_STANDARD_APP_ARGS(args, parse);
 
-	if (chan) {
-		ast_autoservice_start(chan);
+	/* The message takes everything after the channel, commas included, so the server goes with the channel */
+	if (args.channel && (server = strrchr(args.channel, '@'))) {
+		*server++ = '\0';
 	}
-	res = irc_send_user_message(args.channel, args.message);
+
+	/* Only queues the message, so there's no need to autoservice the channel */
+	res = irc_send_user_message(server, args.channel, args.message);
 	if (chan) {
-		ast_autoservice_stop(chan);
+		pbx_builtin_setvar_helper(chan, "IRCSENDSTATUS", res ? "FAILURE" : "QUEUED");
 	}
 	return res;
 }
 
 static int irc_msg_tx(struct mansession *s, const struct message *m)
 {
+	const char *server = astman_get_header(m, "Server");
 	const char *channel = astman_get_header(m, "Channel");
 	const char *id = astman_get_header(m, "ActionID");
 	const char *message = astman_get_header(m, "Message");
@@ -775,8 +1226,8 @@ static int irc_msg_tx(struct mansession *s, const struct message *m)
 		return AMI_SUCCESS;
 	}
 
-	if (irc_send_user_message(channel, message)) {
-		astman_send_error(s, m, "IRC message failed to send");
+	if (irc_send_user_message(server, channel, message)) {
+		astman_send_error(s, m, "IRC message failed to queue");
 		return AMI_SUCCESS; /* Yeah, it doesn't make sense - but returning AMI_DESTROY would cause the entire AMI connection to terminate */
 	}
 
@@ -784,111 +1235,203 @@ static int irc_msg_tx(struct mansession *s, const struct message *m)
 	if (!ast_strlen_zero(id)) {
 		astman_append(s, "ActionID: %s\r\n", id);
 	}
+	astman_append(s, "Message: Queued\r\n");
 
 	astman_append(s, "\r\n");
 
 	return AMI_SUCCESS;
 }
 
+static char *complete_server(const char *word, int state)
+{
+	struct irc_server *server;
+	int which = 0;
+	size_t wordlen = strlen(word);
+	char *ret = NULL;
+
+	AST_RWLIST_RDLOCK(&servers);
+	AST_RWLIST_TRAVERSE(&servers, server, entry) {
+		if (!strncasecmp(word, server->name, wordlen) && ++which > state) {
+			ret = ast_strdup(server->name);
+			break;
+		}
+	}
+	AST_RWLIST_UNLOCK(&servers);
+	return ret;
+}
+
 static char *handle_irc_sendmsg(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
 	switch (cmd) {
 	case CLI_INIT:
 		e->command = "irc msg";
 		e->usage =
-			"Usage: irc msg <channel> <message>\n"
+			"Usage: irc msg <channel> <message> [<server>]\n"
 			"       Send message to an IRC channel (if starts with #) or user.\n"
 			"       If message contains spaces, it will need to be quoted.\n"
 			"       This is intended for debugging so complex messages may\n"
 			"       not work as expected.\n";
 		return NULL;
 	case CLI_GENERATE:
-		return NULL;
+		return a->pos == 4 ? complete_server(a->word, a->n) : NULL;
 	}
 
-	if (a->argc != 4 || ast_strlen_zero(a->argv[2]) || ast_strlen_zero(a->argv[3])) {
+	if ((a->argc != 4 && a->argc != 5) || ast_strlen_zero(a->argv[2]) || ast_strlen_zero(a->argv[3])) {
 		return CLI_SHOWUSAGE;
 	}
 
 	/* Always use irc_send_user_message, so that if it starts with #, it will go to a channel */
-	if (irc_send_user_message(a->argv[2], a->argv[3])) {
+	if (irc_send_user_message(a->argc == 5 ? a->argv[4] : NULL, a->argv[2], a->argv[3])) {
 		return CLI_FAILURE;
 	}
 
+	ast_cli(a->fd, "Message queued\n");
 	return CLI_SUCCESS;
 }
 
 static char *handle_irc_join_channel(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
+	struct irc_server *server;
+	int res;
+
 	switch (cmd) {
 	case CLI_INIT:
 		e->command = "irc join";
 		e->usage =
-			"Usage: irc join <channel>\n"
+			"Usage: irc join <channel> [<server>]\n"
 			"       Join an IRC channel. You must prefix with # or & for channels.\n";
 		return NULL;
 	case CLI_GENERATE:
-		return NULL;
+		return a->pos == 3 ? complete_server(a->word, a->n) : NULL;
 	}
 
-	if (a->argc != 3 || ast_strlen_zero(a->argv[2])) {
+	if ((a->argc != 3 && a->argc != 4) || ast_strlen_zero(a->argv[2])) {
 		return CLI_SHOWUSAGE;
 	}
-	if (irc_channel_join(a->argv[2])) {
-		return CLI_FAILURE;
+
+	AST_RWLIST_RDLOCK(&servers);
+	server = find_server(a->argc == 4 ? a->argv[3] : NULL);
+	res = server ? irc_channel_join(server, a->argv[2]) : -1;
+	AST_RWLIST_UNLOCK(&servers);
+	if (!server) {
+		ast_cli(a->fd, "No such IRC server\n");
 	}
 
-	return CLI_SUCCESS;
+	return res ? CLI_FAILURE : CLI_SUCCESS;
 }
 
-static int irc_leave(const char *channel)
+static int irc_leave(struct irc_server *server, const char *channel)
 {
-	return !ast_strlen_zero(channel) ? irc_send("PART %s", channel) : irc_send("QUIT :That's all, folks!");
+	return !ast_strlen_zero(channel) ? irc_send(server, "PART %s", channel) : irc_send(server, "QUIT :That's all, folks!");
 }
 
 static char *handle_irc_part_channel(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
+	struct irc_server *server;
+	int res;
+
 	switch (cmd) {
 	case CLI_INIT:
 		e->command = "irc part";
 		e->usage =
-			"Usage: irc part <channel>\n"
+			"Usage: irc part <channel> [<server>]\n"
 			"       Leave an IRC channel. You must prefix with # or & for channels.\n";
 		return NULL;
 	case CLI_GENERATE:
-		return NULL;
+		return a->pos == 3 ? complete_server(a->word, a->n) : NULL;
 	}
 
-	if (a->argc != 3 || ast_strlen_zero(a->argv[2])) {
+	if ((a->argc != 3 && a->argc != 4) || ast_strlen_zero(a->argv[2])) {
 		return CLI_SHOWUSAGE;
 	}
-	if (irc_leave(a->argv[2])) {
-		return CLI_FAILURE;
+
+	AST_RWLIST_RDLOCK(&servers);
+	server = find_server(a->argc == 4 ? a->argv[3] : NULL);
+	res = server ? irc_leave(server, a->argv[2]) : -1;
+	AST_RWLIST_UNLOCK(&servers);
+	if (!server) {
+		ast_cli(a->fd, "No such IRC server\n");
 	}
 
-	return CLI_SUCCESS;
+	return res ? CLI_FAILURE : CLI_SUCCESS;
 }
 
 static char *handle_irc_login(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
+	struct irc_server *server;
+	int res;
+
 	switch (cmd) {
 	case CLI_INIT:
 		e->command = "irc login";
 		e->usage =
-			"Usage: irc login <nick> <password>\n"
+			"Usage: irc login <nick> <password> [<server>]\n"
 			"       Log in with NickServ.\n";
 		return NULL;
+	case CLI_GENERATE:
+		return a->pos == 4 ? complete_server(a->word, a->n) : NULL;
+	}
+
+	if ((a->argc != 4 && a->argc != 5) || ast_strlen_zero(a->argv[2]) || ast_strlen_zero(a->argv[3])) {
+		return CLI_SHOWUSAGE;
+	}
+
+	AST_RWLIST_RDLOCK(&servers);
+	server = find_server(a->argc == 5 ? a->argv[4] : NULL);
+	res = server ? irc_nickserv_login(server, a->argv[2], a->argv[3]) : -1;
+	AST_RWLIST_UNLOCK(&servers);
+	if (!server) {
+		ast_cli(a->fd, "No such IRC server\n");
+	}
+
+	return res ? CLI_FAILURE : CLI_SUCCESS;
+}
+
+static char *handle_irc_show_servers(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct irc_server *server;
+	struct timeval now = ast_tvnow();
+	int total = 0;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "irc show servers";
+		e->usage =
+			"Usage: irc show servers\n"
+			"       List configured IRC servers, with message counts and send latency.\n"
+			"       Latency is the time messages spend queued before they are written,\n"
+			"       which includes any delay due to flood control.\n";
+		return NULL;
 	case CLI_GENERATE:
 		return NULL;
 	}
 
-	if (a->argc != 4 || ast_strlen_zero(a->argv[2]) || ast_strlen_zero(a->argv[3])) {
+	if (a->argc != 3) {
 		return CLI_SHOWUSAGE;
 	}
 
-	if (irc_nickserv_login(a->argv[2], a->argv[3])) {
-		return CLI_FAILURE;
+	ast_cli(a->fd, "%-15s %-25s %-9s %8s %5s %8s %7s %8s %10s %10s %7s %7s\n",
+		"Name", "Host", "Uptime", "Queued", "Now", "Sent", "Dropped", "Received", "Bytes Out", "Bytes In", "Avg ms", "Max ms");
+	AST_RWLIST_RDLOCK(&servers);
+	AST_RWLIST_TRAVERSE(&servers, server, entry) {
+		char host[64];
+		char uptime[16] = "-";
+		if (server->socket >= 0) {
+			int secs = ast_tvdiff_sec(now, server->connected);
+			snprintf(uptime, sizeof(uptime), "%d:%02d:%02d", secs / 3600, (secs % 3600) / 60, secs % 60);
+		} else if (__atomic_load_n(&server->running, __ATOMIC_ACQUIRE)) {
+			ast_copy_string(uptime, "Connecting", sizeof(uptime));
+		}
+		snprintf(host, sizeof(host), "%s:%u", S_OR(server->hostname, ""), server->port);
+		ast_cli(a->fd, "%-15s %-25s %-9s %8d %5d %8u %7d %8u %10lu %10lu %7lu %7u\n",
+			server->name, host, uptime,
+			server->msgs_queued, server->outq_count, server->msgs_sent, server->msgs_dropped, server->msgs_received,
+			(unsigned long) server->bytes_sent, (unsigned long) server->bytes_received,
+			(unsigned long) (server->msgs_sent ? server->latency_total / server->msgs_sent : 0), server->latency_max);
+		total++;
 	}
+	AST_RWLIST_UNLOCK(&servers);
+	ast_cli(a->fd, "%d IRC server%s\n", total, ESS(total));
 
 	return CLI_SUCCESS;
 }
@@ -897,16 +1440,73 @@ static struct ast_cli_entry cli_irc[] = {
 	AST_CLI_DEFINE(handle_irc_sendmsg, "Send message to an IRC channel"),
 	AST_CLI_DEFINE(handle_irc_join_channel, "Join an IRC channel"),
 	AST_CLI_DEFINE(handle_irc_part_channel, "Leave an IRC channel"),
-	AST_CLI_DEFINE(handle_irc_login, "Login with NickServ on IRC server")
+	AST_CLI_DEFINE(handle_irc_login, "Login with NickServ on IRC server"),
+	AST_CLI_DEFINE(handle_irc_show_servers, "List IRC servers and statistics"),
 };
 
+static struct irc_server *load_server(struct ast_config *cfg, const char *cat, const char *name)
+{
+	struct irc_server *server;
+	const char *tempstr;
+
+	if (!(server = alloc_server(name))) {
+		return NULL;
+	}
+
+	server->hostname = ((tempstr = ast_variable_retrieve(cfg, cat, "hostname"))) ? ast_strdup(tempstr) : NULL;
+	server->port = ((tempstr = ast_variable_retrieve(cfg, cat, "port"))) ? atoi(tempstr) : IRC_DEFAULT_PORT;
+	server->username = ((tempstr = ast_variable_retrieve(cfg, cat, "username"))) ? ast_strdup(tempstr) : NULL;
+	server->password = ((tempstr = ast_variable_retrieve(cfg, cat, "password"))) ? ast_strdup(tempstr) : NULL;
+	server->autojoin = ((tempstr = ast_variable_retrieve(cfg, cat, "autojoin"))) ? ast_strdup(tempstr) : NULL;
+	server->tls = ((tempstr = ast_variable_retrieve(cfg, cat, "tls"))) ? !strcasecmp(tempstr, "yes") ? 1 : 0 : 0;
+	server->tlsverify = ((tempstr = ast_variable_retrieve(cfg, cat, "tlsverify"))) ? !strcasecmp(tempstr, "yes") ? 1 : 0 : 0;
+	server->sasl = ((tempstr = ast_variable_retrieve(cfg, cat, "sasl"))) ? !strcasecmp(tempstr, "yes") ? 1 : 0 : 0;
+	server->events = ((tempstr = ast_variable_retrieve(cfg, cat, "events"))) ? !strcasecmp(tempstr, "yes") ? 1 : 0 : 0;
+	server->sendburst = ((tempstr = ast_variable_retrieve(cfg, cat, "sendburst"))) ? atoi(tempstr) : IRC_DEFAULT_SEND_BURST;
+	server->sendinterval = ((tempstr = ast_variable_retrieve(cfg, cat, "sendinterval"))) ? atoi(tempstr) : IRC_DEFAULT_SEND_INTERVAL;
+	if (!server->sendburst) {
+		server->sendburst = 1;
+	}
+
+#ifndef HAVE_OPENSSL
+	if (server->tls) {
+		ast_log(LOG_WARNING, "Server %s configured with TLS, but Asterisk was not compiled with OpenSSL. This will fail.\n", name);
+	}
+#endif
+
+	return server;
+}
+
+/*!
+ * \brief Add a server from the config, or replace one that isn't connected
+ * \note Must be called with servers write locked
+ */
+static void add_server(struct ast_config *cfg, const char *cat, const char *name)
+{
+	struct irc_server *server, *existing = find_server(name);
+
+	if (existing && __atomic_load_n(&existing->running, __ATOMIC_ACQUIRE)) {
+		ast_log(LOG_NOTICE, "IRC client for %s is currently running and will not be restarted on a reload\n", name);
+		return;
+	}
+	server = load_server(cfg, cat, name);
+	if (!server) {
+		return;
+	}
+	if (existing) {
+		AST_RWLIST_REMOVE(&servers, existing, entry);
+		irc_disconnect(existing); /* Reap its thread, if it exited on its own */
+		free_server(existing);
+	}
+	AST_RWLIST_INSERT_TAIL(&servers, server, entry);
+}
+
 static int irc_reload(int reload)
 {
 	int res = 0;
 	char *cat = NULL;
 	struct ast_config *cfg;
 	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
-	const char *tempstr;
 
 	if (!(cfg = ast_config_load(CONFIG_FILE, config_flags))) {
 		ast_log(LOG_WARNING, "Missing config file (%s)\n", CONFIG_FILE);
@@ -919,32 +1519,12 @@ static int irc_reload(int reload)
 		return -1;
 	}
 
-	ast_mutex_lock(&irc_lock);
+	AST_RWLIST_WRLOCK(&servers);
 
-	if (ircserver) {
-		free_server(ircserver);
+	/* The general section can define a server by itself, for compatibility with single server configs */
+	if (ast_variable_retrieve(cfg, "general", "hostname")) {
+		add_server(cfg, "general", IRC_DEFAULT_SERVER);
 	}
-	if (!(ircserver = ast_calloc(1, sizeof(*ircserver)))) {
-		return -1;
-	}
-
-	/* General section */
-	/* Reset Global Var Values */
-	ircserver->hostname = ((tempstr = ast_variable_retrieve(cfg, "general", "hostname"))) ? ast_strdup(tempstr) : NULL;
-	ircserver->port = ((tempstr = ast_variable_retrieve(cfg, "general", "port"))) ? atoi(tempstr) : IRC_DEFAULT_PORT;
-	ircserver->username = ((tempstr = ast_variable_retrieve(cfg, "general", "username"))) ? ast_strdup(tempstr) : NULL;
-	ircserver->password = ((tempstr = ast_variable_retrieve(cfg, "general", "password"))) ? ast_strdup(tempstr) : NULL;
-	ircserver->autojoin = ((tempstr = ast_variable_retrieve(cfg, "general", "autojoin"))) ? ast_strdup(tempstr) : NULL;
-	ircserver->tls = ((tempstr = ast_variable_retrieve(cfg, "general", "tls"))) ? !strcasecmp(tempstr, "yes") ? 1 : 0 : 0;
-	ircserver->tlsverify = ((tempstr = ast_variable_retrieve(cfg, "general", "tlsverify"))) ? !strcasecmp(tempstr, "yes") ? 1 : 0 : 0;
-	ircserver->sasl = ((tempstr = ast_variable_retrieve(cfg, "general", "sasl"))) ? !strcasecmp(tempstr, "yes") ? 1 : 0 : 0;
-	ircserver->events = ((tempstr = ast_variable_retrieve(cfg, "general", "events"))) ? !strcasecmp(tempstr, "yes") ? 1 : 0 : 0;
-
-#ifndef HAVE_OPENSSL
-	if (ircserver->tls) {
-		ast_log(LOG_WARNING, "Server configured with TLS, but Asterisk was not compiled with OpenSSL. This will fail.\n");
-	}
-#endif
 
 	/* Remaining sections */
 	while ((cat = ast_category_browse(cfg, cat))) {
@@ -955,62 +1535,73 @@ static int irc_reload(int reload)
 		if (!(type = ast_variable_retrieve(cfg, cat, "type"))) {
 			ast_log(LOG_WARNING, "Invalid entry in %s: %s defined with no type!\n", CONFIG_FILE, cat);
 			continue;
+		} else if (!strcasecmp(type, "server")) {
+			add_server(cfg, cat, cat);
 		} else {
 			ast_log(LOG_WARNING, "Unknown type: '%s'\n", type);
 		}
 	}
 
-	ast_mutex_unlock(&irc_lock);
+	AST_RWLIST_UNLOCK(&servers);
 
 	ast_config_destroy(cfg);
 
 	return res;
 }
 
+/*!
+ * \brief Start any servers that aren't already running
+ * \note Each server connects in its own thread, so this doesn't wait for any of them
+ * \return Number of servers running
+ */
 static int irc_initialize(void)
 {
-	ast_mutex_lock(&irc_lock);
+	struct irc_server *server;
+	int running = 0;
 
-	if (ast_strlen_zero(ircserver->username)) {
-		ast_log(LOG_WARNING, "No IRC username configured\n");
-		return AST_MODULE_LOAD_DECLINE;
-	}
-	if (irc_connect(ircserver->hostname, ircserver->port)) {
-		return AST_MODULE_LOAD_DECLINE;
+	AST_RWLIST_RDLOCK(&servers);
+	AST_RWLIST_TRAVERSE(&servers, server, entry) {
+		if (ast_strlen_zero(server->username)) {
+			ast_log(LOG_WARNING, "No IRC username configured for %s\n", server->name);
+			continue;
+		}
+		if (!irc_start(server)) {
+			running++;
+		}
 	}
-	ast_mutex_unlock(&irc_lock);
+	AST_RWLIST_UNLOCK(&servers);
 
-	return 0;
+	return running;
 }
 
 static int reload_module(void)
 {
-	int res;
-	if (irc_socket >= 0) {
-		ast_log(LOG_NOTICE, "IRC client is currently running and will not be restarted on a reload\n");
-	}
-	res = irc_reload(1);
-	if (irc_socket < 0) {
-		/* Only if we weren't already running in the first place do we try to now start the client */
-		irc_initialize();
-	}
+	int res = irc_reload(1);
+	/* Only servers that weren't already running are (re)started */
+	irc_initialize();
 	return res;
 }
 
 static int unload_module(void)
 {
 	int res = 0;
+	struct irc_server *server;
 
 	ast_unregister_application(send_msg_app);
 	ast_cli_unregister_multiple(cli_irc, ARRAY_LEN(cli_irc));
 	res |= ast_manager_unregister("IRCSendMessage");
-	if (irc_socket >= 0) {
-		irc_leave(NULL); /* If we're still connected, try to send a QUIT message of our own accord before we leave. */
-	}
-	irc_disconnect();
-	if (ircserver) {
-		free_server(ircserver);
+
+	AST_RWLIST_WRLOCK(&servers);
+	while ((server = AST_RWLIST_REMOVE_HEAD(&servers, entry))) {
+		if (server->socket >= 0) {
+			/* If we're still connected, try to send a QUIT message of our own accord before we leave.
+			 * Send it now, since the server's thread is about to go away. */
+			irc_send_now(server, "QUIT :That's all, folks!");
+		}
+		irc_disconnect(server);
+		free_server(server);
 	}
+	AST_RWLIST_UNLOCK(&servers);
 
 #ifdef HAVE_OPENSSL
 	ERR_free_strings(); /* stub */
@@ -1024,15 +1615,20 @@ static int load_module(void)
 {
 	int res = 0;
 
-	ast_mutex_init(&irc_lock);
-	ircserver = NULL;
 	if (irc_reload(0)) {
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
-	res = irc_initialize();
-	if (res) {
-		return res;
+	/* Each server connects in its own thread, so one that's slow or unreachable doesn't hold up the others */
+	if (!irc_initialize()) {
+		struct irc_server *server;
+		ast_log(LOG_WARNING, "Failed to start any IRC servers\n");
+		AST_RWLIST_WRLOCK(&servers);
+		while ((server = AST_RWLIST_REMOVE_HEAD(&servers, entry))) {
+			free_server(server);
+		}
+		AST_RWLIST_UNLOCK(&servers);
+		return AST_MODULE_LOAD_DECLINE;
 	}
 
 	ast_cli_register_multiple(cli_irc, ARRAY_LEN(cli_irc));
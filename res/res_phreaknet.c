@@ -34,6 +34,7 @@
 #include "asterisk.h"
 
 #include <sys/stat.h>   /* stat(2) */
+#include <errno.h>
 #include <curl/curl.h>
 
 #include "asterisk/file.h"
@@ -50,6 +51,9 @@
 #include "asterisk/acl.h"
 #include "asterisk/causes.h"
 #include "asterisk/ast_version.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/stringfields.h"
+#include "asterisk/curl_pool.h"
 
 /*** DOCUMENTATION
 	<configInfo name="res_phreaknet" language="en_US">
@@ -128,6 +132,43 @@
 					</description>
 				</configOption>
 			</configObject>
+			<configObject name="cache">
+				<configOption name="enabled" default="yes">
+					<synopsis>Whether to cache lookup results.</synopsis>
+					<description>
+						<para>Lookups for <literal>PhreakNetDial</literal> and <literal>PHREAKNET(lookup)</literal>
+						normally each require an HTTPS request to the PhreakNet API. With caching, repeat lookups are
+						answered from memory instead.</para>
+						<para>Since lookups depend on the caller as well as the number, a result is only reused
+						for lookups with the same number, flags, and caller information.</para>
+						<para>Lookups are never cached if <literal>requesttoken</literal> is enabled, since tokens are only valid for one call.</para>
+					</description>
+				</configOption>
+				<configOption name="ttl" default="300">
+					<synopsis>How long (in seconds) a lookup result is fresh.</synopsis>
+				</configOption>
+				<configOption name="negative_ttl" default="30">
+					<synopsis>How long (in seconds) a failed lookup is remembered.</synopsis>
+					<description>
+						<para>Failed lookups are cached briefly, so that many calls to a number that can't be looked up
+						don't each wait on the API.</para>
+					</description>
+				</configOption>
+				<configOption name="stale" default="3600">
+					<synopsis>How long (in seconds) after it is no longer fresh a result may still be used.</synopsis>
+					<description>
+						<para>When a result that is no longer fresh is used, it is used immediately, and refreshed
+						in the background, so that calls don't wait on the API. If refreshing fails, the stale
+						result continues to be used until this period elapses.</para>
+					</description>
+				</configOption>
+				<configOption name="maxentries" default="1000">
+					<synopsis>Maximum number of lookups to cache.</synopsis>
+					<description>
+						<para>When the cache is full, the least recently used lookup is evicted.</para>
+					</description>
+				</configOption>
+			</configObject>
 		</configFile>
 	</configInfo>
 	<application name="PhreakNetDial" language="en_US">
@@ -233,12 +274,20 @@
 /*! \brief Default blacklist threshold is 2.1 */
 #define DEFAULT_BLACKLIST_THRESHOLD 2.1
 
+/*! \brief Default lookup cache settings */
+#define DEFAULT_LOOKUP_CACHE_TTL 300
+#define DEFAULT_LOOKUP_CACHE_NEGATIVE_TTL 30
+#define DEFAULT_LOOKUP_CACHE_STALE 3600
+#define DEFAULT_LOOKUP_CACHE_SIZE 1000
+#define LOOKUP_CACHE_BUCKETS 127
+
 struct {
 	unsigned int autokeyfetch:1;
 	unsigned int autokeyrotate:1;
 	unsigned int requesttoken:1;
 	unsigned int fallbackwarning:1;
 	unsigned int requirekeytoload:1;
+	unsigned int lookupcache:1;
 	/* Not set from config file */
 	unsigned int autovonsupport:1;
 } module_flags;
@@ -246,6 +295,10 @@ struct {
 static int keyfetch_interval;
 static int keyrotate_hour;
 static float blacklist_threshold;
+static int lookup_cache_ttl;
+static int lookup_cache_negative_ttl;
+static int lookup_cache_stale;
+static int lookup_cache_size;
 
 static char interlinked_api_key[INTERLINKED_API_KEYLEN + 1];
 static char mainphreaknetdisa[8];
@@ -268,6 +321,12 @@ struct {
 	unsigned int keys_updated;
 	unsigned int outgoing_calls;
 	unsigned int current_outgoing_calls;
+	unsigned int lookup_hits;
+	unsigned int lookup_stale_hits;
+	unsigned int lookup_negative_hits;
+	unsigned int lookup_misses;
+	unsigned int lookup_refreshes;
+	unsigned int lookup_evictions;
 } phreaknet_stats;
 
 ast_mutex_t stat_lock;
@@ -285,6 +344,9 @@ struct phreaknet_cdr_channel {
 
 static AST_RWLIST_HEAD_STATIC(cdr_channels, phreaknet_cdr_channel);
 
+/*! \brief Almost all requests are to the PhreakNet API, so keep connections to it open */
+static struct curl_pool curl_pool;
+
 /*! \note from test_res_prometheus.c */
 /*! \todo replace with ast_curl_str_write_callback if/when merged */
 static size_t curl_write_string_callback(char *rawdata, size_t size, size_t nmemb, void *userdata)
@@ -297,18 +359,19 @@ static size_t curl_write_string_callback(char *rawdata, size_t size, size_t nmem
 
 static struct ast_str *curl_get(const char *url, const char *data)
 {
-	CURL **curl;
+	CURL *curl;
 	CURLcode res;
 	struct ast_str *str;
 	long int http_code;
 	char curl_errbuf[CURL_ERROR_SIZE + 1] = "";
+	struct timeval start;
 
 	str = ast_str_create(512);
 	if (!str) {
 		return NULL;
 	}
 
-	curl = curl_easy_init();
+	curl = curl_pool_get(&curl_pool);
 	if (!curl) {
 		ast_free(str);
 		return NULL;
@@ -323,19 +386,20 @@ static struct ast_str *curl_get(const char *url, const char *data)
 	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_errbuf);
 
 	ast_debug(6, "cURL URL: %s\n", url);
+	start = ast_tvnow();
 	res = curl_easy_perform(curl);
 	if (res != CURLE_OK) {
 		if (*curl_errbuf) {
 			ast_log(LOG_WARNING, "%s\n", curl_errbuf);
 		}
 		ast_log(LOG_WARNING, "Failed to curl URL '%s': %s\n", url, curl_easy_strerror(res));
-		curl_easy_cleanup(curl);
+		curl_pool_put(&curl_pool, curl, start, res);
 		ast_free(str);
 		return NULL;
 	}
 
 	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-	curl_easy_cleanup(curl);
+	curl_pool_put(&curl_pool, curl, start, res);
 
 	ast_debug(5, "Response: %s\n", ast_str_buffer(str));
 	if (http_code / 100 != 2) {
@@ -349,18 +413,19 @@ static struct ast_str *curl_get(const char *url, const char *data)
 
 static struct ast_str *curl_post(const char *url, const char *data)
 {
-	CURL **curl;
+	CURL *curl;
 	CURLcode res;
 	struct ast_str *str;
 	long int http_code;
 	char curl_errbuf[CURL_ERROR_SIZE + 1] = "";
+	struct timeval start;
 
 	str = ast_str_create(512);
 	if (!str) {
 		return NULL;
 	}
 
-	curl = curl_easy_init();
+	curl = curl_pool_get(&curl_pool);
 	if (!curl) {
 		ast_free(str);
 		return NULL;
@@ -372,19 +437,20 @@ static struct ast_str *curl_post(const char *url, const char *data)
 	curl_easy_setopt(curl, CURLOPT_USERAGENT, AST_CURL_USER_AGENT);
 
 	ast_debug(6, "cURL URL: %s\n", url);
+	start = ast_tvnow();
 	res = curl_easy_perform(curl);
 	if (res != CURLE_OK) {
 		if (*curl_errbuf) {
 			ast_log(LOG_WARNING, "%s\n", curl_errbuf);
 		}
 		ast_log(LOG_WARNING, "Failed to curl URL '%s': %s\n", url, curl_easy_strerror(res));
-		curl_easy_cleanup(curl);
+		curl_pool_put(&curl_pool, curl, start, res);
 		ast_free(str);
 		return NULL;
 	}
 
 	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-	curl_easy_cleanup(curl);
+	curl_pool_put(&curl_pool, curl, start, res);
 
 	ast_debug(3, "Response: %s\n", ast_str_buffer(str));
 	if (http_code / 100 != 2) {
@@ -1227,6 +1293,11 @@ static char *handle_show_settings(struct ast_cli_entry *e, int cmd, struct ast_c
 	ast_cli(a->fd, CLI_FMT_S, "Require Key To Load", AST_CLI_YESNO(module_flags.requirekeytoload));
 	ast_cli(a->fd, CLI_FMT_F, "Blacklist threshold", blacklist_threshold);
 	ast_cli(a->fd, CLI_FMT_S, "AUTOVON/MLPP support", AST_CLI_YESNO(module_flags.autovonsupport));
+	ast_cli(a->fd, CLI_FMT_S, "Lookup cache", AST_CLI_YESNO(module_flags.lookupcache));
+	ast_cli(a->fd, CLI_FMT_D, "Lookup cache TTL (s)", lookup_cache_ttl);
+	ast_cli(a->fd, CLI_FMT_D, "Lookup cache negative TTL (s)", lookup_cache_negative_ttl);
+	ast_cli(a->fd, CLI_FMT_D, "Lookup cache stale period (s)", lookup_cache_stale);
+	ast_cli(a->fd, CLI_FMT_D, "Lookup cache max entries", lookup_cache_size);
 #undef CLI_FMT_S
 #undef CLI_FMT_D
 #undef CLI_FMT_F
@@ -1255,6 +1326,12 @@ static char *handle_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_
 	ast_cli(a->fd, "%u current outgoing call%s.\n", phreaknet_stats.current_outgoing_calls, ESS(phreaknet_stats.current_outgoing_calls));
 	ast_cli(a->fd, "%u RSA key creation%s.\n", phreaknet_stats.keys_created, ESS(phreaknet_stats.keys_created));
 	ast_cli(a->fd, "%u RSA key update%s.\n", phreaknet_stats.keys_updated, ESS(phreaknet_stats.keys_updated));
+	ast_cli(a->fd, "%u lookup cache hit%s (%u stale, %u negative).\n", phreaknet_stats.lookup_hits + phreaknet_stats.lookup_stale_hits + phreaknet_stats.lookup_negative_hits,
+		ESS(phreaknet_stats.lookup_hits + phreaknet_stats.lookup_stale_hits + phreaknet_stats.lookup_negative_hits), phreaknet_stats.lookup_stale_hits, phreaknet_stats.lookup_negative_hits);
+	ast_cli(a->fd, "%u lookup cache miss%s.\n", phreaknet_stats.lookup_misses, phreaknet_stats.lookup_misses == 1 ? "" : "es");
+	ast_cli(a->fd, "%u lookup cache refresh%s, %u eviction%s.\n", phreaknet_stats.lookup_refreshes, phreaknet_stats.lookup_refreshes == 1 ? "" : "es",
+		phreaknet_stats.lookup_evictions, ESS(phreaknet_stats.lookup_evictions));
+	ast_cli(a->fd, "%d lookup%s currently cached.\n", ao2_container_count(lookup_cache), ESS(ao2_container_count(lookup_cache)));
 
 	ast_cli(a->fd, "Module loaded %d seconds ago\n", now - load_time);
 	if (reload_time) {
@@ -1417,9 +1494,30 @@ static char *handle_purge_keys(struct ast_cli_entry *e, int cmd, struct ast_cli_
 	return CLI_SUCCESS;
 }
 
+static char *handle_show_http(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "phreaknet show http";
+		e->usage =
+			"Usage: phreaknet show http\n"
+			"       Show HTTP connection reuse and request latency.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	curl_pool_show(&curl_pool, a->fd);
+	return CLI_SUCCESS;
+}
+
 static struct ast_cli_entry phreaknet_cli[] = {
 	AST_CLI_DEFINE(handle_show_settings, "Display module settings"),
 	AST_CLI_DEFINE(handle_show_stats, "Display status of registrations"),
+	AST_CLI_DEFINE(handle_show_http, "Display HTTP connection statistics"),
 	AST_CLI_DEFINE(handle_cdr_show, "Display status of outgoing PhreakNet calls"),
 	AST_CLI_DEFINE(handle_cdr_cleanup, "Reconciles active PhreakNet CDRs with channels list"),
 	AST_CLI_DEFINE(handle_create_keypair, "Create a new PhreakNet RSA public key pair"),
@@ -1493,6 +1591,313 @@ static int load_global_vars(int force)
 	return res;
 }
 
+/*! \brief Perform a lookup using the PhreakNet API, bypassing the cache */
+static struct ast_str *phreaknet_lookup_fetch(const char *number, const char *flags, const char *clid, int ani2, const char *cnam, const char *cvs, const char *ss)
+{
+	static const char *version = NULL;
+	static const char *version_num = NULL;
+	char url[324]; /* min to make gcc happy */
+
+	/* Fetch the first time only */
+	if (!version) {
+		version = ast_get_version();
+	}
+	if (!version_num) {
+		version_num = ast_get_version_num();
+	}
+
+	snprintf(url, sizeof(url), "https://api.phreaknet.org/v1/?key=%s&asterisk=%s&asteriskv=%s"
+		"&number=%s&clid=%s&ani2=%d&cnam=%s&cvs=%s&nodevia=%s&flags=%s&threshold=%f&ss=%s%s",
+		interlinked_api_key, version, version_num,
+		number, clid, ani2, cnam, cvs, mainphreaknetdisa, flags, blacklist_threshold, ss, module_flags.requesttoken ? "&request_key" : "");
+
+	return curl_get(url, NULL);
+}
+
+/*!
+ * \brief Cached result of a lookup
+ * \note Every input to the lookup is part of the key, since the API may screen the
+ * caller as well as route the call, so the same number can have different results.
+ */
+struct lookup_cache_entry {
+	AST_DECLARE_STRING_FIELDS(
+		AST_STRING_FIELD(key);
+		AST_STRING_FIELD(number);
+		AST_STRING_FIELD(flags);
+		AST_STRING_FIELD(clid);
+		AST_STRING_FIELD(cnam);
+		AST_STRING_FIELD(cvs);
+		AST_STRING_FIELD(ss);
+	);
+	int ani2;
+	char *result;			/* Lookup result, or NULL if the lookup failed */
+	time_t expires;			/* When the result is no longer fresh */
+	time_t lastused;
+	unsigned int refresh:1;	/* Stale, and waiting to be refreshed */
+};
+
+static struct ao2_container *lookup_cache;
+static int lookup_refresh_pending = 0;
+
+static int lookup_cache_hash_fn(const void *obj, const int flags)
+{
+	const struct lookup_cache_entry *entry;
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		entry = obj;
+		key = entry->key;
+		break;
+	default:
+		ast_assert(0);
+		return 0;
+	}
+	return ast_str_hash(key);
+}
+
+static int lookup_cache_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct lookup_cache_entry *entry = obj, *right = arg;
+	const char *key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = right->key;
+		/* Fall through */
+	case OBJ_SEARCH_KEY:
+		return strcmp(entry->key, key) ? 0 : CMP_MATCH;
+	default:
+		return 0;
+	}
+}
+
+static void lookup_cache_entry_destructor(void *obj)
+{
+	struct lookup_cache_entry *entry = obj;
+
+	ast_free(entry->result);
+	ast_string_field_free_memory(entry);
+}
+
+/*! \brief Set an entry's result. Must be called with the entry locked. */
+static void lookup_cache_entry_set(struct lookup_cache_entry *entry, struct ast_str *result, time_t now)
+{
+	ast_free(entry->result);
+	entry->result = result ? ast_strdup(ast_str_buffer(result)) : NULL;
+	entry->expires = now + (entry->result ? lookup_cache_ttl : lookup_cache_negative_ttl);
+	entry->refresh = 0;
+}
+
+static int lookup_cache_expired_cb(void *obj, void *arg, int flags)
+{
+	struct lookup_cache_entry *entry = obj;
+	time_t now = *(time_t *) arg;
+	int expired;
+
+	ao2_lock(entry);
+	/* Failed lookups are never served stale */
+	expired = now >= entry->expires + (entry->result ? lookup_cache_stale : 0);
+	ao2_unlock(entry);
+
+	return expired ? CMP_MATCH : 0;
+}
+
+/*! \brief Remove entries too old to be served, even as stale */
+static void lookup_cache_prune(void)
+{
+	time_t now = time(NULL);
+	ao2_callback(lookup_cache, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, lookup_cache_expired_cb, &now);
+}
+
+/*! \brief Make room for a new entry, evicting the least recently used entry if needed */
+static void lookup_cache_evict(void)
+{
+	struct ao2_iterator i;
+	struct lookup_cache_entry *entry, *lru = NULL;
+
+	if (ao2_container_count(lookup_cache) < lookup_cache_size) {
+		return;
+	}
+	lookup_cache_prune();
+	if (ao2_container_count(lookup_cache) < lookup_cache_size) {
+		return;
+	}
+
+	i = ao2_iterator_init(lookup_cache, 0);
+	while ((entry = ao2_iterator_next(&i))) {
+		if (!lru || entry->lastused < lru->lastused) {
+			ao2_cleanup(lru);
+			lru = entry;
+		} else {
+			ao2_ref(entry, -1);
+		}
+	}
+	ao2_iterator_destroy(&i);
+
+	if (lru) {
+		ao2_unlink(lookup_cache, lru);
+		ao2_ref(lru, -1);
+		ast_mutex_lock(&stat_lock);
+		phreaknet_stats.lookup_evictions++;
+		ast_mutex_unlock(&stat_lock);
+	}
+}
+
+static int lookup_cache_refresh_cb(void *obj, void *arg, int flags)
+{
+	struct lookup_cache_entry *entry = obj;
+	int refresh;
+
+	ao2_lock(entry);
+	refresh = entry->refresh;
+	ao2_unlock(entry);
+
+	return refresh ? CMP_MATCH : 0;
+}
+
+/*! \brief Refresh all stale entries that have been requested since the last refresh */
+static void lookup_cache_refresh(void)
+{
+	struct ao2_iterator *i;
+	struct lookup_cache_entry *entry;
+	int refreshed = 0;
+
+	i = ao2_callback(lookup_cache, OBJ_MULTIPLE, lookup_cache_refresh_cb, NULL);
+	if (!i) {
+		return;
+	}
+	while ((entry = ao2_iterator_next(i))) {
+		/* The inputs never change once the entry is created, so no need to lock for them */
+		struct ast_str *result = phreaknet_lookup_fetch(entry->number, entry->flags, entry->clid, entry->ani2, entry->cnam, entry->cvs, entry->ss);
+		ao2_lock(entry);
+		if (result && !strchr(ast_str_buffer(result), '~')) {
+			lookup_cache_entry_set(entry, result, time(NULL));
+		} else {
+			/* Keep serving the stale result until it's too old, rather than failing calls now */
+			entry->refresh = 0;
+		}
+		ao2_unlock(entry);
+		ast_free(result);
+		ao2_ref(entry, -1);
+		refreshed++;
+	}
+	ao2_iterator_destroy(i);
+
+	if (refreshed) {
+		ast_debug(3, "Refreshed %d stale lookup%s\n", refreshed, ESS(refreshed));
+		ast_mutex_lock(&stat_lock);
+		phreaknet_stats.lookup_refreshes += refreshed;
+		ast_mutex_unlock(&stat_lock);
+	}
+}
+
+/*! \brief Have the periodic thread refresh stale entries as soon as possible */
+static void lookup_cache_request_refresh(void)
+{
+	ast_mutex_lock(&refreshlock);
+	lookup_refresh_pending = 1;
+	ast_cond_signal(&refresh_condition);
+	ast_mutex_unlock(&refreshlock);
+}
+
+static struct ast_str *phreaknet_lookup_full(const char *number, const char *flags, const char *clid, int ani2, const char *cnam, const char *cvs, const char *ss)
+{
+	struct lookup_cache_entry *entry;
+	struct ast_str *result;
+	char key[512];
+	time_t now;
+
+	/* Tokens are only good for one call, so those lookups can't be reused */
+	if (!module_flags.lookupcache || module_flags.requesttoken) {
+		return phreaknet_lookup_fetch(number, flags, clid, ani2, cnam, cvs, ss);
+	}
+
+	snprintf(key, sizeof(key), "%s|%s|%s|%d|%s|%s|%s", number, flags, S_OR(clid, ""), ani2, cnam, cvs, ss);
+	now = time(NULL);
+
+	entry = ao2_find(lookup_cache, key, OBJ_SEARCH_KEY);
+	if (entry) {
+		int stale = 0, refresh = 0, negative = 0, usable = 1;
+
+		ao2_lock(entry);
+		if (now >= entry->expires) {
+			if (entry->result && now < entry->expires + lookup_cache_stale) {
+				/* Serve the stale result now, and get a fresh one in the background */
+				stale = 1;
+				if (!entry->refresh) {
+					entry->refresh = refresh = 1;
+				}
+			} else {
+				usable = 0;
+			}
+		}
+		if (usable) {
+			entry->lastused = now;
+			negative = !entry->result;
+			result = entry->result ? ast_str_create(strlen(entry->result) + 1) : NULL;
+			if (result) {
+				ast_str_set(&result, 0, "%s", entry->result);
+			}
+		}
+		ao2_unlock(entry);
+
+		if (usable) {
+			ast_mutex_lock(&stat_lock);
+			if (negative) {
+				phreaknet_stats.lookup_negative_hits++;
+			} else if (stale) {
+				phreaknet_stats.lookup_stale_hits++;
+			} else {
+				phreaknet_stats.lookup_hits++;
+			}
+			ast_mutex_unlock(&stat_lock);
+			ao2_ref(entry, -1);
+			if (refresh) {
+				lookup_cache_request_refresh();
+			}
+			ast_debug(4, "Lookup for %s served from cache%s\n", number, stale ? " (stale)" : "");
+			return result;
+		}
+		ao2_unlink(lookup_cache, entry);
+		ao2_ref(entry, -1);
+	}
+
+	ast_mutex_lock(&stat_lock);
+	phreaknet_stats.lookup_misses++;
+	ast_mutex_unlock(&stat_lock);
+
+	result = phreaknet_lookup_fetch(number, flags, clid, ani2, cnam, cvs, ss);
+	if (result && strchr(ast_str_buffer(result), '~')) {
+		return result; /* Contains a token, don't cache */
+	}
+
+	entry = ao2_alloc(sizeof(*entry), lookup_cache_entry_destructor);
+	if (!entry || ast_string_field_init(entry, 128)) {
+		ao2_cleanup(entry);
+		return result;
+	}
+	ast_string_field_set(entry, key, key);
+	ast_string_field_set(entry, number, number);
+	ast_string_field_set(entry, flags, flags);
+	ast_string_field_set(entry, clid, S_OR(clid, ""));
+	ast_string_field_set(entry, cnam, cnam);
+	ast_string_field_set(entry, cvs, cvs);
+	ast_string_field_set(entry, ss, ss);
+	entry->ani2 = ani2;
+	entry->lastused = now;
+	lookup_cache_entry_set(entry, result, now);
+
+	lookup_cache_evict();
+	ao2_link(lookup_cache, entry);
+	ao2_ref(entry, -1);
+
+	return result;
+}
+
 /*! \brief Single thread to periodically do things */
 static void *phreaknet_periodic(void *varg)
 {
@@ -1542,11 +1947,24 @@ static void *phreaknet_periodic(void *varg)
 			update_rsa_pubkeys();
 		}
 
-		/* Wait a minute. */
+		/* Wait a minute, refreshing any stale lookups in the meantime. */
 		ast_mutex_lock(&refreshlock);
 		ts.tv_sec = (now.tv_sec + 60) + 1;
-		ast_cond_timedwait(&refresh_condition, &refreshlock, &ts);
+		for (;;) {
+			if (lookup_refresh_pending && !module_unloading) {
+				lookup_refresh_pending = 0;
+				ast_mutex_unlock(&refreshlock);
+				lookup_cache_refresh();
+				ast_mutex_lock(&refreshlock);
+				continue;
+			}
+			/* Anything other than a refresh request (e.g. reload, unload) ends the wait */
+			if (module_unloading || ast_cond_timedwait(&refresh_condition, &refreshlock, &ts) == ETIMEDOUT || !lookup_refresh_pending) {
+				break;
+			}
+		}
 		ast_mutex_unlock(&refreshlock);
+		lookup_cache_prune();
 
 		if (module_unloading) {
 			break;
@@ -1573,9 +1991,14 @@ static int load_config(int reload)
 	module_flags.autokeyrotate = 1;
 	module_flags.fallbackwarning = 1;
 	module_flags.requirekeytoload = 1;
+	module_flags.lookupcache = 1;
 	keyfetch_interval = DEFAULT_KEYFETCH_INTERVAL;
 	keyrotate_hour = DEFAULT_KEYROTATE_HOUR;
 	blacklist_threshold = DEFAULT_BLACKLIST_THRESHOLD;
+	lookup_cache_ttl = DEFAULT_LOOKUP_CACHE_TTL;
+	lookup_cache_negative_ttl = DEFAULT_LOOKUP_CACHE_NEGATIVE_TTL;
+	lookup_cache_stale = DEFAULT_LOOKUP_CACHE_STALE;
+	lookup_cache_size = DEFAULT_LOOKUP_CACHE_SIZE;
 
 	find_bindport(reload); /* Determine what IAX2 bindport we're using. */
 
@@ -1647,6 +2070,40 @@ static int load_config(int reload)
 				}
 				var = var->next;
 			}
+		} else if (!strcasecmp(cat, "cache")) {
+			var = ast_variable_browse(cfg, cat);
+			while (var) {
+				if (!strcasecmp(var->name, "enabled")) {
+					module_flags.lookupcache = ast_true(var->value) ? 1 : 0;
+				} else if (!strcasecmp(var->name, "ttl")) {
+					if (ast_str_to_int(var->value, &tmp) || tmp < 0) {
+						ast_log(LOG_WARNING, "Invalid cache TTL, defaulting to %d\n", DEFAULT_LOOKUP_CACHE_TTL);
+					} else {
+						lookup_cache_ttl = tmp;
+					}
+				} else if (!strcasecmp(var->name, "negative_ttl")) {
+					if (ast_str_to_int(var->value, &tmp) || tmp < 0) {
+						ast_log(LOG_WARNING, "Invalid negative cache TTL, defaulting to %d\n", DEFAULT_LOOKUP_CACHE_NEGATIVE_TTL);
+					} else {
+						lookup_cache_negative_ttl = tmp;
+					}
+				} else if (!strcasecmp(var->name, "stale")) {
+					if (ast_str_to_int(var->value, &tmp) || tmp < 0) {
+						ast_log(LOG_WARNING, "Invalid cache stale period, defaulting to %d\n", DEFAULT_LOOKUP_CACHE_STALE);
+					} else {
+						lookup_cache_stale = tmp;
+					}
+				} else if (!strcasecmp(var->name, "maxentries")) {
+					if (ast_str_to_int(var->value, &tmp) || tmp < 1) {
+						ast_log(LOG_WARNING, "Invalid cache size, defaulting to %d\n", DEFAULT_LOOKUP_CACHE_SIZE);
+					} else {
+						lookup_cache_size = tmp;
+					}
+				} else {
+					ast_log(LOG_WARNING, "Unknown setting at line %d: '%s'\n", var->lineno, var->name);
+				}
+				var = var->next;
+			}
 		} else {
 			ast_log(LOG_WARNING, "Line %d: Invalid config section: %s\n", var->lineno, var->name);
 			continue;
@@ -1737,28 +2194,6 @@ static int pop_legacy_handler(struct ast_channel *chan)
 	return 0;
 }
 
-static struct ast_str *phreaknet_lookup_full(const char *number, const char *flags, const char *clid, int ani2, const char *cnam, const char *cvs, const char *ss)
-{
-	static const char *version = NULL;
-	static const char *version_num = NULL;
-	char url[324]; /* min to make gcc happy */
-
-	/* Fetch the first time only */
-	if (!version) {
-		version = ast_get_version();
-	}
-	if (!version_num) {
-		version_num = ast_get_version_num();
-	}
-
-	snprintf(url, sizeof(url), "https://api.phreaknet.org/v1/?key=%s&asterisk=%s&asteriskv=%s"
-		"&number=%s&clid=%s&ani2=%d&cnam=%s&cvs=%s&nodevia=%s&flags=%s&threshold=%f&ss=%s%s",
-		interlinked_api_key, version, version_num,
-		number, clid, ani2, cnam, cvs, mainphreaknetdisa, flags, blacklist_threshold, ss, module_flags.requesttoken ? "&request_key" : "");
-
-	return curl_get(url, NULL);
-}
-
 static int safe_encoded_string(const char *restrict s, char *restrict buf, size_t len)
 {
 	ast_assert(s != NULL);
@@ -2199,6 +2634,8 @@ static int dial_exec(struct ast_channel *chan, const char *data)
 static int reload_module(void)
 {
 	reload_time = time(NULL);
+	/* Settings (e.g. the blacklist threshold) affect lookup results */
+	ao2_callback(lookup_cache, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, NULL, NULL);
 	return load_config(1);
 }
 
@@ -2218,8 +2655,22 @@ static int load_module(void)
 	ast_mutex_init(&refreshlock);
 	ast_cond_init(&refresh_condition, NULL);
 
+	lookup_cache = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0, LOOKUP_CACHE_BUCKETS,
+		lookup_cache_hash_fn, NULL, lookup_cache_cmp_fn);
+	if (!lookup_cache) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	if (curl_pool_init(&curl_pool)) {
+		ao2_ref(lookup_cache, -1);
+		lookup_cache = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
 	if ((res = ast_cdr_register(MODULE_NAME, ast_module_info->description, cdr_handler))) {
 		ast_log(LOG_ERROR, "Unable to register CDR handler\n");
+		curl_pool_destroy(&curl_pool);
+		ao2_ref(lookup_cache, -1);
+		lookup_cache = NULL;
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
@@ -2231,6 +2682,9 @@ static int load_module(void)
 	if (ast_pthread_create_background(&phreaknet_thread, NULL, phreaknet_periodic, NULL) < 0) {
 		ast_log(LOG_ERROR, "Unable to start periodic thread\n");
 		ast_cdr_unregister(MODULE_NAME);
+		curl_pool_destroy(&curl_pool);
+		ao2_ref(lookup_cache, -1);
+		lookup_cache = NULL;
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
@@ -2267,6 +2721,9 @@ static int unload_module(void)
 
 	pthread_join(phreaknet_thread, NULL);
 	cdr_channel_cleanup();
+	curl_pool_destroy(&curl_pool);
+	ao2_cleanup(lookup_cache);
+	lookup_cache = NULL;
 	return 0;
 }
 